@@ -30,6 +30,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <limits.h>
 #include <inttypes.h>
 #include <mtd/ubi-user.h>
@@ -40,6 +41,51 @@
 
 #define PROGRAM_NAME "libubiio"
 
+/**
+ * get_sys_dir_path - return the sys directory path
+ */
+static char *get_sys_dir_path();
+/**
+ * read_positive_ll - read a positive 'long long' value from a file.
+ * @file: the file to read from
+ * @value: the result is stored here
+ *
+ * This function reads file @file and interprets its contents as a positive
+ * 'long long' integer. If this is not true, it fails with %EINVAL error code.
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+static int read_positive_ll(const char *file, long long *value);
+/**
+ * read_positive_int - read a positive 'int' value from a file.
+ * @file: the file to read from
+ * @value: the result is stored here
+ *
+ * This function is the same as 'read_positive_ll()', but it reads an 'int'
+ * value, not 'long long'.
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+static int read_positive_int(const char *file, int *value);
+/**
+ * read_data - read data from a file.
+ * @file: the file to read from
+ * @buf: the buffer to read to
+ * @buf_len: buffer length
+ *
+ * This function returns number of read bytes in case of success and %-1 in
+ * case of failure. Note, if the file contains more then @buf_len bytes of
+ * date, this function fails with %EINVAL error code.
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+static int read_data(const char *file, void *buf, int buf_len);
+/**
+ * read_cdev - read major and minor numbers from a file.
+ * @file: name of the file to read from
+ * @pdev: device decription is returned here
+ *
+ * Returns %0 in case of succes, and %-1 in case of failure.
+ */
+static int read_cdev(const char *file, dev_t * pdev);
+
 static int
 __ubi_get_device_info(int ubi_num, struct ubi_device_info *dev_info)
 {
@@ -179,6 +225,15 @@ __ubi_get_volume_info(int ubi_num, int vol_id, struct ubi_volume_info *vol_info)
   return 0;
 }
 
+/* Run an ioctl on the volume, or emulate it if the volume is simulated */
+static int
+vol_ioctl(struct ubi_volume_desc *desc, unsigned long cmd, void *arg)
+{
+  if (desc->sim)
+    return __ubi_sim_ioctl(desc, cmd, arg);
+  return ioctl(desc->fd, cmd, arg);
+}
+
 static int
 ubi_mode2flags(int mode, int *flags)
 {
@@ -272,6 +327,7 @@ ubi_open_volume(int ubi_num, int vol_id, int mode)
   if ((ret = __ubi_get_volume_info(ubi_num, vol_id, &desc->vi)) < 0)
     goto failed_close;
 
+  __ubi_profile_open(desc);
   return desc;
 failed_close:
   close(desc->fd);
@@ -307,6 +363,16 @@ ubi_get_volume_info(struct ubi_volume_desc *desc,
   memcpy(vi, &desc->vi, sizeof (*vi));
 }
 
+/**
+ * ubi_get_min_io_size - get the minimal I/O unit size of a volume.
+ * @desc: volume descriptor
+ */
+int
+ubi_get_min_io_size(struct ubi_volume_desc *desc)
+{
+  return desc->di.min_io_size;
+}
+
 /**
  * ubi_get_vol_id_by_name - get UBI volume information.
  * @ubi_num: UBI device
@@ -389,6 +455,13 @@ ubi_open_volume_nm(int ubi_num, const char *name, int mode)
 void
 ubi_close_volume(struct ubi_volume_desc *desc)
 {
+  ubi_readahead_disable(desc);
+  ubi_verify_disable(desc);
+  ubi_throttle_attach(desc, NULL);
+  ubi_capture_stop(desc);
+  ubi_profile_set(desc, NULL);
+  if (desc->sim)
+    __ubi_sim_close(desc);
   if (desc->mode == UBI_EXCLUSIVE)
     flock(desc->fd, LOCK_UN);
   close(desc->fd);
@@ -428,18 +501,63 @@ int
 ubi_leb_read(struct ubi_volume_desc *desc, int lnum, char *buf, int offset,
 	     int len, int check)
 {
-  off_t addr;
-  int err;
-
   /* TODO : we may want to use "check" for static volume */
   (void) check;
-  addr = (desc->vi.usable_leb_size * (loff_t) lnum) + offset;
-  err = pread(desc->fd, buf, len, addr);
-  if (err < 0)
+  return ubi_vol_read(desc, buf, len,
+		      desc->vi.usable_leb_size * (long long) lnum + offset);
+}
+
+/* Read from a volume address, readahead first */
+static int
+vol_read(struct ubi_volume_desc *desc, void *buf, int len, long long addr)
+{
+  int leb_size = desc->vi.usable_leb_size;
+
+  if (desc->ra)
+    return __ubi_ra_read(desc->ra, buf, addr, len);
+  if (pread(desc->fd, buf, len, addr) < 0)
     return -errno;
+  if (desc->sim)
+    __ubi_sim_read(desc, addr / leb_size, addr % leb_size, len);
   return 0;
 }
 
+/**
+ * ubi_vol_read - read data at a volume address without checks.
+ * @desc: volume descriptor
+ * @buf: buffer where to store the read data
+ * @len: how many bytes to read
+ * @addr: volume address, i.e. LEB number * usable LEB size + offset in LEB
+ *
+ * This is 'ubi_leb_read()' for callers which have checked the arguments
+ * already, e.g. against a geometry known at compile time. The data must not
+ * cross a LEB boundary.
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_vol_read(struct ubi_volume_desc *desc, void *buf, int len, long long addr)
+{
+  long long start;
+  int err;
+
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_READ, len);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = vol_read(desc, buf, len, addr);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_READ, len, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_READ, addr, &(struct iovec) { buf, len }, 1, 0,
+		  err, start);
+  return err;
+}
+
 /**
  * ubi_leb_write - write data.
  * @desc: volume descriptor
@@ -472,8 +590,6 @@ ubi_leb_write(struct ubi_volume_desc *desc, int lnum, const void *buf,
 	      int offset, int len, int dtype)
 {
   int vol_id = desc->vi.vol_id;
-  off_t addr;
-  int err;
 
   if (vol_id < 0)
     {
@@ -512,13 +628,217 @@ ubi_leb_write(struct ubi_volume_desc *desc, int lnum, const void *buf,
     return 0;
   dbgmsg("write %d bytes to LEB %d:%d:%d", len, vol_id, lnum, offset);
 
-  addr = (desc->vi.usable_leb_size * (loff_t) lnum) + offset;
+  return ubi_vol_write(desc, buf, len,
+		       desc->vi.usable_leb_size * (long long) lnum + offset);
+}
+
+/* Write to a volume address and tell the layers above */
+static int
+vol_write(struct ubi_volume_desc *desc, const void *buf, int len,
+	  long long addr)
+{
+  int leb_size = desc->vi.usable_leb_size;
+  ssize_t err;
+
   err = pwrite(desc->fd, buf, len, addr);
+  if (desc->ra)
+    __ubi_ra_invalidate(desc->ra, addr, len);
   if (err < 0)
       return -errno;
+  if (desc->sim)
+    __ubi_sim_write(desc, addr / leb_size, addr % leb_size, len);
+  if (desc->verify)
+    return __ubi_verify_write(desc->verify, addr / leb_size,
+			      addr % leb_size, buf, len);
   return 0;
 }
 
+/**
+ * ubi_vol_write - write data at a volume address without checks.
+ * @desc: volume descriptor
+ * @buf: data to write
+ * @len: how many bytes to write
+ * @addr: volume address, i.e. LEB number * usable LEB size + offset in LEB
+ *
+ * This is 'ubi_leb_write()' for callers which have checked the arguments
+ * already, e.g. against a geometry known at compile time: the volume is
+ * writable and not being updated, @addr and @len are aligned to the minimal
+ * I/O unit size and the data does not cross a LEB boundary.
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_vol_write(struct ubi_volume_desc *desc, const void *buf, int len,
+	      long long addr)
+{
+  long long start;
+  int err;
+
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_WRITE, len);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = vol_write(desc, buf, len, addr);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_WRITE, len, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_WRITE, addr,
+		  &(struct iovec) { (void *) buf, len }, 1, 0, err, start);
+  return err;
+}
+
+/* Tell the simulator about I/O to a volume region, which may cross LEBs */
+static void
+vol_sim(struct ubi_volume_desc *desc, int write, long long addr, int len)
+{
+  int leb_size = desc->vi.usable_leb_size, n;
+
+  while (len > 0)
+    {
+      n = MIN(len, leb_size - addr % leb_size);
+      if (write)
+	__ubi_sim_write(desc, addr / leb_size, addr % leb_size, n);
+      else
+	__ubi_sim_read(desc, addr / leb_size, addr % leb_size, n);
+      addr += n;
+      len -= n;
+    }
+}
+
+/* Gather data to a volume address */
+static int
+vol_writev(struct ubi_volume_desc *desc, const struct iovec *iov,
+	   int iovcnt, long long addr)
+{
+  int leb_size = desc->vi.usable_leb_size;
+  int i, n, err, len = 0;
+  const char *p;
+  size_t left;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (pwritev(desc->fd, iov, iovcnt, addr) < 0)
+    err = -errno;
+  else
+    err = 0;
+  if (desc->ra)
+    __ubi_ra_invalidate(desc->ra, addr, len);
+  if (err)
+    return err;
+  if (desc->sim)
+    vol_sim(desc, 1, addr, len);
+  for (i = 0; i < iovcnt && desc->verify && !err; i++)
+    for (p = iov[i].iov_base, left = iov[i].iov_len; left && !err;
+	 p += n, left -= n)
+      {
+	n = MIN(left, leb_size - addr % leb_size);
+	err = __ubi_verify_write(desc->verify, addr / leb_size,
+				 addr % leb_size, p, n);
+	addr += n;
+      }
+  return err;
+}
+
+/**
+ * __ubi_vol_writev - gather data to a volume address without checks.
+ * @desc: volume descriptor
+ * @iov: buffers to write, one after the other
+ * @iovcnt: number of elements of @iov, at most %IOV_MAX
+ * @addr: volume address
+ *
+ * This is 'ubi_vol_write()' for data held in several buffers, which are
+ * written by one system call. The data may cross LEB boundaries. Returns %0
+ * in case of success and a negative error code in case of failure.
+ */
+int
+__ubi_vol_writev(struct ubi_volume_desc *desc, const struct iovec *iov,
+		 int iovcnt, long long addr)
+{
+  long long start;
+  int i, err, len = 0;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_WRITE, len);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = vol_writev(desc, iov, iovcnt, addr);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_WRITE, len, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_WRITE, addr, iov, iovcnt, 0, err, start);
+  return err;
+}
+
+/* Scatter data from a volume address, readahead first */
+static int
+vol_readv(struct ubi_volume_desc *desc, const struct iovec *iov,
+	  int iovcnt, long long addr)
+{
+  int i, err, len = 0;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (desc->ra)
+    {
+      for (i = 0, err = 0; i < iovcnt && !err; i++)
+	{
+	  err = __ubi_ra_read(desc->ra, iov[i].iov_base, addr,
+			      iov[i].iov_len);
+	  addr += iov[i].iov_len;
+	}
+      return err;
+    }
+  if (preadv(desc->fd, iov, iovcnt, addr) < 0)
+    return -errno;
+  if (desc->sim)
+    vol_sim(desc, 0, addr, len);
+  return 0;
+}
+
+/**
+ * __ubi_vol_readv - scatter data from a volume address without checks.
+ * @desc: volume descriptor
+ * @iov: buffers to fill, one after the other
+ * @iovcnt: number of elements of @iov, at most %IOV_MAX
+ * @addr: volume address
+ *
+ * This is 'ubi_vol_read()' for several buffers, which are filled by one
+ * system call. The data may cross LEB boundaries. Returns %0 in case of
+ * success and a negative error code in case of failure.
+ */
+int
+__ubi_vol_readv(struct ubi_volume_desc *desc, const struct iovec *iov,
+		int iovcnt, long long addr)
+{
+  long long start;
+  int i, err, len = 0;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_READ, len);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = vol_readv(desc, iov, iovcnt, addr);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_READ, len, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_READ, addr, iov, iovcnt, 0, err, start);
+  return err;
+}
+
 /*
  * ubi_leb_change - change logical eraseblock atomically.
  * @desc: volume descriptor
@@ -539,13 +859,6 @@ int
 ubi_leb_change(struct ubi_volume_desc *desc, int lnum, const void *buf,
 	       int len, int dtype)
 {
-  off_t addr;
-  struct ubi_leb_change_req req = {
-    .lnum = lnum,
-    .bytes = len,
-    .dtype = dtype
-  };
-
   if (desc->mode == UBI_READONLY || desc->vi.vol_type == UBI_STATIC_VOLUME)
     {
       sys_errmsg("UBI volume is readonly or static");
@@ -573,15 +886,73 @@ ubi_leb_change(struct ubi_volume_desc *desc, int lnum, const void *buf,
 
   if (len == 0)
     return 0;
+  return __ubi_leb_change(desc, lnum, buf, len, dtype);
+}
+
+/* Change a LEB */
+static int
+leb_change(struct ubi_volume_desc *desc, int lnum, const void *buf,
+	   int len, int dtype)
+{
+  off_t addr;
+  int err;
+  struct ubi_leb_change_req req = {
+    .lnum = lnum,
+    .bytes = len,
+    .dtype = dtype
+  };
 
   addr = (desc->vi.usable_leb_size * (loff_t) lnum);
-  if (ioctl(desc->fd, UBI_IOCEBCH, &req))
+  if (desc->verify)
+    __ubi_verify_drop(desc->verify, lnum);
+  if (vol_ioctl(desc, UBI_IOCEBCH, &req))
     return -errno;
-  if (pwrite(desc->fd, buf, len, addr) == -1)
+  err = pwrite(desc->fd, buf, len, addr);
+  if (desc->ra)
+    __ubi_ra_invalidate(desc->ra, addr, desc->vi.usable_leb_size);
+  if (err == -1)
     return -errno;
+  if (desc->verify)
+    return __ubi_verify_write(desc->verify, lnum, 0, buf, len);
   return 0;
 }
 
+/**
+ * __ubi_leb_change - change a logical eraseblock without checks.
+ * @desc: volume descriptor
+ * @lnum: logical eraseblock number to change
+ * @buf: data to write
+ * @len: how many bytes to write, not %0
+ * @dtype: expected data type
+ *
+ * This is 'ubi_leb_change()' without the argument checks, for callers which
+ * did them already. Returns %0 in case of success and a negative error code in
+ * case of failure.
+ */
+int
+__ubi_leb_change(struct ubi_volume_desc *desc, int lnum, const void *buf,
+		 int len, int dtype)
+{
+  long long start;
+  int err;
+
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_CHANGE, len);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = leb_change(desc, lnum, buf, len, dtype);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_CHANGE, len, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_CHANGE,
+		  desc->vi.usable_leb_size * (long long) lnum,
+		  &(struct iovec) { (void *) buf, len }, 1, dtype, err, start);
+  return err;
+}
+
 /**
  * ubi_leb_erase - erase logical eraseblock.
  * @desc: volume descriptor
@@ -616,11 +987,50 @@ ubi_leb_erase(struct ubi_volume_desc *desc, int lnum)
       sys_errmsg("The volume is marked as updating");
       return -EBADF;
     }
-  if (ioctl(desc->fd, UBI_IOCEBER, &lnum) < 0)
+  return __ubi_leb_erase(desc, lnum);
+}
+
+/* Erase a LEB */
+static int
+leb_erase(struct ubi_volume_desc *desc, int lnum)
+{
+  int err;
+
+  if (desc->verify)
+    __ubi_verify_drop(desc->verify, lnum);
+  err = vol_ioctl(desc, UBI_IOCEBER, &lnum);
+  if (desc->ra)
+    __ubi_ra_invalidate(desc->ra, desc->vi.usable_leb_size * (loff_t) lnum,
+			desc->vi.usable_leb_size);
+  if (err)
     return -errno;
   return 0;
 }
 
+/* 'ubi_leb_erase()' without the argument checks */
+int
+__ubi_leb_erase(struct ubi_volume_desc *desc, int lnum)
+{
+  long long start;
+  int err;
+
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_ERASE, 0);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = leb_erase(desc, lnum);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_ERASE, 0, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_ERASE,
+		  desc->vi.usable_leb_size * (long long) lnum, NULL, 0, 0, err,
+		  start);
+  return err;
+}
+
 /**
  * ubi_leb_unmap - un-map logical eraseblock.
  * @desc: volume descriptor
@@ -679,12 +1089,50 @@ ubi_leb_unmap(struct ubi_volume_desc *desc, int lnum)
       sys_errmsg("The volume is marked as updating");
       return -EBADF;
     }
+  return __ubi_leb_unmap(desc, lnum);
+}
+
+/* Un-map a LEB */
+static int
+leb_unmap(struct ubi_volume_desc *desc, int lnum)
+{
+  int err;
 
-  if (ioctl(desc->fd, UBI_IOCEBUNMAP, &lnum) < 0)
+  if (desc->verify)
+    __ubi_verify_drop(desc->verify, lnum);
+  err = vol_ioctl(desc, UBI_IOCEBUNMAP, &lnum);
+  if (desc->ra)
+    __ubi_ra_invalidate(desc->ra, desc->vi.usable_leb_size * (loff_t) lnum,
+			desc->vi.usable_leb_size);
+  if (err)
     return -errno;
   return 0;
 }
 
+/* 'ubi_leb_unmap()' without the argument checks */
+int
+__ubi_leb_unmap(struct ubi_volume_desc *desc, int lnum)
+{
+  long long start;
+  int err;
+
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_UNMAP, 0);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = leb_unmap(desc, lnum);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_UNMAP, 0, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_UNMAP,
+		  desc->vi.usable_leb_size * (long long) lnum, NULL, 0, 0, err,
+		  start);
+  return err;
+}
+
 /**
  * ubi_leb_map - map logical erasblock to a physical eraseblock.
  * @desc: volume descriptor
@@ -705,11 +1153,6 @@ ubi_leb_unmap(struct ubi_volume_desc *desc, int lnum)
 int
 ubi_leb_map(struct ubi_volume_desc *desc, int lnum, int dtype)
 {
-  struct ubi_map_req req = {
-    .lnum = lnum,
-    .dtype = dtype
-  };
-
   dbgmsg("map LEB %d:%d", desc->vi.vol_id, lnum);
 
   if (desc->mode == UBI_READONLY || desc->vi.vol_type == UBI_STATIC_VOLUME)
@@ -735,11 +1178,47 @@ ubi_leb_map(struct ubi_volume_desc *desc, int lnum, int dtype)
       sys_errmsg("The volume is marked as updating");
       return -EBADF;
     }
-  if (ioctl(desc->fd, UBI_IOCEBMAP, &req) < 0)
+  return __ubi_leb_map(desc, lnum, dtype);
+}
+
+/* Map a LEB */
+static int
+leb_map(struct ubi_volume_desc *desc, int lnum, int dtype)
+{
+  struct ubi_map_req req = {
+    .lnum = lnum,
+    .dtype = dtype
+  };
+
+  if (vol_ioctl(desc, UBI_IOCEBMAP, &req) < 0)
     return -errno;
   return 0;
 }
 
+/* 'ubi_leb_map()' without the argument checks */
+int
+__ubi_leb_map(struct ubi_volume_desc *desc, int lnum, int dtype)
+{
+  long long start;
+  int err;
+
+  if (desc->throttle)
+    {
+      err = __ubi_throttle(desc->throttle, UBI_OP_MAP, 0);
+      if (err)
+	return err;
+    }
+  start = __ubi_stats_start(desc);
+  err = leb_map(desc, lnum, dtype);
+  if (start)
+    __ubi_stats_account(desc, UBI_OP_MAP, 0, err, start);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_MAP,
+		  desc->vi.usable_leb_size * (long long) lnum, NULL, 0, dtype,
+		  err, start);
+  return err;
+}
+
 /**
  * ubi_is_mapped - check if logical eraseblock is mapped.
  * @desc: volume descriptor
@@ -758,7 +1237,98 @@ ubi_leb_map(struct ubi_volume_desc *desc, int lnum, int dtype)
 int
 ubi_is_mapped(struct ubi_volume_desc *desc, int lnum)
 {
-  return ioctl(desc->fd, UBI_IOCEBISMAP, &lnum);
+  long long start;
+  int ret;
+
+  start = __ubi_stats_start(desc);
+  ret = vol_ioctl(desc, UBI_IOCEBISMAP, &lnum);
+  if (desc->capture)
+    __ubi_capture(desc, UBI_OP_IS_MAPPED,
+		  desc->vi.usable_leb_size * (long long) lnum, NULL, 0, 0,
+		  ret < 0 ? -errno : ret, start);
+  return ret;
+}
+
+/* Pages read at once when verifying the end of a LEB */
+#define FIND_ERASED_VERIFY_IOS	16
+
+/**
+ * ubi_leb_find_erased - find where writing to a logical eraseblock can resume.
+ * @desc: volume descriptor
+ * @lnum: logical eraseblock number
+ * @flags: %UBI_FIND_ERASED_VERIFY to check the whole end of the LEB
+ *
+ * Pages of a LEB are programmed in order, so the written pages are followed
+ * by erased ones only. This function finds the first erased minimal I/O unit
+ * of @lnum by a binary search, reading one unit per step; a unit which cannot
+ * be read because of ECC errors counts as written. An un-mapped LEB is empty
+ * and is not read at all.
+ *
+ * The binary search trusts that nothing was written after the first erased
+ * unit. With %UBI_FIND_ERASED_VERIFY, the rest of the LEB is read and
+ * checked, which catches stray writes, e.g. from a tool writing pages out of
+ * order.
+ *
+ * Returns the offset of the first erased unit, the usable LEB size if the LEB
+ * is full, %-EUCLEAN if the verification found written data after that
+ * offset and another negative error code in case of failure.
+ */
+int
+ubi_leb_find_erased(struct ubi_volume_desc *desc, int lnum, int flags)
+{
+  int io = desc->di.min_io_size, lo = 0, hi, mid, err, off, len;
+  char *buf;
+
+  if (lnum < 0 || lnum >= desc->vi.used_ebs || flags & ~UBI_FIND_ERASED_VERIFY)
+    return -EINVAL;
+
+  err = ubi_is_mapped(desc, lnum);
+  if (err < 0)
+    return -errno;
+  if (err == 0)
+    return 0;
+
+  hi = desc->vi.usable_leb_size / io;
+  buf = malloc(io * (flags & UBI_FIND_ERASED_VERIFY
+		     ? FIND_ERASED_VERIFY_IOS : 1));
+  if (buf == NULL)
+    return -ENOMEM;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      err = ubi_leb_read(desc, lnum, buf, mid * io, io, 0);
+      if (err && err != -EBADMSG)
+	goto out;
+      if (!err && __ubi_is_erased(buf, io))
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+  err = 0;
+
+  if (flags & UBI_FIND_ERASED_VERIFY)
+    {
+      /* the first erased unit has just been read */
+      for (off = (lo + 1) * io; off < desc->vi.usable_leb_size; off += len)
+	{
+	  len = MIN(FIND_ERASED_VERIFY_IOS * io,
+		    desc->vi.usable_leb_size - off);
+	  err = ubi_leb_read(desc, lnum, buf, off, len, 0);
+	  if (err == -EBADMSG || (!err && !__ubi_is_erased(buf, len)))
+	    {
+	      warnmsg("LEB %d has data after its first erased unit at %d",
+		      lnum, lo * io);
+	      err = -EUCLEAN;
+	    }
+	  if (err)
+	    goto out;
+	}
+    }
+
+out:
+  free(buf);
+  return err ? err : lo * io;
 }
 
 /**
@@ -786,6 +1356,13 @@ get_sys_dir_path()
   return "/sys";
 }
 
+/* Where sysfs is mounted, for the other files of the library */
+const char *
+__ubi_sys_dir(void)
+{
+  return get_sys_dir_path();
+}
+
 static int
 read_positive_ll(const char *file, long long *value)
 {
@@ -41,6 +41,840 @@ extern "C"
 #include "ubi.h"
   int ubi_get_vol_id_by_name(int ubi_num, const char *name);
 
+#define UBI_FIND_ERASED_VERIFY 0x1
+  int ubi_leb_find_erased(struct ubi_volume_desc *desc, int lnum, int flags);
+  int ubi_get_min_io_size(struct ubi_volume_desc *desc);
+
+/* I/O without argument checks, for callers which did them */
+  int ubi_vol_read(struct ubi_volume_desc *desc, void *buf, int len,
+		   long long addr);
+  int ubi_vol_write(struct ubi_volume_desc *desc, const void *buf, int len,
+		    long long addr);
+
+/* File-backed stand-in for a UBI volume */
+/**
+ * struct ubi_sim_geometry - geometry of a simulated volume.
+ * @nr_lebs: number of LEBs, %0 to use the whole backing file
+ * @leb_size: usable LEB size
+ * @min_io_size: minimal input/output unit size, a power of 2
+ */
+  struct ubi_sim_geometry
+  {
+    int nr_lebs;
+    int leb_size;
+    int min_io_size;
+  };
+
+  struct ubi_volume_desc *ubi_open_volume_sim(const char *path,
+					      const struct ubi_sim_geometry
+					      *geo, int mode);
+
+#define UBI_SIM_VIRTUAL_CLOCK 0x1
+
+/**
+ * struct ubi_sim_timing - NAND timing model of a simulated volume.
+ * @read_us: time to read a page from the array (tR), in microseconds
+ * @prog_us: time to program a page (tPROG), in microseconds
+ * @erase_us: time to erase a block (tBERS), in microseconds
+ * @dies: number of dies working concurrently
+ * @bus_mbps: bus bandwidth in MB/s, %0 for transfers taking no time
+ * @flags: %UBI_SIM_VIRTUAL_CLOCK to simulate time instead of sleeping
+ */
+  struct ubi_sim_timing
+  {
+    int read_us;
+    int prog_us;
+    int erase_us;
+    int dies;
+    int bus_mbps;
+    int flags;
+  };
+
+  int ubi_sim_set_timing(struct ubi_volume_desc *desc,
+			 const struct ubi_sim_timing *timing);
+  long long ubi_sim_clock(struct ubi_volume_desc *desc);
+  int ubi_sim_set_clock(struct ubi_volume_desc *desc, long long now);
+
+/*
+ * enum ubi_io_opcode - operations which can be queued to an executor.
+ *
+ * Each opcode maps to the synchronous function of the same name; the
+ * @len, @offset, @dtype and @check fields of &struct ubi_io_op are used as
+ * that function uses them.
+ */
+  enum
+  {
+    UBI_OP_READ = 1,
+    UBI_OP_WRITE,
+    UBI_OP_CHANGE,
+    UBI_OP_ERASE,
+    UBI_OP_UNMAP,
+    UBI_OP_MAP,
+    UBI_OP_IS_MAPPED
+  };
+
+/* Flags for 'ubi_exec_submit()' */
+#define UBI_EXEC_NOWAIT		0x1
+
+/*
+ * Scheduling classes of operations queued to an executor. With
+ * %UBI_IOCLASS_AUTO, reads and checks are latency-critical, erasures and
+ * un-maps are background work and the other operations are normal writes.
+ */
+  enum
+  {
+    UBI_IOCLASS_AUTO = 0,
+    UBI_IOCLASS_READ,
+    UBI_IOCLASS_WRITE,
+    UBI_IOCLASS_BACKGROUND
+  };
+
+/**
+ * struct ubi_io_op - an asynchronous UBI operation.
+ * @opcode: what to do (%UBI_OP_READ, %UBI_OP_WRITE, ...)
+ * @desc: volume descriptor to operate on
+ * @lnum: logical eraseblock number
+ * @buf: data buffer for reads and writes
+ * @offset: offset within the logical eraseblock
+ * @len: how many bytes to transfer
+ * @dtype: data type for writes, changes and maps
+ * @check: CRC check flag for reads
+ * @ioclass: scheduling class, %UBI_IOCLASS_AUTO to derive it from @opcode
+ * @result: return value of the operation, valid once it completed
+ * @done: completion callback, or %NULL to use 'ubi_exec_wait()'
+ * @priv: caller private data
+ *
+ * The remaining fields are private to libubiio. The structure is owned by the
+ * caller and must stay valid until the operation completes, i.e. until @done
+ * is called or 'ubi_exec_wait()' returns.
+ */
+  struct ubi_io_op
+  {
+    int opcode;
+    struct ubi_volume_desc *desc;
+    int lnum;
+    void *buf;
+    int offset;
+    int len;
+    int dtype;
+    int check;
+    int ioclass;
+    int result;
+    void (*done) (struct ubi_io_op * op);
+    void *priv;
+    /* private */
+    void *queue;
+    int state;
+    int sched_class;
+    struct ubi_io_op *next;
+    long long submitted;
+  };
+
+/* Executor running UBI operations on per-device worker threads */
+  struct ubi_executor;
+
+/**
+ * struct ubi_exec_class - settings of a scheduling class.
+ * @weight: share of the operations executed when several classes have
+ *          operations pending, relative to the other classes
+ * @deadline_us: queueing time in microseconds after which an operation goes
+ *               before the other classes, %0 for none
+ * @max_inflight: how many operations of the class may be executed at a time
+ *                on a device, %0 for no limit
+ */
+  struct ubi_exec_class
+  {
+    int weight;
+    int deadline_us;
+    int max_inflight;
+  };
+
+  int ubi_io_op_exec(struct ubi_io_op *op);
+  struct ubi_executor *ubi_executor_create(int workers_per_dev,
+					   int queue_depth);
+  void ubi_executor_destroy(struct ubi_executor *ex);
+  int ubi_executor_set_class(struct ubi_executor *ex, int ioclass,
+			     const struct ubi_exec_class *cfg);
+  int ubi_exec_submit(struct ubi_executor *ex, struct ubi_io_op *op,
+		      int flags);
+  int ubi_exec_wait(struct ubi_io_op *op);
+  int ubi_exec_cancel(struct ubi_io_op *op);
+
+/* Pre-validated sequences of LEB operations, run many times */
+  struct ubi_plan;
+
+  struct ubi_plan *ubi_plan_create(struct ubi_volume_desc *desc);
+  void ubi_plan_free(struct ubi_plan *plan);
+  int ubi_plan_write(struct ubi_plan *plan, int lnum, int offset, int len,
+		     int dtype);
+  int ubi_plan_change(struct ubi_plan *plan, int lnum, int len, int dtype);
+  int ubi_plan_erase(struct ubi_plan *plan, int lnum);
+  int ubi_plan_unmap(struct ubi_plan *plan, int lnum);
+  int ubi_plan_map(struct ubi_plan *plan, int lnum, int dtype);
+  int ubi_plan_steps(const struct ubi_plan *plan);
+  int ubi_plan_exec(struct ubi_plan *plan, const void *const *bufs,
+		    int *failed);
+
+/**
+ * struct ubi_readahead_stats - readahead statistics.
+ * @hits: reads served from prefetched data
+ * @misses: reads which went to the flash
+ * @prefetched_bytes: amount of data read ahead
+ * @window: current readahead window size
+ */
+  struct ubi_readahead_stats
+  {
+    long long hits;
+    long long misses;
+    long long prefetched_bytes;
+    int window;
+  };
+
+  int ubi_readahead_enable(struct ubi_volume_desc *desc, int max_window);
+  void ubi_readahead_disable(struct ubi_volume_desc *desc);
+  int ubi_readahead_get_stats(struct ubi_volume_desc *desc,
+			      struct ubi_readahead_stats *stats);
+
+/* Read-after-write verification */
+/* Returned negated when data does not read back as it was written */
+#define UBI_EVERIFY EILSEQ
+
+#define UBI_VERIFY_DEFERRED 0x1
+
+/**
+ * struct ubi_verify_stats - read-after-write verification statistics.
+ * @writes: writes seen
+ * @verified: successful verification reads, merged writes counting once
+ * @bytes: bytes read back
+ * @mismatches: verified writes which did not read back as written
+ * @read_errors: verifications which failed to read the data back
+ * @dropped: queued verifications dropped by a change, erase or un-map
+ * @pending: bytes waiting for deferred verification
+ */
+  struct ubi_verify_stats
+  {
+    long long writes;
+    long long verified;
+    long long bytes;
+    long long mismatches;
+    long long read_errors;
+    long long dropped;
+    long pending;
+  };
+
+  int ubi_verify_enable(struct ubi_volume_desc *desc, int sample, int flags);
+  int ubi_verify_flush(struct ubi_volume_desc *desc);
+  void ubi_verify_disable(struct ubi_volume_desc *desc);
+  int ubi_verify_get_stats(struct ubi_volume_desc *desc,
+			   struct ubi_verify_stats *stats);
+
+/* Log-structured block translation layer on a dynamic volume */
+  struct ubi_ftl;
+
+/**
+ * struct ubi_ftl_stats - block translation layer statistics.
+ * @sector_size: sector size
+ * @nr_sectors: number of sectors
+ * @free_lebs: number of free LEBs in the log
+ * @user_sectors: sectors written on behalf of the user
+ * @gc_sectors: sectors relocated by the garbage collector
+ * @header_ios: minimal I/O units used for record headers
+ * @gc_runs: number of LEBs reclaimed by the garbage collector
+ * @checkpoints: number of checkpoints written
+ */
+  struct ubi_ftl_stats
+  {
+    int sector_size;
+    int nr_sectors;
+    int free_lebs;
+    long long user_sectors;
+    long long gc_sectors;
+    long long header_ios;
+    long long gc_runs;
+    long long checkpoints;
+  };
+
+  int ubi_ftl_format(struct ubi_volume_desc *desc, int sector_size,
+		     int nr_sectors);
+  struct ubi_ftl *ubi_ftl_open(struct ubi_volume_desc *desc);
+  int ubi_ftl_close(struct ubi_ftl *ftl);
+  int ubi_ftl_read(struct ubi_ftl *ftl, int lba, void *buf, int count);
+  int ubi_ftl_write(struct ubi_ftl *ftl, int lba, const void *buf,
+		    int count);
+  int ubi_ftl_discard(struct ubi_ftl *ftl, int lba, int count);
+  int ubi_ftl_sync(struct ubi_ftl *ftl);
+  void ubi_ftl_get_stats(struct ubi_ftl *ftl, struct ubi_ftl_stats *stats);
+
+/* Key-value store on a dynamic volume */
+#define UBI_KV_KEY_MAX 1024
+
+  struct ubi_kv;
+  struct ubi_kv_batch;
+
+/**
+ * struct ubi_kv_stats - key-value store statistics.
+ * @keys: number of keys
+ * @free_lebs: number of free LEBs
+ * @frames: number of frames written
+ * @bytes_written: bytes written, padding included
+ * @lookups: number of successful lookups
+ * @compactions: number of LEBs reclaimed by compaction
+ */
+  struct ubi_kv_stats
+  {
+    int keys;
+    int free_lebs;
+    long long frames;
+    long long bytes_written;
+    long long lookups;
+    long long compactions;
+  };
+
+  struct ubi_kv *ubi_kv_open(struct ubi_volume_desc *desc);
+  void ubi_kv_close(struct ubi_kv *kv);
+  int ubi_kv_get(struct ubi_kv *kv, const void *key, int klen, void *val,
+		 int size);
+  int ubi_kv_put(struct ubi_kv *kv, const void *key, int klen,
+		 const void *val, int vlen);
+  int ubi_kv_delete(struct ubi_kv *kv, const void *key, int klen);
+  struct ubi_kv_batch *ubi_kv_batch_create(void);
+  void ubi_kv_batch_free(struct ubi_kv_batch *batch);
+  int ubi_kv_batch_put(struct ubi_kv_batch *batch, const void *key, int klen,
+		       const void *val, int vlen);
+  int ubi_kv_batch_delete(struct ubi_kv_batch *batch, const void *key,
+			  int klen);
+  int ubi_kv_batch_commit(struct ubi_kv *kv, struct ubi_kv_batch *batch);
+  int ubi_kv_compact(struct ubi_kv *kv);
+  void ubi_kv_get_stats(struct ubi_kv *kv, struct ubi_kv_stats *stats);
+
+/* Append-only log on a dynamic volume */
+  struct ubi_log;
+
+/**
+ * struct ubi_log_stats - log statistics.
+ * @first_lsn: LSN of the oldest record which has not been truncated
+ * @durable_lsn: LSN of the last committed record
+ * @records: number of records appended
+ * @commits: number of chunks written
+ * @bytes_written: bytes written, padding included
+ */
+  struct ubi_log_stats
+  {
+    uint64_t first_lsn;
+    uint64_t durable_lsn;
+    long long records;
+    long long commits;
+    long long bytes_written;
+  };
+
+  struct ubi_log *ubi_log_open(struct ubi_volume_desc *desc);
+  int ubi_log_close(struct ubi_log *log);
+  int ubi_log_append(struct ubi_log *log, const void *rec, int len,
+		     uint64_t *lsn);
+  int ubi_log_commit(struct ubi_log *log, uint64_t lsn);
+  int ubi_log_read(struct ubi_log *log, uint64_t lsn, void *buf, int size);
+  int ubi_log_truncate(struct ubi_log *log, uint64_t lsn);
+  void ubi_log_get_stats(struct ubi_log *log, struct ubi_log_stats *stats);
+
+/* Wear and bad block monitoring of a UBI device */
+  struct ubi_health;
+
+/**
+ * struct ubi_health_sample - device counters at a given time.
+ * @time_ms: when the sample was taken, in milliseconds of a monotonic clock
+ * @avail_ebs: number of eraseblocks available for new volumes
+ * @total_ebs: number of good physical eraseblocks
+ * @bad_pebs: number of bad physical eraseblocks
+ * @max_ec: highest erase counter
+ * @reserved_pebs: physical eraseblocks reserved for bad block handling
+ *
+ * Counters the kernel does not export are %-1.
+ */
+  struct ubi_health_sample
+  {
+    long long time_ms;
+    int avail_ebs;
+    int total_ebs;
+    int bad_pebs;
+    int max_ec;
+    int reserved_pebs;
+  };
+
+/**
+ * struct ubi_health_report - device health trends.
+ * @first: oldest sample kept
+ * @last: newest sample
+ * @samples: number of samples kept
+ * @max_ec_per_hour: rise of the highest erase counter per hour
+ * @bad_pebs_per_day: new bad physical eraseblocks per day
+ * @avail_ebs_per_hour: change of the available eraseblocks per hour
+ * @erase_rate: estimated physical eraseblock erasures per second
+ * @write_rate: estimated bytes programmed per second
+ */
+  struct ubi_health_report
+  {
+    struct ubi_health_sample first;
+    struct ubi_health_sample last;
+    int samples;
+    double max_ec_per_hour;
+    double bad_pebs_per_day;
+    double avail_ebs_per_hour;
+    double erase_rate;
+    double write_rate;
+  };
+
+  struct ubi_health *ubi_health_open(int ubi_num, int interval_ms,
+				     int window);
+  void ubi_health_close(struct ubi_health *h);
+  int ubi_health_poll(struct ubi_health *h);
+  int ubi_health_get_report(struct ubi_health *h,
+			    struct ubi_health_report *r);
+
+/* Counters published in shared memory for other processes */
+#define UBI_STATS_MAGIC		0x55425353	/* "UBSS" */
+#define UBI_STATS_VERSION	1
+#define UBI_STATS_NR_SLOTS	64
+#define UBI_STATS_NR_OPS	6
+#define UBI_STATS_NR_BUCKETS	24
+
+/**
+ * struct ubi_stats_slot - counters of a volume or of a UBI device.
+ * @in_use: non-zero once the slot belongs to a volume or a device
+ * @ubi_num: UBI device number
+ * @vol_id: volume ID, %-1 for the slot of the device
+ * @ops: operations completed, indexed by opcode - 1 (%UBI_OP_READ - 1 to
+ *       %UBI_OP_MAP - 1)
+ * @bytes: bytes transferred by the operations which succeeded
+ * @errors: operations which failed
+ * @lat: latency histogram, bucket N counting the operations which took from
+ *       2^N to 2^(N+1) microseconds, bucket %0 those under 2 microseconds
+ * @queued: operations queued to the executor for the device
+ * @inflight: operations of the device being executed by the executor
+ *
+ * Volume slots have the operation counters, device slots the queue depths.
+ */
+  struct ubi_stats_slot
+  {
+    uint32_t in_use;
+    int32_t ubi_num;
+    int32_t vol_id;
+    uint32_t padding;
+    uint64_t ops[UBI_STATS_NR_OPS];
+    uint64_t bytes[UBI_STATS_NR_OPS];
+    uint64_t errors[UBI_STATS_NR_OPS];
+    uint64_t lat[UBI_STATS_NR_OPS][UBI_STATS_NR_BUCKETS];
+    int64_t queued;
+    int64_t inflight;
+  };
+
+/**
+ * struct ubi_stats_shm - layout of the exported statistics.
+ * @magic: %UBI_STATS_MAGIC, set once the rest of the header is valid
+ * @version: %UBI_STATS_VERSION
+ * @size: size of this structure
+ * @nr_slots: number of entries of @slots
+ * @pid: process exporting the statistics
+ * @padding: reserved, zero
+ * @slots: the counters
+ *
+ * Everything is in host byte order and is updated with relaxed atomic
+ * operations; readers should load the fields atomically as well.
+ */
+  struct ubi_stats_shm
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t nr_slots;
+    int32_t pid;
+    uint32_t padding;
+    struct ubi_stats_slot slots[UBI_STATS_NR_SLOTS];
+  };
+
+  int ubi_stats_export(const char *path);
+  void ubi_stats_unexport(void);
+
+/* Atomic changes of several LEBs of a dynamic volume */
+  struct ubi_txv;
+  struct ubi_tx;
+
+/**
+ * struct ubi_txv_stats - transactional volume statistics.
+ * @nr_lebs: number of LEBs exposed
+ * @free_lebs: number of LEBs available as shadow LEBs
+ * @commits: number of commit records written
+ * @transactions: number of transactions committed
+ * @lebs_written: number of shadow LEBs written
+ * @recovered: LEBs un-mapped at open time, left by an unclean shutdown
+ */
+  struct ubi_txv_stats
+  {
+    int nr_lebs;
+    int free_lebs;
+    long long commits;
+    long long transactions;
+    long long lebs_written;
+    long long recovered;
+  };
+
+  struct ubi_txv *ubi_txv_open(struct ubi_volume_desc *desc, int nr_lebs);
+  void ubi_txv_close(struct ubi_txv *txv);
+  int ubi_txv_read(struct ubi_txv *txv, int lnum, void *buf, int offset,
+		   int len);
+  void ubi_txv_get_stats(struct ubi_txv *txv, struct ubi_txv_stats *stats);
+  struct ubi_tx *ubi_tx_begin(struct ubi_txv *txv);
+  int ubi_tx_change(struct ubi_tx *tx, int lnum, const void *buf, int len);
+  int ubi_tx_unmap(struct ubi_tx *tx, int lnum);
+  int ubi_tx_commit(struct ubi_tx *tx);
+  void ubi_tx_abort(struct ubi_tx *tx);
+
+/* Aligned I/O buffers */
+  struct ubi_bufpool;
+
+#define UBI_BUFPOOL_NO_HUGE	0x1
+
+/**
+ * struct ubi_bufpool_stats - I/O buffer pool statistics.
+ * @mapped: bytes mapped for buffers up to the slab size
+ * @huge: bytes of @mapped backed by reserved huge pages
+ * @refills: allocations the thread caches could not serve
+ */
+  struct ubi_bufpool_stats
+  {
+    long long mapped;
+    long long huge;
+    long long refills;
+  };
+
+  struct ubi_bufpool *ubi_bufpool_create(int align, int flags);
+  void ubi_bufpool_destroy(struct ubi_bufpool *pool);
+  void *ubi_buf_alloc(struct ubi_bufpool *pool, size_t size);
+  void ubi_buf_free(struct ubi_bufpool *pool, void *buf, size_t size);
+  void ubi_bufpool_get_stats(struct ubi_bufpool *pool,
+			     struct ubi_bufpool_stats *stats);
+
+/* Byte streams over a volume */
+  struct ubi_stream;
+
+  struct ubi_stream *ubi_stream_open(struct ubi_volume_desc *desc,
+				     int buf_size);
+  int ubi_stream_close(struct ubi_stream *s);
+  ssize_t ubi_stream_read(struct ubi_stream *s, void *buf, size_t len);
+  ssize_t ubi_stream_write(struct ubi_stream *s, const void *buf,
+			   size_t len);
+  long long ubi_stream_seek(struct ubi_stream *s, long long offset,
+			    int whence);
+  int ubi_stream_flush(struct ubi_stream *s);
+
+/* Background scrubbing of mapped LEBs */
+  struct ubi_scrubber;
+
+/* LEB states reported by the scrubber */
+#define UBI_SCRUB_MARGINAL	1
+#define UBI_SCRUB_BAD		2
+
+/**
+ * struct ubi_scrub_config - scrubber configuration.
+ * @threads: number of reading threads, %0 for the default
+ * @max_bps: bandwidth budget in bytes per second, %0 for none
+ * @max_iops: reads per second budget, %0 for none
+ * @idle_ms: how long the process has to be done with I/O before scrubbing
+ *           resumes, %0 not to back off
+ * @report: called from a scrubbing thread for each LEB which is not sound,
+ *          with %UBI_SCRUB_MARGINAL if a read failed but its retry did not,
+ *          %UBI_SCRUB_BAD if the retry failed too, and the first read error
+ * @priv: passed to @report
+ */
+  struct ubi_scrub_config
+  {
+    int threads;
+    long long max_bps;
+    int max_iops;
+    int idle_ms;
+    void (*report) (struct ubi_volume_desc * desc, int lnum, int state,
+		    int err, void *priv);
+    void *priv;
+  };
+
+/**
+ * struct ubi_scrub_stats - scrubber statistics.
+ * @total: number of LEBs to go through
+ * @scrubbed: mapped LEBs read
+ * @unmapped: unmapped LEBs skipped
+ * @bytes: bytes read
+ * @marginal: LEBs reported as %UBI_SCRUB_MARGINAL
+ * @bad: LEBs reported as %UBI_SCRUB_BAD
+ * @backoffs: waits for foreground I/O to calm down
+ */
+  struct ubi_scrub_stats
+  {
+    long long total;
+    long long scrubbed;
+    long long unmapped;
+    long long bytes;
+    long long marginal;
+    long long bad;
+    long long backoffs;
+  };
+
+  struct ubi_scrubber *ubi_scrub_start(struct ubi_volume_desc *const *descs,
+				       int nr_descs,
+				       const struct ubi_scrub_config *cfg);
+  int ubi_scrub_wait(struct ubi_scrubber *sc, int timeout_ms);
+  void ubi_scrub_stop(struct ubi_scrubber *sc);
+  void ubi_scrub_get_stats(struct ubi_scrubber *sc,
+			   struct ubi_scrub_stats *stats);
+
+/* I/O budgets of volume descriptors */
+  struct ubi_throttle;
+
+/* What an operation over budget does */
+#define UBI_THROTTLE_BLOCK	0	/* wait for the budget */
+#define UBI_THROTTLE_NOWAIT	1	/* fail with -EAGAIN */
+#define UBI_THROTTLE_DELAY	2	/* sleep off the debt, in turn */
+
+/**
+ * struct ubi_throttle_config - throttle configuration.
+ * @max_bps: bytes read or written per second, %0 for no limit
+ * @max_ops: operations per second, %0 for no limit
+ * @max_erases: erasures, changes and un-maps per second, %0 for no limit
+ * @burst_ms: how many milliseconds worth of budget may be used at once, %0
+ *            for the default
+ * @mode: %UBI_THROTTLE_BLOCK, %UBI_THROTTLE_NOWAIT or %UBI_THROTTLE_DELAY
+ */
+  struct ubi_throttle_config
+  {
+    long long max_bps;
+    int max_ops;
+    int max_erases;
+    int burst_ms;
+    int mode;
+  };
+
+/**
+ * struct ubi_throttle_stats - throttling statistics.
+ * @ops: operations let through
+ * @bytes: bytes they transferred
+ * @erases: erasures, changes and un-maps among them
+ * @throttled: operations which had to wait
+ * @rejected: operations failed with %-EAGAIN
+ * @wait_us: total time operations waited, in microseconds
+ */
+  struct ubi_throttle_stats
+  {
+    long long ops;
+    long long bytes;
+    long long erases;
+    long long throttled;
+    long long rejected;
+    long long wait_us;
+  };
+
+  struct ubi_throttle *ubi_throttle_create(const struct ubi_throttle_config
+					   *cfg);
+  int ubi_throttle_destroy(struct ubi_throttle *thr);
+  void ubi_throttle_attach(struct ubi_volume_desc *desc,
+			   struct ubi_throttle *thr);
+  void ubi_throttle_get_stats(struct ubi_throttle *thr,
+			      struct ubi_throttle_stats *stats);
+
+/* Transparently compressed LEBs */
+  struct ubi_zvol;
+
+/**
+ * struct ubi_zvol_stats - compressed volume statistics.
+ * @changes: LEBs changed
+ * @bytes_in: bytes of contents given to the changes
+ * @bytes_written: bytes the changes wrote to flash
+ * @reads: reads done
+ * @extents_read: extents read and decompressed
+ */
+  struct ubi_zvol_stats
+  {
+    long long changes;
+    long long bytes_in;
+    long long bytes_written;
+    long long reads;
+    long long extents_read;
+  };
+
+  struct ubi_zvol *ubi_zvol_open(struct ubi_volume_desc *desc,
+				 int extent_size);
+  void ubi_zvol_close(struct ubi_zvol *zv);
+  int ubi_zvol_change(struct ubi_zvol *zv, int lnum, const void *buf, int len,
+		      int dtype);
+  int ubi_zvol_read(struct ubi_zvol *zv, int lnum, void *buf, int offset,
+		    int len);
+  int ubi_zvol_size(struct ubi_zvol *zv, int lnum);
+  int ubi_zvol_unmap(struct ubi_zvol *zv, int lnum);
+  void ubi_zvol_get_stats(struct ubi_zvol *zv, struct ubi_zvol_stats *stats);
+
+/* Capture of the operations of a volume descriptor, for replay */
+#define UBI_CAPTURE_MAGIC	0x55424350	/* "UBCP" */
+#define UBI_CAPTURE_VERSION	2
+#define UBI_CAPTURE_HASH	0x1
+
+/**
+ * struct ubi_capture_rec - a recorded operation.
+ * @time_ns: when the operation started, in nanoseconds from the start of
+ *           the capture
+ * @lat_ns: how long the operation took, in nanoseconds
+ * @seq: record number + 1 modulo 2^32, %0 while the record is filled in
+ * @lnum: LEB operated on
+ * @offset: offset in the LEB, for reads and writes
+ * @len: bytes transferred, reads and writes may cross LEBs
+ * @result: what the operation returned
+ * @hash: hash of the data transferred with %UBI_CAPTURE_HASH, or %0
+ * @opcode: %UBI_OP_READ, %UBI_OP_WRITE, ...
+ * @dtype: data type of changes and maps
+ * @padding: reserved, zero
+ */
+  struct ubi_capture_rec
+  {
+    uint64_t time_ns;
+    uint64_t lat_ns;
+    uint32_t seq;
+    int32_t lnum;
+    int32_t offset;
+    int32_t len;
+    int32_t result;
+    uint32_t hash;
+    uint8_t opcode;
+    uint8_t dtype;
+    uint8_t padding[6];
+  };
+
+/**
+ * struct ubi_capture_hdr - layout of a capture file.
+ * @magic: %UBI_CAPTURE_MAGIC, set once the rest of the header is valid
+ * @version: %UBI_CAPTURE_VERSION
+ * @rec_size: size of a record
+ * @nr_recs: number of records in the ring
+ * @flags: flags given to 'ubi_capture_start()'
+ * @ubi_num: UBI device number of the volume
+ * @vol_id: volume ID
+ * @leb_size: usable LEB size of the volume
+ * @min_io_size: minimal I/O unit size of the device
+ * @nr_lebs: number of LEBs of the volume
+ * @start_time: when the capture started, in nanoseconds since the Epoch
+ * @head: number of records taken so far, record N being at index N modulo
+ *        @nr_recs of the ring which follows the header
+ *
+ * Everything is in host byte order. @head and the @seq field of the records
+ * are updated atomically.
+ */
+  struct ubi_capture_hdr
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t nr_recs;
+    uint32_t flags;
+    int32_t ubi_num;
+    int32_t vol_id;
+    int32_t leb_size;
+    int32_t min_io_size;
+    int32_t nr_lebs;
+    uint64_t start_time;
+    uint64_t head;
+  };
+
+  int ubi_capture_start(struct ubi_volume_desc *desc, const char *path,
+			int nr_recs, int flags);
+  void ubi_capture_stop(struct ubi_volume_desc *desc);
+
+/* Reservoir of pre-mapped LEBs for writers */
+  struct ubi_reservoir;
+
+/* Only take a pre-mapped LEB */
+#define UBI_RESERVOIR_NOWAIT	0x1
+
+/**
+ * struct ubi_reservoir_config - reservoir configuration.
+ * @first_leb: first LEB managed by the reservoir
+ * @nr_lebs: number of LEBs managed, %0 for all up to the end of the volume
+ * @target: number of LEBs to keep mapped ahead of time, %0 for the default
+ * @dtype: data type to map LEBs with (%UBI_LONGTERM, %UBI_SHORTTERM,
+ *         %UBI_UNKNOWN)
+ */
+  struct ubi_reservoir_config
+  {
+    int first_leb;
+    int nr_lebs;
+    int target;
+    int dtype;
+  };
+
+/**
+ * struct ubi_reservoir_stats - reservoir statistics.
+ * @ready: LEBs mapped ahead of time and not claimed
+ * @free: un-mapped LEBs, including those being mapped
+ * @dirty: LEBs given back and not un-mapped yet
+ * @hits: claims served with a pre-mapped LEB
+ * @misses: claims served with an un-mapped LEB
+ * @maps: LEBs mapped ahead of time
+ * @unmaps: LEBs given back and un-mapped
+ * @errors: maps and un-maps which failed
+ */
+  struct ubi_reservoir_stats
+  {
+    int ready;
+    int free;
+    int dirty;
+    long long hits;
+    long long misses;
+    long long maps;
+    long long unmaps;
+    long long errors;
+  };
+
+  struct ubi_reservoir *ubi_reservoir_create(struct ubi_volume_desc *desc,
+					     const struct ubi_reservoir_config
+					     *cfg);
+  void ubi_reservoir_destroy(struct ubi_reservoir *res);
+  int ubi_reservoir_get(struct ubi_reservoir *res, int flags);
+  int ubi_reservoir_put(struct ubi_reservoir *res, int lnum);
+  void ubi_reservoir_get_stats(struct ubi_reservoir *res,
+			       struct ubi_reservoir_stats *stats);
+
+/* Measured performance of a UBI device, which the defaults follow */
+/**
+ * struct ubi_profile - performance profile of a UBI device.
+ * @write_size: smallest write size getting close to the best throughput
+ * @read_size: smallest read size getting close to the best throughput
+ * @queue_depth: smallest number of concurrent reads of @read_size getting
+ *               close to the best throughput
+ * @readahead: readahead window, a few reads of @read_size for each one which
+ *             can be in flight, at most a LEB
+ * @write_kbps: write throughput with @write_size, in kB/s
+ * @read_kbps: read throughput with @read_size and @queue_depth, in kB/s
+ * @read_us: time to read a minimal I/O unit, in microseconds
+ * @prog_us: time to write a minimal I/O unit, in microseconds
+ * @erase_us: time to erase a LEB, in microseconds
+ */
+  struct ubi_profile
+  {
+    int write_size;
+    int read_size;
+    int queue_depth;
+    int readahead;
+    int write_kbps;
+    int read_kbps;
+    int read_us;
+    int prog_us;
+    int erase_us;
+  };
+
+  int ubi_calibrate(struct ubi_volume_desc *desc, int lnum, int budget_ms,
+		    struct ubi_profile *prof);
+  int ubi_profile_dir(const char *dir);
+  int ubi_profile_save(struct ubi_volume_desc *desc,
+		       const struct ubi_profile *prof);
+  int ubi_profile_load(struct ubi_volume_desc *desc, struct ubi_profile *prof);
+  int ubi_profile_set(struct ubi_volume_desc *desc,
+		      const struct ubi_profile *prof);
+  int ubi_profile_get(struct ubi_volume_desc *desc, struct ubi_profile *prof);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1188 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - C++ interface.
+ *
+ * 'ubi::volume' owns a volume descriptor and closes it when it goes away;
+ * it can be moved but not copied. Data is passed as spans of bytes, so
+ * nothing is copied or allocated on the way to the C functions, and the
+ * arguments are checked against the volume geometry before calling them.
+ * Errors come back as a 'ubi::result', holding either a value or a
+ * 'std::error_code' of the generic category, i.e. an errno value, much
+ * like C++23 'std::expected'. 'ubi::buffer_resource' lets the standard
+ * containers allocate from an I/O buffer pool. 'ubi::async_volume' gives
+ * awaitable operations run by a 'ubi::executor', for coroutines.
+ *
+ * This needs C++20.
+ */
+
+#ifndef __LIBUBIIO_HPP__
+#define __LIBUBIIO_HPP__
+
+#if __cplusplus < 202002L
+#error "libubiio.hpp needs C++20"
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <coroutine>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "libubiio.h"
+
+namespace ubi
+{
+  using bytes = std::span<std::byte>;
+  using const_bytes = std::span<const std::byte>;
+
+  enum class mode : int
+  {
+    readonly = UBI_READONLY,
+    readwrite = UBI_READWRITE,
+    exclusive = UBI_EXCLUSIVE
+  };
+
+  enum class dtype : int
+  {
+    longterm = UBI_LONGTERM,
+    shortterm = UBI_SHORTTERM,
+    unknown = UBI_UNKNOWN
+  };
+
+  /* Turn a negative error code of the C library into an error code */
+  inline std::error_code
+  make_error(int err) noexcept
+  {
+    return std::error_code(err < 0 ? -err : err, std::generic_category());
+  }
+
+/**
+ * class result - a value or an error.
+ *
+ * Converts to %true when it holds a value. 'value()' and the dereference
+ * operators must only be used then, and 'error()' otherwise.
+ */
+  template <typename T>
+  class [[nodiscard]] result
+  {
+  public:
+    result(T value) noexcept(std::is_nothrow_move_constructible_v<T>)
+      : value_(std::move(value))
+    {
+    }
+
+    result(std::error_code err) noexcept : err_(err)
+    {
+    }
+
+    bool has_value() const noexcept { return value_.has_value(); }
+    explicit operator bool() const noexcept { return has_value(); }
+    std::error_code error() const noexcept { return err_; }
+
+    T &value() & noexcept { return *value_; }
+    const T &value() const & noexcept { return *value_; }
+    T &&value() && noexcept { return std::move(*value_); }
+    T &operator*() & noexcept { return *value_; }
+    const T &operator*() const & noexcept { return *value_; }
+    T &&operator*() && noexcept { return std::move(*value_); }
+    T *operator->() noexcept { return &*value_; }
+    const T *operator->() const noexcept { return &*value_; }
+
+    template <typename U>
+    T
+    value_or(U &&other) const &
+    {
+      return value_ ? *value_ : static_cast<T>(std::forward<U>(other));
+    }
+
+  private:
+    std::optional<T> value_;
+    std::error_code err_;
+  };
+
+  template <>
+  class [[nodiscard]] result<void>
+  {
+  public:
+    result() noexcept = default;
+
+    result(std::error_code err) noexcept : err_(err)
+    {
+    }
+
+    bool has_value() const noexcept { return !err_; }
+    explicit operator bool() const noexcept { return has_value(); }
+    std::error_code error() const noexcept { return err_; }
+
+  private:
+    std::error_code err_;
+  };
+
+/**
+ * class volume - an open UBI volume.
+ *
+ * A default-constructed or moved-from volume is closed; 'is_open()' tells.
+ * All the I/O functions assume the volume is open.
+ */
+  class volume
+  {
+  public:
+    volume() noexcept = default;
+
+    /* Take ownership of a descriptor from the C interface */
+    explicit volume(ubi_volume_desc *desc) noexcept : desc_(desc)
+    {
+      if (desc_)
+	ubi_get_volume_info(desc_, &vi_);
+    }
+
+    volume(const volume &) = delete;
+    volume &operator=(const volume &) = delete;
+
+    volume(volume &&other) noexcept
+      : desc_(std::exchange(other.desc_, nullptr)), vi_(other.vi_)
+    {
+    }
+
+    volume &
+    operator=(volume &&other) noexcept
+    {
+      if (this != &other)
+	{
+	  close();
+	  desc_ = std::exchange(other.desc_, nullptr);
+	  vi_ = other.vi_;
+	}
+      return *this;
+    }
+
+    ~volume() { close(); }
+
+    static result<volume>
+    open(int ubi_num, int vol_id, mode m = mode::readwrite) noexcept
+    {
+      return adopt(ubi_open_volume(ubi_num, vol_id, static_cast<int>(m)));
+    }
+
+    static result<volume>
+    open(int ubi_num, const char *name, mode m = mode::readwrite) noexcept
+    {
+      return adopt(ubi_open_volume_nm(ubi_num, name, static_cast<int>(m)));
+    }
+
+    static result<volume>
+    open_sim(const char *path, const ubi_sim_geometry &geo,
+	     mode m = mode::readwrite) noexcept
+    {
+      return adopt(ubi_open_volume_sim(path, &geo, static_cast<int>(m)));
+    }
+
+    void
+    close() noexcept
+    {
+      if (desc_)
+	ubi_close_volume(std::exchange(desc_, nullptr));
+    }
+
+    /* Give the descriptor back to the caller, who must close it */
+    ubi_volume_desc *
+    release() noexcept
+    {
+      return std::exchange(desc_, nullptr);
+    }
+
+    ubi_volume_desc *native_handle() const noexcept { return desc_; }
+    bool is_open() const noexcept { return desc_ != nullptr; }
+    const ubi_volume_info &info() const noexcept { return vi_; }
+    int leb_size() const noexcept { return vi_.usable_leb_size; }
+    int lebs() const noexcept { return vi_.used_ebs; }
+
+    int
+    min_io_size() const noexcept
+    {
+      return ubi_get_min_io_size(desc_);
+    }
+
+    result<void>
+    read(int lnum, int offset, bytes buf) const noexcept
+    {
+      if (in_leb(lnum, offset, buf.size())) [[likely]]
+	return status(ubi_leb_read(desc_, lnum,
+				   reinterpret_cast<char *>(buf.data()),
+				   offset, static_cast<int>(buf.size()), 0));
+      return make_error(-EINVAL);
+    }
+
+    result<void>
+    write(int lnum, int offset, const_bytes buf,
+	  dtype type = dtype::unknown) noexcept
+    {
+      if (in_leb(lnum, offset, buf.size())) [[likely]]
+	return status(ubi_leb_write(desc_, lnum, buf.data(), offset,
+				    static_cast<int>(buf.size()),
+				    static_cast<int>(type)));
+      return make_error(-EINVAL);
+    }
+
+    /* Read consecutive data of a LEB into several buffers */
+    result<void>
+    readv(int lnum, int offset, std::span<const bytes> iov) const noexcept
+    {
+      for (bytes buf : iov)
+	{
+	  if (auto res = read(lnum, offset, buf); !res) [[unlikely]]
+	    return res;
+	  offset += static_cast<int>(buf.size());
+	}
+      return {};
+    }
+
+    /*
+     * Write several buffers one after the other in a LEB; the size of each
+     * has to be a multiple of the minimal I/O unit size.
+     */
+    result<void>
+    writev(int lnum, int offset, std::span<const const_bytes> iov,
+	   dtype type = dtype::unknown) noexcept
+    {
+      for (const_bytes buf : iov)
+	{
+	  if (auto res = write(lnum, offset, buf, type); !res) [[unlikely]]
+	    return res;
+	  offset += static_cast<int>(buf.size());
+	}
+      return {};
+    }
+
+    result<void>
+    change(int lnum, const_bytes buf, dtype type = dtype::unknown) noexcept
+    {
+      if (in_leb(lnum, 0, buf.size())) [[likely]]
+	return status(ubi_leb_change(desc_, lnum, buf.data(),
+				     static_cast<int>(buf.size()),
+				     static_cast<int>(type)));
+      return make_error(-EINVAL);
+    }
+
+    result<void>
+    erase(int lnum) noexcept
+    {
+      return status(ubi_leb_erase(desc_, lnum));
+    }
+
+    result<void>
+    unmap(int lnum) noexcept
+    {
+      return status(ubi_leb_unmap(desc_, lnum));
+    }
+
+    result<void>
+    map(int lnum, dtype type = dtype::unknown) noexcept
+    {
+      return status(ubi_leb_map(desc_, lnum, static_cast<int>(type)));
+    }
+
+    result<bool>
+    is_mapped(int lnum) const noexcept
+    {
+      int ret = ubi_is_mapped(desc_, lnum);
+
+      if (ret >= 0) [[likely]]
+	return ret != 0;
+      return make_error(-errno);
+    }
+
+    /* Offset where writing to @lnum can resume, see 'ubi_leb_find_erased()' */
+    result<int>
+    find_erased(int lnum, int flags = 0) const noexcept
+    {
+      int ret = ubi_leb_find_erased(desc_, lnum, flags);
+
+      if (ret >= 0) [[likely]]
+	return ret;
+      return make_error(ret);
+    }
+
+  private:
+    static result<volume>
+    adopt(ubi_volume_desc *desc) noexcept
+    {
+      if (desc == nullptr) [[unlikely]]
+	return make_error(errno ? errno : EIO);
+      return volume(desc);
+    }
+
+    static result<void>
+    status(int err) noexcept
+    {
+      if (err == 0) [[likely]]
+	return {};
+      return make_error(err);
+    }
+
+    bool
+    in_leb(int lnum, int offset, std::size_t len) const noexcept
+    {
+      return lnum >= 0 && lnum < vi_.used_ebs && offset >= 0
+	&& offset <= vi_.usable_leb_size
+	&& len <= static_cast<std::size_t>(vi_.usable_leb_size - offset);
+    }
+
+    ubi_volume_desc *desc_ = nullptr;
+    ubi_volume_info vi_ = {};
+  };
+
+/**
+ * class fixed_volume - a volume of a geometry known at compile time.
+ * @LebSize: usable LEB size
+ * @MinIo: minimal I/O unit size
+ *
+ * Products with a fixed flash layout can check and place their I/O with
+ * constants: the range and alignment checks of 'read()' and 'write()' are
+ * done here, against @LebSize and @MinIo, and the data goes straight to
+ * 'ubi_vol_read()' and 'ubi_vol_write()'. 'attach()' checks once that the
+ * volume has this geometry.
+ */
+  template <int LebSize, int MinIo>
+  class fixed_volume
+  {
+    static_assert(MinIo > 0 && (MinIo & (MinIo - 1)) == 0,
+		  "the minimal I/O unit size must be a power of 2");
+    static_assert(LebSize > 0 && LebSize % MinIo == 0,
+		  "the LEB size must be a multiple of the minimal I/O size");
+
+  public:
+    static constexpr int leb_size = LebSize;
+    static constexpr int min_io_size = MinIo;
+
+    /*
+     * Take over @vol if its geometry is @LebSize and @MinIo; otherwise,
+     * @vol is left alone and %EXDEV is returned. A volume being updated
+     * gives %EBADF.
+     */
+    static result<fixed_volume>
+    attach(volume &vol) noexcept
+    {
+      if (vol.leb_size() != LebSize || vol.min_io_size() != MinIo)
+	return make_error(-EXDEV);
+      if (vol.info().upd_marker)
+	return make_error(-EBADF);
+      return fixed_volume(std::move(vol));
+    }
+
+    volume &base() noexcept { return vol_; }
+    const volume &base() const noexcept { return vol_; }
+    int lebs() const noexcept { return lebs_; }
+
+    static constexpr long long
+    address(int lnum, int offset) noexcept
+    {
+      return static_cast<long long>(lnum) * LebSize + offset;
+    }
+
+    result<void>
+    read(int lnum, int offset, bytes buf) const noexcept
+    {
+      if (in_leb(lnum, offset, buf.size())) [[likely]]
+	return status(ubi_vol_read(vol_.native_handle(), buf.data(),
+				   static_cast<int>(buf.size()),
+				   address(lnum, offset)));
+      return make_error(-EINVAL);
+    }
+
+    result<void>
+    write(int lnum, int offset, const_bytes buf) noexcept
+    {
+      if (in_leb(lnum, offset, buf.size())
+	  && ((offset | buf.size()) & (MinIo - 1)) == 0) [[likely]]
+	{
+	  if (buf.empty()) [[unlikely]]
+	    return {};
+	  return status(ubi_vol_write(vol_.native_handle(), buf.data(),
+				      static_cast<int>(buf.size()),
+				      address(lnum, offset)));
+	}
+      return make_error(-EINVAL);
+    }
+
+    result<void>
+    change(int lnum, const_bytes buf, dtype type = dtype::unknown) noexcept
+    {
+      return vol_.change(lnum, buf, type);
+    }
+
+    result<void> erase(int lnum) noexcept { return vol_.erase(lnum); }
+    result<void> unmap(int lnum) noexcept { return vol_.unmap(lnum); }
+
+  private:
+    explicit fixed_volume(volume &&vol) noexcept
+      : vol_(std::move(vol)), lebs_(vol_.lebs())
+    {
+    }
+
+    static result<void>
+    status(int err) noexcept
+    {
+      if (err == 0) [[likely]]
+	return {};
+      return make_error(err);
+    }
+
+    bool
+    in_leb(int lnum, int offset, std::size_t len) const noexcept
+    {
+      return static_cast<unsigned int>(lnum) < static_cast<unsigned int>(lebs_)
+	&& static_cast<unsigned int>(offset) <= LebSize
+	&& len <= static_cast<std::size_t>(LebSize - offset);
+    }
+
+    volume vol_;
+    int lebs_;
+  };
+
+/**
+ * class buffer_resource - a memory resource backed by an I/O buffer pool.
+ *
+ * Allocations are aligned to the alignment the pool was created with, at
+ * least the page size, and to the requested alignment, up to 2 MiB. They
+ * are meant for I/O buffers: small objects still take a whole page. A
+ * resource must outlive what was allocated from it.
+ */
+  class buffer_resource : public std::pmr::memory_resource
+  {
+  public:
+    /* See 'ubi_bufpool_create()' */
+    static result<buffer_resource>
+    create(int align = 0, int flags = 0) noexcept
+    {
+      ubi_bufpool *pool = ubi_bufpool_create(align, flags);
+
+      if (pool == nullptr) [[unlikely]]
+	return make_error(errno);
+      return buffer_resource(pool);
+    }
+
+    buffer_resource(const buffer_resource &) = delete;
+    buffer_resource &operator=(const buffer_resource &) = delete;
+
+    buffer_resource(buffer_resource &&other) noexcept
+      : pool_(std::exchange(other.pool_, nullptr))
+    {
+    }
+
+    ~buffer_resource()
+    {
+      if (pool_)
+	ubi_bufpool_destroy(pool_);
+    }
+
+    ubi_bufpool *native_handle() const noexcept { return pool_; }
+
+  private:
+    explicit buffer_resource(ubi_bufpool *pool) noexcept : pool_(pool)
+    {
+    }
+
+    static std::size_t
+    size_of(std::size_t bytes, std::size_t alignment) noexcept
+    {
+      /* the pool has no empty buffers */
+      if (bytes == 0)
+	bytes = 1;
+      /* buffers are aligned to their size class */
+      return bytes > alignment ? bytes : alignment;
+    }
+
+    void *
+    do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+      void *p = nullptr;
+
+      if (alignment <= max_alignment) [[likely]]
+	p = ubi_buf_alloc(pool_, size_of(bytes, alignment));
+      if (p == nullptr) [[unlikely]]
+	throw std::bad_alloc();
+      return p;
+    }
+
+    void
+    do_deallocate(void *p, std::size_t bytes,
+		  std::size_t alignment) noexcept override
+    {
+      ubi_buf_free(pool_, p, size_of(bytes, alignment));
+    }
+
+    bool
+    do_is_equal(const std::pmr::memory_resource &other)
+      const noexcept override
+    {
+      return this == &other;
+    }
+
+    static constexpr std::size_t max_alignment = 2 << 20;
+
+    ubi_bufpool *pool_;
+  };
+
+/**
+ * struct resumer - how a coroutine is resumed once its operation completed.
+ *
+ * By default the coroutine is resumed right away, on the I/O thread which
+ * completed the operation; 'resume_on()' makes one which posts it to the
+ * scheduler of the caller instead.
+ */
+  struct resumer
+  {
+    void (*fn)(void *ctx, std::coroutine_handle<> h) = nullptr;
+    void *ctx = nullptr;
+
+    void
+    resume(std::coroutine_handle<> h) const
+    {
+      if (fn)
+	fn(ctx, h);
+      else
+	h.resume();
+    }
+  };
+
+  /* Resume coroutines through @sched.post(), which takes a callable */
+  template <typename Scheduler>
+  resumer
+  resume_on(Scheduler &sched) noexcept
+  {
+    return {[](void *ctx, std::coroutine_handle<> h) {
+	      static_cast<Scheduler *>(ctx)->post([h] { h.resume(); });
+	    }, &sched};
+  }
+
+  class executor;
+  class async_volume;
+
+  namespace detail
+  {
+    /* Coroutine waiting for several operations */
+    struct group
+    {
+      std::atomic<int> count;
+      std::coroutine_handle<> h;
+      resumer res;
+
+      /* Returns %true if this was the last one to arrive */
+      bool
+      arrive_last() noexcept
+      {
+	return count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+      }
+
+      void
+      arrive() noexcept
+      {
+	if (arrive_last())
+	  res.resume(h);
+      }
+    };
+
+/*
+ * An operation submitted to an executor. The completion callback and the
+ * thread starting the operation each drop a reference, and whoever drops
+ * the last one goes on with the coroutine, so that the coroutine is never
+ * resumed while the operation is still being started.
+ */
+    class io_base
+    {
+    public:
+      io_base(executor &ex, const resumer &res, std::stop_token stop,
+	      int ubi_num, int err) noexcept
+	: ex_(&ex), res_(res), stop_(std::move(stop)), ubi_num_(ubi_num),
+	  err_(err)
+      {
+      }
+
+      /* Operations can only be moved before they are started */
+      io_base(io_base &&other) noexcept
+	: op_(other.op_), ex_(other.ex_), res_(other.res_),
+	  stop_(std::move(other.stop_)), ubi_num_(other.ubi_num_),
+	  err_(other.err_)
+      {
+      }
+
+      io_base(const io_base &) = delete;
+      io_base &operator=(const io_base &) = delete;
+
+      /* Return value of the C function, once completed */
+      int status() const noexcept { return op_.result; }
+
+      /* Start as part of @g, which gets one arrival when this completes */
+      void
+      start_in(group *g) noexcept
+      {
+	group_ = g;
+	if (start())
+	  g->arrive();
+      }
+
+      const resumer &get_resumer() const noexcept { return res_; }
+
+    protected:
+      /* Returns %true if the operation completed already */
+      bool start() noexcept;
+
+      ubi_io_op op_ = {};
+      std::coroutine_handle<> h_;
+
+    private:
+      friend class ubi::executor;
+
+      struct canceller
+      {
+	io_base *io;
+	void operator()() const noexcept;
+      };
+
+      static void on_done(ubi_io_op *op) noexcept;
+
+      executor *ex_;
+      resumer res_;
+      std::stop_token stop_;
+      int ubi_num_;
+      int err_;
+      std::atomic<int> refs_;
+      group *group_ = nullptr;
+      std::optional<std::stop_callback<canceller>> cancel_;
+      /*
+       * In the overflow list of the executor, changed under its lock only;
+       * the links also chain operations to fail once the lock is dropped.
+       */
+      bool overflowed_ = false;
+      io_base *prev_ = nullptr;
+      io_base *next_ = nullptr;
+    };
+  }
+
+/**
+ * class executor - I/O threads running operations for coroutines.
+ *
+ * Owns a 'ubi_executor', see 'ubi_executor_create()'. Operations started
+ * while the queue of their device is full wait in an overflow list instead
+ * of blocking the starting thread, and are queued as operations of the
+ * device complete, so that any number of them can be outstanding on a fixed
+ * number of threads. The executor must outlive its operations; the ones
+ * still in the overflow list when it is destroyed are cancelled.
+ */
+  class executor
+  {
+  public:
+    static result<executor>
+    create(int workers_per_dev = 0, int queue_depth = 0) noexcept
+    {
+      state *st = new (std::nothrow) state;
+
+      if (st == nullptr) [[unlikely]]
+	return make_error(ENOMEM);
+      st->ex = ubi_executor_create(workers_per_dev, queue_depth);
+      if (st->ex == nullptr) [[unlikely]]
+	{
+	  int err = errno;
+
+	  delete st;
+	  return make_error(err);
+	}
+      return executor(st);
+    }
+
+    executor(const executor &) = delete;
+    executor &operator=(const executor &) = delete;
+
+    executor(executor &&other) noexcept
+      : st_(std::exchange(other.st_, nullptr))
+    {
+    }
+
+    ~executor()
+    {
+      if (st_ == nullptr)
+	return;
+      for (;;)
+	{
+	  detail::io_base *io = nullptr;
+	  {
+	    std::lock_guard<std::mutex> guard(st_->lock);
+	    for (auto &q : st_->overflow)
+	      if ((io = q.second.head) != nullptr)
+		{
+		  q.second.remove(io);
+		  io->overflowed_ = false;
+		  break;
+		}
+	  }
+	  if (io == nullptr)
+	    break;
+	  io->op_.result = -ECANCELED;
+	  detail::io_base::on_done(&io->op_);
+	}
+      ubi_executor_destroy(st_->ex);
+      delete st_;
+    }
+
+    ubi_executor *native_handle() const noexcept { return st_->ex; }
+
+    /* See 'ubi_executor_set_class()' */
+    result<void>
+    set_class(int ioclass, const ubi_exec_class &cfg) noexcept
+    {
+      int err = ubi_executor_set_class(st_->ex, ioclass, &cfg);
+
+      if (err) [[unlikely]]
+	return make_error(err);
+      return {};
+    }
+
+  private:
+    friend class detail::io_base;
+
+    struct io_list
+    {
+      detail::io_base *head = nullptr;
+      detail::io_base *tail = nullptr;
+
+      void
+      push_back(detail::io_base *io) noexcept
+      {
+	io->prev_ = tail;
+	io->next_ = nullptr;
+	(tail ? tail->next_ : head) = io;
+	tail = io;
+      }
+
+      void
+      remove(detail::io_base *io) noexcept
+      {
+	(io->prev_ ? io->prev_->next_ : head) = io->next_;
+	(io->next_ ? io->next_->prev_ : tail) = io->prev_;
+      }
+    };
+
+    /**
+     * struct state - what the operations refer to, which does not move.
+     * @ex: the C executor
+     * @lock: protects @overflow
+     * @overflow: operations waiting for room in a device queue, by device
+     * @nr_overflow: number of operations in @overflow
+     */
+    struct state
+    {
+      ubi_executor *ex = nullptr;
+      std::mutex lock;
+      std::unordered_map<int, io_list> overflow;
+      std::atomic<int> nr_overflow{0};
+    };
+
+    explicit executor(state *st) noexcept : st_(st)
+    {
+    }
+
+    int
+    submit(detail::io_base *io) noexcept
+    {
+      int err = ubi_exec_submit(st_->ex, &io->op_, UBI_EXEC_NOWAIT);
+      io_list failed;
+
+      if (err != -EAGAIN) [[likely]]
+	return err;
+      {
+	std::lock_guard<std::mutex> guard(st_->lock);
+	try
+	  {
+	    st_->overflow[io->ubi_num_].push_back(io);
+	  }
+	catch (...)
+	  {
+	    return -ENOMEM;
+	  }
+	io->overflowed_ = true;
+	st_->nr_overflow.fetch_add(1);
+	/* the queue may have drained since it was found full */
+	drain_locked(st_->overflow[io->ubi_num_], failed);
+      }
+      complete_failed(failed);
+      return 0;
+    }
+
+    /* Queue what fits of the overflow list of device @ubi_num */
+    void
+    drain(int ubi_num) noexcept
+    {
+      io_list failed;
+
+      if (st_->nr_overflow.load() == 0) [[likely]]
+	return;
+      {
+	std::lock_guard<std::mutex> guard(st_->lock);
+	auto q = st_->overflow.find(ubi_num);
+
+	if (q != st_->overflow.end())
+	  drain_locked(q->second, failed);
+      }
+      complete_failed(failed);
+    }
+
+    void
+    drain_locked(io_list &q, io_list &failed) noexcept
+    {
+      while (detail::io_base *io = q.head)
+	{
+	  int err = ubi_exec_submit(st_->ex, &io->op_, UBI_EXEC_NOWAIT);
+
+	  if (err == -EAGAIN)
+	    break;
+	  q.remove(io);
+	  io->overflowed_ = false;
+	  st_->nr_overflow.fetch_sub(1);
+	  if (err)
+	    {
+	      io->op_.result = err;
+	      failed.push_back(io);
+	    }
+	}
+    }
+
+    static void
+    complete_failed(io_list &failed) noexcept
+    {
+      while (detail::io_base *io = failed.head)
+	{
+	  failed.remove(io);
+	  detail::io_base::on_done(&io->op_);
+	}
+    }
+
+    void
+    cancel(detail::io_base *io) noexcept
+    {
+      bool found = false;
+
+      {
+	std::lock_guard<std::mutex> guard(st_->lock);
+	if (io->overflowed_)
+	  {
+	    st_->overflow[io->ubi_num_].remove(io);
+	    io->overflowed_ = false;
+	    st_->nr_overflow.fetch_sub(1);
+	    found = true;
+	  }
+      }
+      if (found)
+	{
+	  io->op_.result = -ECANCELED;
+	  detail::io_base::on_done(&io->op_);
+	}
+      else
+	ubi_exec_cancel(&io->op_);
+    }
+
+    state *st_;
+  };
+
+  inline bool
+  detail::io_base::start() noexcept
+  {
+    refs_.store(2, std::memory_order_relaxed);
+    if (err_) [[unlikely]]
+      {
+	op_.result = err_;
+	return true;
+      }
+    if (stop_.stop_requested())
+      {
+	op_.result = -ECANCELED;
+	return true;
+      }
+    op_.done = on_done;
+    op_.priv = this;
+    if (int err = ex_->submit(this)) [[unlikely]]
+      {
+	op_.result = err;
+	return true;
+      }
+    if (stop_.stop_possible())
+      cancel_.emplace(stop_, canceller{this});
+    return refs_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  inline void
+  detail::io_base::canceller::operator()() const noexcept
+  {
+    io->ex_->cancel(io);
+  }
+
+  inline void
+  detail::io_base::on_done(ubi_io_op *op) noexcept
+  {
+    io_base *io = static_cast<io_base *>(op->priv);
+
+    /* there is room in the queue of the device now */
+    io->ex_->drain(io->ubi_num_);
+    if (io->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+      return;
+    if (io->group_)
+      io->group_->arrive();
+    else
+      io->res_.resume(io->h_);
+  }
+
+/**
+ * class io - an awaitable operation.
+ * @T: %void, or %bool for 'async_volume::is_mapped()'
+ *
+ * The operation starts when it is awaited and the coroutine goes on once it
+ * completed, with a 'result<T>'. Requesting a stop through the stop token
+ * given for the operation cancels it if it is still queued, and it then
+ * fails with %ECANCELED; an operation being executed cannot be interrupted.
+ * An operation is awaited once, and must not be moved once started.
+ */
+  template <typename T>
+  class [[nodiscard]] io : public detail::io_base
+  {
+  public:
+    using detail::io_base::io_base;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool
+    await_suspend(std::coroutine_handle<> h) noexcept
+    {
+      h_ = h;
+      return !start();
+    }
+
+    result<T>
+    await_resume() const noexcept
+    {
+      if (op_.result < 0) [[unlikely]]
+	return make_error(op_.result);
+      if constexpr (std::is_same_v<T, bool>)
+	return op_.result != 0;
+      else
+	return {};
+    }
+
+  private:
+    friend class async_volume;
+  };
+
+/**
+ * class async_volume - awaitable operations on a volume.
+ *
+ * The operations are those of 'volume', checked the same way, and run on
+ * the threads of @ex; coroutines are resumed through @res. The volume, the
+ * executor and the buffers must outlive the operations.
+ */
+  class async_volume
+  {
+  public:
+    async_volume(volume &vol, executor &ex, resumer res = {}) noexcept
+      : vol_(&vol), ex_(&ex), res_(res)
+    {
+    }
+
+    io<void>
+    read(int lnum, int offset, bytes buf, std::stop_token stop = {}) noexcept
+    {
+      return make<void>(UBI_OP_READ, lnum, offset, buf.data(), buf.size(),
+			dtype::unknown, std::move(stop));
+    }
+
+    io<void>
+    write(int lnum, int offset, const_bytes buf,
+	  dtype type = dtype::unknown, std::stop_token stop = {}) noexcept
+    {
+      return make<void>(UBI_OP_WRITE, lnum, offset,
+			const_cast<std::byte *>(buf.data()), buf.size(), type,
+			std::move(stop));
+    }
+
+    io<void>
+    change(int lnum, const_bytes buf, dtype type = dtype::unknown,
+	   std::stop_token stop = {}) noexcept
+    {
+      return make<void>(UBI_OP_CHANGE, lnum, 0,
+			const_cast<std::byte *>(buf.data()), buf.size(), type,
+			std::move(stop));
+    }
+
+    io<void>
+    erase(int lnum, std::stop_token stop = {}) noexcept
+    {
+      return make<void>(UBI_OP_ERASE, lnum, 0, nullptr, 0, dtype::unknown,
+			std::move(stop));
+    }
+
+    io<void>
+    unmap(int lnum, std::stop_token stop = {}) noexcept
+    {
+      return make<void>(UBI_OP_UNMAP, lnum, 0, nullptr, 0, dtype::unknown,
+			std::move(stop));
+    }
+
+    io<void>
+    map(int lnum, dtype type = dtype::unknown,
+	std::stop_token stop = {}) noexcept
+    {
+      return make<void>(UBI_OP_MAP, lnum, 0, nullptr, 0, type,
+			std::move(stop));
+    }
+
+    io<bool>
+    is_mapped(int lnum, std::stop_token stop = {}) noexcept
+    {
+      return make<bool>(UBI_OP_IS_MAPPED, lnum, 0, nullptr, 0,
+			dtype::unknown, std::move(stop));
+    }
+
+    volume &base() const noexcept { return *vol_; }
+
+  private:
+    template <typename T>
+    io<T>
+    make(int opcode, int lnum, int offset, std::byte *buf, std::size_t len,
+	 dtype type, std::stop_token stop) noexcept
+    {
+      const ubi_volume_info &vi = vol_->info();
+      bool ok = lnum >= 0 && lnum < vi.used_ebs && offset >= 0
+	&& offset <= vi.usable_leb_size
+	&& len <= static_cast<std::size_t>(vi.usable_leb_size - offset);
+      io<T> op(*ex_, res_, std::move(stop), vi.ubi_num, ok ? 0 : -EINVAL);
+
+      op.op_.opcode = opcode;
+      op.op_.desc = vol_->native_handle();
+      op.op_.lnum = lnum;
+      op.op_.buf = buf;
+      op.op_.offset = offset;
+      op.op_.len = static_cast<int>(len);
+      op.op_.dtype = static_cast<int>(type);
+      return op;
+    }
+
+    volume *vol_;
+    executor *ex_;
+    resumer res_;
+  };
+
+/**
+ * when_all - await several operations at once.
+ *
+ * The operations are started together and the coroutine goes on, the way
+ * the first operation would have, once they all completed. With operations
+ * given one by one, the awaitable gives a tuple of their results. With a
+ * span, which suits batches of any size, it gives the first error, if any,
+ * and the result of each operation is left in it, see 'io::await_resume()'.
+ */
+  template <typename... T>
+  class [[nodiscard]] when_all_io
+  {
+  public:
+    explicit when_all_io(io<T> &&...ops) noexcept : ops_(std::move(ops)...)
+    {
+    }
+
+    bool await_ready() const noexcept { return sizeof...(T) == 0; }
+
+    bool
+    await_suspend(std::coroutine_handle<> h) noexcept
+    {
+      group_.count.store(sizeof...(T) + 1, std::memory_order_relaxed);
+      group_.h = h;
+      group_.res = std::get<0>(ops_).get_resumer();
+      std::apply([this](auto &...op) { (op.start_in(&group_), ...); }, ops_);
+      return !group_.arrive_last();
+    }
+
+    std::tuple<result<T>...>
+    await_resume() const noexcept
+    {
+      return std::apply([](const auto &...op) {
+			  return std::tuple<result<T>...>(op.await_resume()...);
+			}, ops_);
+    }
+
+  private:
+    std::tuple<io<T>...> ops_;
+    detail::group group_;
+  };
+
+  template <typename T>
+  class [[nodiscard]] when_all_span
+  {
+  public:
+    explicit when_all_span(std::span<io<T>> ops) noexcept : ops_(ops)
+    {
+    }
+
+    bool await_ready() const noexcept { return ops_.empty(); }
+
+    bool
+    await_suspend(std::coroutine_handle<> h) noexcept
+    {
+      group_.count.store(static_cast<int>(ops_.size()) + 1,
+			 std::memory_order_relaxed);
+      group_.h = h;
+      group_.res = ops_.front().get_resumer();
+      for (io<T> &op : ops_)
+	op.start_in(&group_);
+      return !group_.arrive_last();
+    }
+
+    result<void>
+    await_resume() const noexcept
+    {
+      for (const io<T> &op : ops_)
+	if (op.status() < 0) [[unlikely]]
+	  return make_error(op.status());
+      return {};
+    }
+
+  private:
+    std::span<io<T>> ops_;
+    detail::group group_;
+  };
+
+  template <typename... T>
+  when_all_io<T...>
+  when_all(io<T> &&...ops) noexcept
+  {
+    return when_all_io<T...>(std::move(ops)...);
+  }
+
+  template <typename T>
+  when_all_span<T>
+  when_all(std::span<io<T>> ops) noexcept
+  {
+    return when_all_span<T>(ops);
+  }
+}
+
+#endif				/* !__LIBUBIIO_HPP__ */
@@ -0,0 +1,445 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - I/O buffer pool.
+ *
+ * Buffers are handed out by power of two size classes, from the page size
+ * up to the slab size, and are carved from slabs aligned to their size, so
+ * a buffer is aligned to its class size: to the page and to the minimal I/O
+ * unit size. Slabs are mapped with huge pages when the system has some
+ * reserved, with transparent huge pages otherwise, and are faulted in when
+ * they are mapped rather than on the I/O path.
+ *
+ * Each thread keeps a few free buffers of each class, so allocating and
+ * freeing usually takes no lock; the others go back to per-class free lists
+ * shared by the threads. Memory is only returned to the system when the
+ * pool is destroyed. Requests larger than a slab are mapped on their own.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/* Slabs of 2 MiB, the usual huge page size */
+#define POOL_SLAB_SHIFT		21
+#define POOL_SLAB_SIZE		(1UL << POOL_SLAB_SHIFT)
+#define POOL_MAX_CLASSES	(POOL_SLAB_SHIFT - 11)
+
+/* Bytes of free buffers a thread keeps per class, at least one buffer */
+#define POOL_CACHE_BYTES	(512 * 1024)
+
+/**
+ * struct pool_cache - free buffers kept by a thread.
+ * @pool: the pool
+ * @count: number of buffers in @bufs, by class
+ * @bufs: the buffers, by class
+ * @next: next cache of the pool
+ * @prev: where the pool or the previous cache points to this one
+ */
+struct pool_cache
+{
+  struct ubi_bufpool *pool;
+  int count[POOL_MAX_CLASSES];
+  void **bufs[POOL_MAX_CLASSES];
+  struct pool_cache *next;
+  struct pool_cache **prev;
+};
+
+/**
+ * struct pool_slab - a mapped slab.
+ * @addr: where it is mapped
+ * @size: mapping size
+ * @next: next slab of the pool
+ */
+struct pool_slab
+{
+  void *addr;
+  size_t size;
+  struct pool_slab *next;
+};
+
+/**
+ * struct ubi_bufpool - I/O buffer pool.
+ * @min_shift: log2 of the smallest class size
+ * @nr_classes: number of classes
+ * @cache_max: how many buffers a thread cache keeps, by class
+ * @no_huge: do not try huge pages
+ * @key: thread cache key
+ * @lock: protects all the fields below
+ * @free: free lists of buffers, linked through their first word, by class
+ * @carve: unused part of the slab being carved, by class
+ * @carve_end: end of the slab being carved, by class
+ * @slabs: mapped slabs
+ * @caches: thread caches
+ * @stats: statistics
+ */
+struct ubi_bufpool
+{
+  int min_shift;
+  int nr_classes;
+  int cache_max[POOL_MAX_CLASSES];
+  int no_huge;
+  pthread_key_t key;
+  pthread_mutex_t lock;
+  void *free[POOL_MAX_CLASSES];
+  char *carve[POOL_MAX_CLASSES];
+  char *carve_end[POOL_MAX_CLASSES];
+  struct pool_slab *slabs;
+  struct pool_cache *caches;
+  struct ubi_bufpool_stats stats;
+};
+
+/* Class of a buffer of @size bytes, %-1 if it is larger than a slab */
+static int
+pool_class(struct ubi_bufpool *pool, size_t size)
+{
+  int c = 0;
+
+  while (c < pool->nr_classes && size > 1UL << (pool->min_shift + c))
+    c++;
+  return c < pool->nr_classes ? c : -1;
+}
+
+/*
+ * Map @size bytes aligned to @align, with huge pages if possible and
+ * faulted in. Returns the address or %NULL, storing whether huge pages of
+ * the system reserve were used in @huge.
+ */
+static void *
+pool_map(struct ubi_bufpool *pool, size_t size, size_t align, int *huge)
+{
+  char *p, *q;
+
+  *huge = 0;
+#ifdef MAP_HUGETLB
+  if (!pool->no_huge && size % POOL_SLAB_SIZE == 0)
+    {
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1,
+	       0);
+      if (p != MAP_FAILED)
+	{
+	  *huge = 1;
+	  return p;
+	}
+    }
+#endif
+
+  /* over-map and trim to get the alignment */
+  p = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  q = (char *) (((unsigned long) p + align - 1) & ~(align - 1));
+  if (q > p)
+    munmap(p, q - p);
+  if (p + align > q)
+    munmap(q + size, p + align - q);
+#ifdef MADV_HUGEPAGE
+  if (!pool->no_huge)
+    madvise(q, size, MADV_HUGEPAGE);
+#endif
+  /* fault the pages in now rather than on the I/O path */
+  for (p = q; p < q + size; p += getpagesize())
+    *p = 0;
+  return q;
+}
+
+/* Give a slab to class @c, called with @pool->lock held */
+static int
+pool_grow(struct ubi_bufpool *pool, int c)
+{
+  struct pool_slab *slab;
+  int huge;
+
+  slab = malloc(sizeof(struct pool_slab));
+  if (slab == NULL)
+    return -ENOMEM;
+  slab->size = POOL_SLAB_SIZE;
+  slab->addr = pool_map(pool, slab->size, POOL_SLAB_SIZE, &huge);
+  if (slab->addr == NULL)
+    {
+      free(slab);
+      return -ENOMEM;
+    }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pool->carve[c] = slab->addr;
+  pool->carve_end[c] = pool->carve[c] + slab->size;
+  pool->stats.mapped += slab->size;
+  if (huge)
+    pool->stats.huge += slab->size;
+  return 0;
+}
+
+/* Return the buffers of a thread cache to the free lists */
+static void
+pool_cache_drain(struct pool_cache *tc)
+{
+  struct ubi_bufpool *pool = tc->pool;
+  void *buf;
+  int c;
+
+  for (c = 0; c < pool->nr_classes; c++)
+    while (tc->count[c])
+      {
+	buf = tc->bufs[c][--tc->count[c]];
+	*(void **) buf = pool->free[c];
+	pool->free[c] = buf;
+      }
+}
+
+static void
+pool_cache_free(struct pool_cache *tc)
+{
+  int c;
+
+  for (c = 0; c < tc->pool->nr_classes; c++)
+    free(tc->bufs[c]);
+  free(tc);
+}
+
+/* Thread exit destructor of the thread caches */
+static void
+pool_cache_exit(void *arg)
+{
+  struct pool_cache *tc = arg;
+  struct ubi_bufpool *pool = tc->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  pool_cache_drain(tc);
+  *tc->prev = tc->next;
+  if (tc->next)
+    tc->next->prev = tc->prev;
+  pthread_mutex_unlock(&pool->lock);
+  pool_cache_free(tc);
+}
+
+/* Get the cache of the calling thread, creating it if needed */
+static struct pool_cache *
+pool_get_cache(struct ubi_bufpool *pool)
+{
+  struct pool_cache *tc = pthread_getspecific(pool->key);
+  int c;
+
+  if (tc != NULL)
+    return tc;
+  tc = calloc(1, sizeof(struct pool_cache));
+  if (tc == NULL)
+    return NULL;
+  tc->pool = pool;
+  for (c = 0; c < pool->nr_classes; c++)
+    {
+      tc->bufs[c] = malloc(pool->cache_max[c] * sizeof(void *));
+      if (tc->bufs[c] == NULL)
+	{
+	  pool_cache_free(tc);
+	  return NULL;
+	}
+    }
+  if (pthread_setspecific(pool->key, tc))
+    {
+      pool_cache_free(tc);
+      return NULL;
+    }
+  pthread_mutex_lock(&pool->lock);
+  tc->next = pool->caches;
+  if (tc->next)
+    tc->next->prev = &tc->next;
+  tc->prev = &pool->caches;
+  pool->caches = tc;
+  pthread_mutex_unlock(&pool->lock);
+  return tc;
+}
+
+/**
+ * ubi_bufpool_create - create an I/O buffer pool.
+ * @align: alignment of the buffers, a power of 2, e.g. the minimal I/O unit
+ *         size of a volume; buffers are always aligned to the page size
+ * @flags: %UBI_BUFPOOL_NO_HUGE not to use huge pages
+ *
+ * Returns the pool in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_bufpool *
+ubi_bufpool_create(int align, int flags)
+{
+  struct ubi_bufpool *pool;
+  int c, err;
+
+  if (align < 0 || align & (align - 1) || align > (int) POOL_SLAB_SIZE
+      || flags & ~UBI_BUFPOOL_NO_HUGE)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  pool = calloc(1, sizeof(struct ubi_bufpool));
+  if (pool == NULL)
+    return NULL;
+  pool->no_huge = !!(flags & UBI_BUFPOOL_NO_HUGE);
+  align = MAX(align, getpagesize());
+  while (1 << pool->min_shift < align)
+    pool->min_shift++;
+  pool->nr_classes = POOL_SLAB_SHIFT - pool->min_shift + 1;
+  for (c = 0; c < pool->nr_classes; c++)
+    pool->cache_max[c] = MAX(POOL_CACHE_BYTES >> (pool->min_shift + c), 1);
+
+  err = pthread_key_create(&pool->key, pool_cache_exit);
+  if (err)
+    {
+      free(pool);
+      errno = err;
+      return NULL;
+    }
+  pthread_mutex_init(&pool->lock, NULL);
+  return pool;
+}
+
+/**
+ * ubi_bufpool_destroy - destroy an I/O buffer pool.
+ * @pool: the pool
+ *
+ * All the buffers must have been freed, and no other thread may use the pool
+ * anymore.
+ */
+void
+ubi_bufpool_destroy(struct ubi_bufpool *pool)
+{
+  struct pool_slab *slab, *next;
+  struct pool_cache *tc;
+
+  pthread_key_delete(pool->key);
+  while ((tc = pool->caches) != NULL)
+    {
+      pool->caches = tc->next;
+      pool_cache_free(tc);
+    }
+  for (slab = pool->slabs; slab != NULL; slab = next)
+    {
+      next = slab->next;
+      munmap(slab->addr, slab->size);
+      free(slab);
+    }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/**
+ * ubi_buf_alloc - allocate an I/O buffer.
+ * @pool: the pool
+ * @size: buffer size, not %0
+ *
+ * Returns the buffer in case of success and %NULL in case of failure, with
+ * errno set. The buffer is not zeroed.
+ */
+void *
+ubi_buf_alloc(struct ubi_bufpool *pool, size_t size)
+{
+  struct pool_cache *tc;
+  void *buf;
+  int c, huge;
+
+  if (size == 0)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  c = pool_class(pool, size);
+  if (c < 0)
+    {
+      size = (size + POOL_SLAB_SIZE - 1) & ~(POOL_SLAB_SIZE - 1);
+      buf = pool_map(pool, size, POOL_SLAB_SIZE, &huge);
+      if (buf == NULL)
+	errno = ENOMEM;
+      return buf;
+    }
+
+  tc = pool_get_cache(pool);
+  if (tc != NULL && tc->count[c])
+    return tc->bufs[c][--tc->count[c]];
+
+  pthread_mutex_lock(&pool->lock);
+  buf = pool->free[c];
+  if (buf != NULL)
+    pool->free[c] = *(void **) buf;
+  else
+    {
+      if (pool->carve[c] == pool->carve_end[c] && pool_grow(pool, c))
+	{
+	  pthread_mutex_unlock(&pool->lock);
+	  errno = ENOMEM;
+	  return NULL;
+	}
+      buf = pool->carve[c];
+      pool->carve[c] += 1UL << (pool->min_shift + c);
+    }
+  pool->stats.refills += 1;
+  pthread_mutex_unlock(&pool->lock);
+  return buf;
+}
+
+/**
+ * ubi_buf_free - free an I/O buffer.
+ * @pool: the pool the buffer was allocated from
+ * @buf: the buffer, may be %NULL
+ * @size: the size it was allocated with
+ */
+void
+ubi_buf_free(struct ubi_bufpool *pool, void *buf, size_t size)
+{
+  struct pool_cache *tc;
+  int c;
+
+  if (buf == NULL)
+    return;
+  c = pool_class(pool, size);
+  if (c < 0)
+    {
+      munmap(buf, (size + POOL_SLAB_SIZE - 1) & ~(POOL_SLAB_SIZE - 1));
+      return;
+    }
+
+  tc = pool_get_cache(pool);
+  if (tc != NULL && tc->count[c] < pool->cache_max[c])
+    {
+      tc->bufs[c][tc->count[c]++] = buf;
+      return;
+    }
+  pthread_mutex_lock(&pool->lock);
+  *(void **) buf = pool->free[c];
+  pool->free[c] = buf;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * ubi_bufpool_get_stats - get buffer pool statistics.
+ * @pool: the pool
+ * @stats: the statistics are stored here
+ */
+void
+ubi_bufpool_get_stats(struct ubi_bufpool *pool,
+		      struct ubi_bufpool_stats *stats)
+{
+  pthread_mutex_lock(&pool->lock);
+  memcpy(stats, &pool->stats, sizeof(*stats));
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,652 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - performance calibration.
+ *
+ * Sysfs gives the minimal I/O unit and the LEB size of a device, which say
+ * little about the transfer sizes and the number of concurrent operations it
+ * performs best with. Calibration measures them with a short benchmark on a
+ * scratch LEB: each transfer size from the minimal I/O unit up is timed over
+ * the whole LEB, then reads of the chosen size are run from more and more
+ * threads. The smallest setting which gets %CALIB_GOOD_PCT percent of the
+ * best throughput wins, since larger ones only cost memory and latency.
+ *
+ * The resulting profile is saved in a file per device, which opening a volume
+ * of that device loads. Readahead windows, stream buffers and executor
+ * workers then default to the measured values.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define CALIB_DEFAULT_BUDGET_MS	2000
+/* Largest transfer size and number of threads tried */
+#define CALIB_MAX_IO		(256 * 1024)
+#define CALIB_MAX_DEPTH		16
+/* Operations timed for the latencies of single pages */
+#define CALIB_LAT_OPS		8
+/* Reads done per thread count */
+#define CALIB_DEPTH_OPS		64
+/* Share of the best throughput which is good enough, in percent */
+#define CALIB_GOOD_PCT		90
+/* Readahead windows hold this many reads for each one in flight */
+#define CALIB_RA_READS		4
+
+#define PROFILE_DEFAULT_DIR	"/var/lib/libubiio"
+#define PROFILE_MAGIC		0x55425046	/* "UBPF" */
+#define PROFILE_VERSION		1
+
+/**
+ * struct profile_file - layout of a profile file.
+ * @magic: %PROFILE_MAGIC
+ * @version: %PROFILE_VERSION
+ * @leb_size: LEB size of the device the profile was measured on
+ * @min_io_size: minimal I/O unit size of that device
+ * @prof: the profile
+ * @crc: CRC32 of the fields above
+ */
+struct profile_file
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t leb_size;
+  int32_t min_io_size;
+  struct ubi_profile prof;
+  uint32_t crc;
+};
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+/* leaves room in a path for the name of a profile file */
+static char profile_dir[PATH_MAX - 64] = PROFILE_DEFAULT_DIR;
+
+/**
+ * struct calib - state of a calibration.
+ * @desc: volume descriptor
+ * @lnum: the scratch LEB
+ * @leb_size: usable LEB size
+ * @io: minimal I/O unit size
+ * @buf: a LEB worth of data
+ * @deadline: when the time budget runs out, in microseconds
+ */
+struct calib
+{
+  struct ubi_volume_desc *desc;
+  int lnum;
+  int leb_size;
+  int io;
+  char *buf;
+  long long deadline;
+};
+
+/**
+ * struct calib_depth - state of the concurrency test.
+ * @c: the calibration
+ * @size: size of the reads
+ * @nr: number of threads
+ * @lock: protects @go
+ * @cond: signalled when @go changes
+ * @go: %1 once all the threads are started, %-1 if they have to exit
+ */
+struct calib_depth
+{
+  struct calib *c;
+  int size;
+  int nr;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int go;
+};
+
+/**
+ * struct calib_reader - a thread of the concurrency test.
+ * @d: the test
+ * @thread: the thread
+ * @id: index of the thread
+ * @buf: where to read to
+ * @err: the first error
+ */
+struct calib_reader
+{
+  struct calib_depth *d;
+  pthread_t thread;
+  int id;
+  char *buf;
+  int err;
+};
+
+static long long
+calib_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Throughput in kB/s of @bytes transferred in @us microseconds */
+static int
+calib_kbps(long long bytes, long long us)
+{
+  return MIN(bytes * 1000 / MAX(us, 1), INT_MAX);
+}
+
+/* Index of the smallest setting getting a good share of the best rate */
+static int
+calib_pick(const int *rates, int nr)
+{
+  int best = 0, i;
+
+  for (i = 0; i < nr; i++)
+    best = MAX(best, rates[i]);
+  for (i = 0; rates[i] * 100LL < best * (long long) CALIB_GOOD_PCT; i++)
+    ;
+  return i;
+}
+
+/* Time page programs, page reads and an erasure of the scratch LEB */
+static int
+calib_latency(struct calib *c, struct ubi_profile *prof)
+{
+  int n = MIN(CALIB_LAT_OPS, c->leb_size / c->io), i, err;
+  long long t;
+
+  err = ubi_leb_map(c->desc, c->lnum, UBI_UNKNOWN);
+  if (err)
+    return err;
+  t = calib_now();
+  for (i = 0; i < n; i++)
+    if ((err = ubi_leb_write(c->desc, c->lnum, c->buf, i * c->io, c->io,
+			     UBI_UNKNOWN)))
+      return err;
+  prof->prog_us = (calib_now() - t) / n;
+
+  t = calib_now();
+  for (i = 0; i < n; i++)
+    if ((err = ubi_leb_read(c->desc, c->lnum, c->buf, i * c->io, c->io, 0)))
+      return err;
+  prof->read_us = (calib_now() - t) / n;
+
+  t = calib_now();
+  err = ubi_leb_erase(c->desc, c->lnum);
+  prof->erase_us = calib_now() - t;
+  return err;
+}
+
+/*
+ * Fill the scratch LEB with writes of @size bytes and return the throughput,
+ * or a negative error code. The LEB is mapped and erased again outside of the
+ * time measured.
+ */
+static int
+calib_write(struct calib *c, int size)
+{
+  int off, err;
+  long long t;
+
+  err = ubi_leb_map(c->desc, c->lnum, UBI_UNKNOWN);
+  if (err)
+    return err;
+  t = calib_now();
+  for (off = 0; off + size <= c->leb_size; off += size)
+    if ((err = ubi_leb_write(c->desc, c->lnum, c->buf + off, off, size,
+			     UBI_UNKNOWN)))
+      return err;
+  t = calib_now() - t;
+  err = ubi_leb_erase(c->desc, c->lnum);
+  return err ? err : calib_kbps(off, t);
+}
+
+/* Read the scratch LEB by @size bytes and return the throughput */
+static int
+calib_read(struct calib *c, int size)
+{
+  int off, err;
+  long long t;
+
+  t = calib_now();
+  for (off = 0; off + size <= c->leb_size; off += size)
+    if ((err = ubi_leb_read(c->desc, c->lnum, c->buf + off, off, size, 0)))
+      return err;
+  return calib_kbps(off, calib_now() - t);
+}
+
+static void *
+calib_reader_thread(void *arg)
+{
+  struct calib_reader *r = arg;
+  struct calib_depth *d = r->d;
+  int slots = d->c->leb_size / d->size, i;
+
+  pthread_mutex_lock(&d->lock);
+  while (d->go == 0)
+    pthread_cond_wait(&d->cond, &d->lock);
+  pthread_mutex_unlock(&d->lock);
+  if (d->go < 0)
+    return NULL;
+
+  for (i = r->id; i < CALIB_DEPTH_OPS; i += d->nr)
+    {
+      r->err = ubi_leb_read(d->c->desc, d->c->lnum, r->buf,
+			    i % slots * d->size, d->size, 0);
+      if (r->err)
+	break;
+    }
+  return NULL;
+}
+
+/* Read the scratch LEB by @size bytes from @nr threads */
+static int
+calib_depth(struct calib *c, int size, int nr)
+{
+  struct calib_reader r[CALIB_MAX_DEPTH];
+  struct calib_depth d = {
+    .c = c,
+    .size = size,
+    .nr = nr
+  };
+  int i, started, err = 0;
+  long long t;
+
+  pthread_mutex_init(&d.lock, NULL);
+  pthread_cond_init(&d.cond, NULL);
+  for (started = 0; started < nr; started++)
+    {
+      r[started].d = &d;
+      r[started].id = started;
+      r[started].err = 0;
+      r[started].buf = malloc(size);
+      if (r[started].buf == NULL)
+	{
+	  err = -ENOMEM;
+	  break;
+	}
+      err = -pthread_create(&r[started].thread, NULL, calib_reader_thread,
+			    &r[started]);
+      if (err)
+	{
+	  free(r[started].buf);
+	  break;
+	}
+    }
+
+  pthread_mutex_lock(&d.lock);
+  d.go = err ? -1 : 1;
+  pthread_cond_broadcast(&d.cond);
+  pthread_mutex_unlock(&d.lock);
+  t = calib_now();
+  for (i = 0; i < started; i++)
+    pthread_join(r[i].thread, NULL);
+  t = calib_now() - t;
+  for (i = 0; i < started; i++)
+    {
+      if (r[i].err && !err)
+	err = r[i].err;
+      free(r[i].buf);
+    }
+  pthread_cond_destroy(&d.cond);
+  pthread_mutex_destroy(&d.lock);
+  return err ? err : calib_kbps((long long) CALIB_DEPTH_OPS * size, t);
+}
+
+/* Run the measurements, leaving the scratch LEB in any state */
+static int
+calib_run(struct calib *c, struct ubi_profile *prof)
+{
+  int sizes[32], rates[32], depths[32], nr, i, ret;
+
+  ret = calib_latency(c, prof);
+  if (ret)
+    return ret;
+
+  /* transfer sizes, from the minimal I/O unit up */
+  for (nr = 0, i = c->io; i <= MIN(c->leb_size, CALIB_MAX_IO); i *= 2)
+    sizes[nr++] = i;
+
+  for (i = 0; i < nr && (i == 0 || calib_now() < c->deadline); i++)
+    {
+      ret = calib_write(c, sizes[i]);
+      if (ret < 0)
+	return ret;
+      rates[i] = ret;
+    }
+  ret = calib_pick(rates, i);
+  prof->write_size = sizes[ret];
+  prof->write_kbps = rates[ret];
+
+  ret = ubi_leb_change(c->desc, c->lnum, c->buf, c->leb_size, UBI_UNKNOWN);
+  if (ret)
+    return ret;
+  for (i = 0; i < nr && (i == 0 || calib_now() < c->deadline); i++)
+    {
+      ret = calib_read(c, sizes[i]);
+      if (ret < 0)
+	return ret;
+      rates[i] = ret;
+    }
+  ret = calib_pick(rates, i);
+  prof->read_size = sizes[ret];
+  prof->read_kbps = rates[ret];
+
+  /* concurrent reads of the chosen size */
+  for (nr = 0, i = 1; i <= CALIB_MAX_DEPTH; i *= 2)
+    depths[nr++] = i;
+  for (i = 0; i < nr && (i == 0 || calib_now() < c->deadline); i++)
+    {
+      ret = calib_depth(c, prof->read_size, depths[i]);
+      if (ret < 0)
+	return ret;
+      rates[i] = ret;
+    }
+  ret = calib_pick(rates, i);
+  prof->queue_depth = depths[ret];
+  prof->read_kbps = MAX(prof->read_kbps, rates[ret]);
+
+  prof->readahead = MIN(CALIB_RA_READS * prof->read_size * prof->queue_depth,
+			c->leb_size / c->io * c->io);
+  return 0;
+}
+
+/**
+ * ubi_calibrate - measure the performance of a UBI device.
+ * @desc: volume descriptor, without readahead nor throttling
+ * @lnum: an un-mapped LEB of the volume to run the benchmark on
+ * @budget_ms: how long the benchmark may run, in milliseconds, %0 for the
+ *             default of 2 seconds
+ * @prof: the profile measured is stored here
+ *
+ * The benchmark writes and reads @lnum, which is un-mapped again at the end.
+ * It stops trying larger settings once @budget_ms has elapsed, so it takes a
+ * little longer on slow devices. The profile is not saved nor used; see
+ * 'ubi_profile_save()' and 'ubi_profile_set()'.
+ *
+ * Returns %0 in case of success, %-EBUSY if @lnum is mapped or @desc does
+ * readahead or is throttled, which would skew the measurements, and another
+ * negative error code in case of failure.
+ */
+int
+ubi_calibrate(struct ubi_volume_desc *desc, int lnum, int budget_ms,
+	      struct ubi_profile *prof)
+{
+  struct calib c;
+  int err, i;
+
+  if (desc->mode == UBI_READONLY || desc->vi.vol_type == UBI_STATIC_VOLUME)
+    return -EROFS;
+  if (lnum < 0 || lnum >= desc->vi.used_ebs || budget_ms < 0)
+    return -EINVAL;
+  if (desc->ra || desc->throttle)
+    return -EBUSY;
+  err = ubi_is_mapped(desc, lnum);
+  if (err)
+    return err < 0 ? -errno : -EBUSY;
+
+  c.desc = desc;
+  c.lnum = lnum;
+  c.leb_size = desc->vi.usable_leb_size;
+  c.io = desc->di.min_io_size;
+  c.deadline = calib_now()
+    + (budget_ms ? budget_ms : CALIB_DEFAULT_BUDGET_MS) * 1000LL;
+  c.buf = malloc(c.leb_size);
+  if (c.buf == NULL)
+    return -ENOMEM;
+  /* data which does not look erased nor compresses away */
+  for (i = 0; i < c.leb_size; i++)
+    c.buf[i] = (i * 2654435761U) >> 24;
+
+  memset(prof, 0, sizeof(*prof));
+  err = calib_run(&c, prof);
+  i = ubi_leb_unmap(desc, lnum);
+  free(c.buf);
+  return err ? err : i;
+}
+
+/**
+ * ubi_profile_dir - set where profiles are kept.
+ * @dir: the directory, %NULL for the default of "/var/lib/libubiio"
+ *
+ * Returns %0 in case of success and %-ENAMETOOLONG if @dir is too long.
+ */
+int
+ubi_profile_dir(const char *dir)
+{
+  if (dir == NULL)
+    dir = PROFILE_DEFAULT_DIR;
+  if (strlen(dir) >= sizeof(profile_dir))
+    return -ENAMETOOLONG;
+  pthread_mutex_lock(&profile_lock);
+  strcpy(profile_dir, dir);
+  pthread_mutex_unlock(&profile_lock);
+  return 0;
+}
+
+/*
+ * Path of the profile of the device @desc belongs to. Simulated volumes are
+ * told apart by their backing file.
+ */
+static int
+profile_path(struct ubi_volume_desc *desc, char *path, size_t len)
+{
+  struct stat st;
+
+  pthread_mutex_lock(&profile_lock);
+  if (desc->sim == NULL)
+    snprintf(path, len, "%s/ubi%d.profile", profile_dir, desc->di.ubi_num);
+  else if (fstat(desc->fd, &st) == 0)
+    snprintf(path, len, "%s/sim-%llx-%llx.profile", profile_dir,
+	     (unsigned long long) st.st_dev, (unsigned long long) st.st_ino);
+  else
+    {
+      pthread_mutex_unlock(&profile_lock);
+      return -errno;
+    }
+  pthread_mutex_unlock(&profile_lock);
+  return 0;
+}
+
+/* Check that @prof makes sense for the device of @desc */
+static int
+profile_valid(struct ubi_volume_desc *desc, const struct ubi_profile *prof)
+{
+  int io = desc->di.min_io_size;
+
+  return prof->write_size > 0 && prof->write_size % io == 0
+    && prof->read_size > 0 && prof->read_size % io == 0
+    && prof->readahead >= prof->read_size && prof->readahead % io == 0
+    && prof->queue_depth > 0 && prof->queue_depth <= CALIB_MAX_DEPTH;
+}
+
+/**
+ * ubi_profile_save - save the profile of a UBI device.
+ * @desc: volume descriptor
+ * @prof: the profile, as measured by 'ubi_calibrate()'
+ *
+ * The profile is saved for the device @desc belongs to, and is loaded by the
+ * volumes of that device opened from then on. The directory is created if
+ * needed, and the file is replaced atomically. Returns %0 in case of success
+ * and a negative error code in case of failure.
+ */
+int
+ubi_profile_save(struct ubi_volume_desc *desc, const struct ubi_profile *prof)
+{
+  struct profile_file pf;
+  char path[PATH_MAX], tmp[PATH_MAX + 16];
+  int fd, err;
+
+  if (!profile_valid(desc, prof))
+    return -EINVAL;
+  err = profile_path(desc, path, sizeof(path));
+  if (err)
+    return err;
+  memset(&pf, 0, sizeof(pf));
+  pf.magic = PROFILE_MAGIC;
+  pf.version = PROFILE_VERSION;
+  pf.leb_size = desc->di.leb_size;
+  pf.min_io_size = desc->di.min_io_size;
+  pf.prof = *prof;
+  pf.crc = __ubi_crc32(UBI_CRC32_INIT, &pf, offsetof(struct profile_file,
+						       crc));
+
+  pthread_mutex_lock(&profile_lock);
+  if (mkdir(profile_dir, 0755) && errno != EEXIST)
+    {
+      err = -errno;
+      sys_errmsg("cannot create \"%s\"", profile_dir);
+      pthread_mutex_unlock(&profile_lock);
+      return err;
+    }
+  pthread_mutex_unlock(&profile_lock);
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      err = -errno;
+      sys_errmsg("cannot create \"%s\"", tmp);
+      return err;
+    }
+  if (write(fd, &pf, sizeof(pf)) != sizeof(pf) || fsync(fd))
+    {
+      err = errno ? -errno : -EIO;
+      close(fd);
+      unlink(tmp);
+      return err;
+    }
+  close(fd);
+  if (rename(tmp, path))
+    {
+      err = -errno;
+      unlink(tmp);
+      return err;
+    }
+  return 0;
+}
+
+/**
+ * ubi_profile_load - load the profile of a UBI device.
+ * @desc: volume descriptor
+ * @prof: the profile is stored here
+ *
+ * Returns %0 in case of success, %-ENOENT if the device has no profile,
+ * %-EBADMSG if the profile file is corrupted, %-ESTALE if it was measured on
+ * a device of another geometry and another negative error code in case of
+ * failure.
+ */
+int
+ubi_profile_load(struct ubi_volume_desc *desc, struct ubi_profile *prof)
+{
+  struct profile_file pf;
+  char path[PATH_MAX];
+  int fd, err;
+  ssize_t ret;
+
+  err = profile_path(desc, path, sizeof(path));
+  if (err)
+    return err;
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+  ret = read(fd, &pf, sizeof(pf));
+  err = errno;
+  close(fd);
+  if (ret < 0)
+    return -err;
+  if (ret != sizeof(pf) || pf.magic != PROFILE_MAGIC
+      || pf.version != PROFILE_VERSION
+      || pf.crc != __ubi_crc32(UBI_CRC32_INIT, &pf,
+			       offsetof(struct profile_file, crc)))
+    return -EBADMSG;
+  if (pf.leb_size != desc->di.leb_size
+      || pf.min_io_size != desc->di.min_io_size
+      || !profile_valid(desc, &pf.prof))
+    return -ESTALE;
+  *prof = pf.prof;
+  return 0;
+}
+
+/**
+ * ubi_profile_set - use a profile for a volume descriptor.
+ * @desc: volume descriptor
+ * @prof: the profile, %NULL to use none
+ *
+ * Readahead, streams and executors set up from then on for @desc default to
+ * the values of @prof. Opening a volume does this with the saved profile of
+ * its device, if any. Returns %0 in case of success and a negative error
+ * code in case of failure.
+ */
+int
+ubi_profile_set(struct ubi_volume_desc *desc, const struct ubi_profile *prof)
+{
+  struct ubi_profile *p = NULL;
+
+  if (prof)
+    {
+      if (!profile_valid(desc, prof))
+	return -EINVAL;
+      p = malloc(sizeof(struct ubi_profile));
+      if (p == NULL)
+	return -ENOMEM;
+      *p = *prof;
+    }
+  free(desc->profile);
+  desc->profile = p;
+  return 0;
+}
+
+/**
+ * ubi_profile_get - get the profile a volume descriptor uses.
+ * @desc: volume descriptor
+ * @prof: the profile is stored here
+ *
+ * Returns %0 in case of success and %-ENOENT if @desc uses no profile.
+ */
+int
+ubi_profile_get(struct ubi_volume_desc *desc, struct ubi_profile *prof)
+{
+  if (desc->profile == NULL)
+    return -ENOENT;
+  *prof = *desc->profile;
+  return 0;
+}
+
+/**
+ * __ubi_profile_open - use the saved profile of a volume just opened.
+ * @desc: volume descriptor
+ *
+ * Failing to load the profile is not an error, the defaults are used.
+ */
+void
+__ubi_profile_open(struct ubi_volume_desc *desc)
+{
+  struct ubi_profile prof;
+  int err;
+
+  err = ubi_profile_load(desc, &prof);
+  if (err == 0)
+    ubi_profile_set(desc, &prof);
+  else if (err != -ENOENT)
+    warnmsg("ignoring the saved profile of volume \"%s\", error %d",
+	    desc->vi.name, err);
+}
@@ -0,0 +1,236 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - workload capture.
+ *
+ * A capture records every operation done through a volume descriptor in a
+ * ring of fixed-size records in a file mapped by the process, laid out as
+ * described by &struct ubi_capture_hdr in libubiio.h. Recording an
+ * operation takes a slot with an atomic increment of the head of the ring
+ * and fills it in, without system calls or locks; the kernel writes the
+ * pages back. When the ring is full, the oldest records are overwritten.
+ *
+ * Each record carries its sequence number, cleared while the record is
+ * being filled in and set last, so that readers can tell records which were
+ * overwritten or not finished. Records are numbered in the order operations
+ * complete, which is not always the order they started in.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define CAPTURE_DEFAULT_RECS	65536
+#define CAPTURE_FNV_BASIS	0xCBF29CE484222325ULL
+#define CAPTURE_FNV_PRIME	0x100000001B3ULL
+
+/**
+ * struct ubi_capture - capture of a volume descriptor.
+ * @hdr: the mapped file
+ * @recs: the ring of records
+ * @map_size: size of the mapping
+ * @flags: %UBI_CAPTURE_HASH or %0
+ * @t0: when the capture started, in monotonic nanoseconds
+ */
+struct ubi_capture
+{
+  struct ubi_capture_hdr *hdr;
+  struct ubi_capture_rec *recs;
+  size_t map_size;
+  int flags;
+  long long t0;
+};
+
+/*
+ * Hash @len bytes at @buf into @h, FNV-1a on 64-bit words, which is several
+ * times faster than the CRC and good enough to tell data apart.
+ */
+static uint64_t
+capture_hash(uint64_t h, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  uint64_t w;
+
+  for (; len >= 8; p += 8, len -= 8)
+    {
+      memcpy(&w, p, 8);
+      h = (h ^ w) * CAPTURE_FNV_PRIME;
+    }
+  for (; len; len--)
+    h = (h ^ *p++) * CAPTURE_FNV_PRIME;
+  return h;
+}
+
+static long long
+capture_clock(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * __ubi_capture - record an operation.
+ * @desc: volume descriptor, being captured
+ * @opcode: %UBI_OP_READ, %UBI_OP_WRITE, ...
+ * @addr: volume address of the operation, or of the LEB
+ * @iov: data of the operation, %NULL if none
+ * @iovcnt: number of elements of @iov
+ * @dtype: data type of changes and maps
+ * @result: what the operation returned
+ * @start: what '__ubi_stats_start()' returned before the operation
+ */
+void
+__ubi_capture(struct ubi_volume_desc *desc, int opcode, long long addr,
+	      const struct iovec *iov, int iovcnt, int dtype, int result,
+	      long long start)
+{
+  struct ubi_capture *cap = desc->capture;
+  struct ubi_capture_rec *rec;
+  int leb_size = desc->vi.usable_leb_size, i, len = 0;
+  uint64_t hash = CAPTURE_FNV_BASIS;
+  long long now = capture_clock(CLOCK_MONOTONIC);
+  uint64_t seq;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  /* read data is only worth hashing if it was read */
+  if ((cap->flags & UBI_CAPTURE_HASH) && !(opcode == UBI_OP_READ && result))
+    for (i = 0; i < iovcnt; i++)
+      hash = capture_hash(hash, iov[i].iov_base, iov[i].iov_len);
+
+  seq = __atomic_fetch_add(&cap->hdr->head, 1, __ATOMIC_RELAXED);
+  rec = &cap->recs[seq % cap->hdr->nr_recs];
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->time_ns = start > cap->t0 ? start - cap->t0 : 0;
+  rec->lat_ns = now - start;
+  rec->lnum = addr / leb_size;
+  rec->offset = addr % leb_size;
+  rec->len = len;
+  rec->result = result;
+  rec->hash = cap->flags & UBI_CAPTURE_HASH ? hash ^ hash >> 32 : 0;
+  rec->opcode = opcode;
+  rec->dtype = dtype;
+  memset(rec->padding, 0, sizeof(rec->padding));
+  __atomic_store_n(&rec->seq, (uint32_t) (seq + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * ubi_capture_start - record the operations of a volume descriptor.
+ * @desc: volume descriptor
+ * @path: file to record to, created or truncated
+ * @nr_recs: number of records the file holds, %0 for the default of 65536
+ * @flags: %UBI_CAPTURE_HASH to record a hash of the data transferred
+ *
+ * Every read, write, change, erase, un-map, map and mapping check done
+ * through @desc is recorded until 'ubi_capture_stop()' is called, which
+ * closing @desc does. This must not be called while I/O is going on through
+ * @desc. Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_capture_start(struct ubi_volume_desc *desc, const char *path, int nr_recs,
+		  int flags)
+{
+  struct ubi_capture *cap;
+  size_t size;
+  void *map;
+  int fd, err;
+
+  if (desc->capture)
+    return -EBUSY;
+  if (nr_recs < 0 || (flags & ~UBI_CAPTURE_HASH))
+    return -EINVAL;
+  if (nr_recs == 0)
+    nr_recs = CAPTURE_DEFAULT_RECS;
+
+  cap = calloc(1, sizeof(struct ubi_capture));
+  if (cap == NULL)
+    return -ENOMEM;
+  size = sizeof(struct ubi_capture_hdr)
+    + nr_recs * sizeof(struct ubi_capture_rec);
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      err = -errno;
+      sys_errmsg("cannot create \"%s\"", path);
+      goto out_free;
+    }
+  if (ftruncate(fd, size))
+    {
+      err = -errno;
+      close(fd);
+      goto out_free;
+    }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    {
+      err = -errno;
+      goto out_free;
+    }
+
+  cap->hdr = map;
+  cap->recs = (struct ubi_capture_rec *) (cap->hdr + 1);
+  cap->map_size = size;
+  cap->flags = flags;
+  cap->hdr->version = UBI_CAPTURE_VERSION;
+  cap->hdr->rec_size = sizeof(struct ubi_capture_rec);
+  cap->hdr->nr_recs = nr_recs;
+  cap->hdr->flags = flags;
+  cap->hdr->ubi_num = desc->vi.ubi_num;
+  cap->hdr->vol_id = desc->vi.vol_id;
+  cap->hdr->leb_size = desc->vi.usable_leb_size;
+  cap->hdr->min_io_size = desc->di.min_io_size;
+  cap->hdr->nr_lebs = desc->vi.used_ebs;
+  cap->hdr->start_time = capture_clock(CLOCK_REALTIME);
+  cap->t0 = capture_clock(CLOCK_MONOTONIC);
+  __atomic_store_n(&cap->hdr->magic, UBI_CAPTURE_MAGIC, __ATOMIC_RELEASE);
+  desc->capture = cap;
+  return 0;
+
+out_free:
+  free(cap);
+  return err;
+}
+
+/**
+ * ubi_capture_stop - stop recording the operations of a volume descriptor.
+ * @desc: volume descriptor
+ *
+ * The records stay in the file. This must not be called while I/O is going
+ * on through @desc.
+ */
+void
+ubi_capture_stop(struct ubi_volume_desc *desc)
+{
+  struct ubi_capture *cap = desc->capture;
+
+  if (cap == NULL)
+    return;
+  desc->capture = NULL;
+  munmap(cap->hdr, cap->map_size);
+  free(cap);
+}
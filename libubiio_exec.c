@@ -0,0 +1,666 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - per-device executor.
+ *
+ * The executor owns a set of worker threads for every UBI device it has seen
+ * an operation for. Operations are queued to their device through a bounded
+ * submission queue, so that a slow device never holds up the others, and
+ * completed either through the operation's callback or 'ubi_exec_wait()'.
+ *
+ * The queue of a device is split by scheduling class: latency-critical
+ * reads, normal writes and background erasures and un-maps. Workers pick the
+ * class to serve by stride scheduling, each class getting a share of the
+ * operations proportional to its weight, except that an operation which
+ * waited longer than the deadline of its class goes first. An erasure cannot
+ * be interrupted once it is running, so the number of background operations
+ * in flight is capped below the number of workers, which keeps a worker free
+ * for the reads queued behind them.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/*
+ * NAND chips serialize operations internally, so more than a couple of
+ * workers per device only adds contention. Two workers keep one operation in
+ * flight while the next is being dispatched.
+ */
+#define EXEC_DEFAULT_WORKERS	2
+#define EXEC_DEFAULT_DEPTH	64
+
+#define EXEC_NR_CLASSES		3
+
+/* Pass added when a class of weight 1 is served */
+#define EXEC_STRIDE		(1 << 20)
+
+/* Default weight, deadline and in-flight limit of each class */
+static const struct ubi_exec_class exec_default_classes[EXEC_NR_CLASSES] = {
+  {16, 0, 0},			/* UBI_IOCLASS_READ */
+  {4, 200000, 0},		/* UBI_IOCLASS_WRITE */
+  {1, 1000000, 0}		/* UBI_IOCLASS_BACKGROUND, limit per device */
+};
+
+/* States of a &struct ubi_io_op */
+enum
+{
+  OP_IDLE = 0,
+  OP_QUEUED,
+  OP_RUNNING,
+  OP_DONE
+};
+
+/**
+ * struct exec_class - queue of a scheduling class.
+ * @head: oldest pending operation
+ * @tail: where the next operation is queued
+ * @inflight: number of operations of the class being executed
+ * @pass: stride scheduling pass, the class with the lowest one is served
+ * @cfg: weight, deadline and in-flight limit
+ */
+struct exec_class
+{
+  struct ubi_io_op *head;
+  struct ubi_io_op **tail;
+  int inflight;
+  unsigned long long pass;
+  struct ubi_exec_class cfg;
+};
+
+/**
+ * struct exec_dev - per-device submission queue.
+ * @ubi_num: UBI device number served by this queue
+ * @classes: pending operations, by scheduling class
+ * @vtime: pass of the class served last
+ * @depth: maximum number of pending operations
+ * @count: number of pending operations
+ * @lock: protects the queue and the state of queued operations
+ * @not_empty: signalled when an operation has been queued
+ * @not_full: signalled when an operation has been dequeued
+ * @done: signalled when an operation without callback completed
+ * @stop: set when the workers have to exit once the queue is drained
+ * @nr_workers: number of entries in @workers
+ * @workers: worker thread ids
+ * @stats: exported statistics slot of the device, if any
+ * @next: next device of the executor
+ */
+struct exec_dev
+{
+  int ubi_num;
+  struct exec_class classes[EXEC_NR_CLASSES];
+  unsigned long long vtime;
+  int depth;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t done;
+  int stop;
+  int nr_workers;
+  pthread_t *workers;
+  struct ubi_stats_slot *stats;
+  struct exec_dev *next;
+};
+
+/**
+ * struct ubi_executor - UBI operation executor.
+ * @workers_per_dev: how many workers to start for each device, %0 to go by
+ *                   the profile of the device
+ * @depth: submission queue depth of each device
+ * @classes: scheduling class settings of new devices
+ * @lock: protects @classes and @devs
+ * @devs: list of the devices operations were submitted for
+ */
+struct ubi_executor
+{
+  int workers_per_dev;
+  int depth;
+  struct ubi_exec_class classes[EXEC_NR_CLASSES];
+  pthread_mutex_t lock;
+  struct exec_dev *devs;
+};
+
+/**
+ * ubi_io_op_exec - execute an operation synchronously.
+ * @op: the operation to execute
+ *
+ * This function calls the synchronous function corresponding to
+ * @op->opcode, stores its return value to @op->result and returns it.
+ */
+int
+ubi_io_op_exec(struct ubi_io_op *op)
+{
+  struct ubi_volume_desc *desc = op->desc;
+
+  switch (op->opcode)
+    {
+    case UBI_OP_READ:
+      op->result = ubi_leb_read(desc, op->lnum, op->buf, op->offset, op->len,
+				op->check);
+      break;
+    case UBI_OP_WRITE:
+      op->result = ubi_leb_write(desc, op->lnum, op->buf, op->offset,
+				 op->len, op->dtype);
+      break;
+    case UBI_OP_CHANGE:
+      op->result = ubi_leb_change(desc, op->lnum, op->buf, op->len,
+				  op->dtype);
+      break;
+    case UBI_OP_ERASE:
+      op->result = ubi_leb_erase(desc, op->lnum);
+      break;
+    case UBI_OP_UNMAP:
+      op->result = ubi_leb_unmap(desc, op->lnum);
+      break;
+    case UBI_OP_MAP:
+      op->result = ubi_leb_map(desc, op->lnum, op->dtype);
+      break;
+    case UBI_OP_IS_MAPPED:
+      op->result = ubi_is_mapped(desc, op->lnum);
+      if (op->result < 0)
+	op->result = -errno;
+      break;
+    default:
+      op->result = -EINVAL;
+    }
+  return op->result;
+}
+
+static void
+exec_complete(struct exec_dev *dev, struct ubi_io_op *op)
+{
+  if (op->done)
+    {
+      /* the operation belongs to the caller again once @done is called */
+      op->state = OP_DONE;
+      op->done(op);
+      return;
+    }
+
+  pthread_mutex_lock(&dev->lock);
+  op->state = OP_DONE;
+  pthread_cond_broadcast(&dev->done);
+  pthread_mutex_unlock(&dev->lock);
+}
+
+static long long
+exec_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Scheduling class index of an operation, %-1 if it is invalid */
+static int
+exec_class_of(const struct ubi_io_op *op)
+{
+  if (op->ioclass < 0 || op->ioclass > EXEC_NR_CLASSES)
+    return -1;
+  if (op->ioclass != UBI_IOCLASS_AUTO)
+    return op->ioclass - 1;
+  switch (op->opcode)
+    {
+    case UBI_OP_READ:
+    case UBI_OP_IS_MAPPED:
+      return UBI_IOCLASS_READ - 1;
+    case UBI_OP_ERASE:
+    case UBI_OP_UNMAP:
+      return UBI_IOCLASS_BACKGROUND - 1;
+    }
+  return UBI_IOCLASS_WRITE - 1;
+}
+
+/* Whether operations of @dev are being executed, called with @dev->lock held */
+static int
+exec_busy(struct exec_dev *dev)
+{
+  int i;
+
+  for (i = 0; i < EXEC_NR_CLASSES; i++)
+    if (dev->classes[i].inflight)
+      return 1;
+  return 0;
+}
+
+/*
+ * Dequeue the next operation to execute, called with @dev->lock held.
+ * Returns %NULL if nothing is pending or every class with pending operations
+ * has reached its in-flight limit.
+ */
+static struct ubi_io_op *
+exec_pick(struct exec_dev *dev)
+{
+  struct exec_class *cl, *best = NULL;
+  struct ubi_io_op *op;
+  long long now = 0, due, best_due = 0;
+  int i;
+
+  /* an operation past its deadline goes first */
+  for (i = 0; i < EXEC_NR_CLASSES; i++)
+    {
+      cl = &dev->classes[i];
+      if (cl->head == NULL || cl->cfg.deadline_us == 0
+	  || (cl->cfg.max_inflight && cl->inflight >= cl->cfg.max_inflight))
+	continue;
+      if (now == 0)
+	now = exec_now();
+      due = cl->head->submitted + cl->cfg.deadline_us * 1000LL;
+      if (due <= now && (best == NULL || due < best_due))
+	{
+	  best = cl;
+	  best_due = due;
+	}
+    }
+  if (best == NULL)
+    for (i = 0; i < EXEC_NR_CLASSES; i++)
+      {
+	cl = &dev->classes[i];
+	if (cl->head == NULL
+	    || (cl->cfg.max_inflight && cl->inflight >= cl->cfg.max_inflight))
+	  continue;
+	if (best == NULL || cl->pass < best->pass)
+	  best = cl;
+      }
+  if (best == NULL)
+    return NULL;
+
+  op = best->head;
+  best->head = op->next;
+  if (best->head == NULL)
+    best->tail = &best->head;
+  best->inflight += 1;
+  if (best->pass > dev->vtime)
+    dev->vtime = best->pass;
+  best->pass += EXEC_STRIDE / best->cfg.weight;
+  dev->count -= 1;
+  if (dev->stats)
+    {
+      __atomic_fetch_sub(&dev->stats->queued, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&dev->stats->inflight, 1, __ATOMIC_RELAXED);
+    }
+  return op;
+}
+
+static void *
+exec_worker(void *arg)
+{
+  struct exec_dev *dev = arg;
+  struct ubi_io_op *op;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&dev->lock);
+      while ((op = exec_pick(dev)) == NULL)
+	{
+	  if (dev->count == 0 && dev->stop)
+	    break;
+	  pthread_cond_wait(&dev->not_empty, &dev->lock);
+	}
+      if (op == NULL)
+	{
+	  pthread_mutex_unlock(&dev->lock);
+	  break;
+	}
+      op->state = OP_RUNNING;
+      pthread_cond_signal(&dev->not_full);
+      pthread_mutex_unlock(&dev->lock);
+
+      ubi_io_op_exec(op);
+
+      /* a class may have been held back by its in-flight limit */
+      pthread_mutex_lock(&dev->lock);
+      dev->classes[op->sched_class].inflight -= 1;
+      if (dev->stats)
+	__atomic_fetch_sub(&dev->stats->inflight, 1, __ATOMIC_RELAXED);
+      if (dev->count)
+	pthread_cond_signal(&dev->not_empty);
+      pthread_mutex_unlock(&dev->lock);
+      exec_complete(dev, op);
+    }
+  return NULL;
+}
+
+static void
+exec_dev_stop(struct exec_dev *dev)
+{
+  int i;
+
+  pthread_mutex_lock(&dev->lock);
+  dev->stop = 1;
+  pthread_cond_broadcast(&dev->not_empty);
+  pthread_mutex_unlock(&dev->lock);
+  for (i = 0; i < dev->nr_workers; i++)
+    pthread_join(dev->workers[i], NULL);
+}
+
+static void
+exec_dev_free(struct exec_dev *dev)
+{
+  pthread_cond_destroy(&dev->done);
+  pthread_cond_destroy(&dev->not_full);
+  pthread_cond_destroy(&dev->not_empty);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev->workers);
+  free(dev);
+}
+
+/*
+ * With a profile, a device gets a worker for each operation it can usefully
+ * run at a time, and one more to dispatch the next one.
+ */
+static struct exec_dev *
+exec_dev_create(struct ubi_executor *ex, struct ubi_volume_desc *desc)
+{
+  struct exec_dev *dev;
+  int ubi_num = desc->vi.ubi_num, workers = ex->workers_per_dev, err, i;
+
+  dev = calloc(1, sizeof(struct exec_dev));
+  if (dev == NULL)
+    return NULL;
+  dev->ubi_num = ubi_num;
+  dev->depth = ex->depth;
+  for (i = 0; i < EXEC_NR_CLASSES; i++)
+    {
+      dev->classes[i].tail = &dev->classes[i].head;
+      dev->classes[i].cfg = ex->classes[i];
+    }
+  if (workers == 0)
+    workers = desc->profile ? desc->profile->queue_depth + 1
+      : EXEC_DEFAULT_WORKERS;
+  /* negative until set, for the default of all the workers but one */
+  i = UBI_IOCLASS_BACKGROUND - 1;
+  if (dev->classes[i].cfg.max_inflight < 0)
+    dev->classes[i].cfg.max_inflight = MAX(workers - 1, 1);
+  dev->workers = calloc(workers, sizeof(pthread_t));
+  if (dev->workers == NULL)
+    {
+      free(dev);
+      errno = ENOMEM;
+      return NULL;
+    }
+  pthread_mutex_init(&dev->lock, NULL);
+  pthread_cond_init(&dev->not_empty, NULL);
+  pthread_cond_init(&dev->not_full, NULL);
+  pthread_cond_init(&dev->done, NULL);
+
+  for (; dev->nr_workers < workers; dev->nr_workers++)
+    {
+      err = pthread_create(&dev->workers[dev->nr_workers], NULL, exec_worker,
+			   dev);
+      if (err)
+	{
+	  errmsg("cannot start worker for UBI device %d", ubi_num);
+	  exec_dev_stop(dev);
+	  exec_dev_free(dev);
+	  errno = err;
+	  return NULL;
+	}
+    }
+  dbgmsg("executor: %d workers for UBI device %d", dev->nr_workers, ubi_num);
+  return dev;
+}
+
+static struct exec_dev *
+exec_get_dev(struct ubi_executor *ex, struct ubi_volume_desc *desc)
+{
+  struct exec_dev *dev;
+
+  pthread_mutex_lock(&ex->lock);
+  for (dev = ex->devs; dev != NULL; dev = dev->next)
+    if (dev->ubi_num == desc->vi.ubi_num)
+      break;
+  if (dev == NULL)
+    {
+      dev = exec_dev_create(ex, desc);
+      if (dev != NULL)
+	{
+	  dev->next = ex->devs;
+	  ex->devs = dev;
+	}
+    }
+  pthread_mutex_unlock(&ex->lock);
+  return dev;
+}
+
+/**
+ * ubi_executor_create - create an executor.
+ * @workers_per_dev: number of worker threads per UBI device, or %0 for one
+ *                   more than the queue depth in the profile of the device,
+ *                   or 2 if it has no profile
+ * @queue_depth: maximum number of pending operations per UBI device, or %0
+ *               for the default
+ *
+ * Workers are started lazily, the first time an operation is submitted for a
+ * given UBI device. By default, at most all the workers but one execute
+ * background operations at a time.
+ *
+ * Returns the executor in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_executor *
+ubi_executor_create(int workers_per_dev, int queue_depth)
+{
+  struct ubi_executor *ex;
+  int i;
+
+  if (workers_per_dev < 0 || queue_depth < 0)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  ex = calloc(1, sizeof(struct ubi_executor));
+  if (ex == NULL)
+    return NULL;
+  ex->workers_per_dev = workers_per_dev;
+  ex->depth = queue_depth ? queue_depth : EXEC_DEFAULT_DEPTH;
+  memcpy(ex->classes, exec_default_classes, sizeof(ex->classes));
+  i = UBI_IOCLASS_BACKGROUND - 1;
+  ex->classes[i].max_inflight = -1;
+  pthread_mutex_init(&ex->lock, NULL);
+  return ex;
+}
+
+/**
+ * ubi_executor_destroy - destroy an executor.
+ * @ex: the executor to destroy
+ *
+ * Operations which are still queued are executed before the workers exit,
+ * so every submitted operation is completed when this function returns.
+ */
+void
+ubi_executor_destroy(struct ubi_executor *ex)
+{
+  struct exec_dev *dev, *next;
+
+  for (dev = ex->devs; dev != NULL; dev = next)
+    {
+      next = dev->next;
+      exec_dev_stop(dev);
+      exec_dev_free(dev);
+    }
+  pthread_mutex_destroy(&ex->lock);
+  free(ex);
+}
+
+/**
+ * ubi_executor_set_class - configure a scheduling class.
+ * @ex: the executor
+ * @ioclass: %UBI_IOCLASS_READ, %UBI_IOCLASS_WRITE or %UBI_IOCLASS_BACKGROUND
+ * @cfg: the new settings of the class
+ *
+ * The settings apply to the devices the executor already serves and to the
+ * ones it will. Returns %0 in case of success and %-EINVAL if the arguments
+ * are invalid.
+ */
+int
+ubi_executor_set_class(struct ubi_executor *ex, int ioclass,
+		       const struct ubi_exec_class *cfg)
+{
+  struct exec_dev *dev;
+
+  if (ioclass <= UBI_IOCLASS_AUTO || ioclass > EXEC_NR_CLASSES
+      || cfg->weight <= 0 || cfg->weight > EXEC_STRIDE
+      || cfg->deadline_us < 0 || cfg->max_inflight < 0)
+    return -EINVAL;
+
+  pthread_mutex_lock(&ex->lock);
+  ex->classes[ioclass - 1] = *cfg;
+  for (dev = ex->devs; dev != NULL; dev = dev->next)
+    {
+      pthread_mutex_lock(&dev->lock);
+      dev->classes[ioclass - 1].cfg = *cfg;
+      pthread_cond_broadcast(&dev->not_empty);
+      pthread_mutex_unlock(&dev->lock);
+    }
+  pthread_mutex_unlock(&ex->lock);
+  return 0;
+}
+
+/**
+ * ubi_exec_submit - queue an operation to an executor.
+ * @ex: the executor
+ * @op: the operation
+ * @flags: %UBI_EXEC_NOWAIT not to block when the device queue is full
+ *
+ * The operation is queued to the device @op->desc belongs to, in the queue
+ * of its scheduling class. If the queue of this device is full, this
+ * function blocks until there is room, unless %UBI_EXEC_NOWAIT is set in
+ * @flags, in which case %-EAGAIN is returned.
+ *
+ * Returns %0 if the operation has been queued and a negative error code
+ * otherwise; the operation is not completed in the latter case.
+ */
+int
+ubi_exec_submit(struct ubi_executor *ex, struct ubi_io_op *op, int flags)
+{
+  struct exec_dev *dev;
+  struct exec_class *cl;
+  int i;
+
+  i = exec_class_of(op);
+  if (op->desc == NULL || i < 0)
+    return -EINVAL;
+
+  dev = exec_get_dev(ex, op->desc);
+  if (dev == NULL)
+    return -errno;
+
+  op->queue = dev;
+  op->result = 0;
+  op->sched_class = i;
+  op->next = NULL;
+  op->submitted = exec_now();
+
+  pthread_mutex_lock(&dev->lock);
+  cl = &dev->classes[i];
+  while (dev->count == dev->depth)
+    {
+      if (flags & UBI_EXEC_NOWAIT)
+	{
+	  pthread_mutex_unlock(&dev->lock);
+	  return -EAGAIN;
+	}
+      pthread_cond_wait(&dev->not_full, &dev->lock);
+    }
+  if (cl->head == NULL && cl->pass < dev->vtime)
+    cl->pass = dev->vtime;
+  *cl->tail = op;
+  cl->tail = &op->next;
+  /* start the queue depth gauges with nothing in the queue */
+  if (dev->stats == NULL && __ubi_stats_on && dev->count == 0
+      && !exec_busy(dev))
+    dev->stats = __ubi_stats_dev(dev->ubi_num);
+  dev->count += 1;
+  if (dev->stats)
+    __atomic_fetch_add(&dev->stats->queued, 1, __ATOMIC_RELAXED);
+  op->state = OP_QUEUED;
+  pthread_cond_signal(&dev->not_empty);
+  pthread_mutex_unlock(&dev->lock);
+  return 0;
+}
+
+/**
+ * ubi_exec_cancel - cancel a queued operation.
+ * @op: the operation
+ *
+ * An operation which is still queued is taken off its queue and completed
+ * with %-ECANCELED as result, its callback being called from this function.
+ * One which is being executed cannot be interrupted.
+ *
+ * Returns %0 if the operation has been cancelled, %-EBUSY if it is being
+ * executed or completed already and %-EINVAL if it was never submitted.
+ */
+int
+ubi_exec_cancel(struct ubi_io_op *op)
+{
+  struct exec_dev *dev = op->queue;
+  struct exec_class *cl;
+  struct ubi_io_op **p;
+
+  if (dev == NULL)
+    return -EINVAL;
+
+  pthread_mutex_lock(&dev->lock);
+  if (op->state != OP_QUEUED)
+    {
+      pthread_mutex_unlock(&dev->lock);
+      return -EBUSY;
+    }
+  cl = &dev->classes[op->sched_class];
+  for (p = &cl->head; *p != op; p = &(*p)->next)
+    ;
+  *p = op->next;
+  if (cl->tail == &op->next)
+    cl->tail = p;
+  dev->count -= 1;
+  if (dev->stats)
+    __atomic_fetch_sub(&dev->stats->queued, 1, __ATOMIC_RELAXED);
+  op->state = OP_RUNNING;
+  op->result = -ECANCELED;
+  pthread_cond_signal(&dev->not_full);
+  pthread_mutex_unlock(&dev->lock);
+  exec_complete(dev, op);
+  return 0;
+}
+
+/**
+ * ubi_exec_wait - wait for a submitted operation to complete.
+ * @op: the operation, submitted without completion callback
+ *
+ * Returns the result of the operation.
+ */
+int
+ubi_exec_wait(struct ubi_io_op *op)
+{
+  struct exec_dev *dev = op->queue;
+
+  if (dev == NULL || op->done != NULL)
+    return -EINVAL;
+
+  pthread_mutex_lock(&dev->lock);
+  while (op->state != OP_DONE)
+    pthread_cond_wait(&dev->done, &dev->lock);
+  pthread_mutex_unlock(&dev->lock);
+  return op->result;
+}
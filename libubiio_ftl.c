@@ -0,0 +1,1319 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - block translation layer.
+ *
+ * The translation layer offers fixed-size sectors which can be rewritten in
+ * any order on top of a dynamic volume. The volume is split in two parts:
+ *
+ * o the first LEBs hold two checkpoint slots, each containing a copy of the
+ *   sector map and of the per-LEB sequence numbers, written with
+ *   'ubi_leb_change()' so that each LEB of a slot is replaced atomically;
+ * o the remaining LEBs form a log. Sectors are appended to the open LEB as
+ *   records made of one header unit, listing the sectors, followed by the
+ *   sector data.
+ *
+ * Every record carries a sequence number and the LEB the writer will move to
+ * once the open LEB is full. At open time the newest valid checkpoint is
+ * loaded and the records written after it are replayed by following those
+ * hints, so recovery reads only what was written since the last checkpoint.
+ *
+ * Space is reclaimed by a cost-benefit garbage collector: the victim is the
+ * LEB maximizing (1 - u) * age / (1 + u), u being the fraction of valid
+ * sectors it holds. Its valid sectors are appended to the log again and the
+ * LEB is un-mapped. Only LEBs already covered by a checkpoint are collected,
+ * so that the records a replay needs are never destroyed.
+ *
+ * On-flash structures use host byte order.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define FTL_REC_MAGIC		0x55424652	/* "UBFR" */
+#define FTL_CP_MAGIC		0x55424643	/* "UBFC" */
+#define FTL_NONE		0xFFFFFFFFU
+
+/* Free LEBs kept for the garbage collector */
+#define FTL_GC_RESERVE		2
+/* Checkpoint after this many LEBs have been filled */
+#define FTL_CP_INTERVAL		8
+/* Largest number of sectors in a record */
+#define FTL_MAX_BATCH		64
+#define FTL_DEFAULT_SECTOR	4096
+
+/* LEB states */
+enum
+{
+  LEB_FREE = 0,
+  LEB_OPEN,
+  LEB_NEXT,
+  LEB_FULL
+};
+
+/**
+ * struct ftl_rec_hdr - header unit of a record.
+ * @magic: %FTL_REC_MAGIC
+ * @hdr_crc: CRC of the header unit, starting at @fmt_id
+ * @fmt_id: identifier of the format the record belongs to
+ * @data_crc: CRC of the sector data following the header
+ * @seq: record sequence number
+ * @next_lnum: LEB the log continues in once this LEB is full
+ * @nsect: number of sectors stored in the record
+ * @ndiscard: number of sectors discarded by the record
+ * @lba: @nsect sector numbers followed by @ndiscard discarded sector numbers
+ */
+struct ftl_rec_hdr
+{
+  uint32_t magic;
+  uint32_t hdr_crc;
+  uint32_t fmt_id;
+  uint32_t data_crc;
+  uint64_t seq;
+  int32_t next_lnum;
+  uint16_t nsect;
+  uint16_t ndiscard;
+  uint32_t lba[];
+};
+
+/**
+ * struct ftl_cp_hdr - header of a checkpoint LEB.
+ * @magic: %FTL_CP_MAGIC
+ * @hdr_crc: CRC of the header, starting at @data_crc
+ * @data_crc: CRC of the checkpoint data stored in this LEB
+ * @fmt_id: identifier of the format
+ * @cp_seq: checkpoint sequence number, the same in all LEBs of a slot
+ * @rec_seq: sequence number of the last record covered
+ * @index: index of this LEB in the slot
+ * @count: number of LEBs in a slot
+ * @sector_size: sector size
+ * @nr_sectors: number of sectors
+ * @open_lnum: LEB the log continues in
+ * @open_unit: minimal I/O unit of @open_lnum the log continues at
+ * @next_lnum: LEB reserved to follow @open_lnum
+ * @len: checkpoint data bytes stored in this LEB
+ *
+ * The checkpoint data is the sector map (one 32-bit location per sector)
+ * followed by the sequence number of the last record of each LEB.
+ */
+struct ftl_cp_hdr
+{
+  uint32_t magic;
+  uint32_t hdr_crc;
+  uint32_t data_crc;
+  uint32_t fmt_id;
+  uint64_t cp_seq;
+  uint64_t rec_seq;
+  uint32_t index;
+  uint32_t count;
+  uint32_t sector_size;
+  uint32_t nr_sectors;
+  int32_t open_lnum;
+  int32_t open_unit;
+  int32_t next_lnum;
+  uint32_t len;
+};
+
+/**
+ * struct ftl_leb - in-memory state of a LEB.
+ * @state: %LEB_FREE, %LEB_OPEN, %LEB_NEXT or %LEB_FULL
+ * @valid: number of valid sectors
+ * @dirty: non-zero if the LEB may contain data and has to be un-mapped
+ *         before it is written again
+ * @seq: sequence number of the last record written to the LEB
+ */
+struct ftl_leb
+{
+  int state;
+  int valid;
+  int dirty;
+  uint64_t seq;
+};
+
+/**
+ * struct ubi_ftl - block translation layer.
+ * @desc: volume descriptor
+ * @lock: serializes all operations
+ * @io: minimal I/O unit size
+ * @sector_size: sector size
+ * @su: minimal I/O units per sector
+ * @nr_sectors: number of sectors
+ * @nr_lebs: number of LEBs of the volume
+ * @cp_lebs: number of LEBs in a checkpoint slot
+ * @first_data: first LEB of the log
+ * @upl: minimal I/O units per LEB
+ * @hdr_cap: how many sector numbers fit in a record header
+ * @fmt_id: identifier of the format
+ * @map: sector number to location map
+ * @rmap: location to sector number map
+ * @lebs: per-LEB state
+ * @nr_free: number of free LEBs
+ * @alloc_cursor: where to start looking for a free LEB
+ * @open_lnum: LEB records are appended to
+ * @open_unit: where the next record goes in @open_lnum
+ * @next_lnum: LEB reserved to follow @open_lnum
+ * @seq: sequence number of the last record written
+ * @cp_seq: sequence number of the last checkpoint
+ * @cp_slot: slot the last checkpoint is stored in
+ * @cp_rec_seq: last record covered by the last checkpoint
+ * @filled: LEBs filled since the last checkpoint
+ * @in_gc: non-zero while the garbage collector relocates sectors
+ * @wbuf: record buffer
+ * @lebbuf: one LEB worth of buffer for the garbage collector and checkpoints
+ * @nstaged: number of sectors waiting in @stage_data
+ * @stage_lba: sector numbers of the staged sectors
+ * @stage_data: data of the staged sectors
+ * @stats: statistics
+ *
+ * A location is the index of the minimal I/O unit a sector starts at, LEB
+ * @lnum covering locations @lnum * @upl to (@lnum + 1) * @upl - 1.
+ */
+struct ubi_ftl
+{
+  struct ubi_volume_desc *desc;
+  pthread_mutex_t lock;
+  int io;
+  int sector_size;
+  int su;
+  int nr_sectors;
+  int nr_lebs;
+  int cp_lebs;
+  int first_data;
+  int upl;
+  int hdr_cap;
+  uint32_t fmt_id;
+  uint32_t *map;
+  uint32_t *rmap;
+  struct ftl_leb *lebs;
+  int nr_free;
+  int alloc_cursor;
+  int open_lnum;
+  int open_unit;
+  int next_lnum;
+  uint64_t seq;
+  uint64_t cp_seq;
+  int cp_slot;
+  uint64_t cp_rec_seq;
+  int filled;
+  int in_gc;
+  char *wbuf;
+  char *lebbuf;
+  int nstaged;
+  uint32_t *stage_lba;
+  char *stage_data;
+  struct ubi_ftl_stats stats;
+};
+
+static int ftl_checkpoint(struct ubi_ftl *ftl);
+
+static int
+ftl_align(struct ubi_ftl *ftl, int len)
+{
+  return (len + ftl->io - 1) / ftl->io * ftl->io;
+}
+
+/* Set the geometry depending on the sector size and count */
+static int
+ftl_geometry(struct ubi_ftl *ftl, struct ubi_volume_desc *desc,
+	     int sector_size, int nr_sectors)
+{
+  int leb_size = desc->vi.usable_leb_size, worst;
+  long long cp_len;
+
+  ftl->desc = desc;
+  ftl->io = desc->di.min_io_size;
+  ftl->nr_lebs = desc->vi.used_ebs;
+  ftl->upl = leb_size / ftl->io;
+  if (sector_size == 0)
+    sector_size = MIN(FTL_DEFAULT_SECTOR, leb_size / 4);
+  if (sector_size < ftl->io)
+    sector_size = ftl->io;
+  if (sector_size % ftl->io)
+    return -EINVAL;
+  ftl->sector_size = sector_size;
+  ftl->su = sector_size / ftl->io;
+  ftl->hdr_cap = (ftl->io - sizeof(struct ftl_rec_hdr)) / sizeof(uint32_t);
+  if (ftl->hdr_cap <= 0 || ftl->upl < 1 + 2 * ftl->su)
+    return -EINVAL;
+
+  /* a slot must be able to hold the map of the whole data area */
+  worst = ftl->upl / (1 + ftl->su);
+  if (nr_sectors == 0)
+    {
+      /* keep 1/8 of the log free so that GC is not too expensive */
+      int lebs = ftl->nr_lebs - FTL_GC_RESERVE - 2;
+      int cp = 1, prev = 0;
+
+      while (cp != prev)
+	{
+	  prev = cp;
+	  nr_sectors = (long long) (lebs - 2 * cp) * worst * 7 / 8;
+	  if (nr_sectors <= 0)
+	    return -ENOSPC;
+	  cp_len = (long long) nr_sectors * 4 + (long long) ftl->nr_lebs * 8;
+	  cp = (cp_len + leb_size - ftl->io - 1) / (leb_size - ftl->io);
+	}
+    }
+  ftl->nr_sectors = nr_sectors;
+  cp_len = (long long) nr_sectors * 4 + (long long) ftl->nr_lebs * 8;
+  ftl->cp_lebs = (cp_len + leb_size - ftl->io - 1) / (leb_size - ftl->io);
+  ftl->first_data = 2 * ftl->cp_lebs;
+
+  if (nr_sectors <= 0 || (long long) nr_sectors >
+      (long long) (ftl->nr_lebs - ftl->first_data - FTL_GC_RESERVE - 2) *
+      worst)
+    return -ENOSPC;
+  return 0;
+}
+
+static int
+ftl_alloc(struct ubi_ftl *ftl, struct ubi_volume_desc *desc)
+{
+  int units = ftl->nr_lebs * ftl->upl, i;
+  int batch = MIN(FTL_MAX_BATCH, ftl->hdr_cap);
+
+  ftl->map = malloc(ftl->nr_sectors * sizeof(uint32_t));
+  ftl->rmap = malloc(units * sizeof(uint32_t));
+  ftl->lebs = calloc(ftl->nr_lebs, sizeof(struct ftl_leb));
+  ftl->wbuf = malloc(ftl->io + (size_t) batch * ftl->sector_size);
+  ftl->lebbuf = malloc(desc->vi.usable_leb_size);
+  ftl->stage_lba = malloc(batch * sizeof(uint32_t));
+  ftl->stage_data = malloc((size_t) batch * ftl->sector_size);
+  if (!ftl->map || !ftl->rmap || !ftl->lebs || !ftl->wbuf || !ftl->lebbuf
+      || !ftl->stage_lba || !ftl->stage_data)
+    return -ENOMEM;
+  for (i = 0; i < ftl->nr_sectors; i++)
+    ftl->map[i] = FTL_NONE;
+  for (i = 0; i < units; i++)
+    ftl->rmap[i] = FTL_NONE;
+  pthread_mutex_init(&ftl->lock, NULL);
+  return 0;
+}
+
+static void
+ftl_free(struct ubi_ftl *ftl)
+{
+  free(ftl->stage_data);
+  free(ftl->stage_lba);
+  free(ftl->lebbuf);
+  free(ftl->wbuf);
+  free(ftl->lebs);
+  free(ftl->rmap);
+  free(ftl->map);
+  free(ftl);
+}
+
+static int
+ftl_batch(struct ubi_ftl *ftl)
+{
+  return MIN(FTL_MAX_BATCH, ftl->hdr_cap);
+}
+
+/*
+ * LEB @leb is full and holds no valid sector. It becomes free once the last
+ * checkpoint covers its records; until then a replay has to go through them,
+ * so it stays full, and the next checkpoint frees it.
+ */
+static void
+ftl_release(struct ubi_ftl *ftl, struct ftl_leb *leb)
+{
+  if (leb->seq > ftl->cp_rec_seq)
+    {
+      leb->state = LEB_FULL;
+      return;
+    }
+  leb->state = LEB_FREE;
+  leb->dirty = 1;
+  ftl->nr_free += 1;
+}
+
+/* Point sector @lba to location @loc, %FTL_NONE to unmap it */
+static void
+ftl_set(struct ubi_ftl *ftl, uint32_t lba, uint32_t loc)
+{
+  uint32_t old = ftl->map[lba];
+  struct ftl_leb *leb;
+
+  if (old != FTL_NONE)
+    {
+      leb = &ftl->lebs[old / ftl->upl];
+      ftl->rmap[old] = FTL_NONE;
+      leb->valid -= 1;
+      if (leb->valid == 0 && leb->state == LEB_FULL)
+	ftl_release(ftl, leb);
+    }
+  ftl->map[lba] = loc;
+  if (loc != FTL_NONE)
+    {
+      ftl->rmap[loc] = lba;
+      ftl->lebs[loc / ftl->upl].valid += 1;
+    }
+}
+
+/* Mark LEB @lnum as filled, it may become free if nothing in it is valid */
+static void
+ftl_close_leb(struct ubi_ftl *ftl, int lnum)
+{
+  struct ftl_leb *leb = &ftl->lebs[lnum];
+
+  if (leb->valid == 0)
+    ftl_release(ftl, leb);
+  else
+    leb->state = LEB_FULL;
+}
+
+static int
+ftl_pick_free(struct ubi_ftl *ftl)
+{
+  int n = ftl->nr_lebs - ftl->first_data, i, lnum;
+
+  for (i = 0; i < n; i++)
+    {
+      lnum = ftl->first_data + (ftl->alloc_cursor + i) % n;
+      if (ftl->lebs[lnum].state == LEB_FREE)
+	{
+	  ftl->alloc_cursor = (lnum - ftl->first_data + 1) % n;
+	  ftl->lebs[lnum].state = LEB_NEXT;
+	  ftl->nr_free -= 1;
+	  return lnum;
+	}
+    }
+  return -ENOSPC;
+}
+
+/* Move the log to the reserved LEB and reserve the following one */
+static int
+ftl_next_leb(struct ubi_ftl *ftl)
+{
+  struct ftl_leb *leb;
+  int next, err;
+
+  next = ftl_pick_free(ftl);
+  if (next < 0)
+    {
+      errmsg("block translation layer out of free LEBs");
+      return next;
+    }
+
+  ftl_close_leb(ftl, ftl->open_lnum);
+  ftl->open_lnum = ftl->next_lnum;
+  ftl->open_unit = 0;
+  ftl->next_lnum = next;
+  leb = &ftl->lebs[ftl->open_lnum];
+  leb->state = LEB_OPEN;
+  if (leb->dirty)
+    {
+      err = ubi_leb_unmap(ftl->desc, ftl->open_lnum);
+      if (err)
+	return err;
+      leb->dirty = 0;
+    }
+
+  ftl->filled += 1;
+  if (ftl->filled >= FTL_CP_INTERVAL && !ftl->in_gc)
+    return ftl_checkpoint(ftl);
+  return 0;
+}
+
+/*
+ * Write one record holding @nsect sectors from @data and discarding
+ * @ndiscard sectors, at the current position of the log, which must have
+ * room for it.
+ */
+static int
+ftl_write_record(struct ubi_ftl *ftl, const uint32_t *lbas, const char *data,
+		 int nsect, const uint32_t *discards, int ndiscard)
+{
+  struct ftl_rec_hdr *hdr = (struct ftl_rec_hdr *) ftl->wbuf;
+  int len = ftl->io + nsect * ftl->sector_size, err, i;
+  uint32_t loc;
+
+  memset(hdr, 0, ftl->io);
+  hdr->magic = FTL_REC_MAGIC;
+  hdr->fmt_id = ftl->fmt_id;
+  hdr->seq = ftl->seq + 1;
+  hdr->next_lnum = ftl->next_lnum;
+  hdr->nsect = nsect;
+  hdr->ndiscard = ndiscard;
+  if (nsect)
+    {
+      memcpy(hdr->lba, lbas, nsect * sizeof(uint32_t));
+      memcpy(ftl->wbuf + ftl->io, data, (size_t) nsect * ftl->sector_size);
+    }
+  if (ndiscard)
+    memcpy(hdr->lba + nsect, discards, ndiscard * sizeof(uint32_t));
+  hdr->data_crc = __ubi_crc32(UBI_CRC32_INIT, ftl->wbuf + ftl->io,
+			      len - ftl->io);
+  hdr->hdr_crc = __ubi_crc32(UBI_CRC32_INIT, &hdr->fmt_id, ftl->io - 8);
+
+  err = ubi_leb_write(ftl->desc, ftl->open_lnum, ftl->wbuf,
+		      ftl->open_unit * ftl->io, len, UBI_UNKNOWN);
+  if (err)
+    {
+      /* something may have been programmed, never write there again */
+      ftl->open_unit = ftl->upl;
+      return err;
+    }
+
+  ftl->seq += 1;
+  ftl->lebs[ftl->open_lnum].seq = ftl->seq;
+  loc = ftl->open_lnum * ftl->upl + ftl->open_unit + 1;
+  for (i = 0; i < nsect; i++, loc += ftl->su)
+    ftl_set(ftl, lbas[i], loc);
+  for (i = 0; i < ndiscard; i++)
+    ftl_set(ftl, discards[i], FTL_NONE);
+  ftl->open_unit += 1 + nsect * ftl->su;
+  ftl->stats.header_ios += 1;
+  return 0;
+}
+
+static int ftl_gc(struct ubi_ftl *ftl);
+
+/* Append sectors and discards to the log, as as many records as needed */
+static int
+ftl_append(struct ubi_ftl *ftl, const uint32_t *lbas, const char *data,
+	   int nsect, const uint32_t *discards, int ndiscard)
+{
+  int err, fit, n, nd;
+
+  while (nsect > 0 || ndiscard > 0)
+    {
+      while (!ftl->in_gc && ftl->nr_free < FTL_GC_RESERVE)
+	{
+	  err = ftl_gc(ftl);
+	  if (err)
+	    return err;
+	}
+
+      if (ftl->upl - ftl->open_unit < 1 + ftl->su)
+	{
+	  err = ftl_next_leb(ftl);
+	  if (err)
+	    return err;
+	  continue;
+	}
+
+      fit = (ftl->upl - ftl->open_unit - 1) / ftl->su;
+      n = MIN(MIN(nsect, fit), ftl_batch(ftl));
+      nd = MIN(ndiscard, ftl->hdr_cap - n);
+      err = ftl_write_record(ftl, lbas, data, n, discards, nd);
+      if (err)
+	return err;
+      lbas += n;
+      data += (size_t) n * ftl->sector_size;
+      nsect -= n;
+      discards += nd;
+      ndiscard -= nd;
+      if (ftl->in_gc)
+	ftl->stats.gc_sectors += n;
+      else
+	ftl->stats.user_sectors += n;
+    }
+  return 0;
+}
+
+/*
+ * Reclaim the LEB with the best benefit to cost ratio among the LEBs covered
+ * by the last checkpoint.
+ */
+static int
+ftl_gc(struct ubi_ftl *ftl)
+{
+  int spl = ftl->upl / ftl->su, lnum, victim = -1, unit, n = 0, err;
+  double best = -1, u, age, score;
+  uint32_t lba, loc, lbas[FTL_MAX_BATCH];
+  char *data;
+
+  for (lnum = ftl->first_data; lnum < ftl->nr_lebs; lnum++)
+    {
+      struct ftl_leb *leb = &ftl->lebs[lnum];
+
+      if (leb->state != LEB_FULL || leb->seq > ftl->cp_rec_seq)
+	continue;
+      u = (double) leb->valid / spl;
+      age = (double) (ftl->seq - leb->seq) + 1;
+      score = (1 - u) * age / (1 + u);
+      if (score > best)
+	{
+	  best = score;
+	  victim = lnum;
+	}
+    }
+
+  if (victim < 0 || ftl->lebs[victim].valid >= spl)
+    {
+      /* recent LEBs cannot be collected before being checkpointed */
+      if (ftl->seq != ftl->cp_rec_seq)
+	return ftl_checkpoint(ftl);
+      errmsg("block translation layer is full");
+      return -ENOSPC;
+    }
+
+  dbgmsg("ftl: collecting LEB %d, %d valid sectors", victim,
+	 ftl->lebs[victim].valid);
+  err = ubi_leb_read(ftl->desc, victim, ftl->lebbuf, 0,
+		     ftl->upl * ftl->io, 0);
+  if (err)
+    return err;
+
+  ftl->in_gc = 1;
+  data = ftl->lebbuf;
+  for (unit = 0; unit < ftl->upl && ftl->lebs[victim].valid; unit++)
+    {
+      loc = victim * ftl->upl + unit;
+      lba = ftl->rmap[loc];
+      if (lba == FTL_NONE)
+	continue;
+      /* sectors are relocated in batches of contiguous units */
+      if (n && (n == FTL_MAX_BATCH || data + (size_t) n * ftl->sector_size
+		!= ftl->lebbuf + (size_t) unit * ftl->io))
+	{
+	  err = ftl_append(ftl, lbas, data, n, NULL, 0);
+	  if (err)
+	    goto out;
+	  n = 0;
+	}
+      if (n == 0)
+	data = ftl->lebbuf + (size_t) unit * ftl->io;
+      lbas[n++] = lba;
+    }
+  if (n)
+    {
+      err = ftl_append(ftl, lbas, data, n, NULL, 0);
+      if (err)
+	goto out;
+    }
+
+  /* the LEB became free when its last valid sector moved */
+  err = ubi_leb_unmap(ftl->desc, victim);
+  if (err)
+    goto out;
+  ftl->lebs[victim].dirty = 0;
+  ftl->stats.gc_runs += 1;
+out:
+  ftl->in_gc = 0;
+  return err;
+}
+
+/*
+ * Copy @len bytes of checkpoint data starting at @at to @p if @save is
+ * non-zero, or from @p otherwise.
+ */
+static void
+ftl_cp_copy(struct ubi_ftl *ftl, long long at, char *p, int len, int save)
+{
+  long long map_len = (long long) ftl->nr_sectors * 4;
+  int chunk, off;
+  char *mem;
+
+  while (len > 0)
+    {
+      if (at < map_len)
+	{
+	  chunk = MIN(len, map_len - at);
+	  mem = (char *) ftl->map + at;
+	}
+      else
+	{
+	  off = (at - map_len) % 8;
+	  chunk = MIN(len, 8 - off);
+	  mem = (char *) &ftl->lebs[(at - map_len) / 8].seq + off;
+	}
+      if (save)
+	memcpy(p, mem, chunk);
+      else
+	memcpy(mem, p, chunk);
+      p += chunk;
+      at += chunk;
+      len -= chunk;
+    }
+}
+
+/* Write the in-memory state to the checkpoint slot not holding the last one */
+static int
+ftl_checkpoint(struct ubi_ftl *ftl)
+{
+  struct ubi_volume_desc *desc = ftl->desc;
+  struct ftl_cp_hdr *hdr = (struct ftl_cp_hdr *) ftl->lebbuf;
+  int room = desc->vi.usable_leb_size - ftl->io, slot = ftl->cp_slot ^ 1;
+  long long map_len = (long long) ftl->nr_sectors * 4, total, pos = 0;
+  int i, len, err;
+  char *p;
+
+  total = map_len + (long long) ftl->nr_lebs * 8;
+  for (i = 0; i < ftl->cp_lebs; i++)
+    {
+      memset(hdr, 0xFF, ftl->io);
+      p = ftl->lebbuf + ftl->io;
+      len = MIN(room, total - pos);
+      ftl_cp_copy(ftl, pos, p, len, 1);
+
+      hdr->magic = FTL_CP_MAGIC;
+      hdr->data_crc = __ubi_crc32(UBI_CRC32_INIT, p, len);
+      hdr->fmt_id = ftl->fmt_id;
+      hdr->cp_seq = ftl->cp_seq + 1;
+      hdr->rec_seq = ftl->seq;
+      hdr->index = i;
+      hdr->count = ftl->cp_lebs;
+      hdr->sector_size = ftl->sector_size;
+      hdr->nr_sectors = ftl->nr_sectors;
+      hdr->open_lnum = ftl->open_lnum;
+      hdr->open_unit = ftl->open_unit;
+      hdr->next_lnum = ftl->next_lnum;
+      hdr->len = len;
+      hdr->hdr_crc = __ubi_crc32(UBI_CRC32_INIT, &hdr->data_crc,
+				 sizeof(*hdr) - 8);
+
+      err = ubi_leb_change(desc, slot * ftl->cp_lebs + i, ftl->lebbuf,
+			   ftl_align(ftl, ftl->io + len), UBI_LONGTERM);
+      if (err)
+	return err;
+      pos += len;
+    }
+
+  ftl->cp_seq += 1;
+  ftl->cp_slot = slot;
+  ftl->cp_rec_seq = ftl->seq;
+  ftl->filled = 0;
+  ftl->stats.checkpoints += 1;
+
+  /* the LEBs left without valid sectors are not needed by replays any more */
+  for (i = ftl->first_data; i < ftl->nr_lebs; i++)
+    if (ftl->lebs[i].state == LEB_FULL && ftl->lebs[i].valid == 0)
+      ftl_release(ftl, &ftl->lebs[i]);
+  return 0;
+}
+
+/* Read and validate the header of checkpoint LEB @lnum */
+static int
+ftl_read_cp_hdr(struct ubi_volume_desc *desc, int lnum,
+		struct ftl_cp_hdr *hdr)
+{
+  int err;
+
+  err = ubi_leb_read(desc, lnum, (char *) hdr, 0, sizeof(*hdr), 0);
+  if (err)
+    return err;
+  if (hdr->magic != FTL_CP_MAGIC || hdr->hdr_crc !=
+      __ubi_crc32(UBI_CRC32_INIT, &hdr->data_crc, sizeof(*hdr) - 8))
+    return -EUCLEAN;
+  return 0;
+}
+
+/* Load checkpoint slot @slot, returns %-EUCLEAN if it is not complete */
+static int
+ftl_load_slot(struct ubi_ftl *ftl, int slot, const struct ftl_cp_hdr *first)
+{
+  struct ftl_cp_hdr *hdr = (struct ftl_cp_hdr *) ftl->lebbuf;
+  long long pos = 0;
+  int i, err;
+  char *p;
+
+  for (i = 0; i < ftl->cp_lebs; i++)
+    {
+      err = ubi_leb_read(ftl->desc, slot * ftl->cp_lebs + i, ftl->lebbuf, 0,
+			 ftl->desc->vi.usable_leb_size, 0);
+      if (err)
+	return err;
+      if (hdr->magic != FTL_CP_MAGIC || hdr->hdr_crc !=
+	  __ubi_crc32(UBI_CRC32_INIT, &hdr->data_crc, sizeof(*hdr) - 8)
+	  || hdr->cp_seq != first->cp_seq || hdr->index != (uint32_t) i
+	  || hdr->fmt_id != first->fmt_id
+	  || hdr->len > (uint32_t) (ftl->desc->vi.usable_leb_size - ftl->io))
+	return -EUCLEAN;
+      p = ftl->lebbuf + ftl->io;
+      if (hdr->data_crc != __ubi_crc32(UBI_CRC32_INIT, p, hdr->len))
+	return -EUCLEAN;
+
+      ftl_cp_copy(ftl, pos, p, hdr->len, 0);
+      pos += hdr->len;
+    }
+  return 0;
+}
+
+/*
+ * Read the record at unit @unit of LEB @lnum into @ftl->wbuf and check it is
+ * the record with sequence number @seq. Returns %1 if so, %0 if not and a
+ * negative error code in case of failure.
+ */
+static int
+ftl_read_record(struct ubi_ftl *ftl, int lnum, int unit, uint64_t seq)
+{
+  struct ftl_rec_hdr *hdr = (struct ftl_rec_hdr *) ftl->wbuf;
+  int len, err;
+
+  if (ftl->upl - unit < 1 + ftl->su)
+    return 0;
+  err = ubi_leb_read(ftl->desc, lnum, ftl->wbuf, unit * ftl->io, ftl->io, 0);
+  if (err == -EBADMSG)
+    return 0;
+  if (err)
+    return err;
+  if (hdr->magic != FTL_REC_MAGIC || hdr->fmt_id != ftl->fmt_id
+      || hdr->seq != seq || hdr->hdr_crc !=
+      __ubi_crc32(UBI_CRC32_INIT, &hdr->fmt_id, ftl->io - 8))
+    return 0;
+  if (hdr->nsect > ftl_batch(ftl) || hdr->nsect + hdr->ndiscard >
+      ftl->hdr_cap || unit + 1 + hdr->nsect * ftl->su > ftl->upl
+      || hdr->next_lnum < ftl->first_data || hdr->next_lnum >= ftl->nr_lebs)
+    return 0;
+
+  len = hdr->nsect * ftl->sector_size;
+  err = ubi_leb_read(ftl->desc, lnum, ftl->wbuf + ftl->io,
+		     (unit + 1) * ftl->io, len, 0);
+  if (err == -EBADMSG)
+    return 0;
+  if (err)
+    return err;
+  return hdr->data_crc == __ubi_crc32(UBI_CRC32_INIT, ftl->wbuf + ftl->io,
+				      len);
+}
+
+/* Look for the LEB the record @seq was written to, after @lnum was full */
+static int
+ftl_find_next(struct ubi_ftl *ftl, int hint, uint64_t seq)
+{
+  int lnum, ret;
+
+  if (hint >= ftl->first_data && hint < ftl->nr_lebs
+      && ftl->lebs[hint].state == LEB_FREE)
+    {
+      ret = ftl_read_record(ftl, hint, 0, seq);
+      if (ret)
+	return ret < 0 ? ret : hint;
+    }
+
+  /* the hint is wrong, this should not happen */
+  for (lnum = ftl->first_data; lnum < ftl->nr_lebs; lnum++)
+    {
+      if (ftl->lebs[lnum].state != LEB_FREE || lnum == hint)
+	continue;
+      ret = ftl_read_record(ftl, lnum, 0, seq);
+      if (ret)
+	{
+	  warnmsg("ftl: log continues in LEB %d instead of %d", lnum, hint);
+	  return ret < 0 ? ret : lnum;
+	}
+    }
+  return -ENOENT;
+}
+
+/* Replay the records written after the checkpoint */
+static int
+ftl_replay(struct ubi_ftl *ftl, int hint)
+{
+  struct ftl_rec_hdr *hdr = (struct ftl_rec_hdr *) ftl->wbuf;
+  int ret, i, replayed = 0;
+  uint32_t loc;
+
+  for (;;)
+    {
+      ret = ftl_read_record(ftl, ftl->open_lnum, ftl->open_unit,
+			    ftl->seq + 1);
+      if (ret < 0)
+	return ret;
+      if (ret == 0)
+	{
+	  ret = ftl_find_next(ftl, hint, ftl->seq + 1);
+	  if (ret == -ENOENT)
+	    break;
+	  if (ret < 0)
+	    return ret;
+	  ftl_close_leb(ftl, ftl->open_lnum);
+	  ftl->open_lnum = ret;
+	  ftl->open_unit = 0;
+	  ftl->lebs[ret].state = LEB_OPEN;
+	  ftl->lebs[ret].dirty = 0;
+	  ftl->nr_free -= 1;
+	  ftl->filled += 1;
+	  /* the record is in @ftl->wbuf already */
+	}
+
+      ftl->seq += 1;
+      ftl->lebs[ftl->open_lnum].seq = ftl->seq;
+      loc = ftl->open_lnum * ftl->upl + ftl->open_unit + 1;
+      for (i = 0; i < hdr->nsect; i++, loc += ftl->su)
+	if (hdr->lba[i] < (uint32_t) ftl->nr_sectors)
+	  ftl_set(ftl, hdr->lba[i], loc);
+      for (i = hdr->nsect; i < hdr->nsect + hdr->ndiscard; i++)
+	if (hdr->lba[i] < (uint32_t) ftl->nr_sectors)
+	  ftl_set(ftl, hdr->lba[i], FTL_NONE);
+      ftl->open_unit += 1 + hdr->nsect * ftl->su;
+      hint = hdr->next_lnum;
+      replayed += 1;
+    }
+
+  dbgmsg("ftl: replayed %d records, log continues at %d:%d", replayed,
+	 ftl->open_lnum, ftl->open_unit);
+  return hint;
+}
+
+/*
+ * Set up the writer after the replay: if the log does not end on erased
+ * space, the end of the open LEB may have been partially programmed by an
+ * interrupted write, so the log moves on to the next LEB.
+ */
+static int
+ftl_resume(struct ubi_ftl *ftl, int hint)
+{
+  int lnum, unit = ftl->open_unit, err;
+
+  if (hint >= ftl->first_data && hint < ftl->nr_lebs
+      && ftl->lebs[hint].state == LEB_FREE && hint != ftl->open_lnum)
+    {
+      ftl->lebs[hint].state = LEB_NEXT;
+      ftl->nr_free -= 1;
+      ftl->next_lnum = hint;
+    }
+  else
+    {
+      lnum = ftl_pick_free(ftl);
+      if (lnum < 0)
+	return lnum;
+      ftl->next_lnum = lnum;
+    }
+  /* the reserved LEB may hold stale data */
+  ftl->lebs[ftl->next_lnum].dirty = 1;
+
+  if (ftl->upl - unit < 1 + ftl->su)
+    return 0;
+  err = ubi_leb_read(ftl->desc, ftl->open_lnum, ftl->lebbuf,
+		     unit * ftl->io, (ftl->upl - unit) * ftl->io, 0);
+  if (err && err != -EBADMSG)
+    return err;
+  if (err || !__ubi_is_erased(ftl->lebbuf, (ftl->upl - unit) * ftl->io))
+    {
+      warnmsg("ftl: LEB %d was not cleanly written, skipping its end",
+	      ftl->open_lnum);
+      ftl->open_unit = ftl->upl;
+    }
+  return 0;
+}
+
+/**
+ * ubi_ftl_format - create an empty block translation layer.
+ * @desc: descriptor of the dynamic volume to format
+ * @sector_size: sector size, a multiple of the minimal I/O unit size, or %0
+ *               for the default (4KiB)
+ * @nr_sectors: number of sectors, or %0 to use 7/8 of the available space
+ *
+ * Everything stored in the volume is lost. Returns %0 in case of success and
+ * a negative error code in case of failure.
+ */
+int
+ubi_ftl_format(struct ubi_volume_desc *desc, int sector_size, int nr_sectors)
+{
+  struct ubi_ftl *ftl;
+  struct timespec ts;
+  int err, lnum;
+
+  if (desc->vi.vol_type != UBI_DYNAMIC_VOLUME || sector_size < 0
+      || nr_sectors < 0)
+    return -EINVAL;
+
+  ftl = calloc(1, sizeof(struct ubi_ftl));
+  if (ftl == NULL)
+    return -ENOMEM;
+  err = ftl_geometry(ftl, desc, sector_size, nr_sectors);
+  if (err)
+    goto out;
+  err = ftl_alloc(ftl, desc);
+  if (err)
+    goto out;
+
+  /* the second slot must not hold an older checkpoint anymore */
+  for (lnum = ftl->cp_lebs; lnum < 2 * ftl->cp_lebs; lnum++)
+    {
+      err = ubi_leb_erase(desc, lnum);
+      if (err)
+	goto out_lock;
+    }
+  /*
+   * Old records may come back after un-mapping, but they belong to another
+   * format and are ignored.
+   */
+  for (lnum = ftl->first_data; lnum < ftl->nr_lebs; lnum++)
+    {
+      err = ubi_leb_unmap(desc, lnum);
+      if (err)
+	goto out_lock;
+    }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ftl->fmt_id = (uint32_t) (ts.tv_sec ^ ts.tv_nsec ^ (getpid() << 16));
+  ftl->open_lnum = ftl->first_data;
+  ftl->next_lnum = ftl->first_data + 1;
+  ftl->lebs[ftl->open_lnum].state = LEB_OPEN;
+  ftl->lebs[ftl->next_lnum].state = LEB_NEXT;
+  /* slot 1 is written first, then its successor */
+  ftl->cp_slot = 1;
+  err = ftl_checkpoint(ftl);
+out_lock:
+  pthread_mutex_destroy(&ftl->lock);
+out:
+  ftl_free(ftl);
+  return err;
+}
+
+/**
+ * ubi_ftl_open - open a block translation layer.
+ * @desc: descriptor of the volume formatted with 'ubi_ftl_format()'
+ *
+ * The newest complete checkpoint is loaded and the records written after it
+ * are replayed. @desc must stay open as long as the translation layer is.
+ *
+ * Returns the translation layer in case of success and %NULL in case of
+ * failure, with errno set.
+ */
+struct ubi_ftl *
+ubi_ftl_open(struct ubi_volume_desc *desc)
+{
+  struct ftl_cp_hdr cp[2], *first;
+  struct ubi_ftl *ftl;
+  int err, slot, lnum, i, ok[2];
+
+  ftl = calloc(1, sizeof(struct ubi_ftl));
+  if (ftl == NULL)
+    return NULL;
+
+  /* LEB 0 tells the geometry; the header of a slot is that of its LEB 0 */
+  err = ftl_read_cp_hdr(desc, 0, &cp[0]);
+  if (err)
+    goto out_free;
+  err = ftl_geometry(ftl, desc, cp[0].sector_size, cp[0].nr_sectors);
+  if (err || ftl->cp_lebs != (int) cp[0].count)
+    {
+      errmsg("bad block translation layer geometry");
+      err = -EINVAL;
+      goto out_free;
+    }
+  err = ftl_alloc(ftl, desc);
+  if (err)
+    goto out_free;
+
+  ok[0] = 1;
+  err = ftl_read_cp_hdr(desc, ftl->cp_lebs, &cp[1]);
+  if (err && err != -EUCLEAN && err != -EBADMSG)
+    goto out;
+  ok[1] = !err && cp[1].fmt_id == cp[0].fmt_id;
+
+  /* try the newest slot first */
+  slot = ok[1] && cp[1].cp_seq > cp[0].cp_seq;
+  err = ftl_load_slot(ftl, slot, &cp[slot]);
+  if (err == -EUCLEAN && ok[!slot])
+    {
+      warnmsg("ftl: checkpoint %llu incomplete, using the previous one",
+	      (unsigned long long) cp[slot].cp_seq);
+      slot = !slot;
+      err = ftl_load_slot(ftl, slot, &cp[slot]);
+    }
+  if (err)
+    goto out;
+  first = &cp[slot];
+
+  ftl->fmt_id = first->fmt_id;
+  ftl->cp_seq = first->cp_seq;
+  ftl->cp_slot = slot;
+  ftl->seq = ftl->cp_rec_seq = first->rec_seq;
+  ftl->open_lnum = first->open_lnum;
+  ftl->open_unit = first->open_unit;
+  if (ftl->open_lnum < ftl->first_data || ftl->open_lnum >= ftl->nr_lebs)
+    {
+      err = -EINVAL;
+      goto out;
+    }
+
+  /* rebuild the reverse map and the LEB states */
+  for (i = 0; i < ftl->nr_sectors; i++)
+    {
+      uint32_t loc = ftl->map[i];
+
+      if (loc == FTL_NONE)
+	continue;
+      if (loc >= (uint32_t) (ftl->nr_lebs * ftl->upl)
+	  || (int) (loc / ftl->upl) < ftl->first_data)
+	{
+	  errmsg("ftl: bad location %u of sector %d", loc, i);
+	  err = -EINVAL;
+	  goto out;
+	}
+      ftl->rmap[loc] = i;
+      ftl->lebs[loc / ftl->upl].valid += 1;
+    }
+  for (lnum = ftl->first_data; lnum < ftl->nr_lebs; lnum++)
+    {
+      struct ftl_leb *leb = &ftl->lebs[lnum];
+
+      if (lnum == ftl->open_lnum)
+	leb->state = LEB_OPEN;
+      else if (leb->valid)
+	leb->state = LEB_FULL;
+      else
+	{
+	  leb->state = LEB_FREE;
+	  leb->dirty = 1;
+	  ftl->nr_free += 1;
+	}
+    }
+
+  err = ftl_replay(ftl, first->next_lnum);
+  if (err < 0)
+    goto out;
+  err = ftl_resume(ftl, err);
+  if (err)
+    goto out;
+
+  ftl->stats.sector_size = ftl->sector_size;
+  ftl->stats.nr_sectors = ftl->nr_sectors;
+  return ftl;
+
+out:
+  pthread_mutex_destroy(&ftl->lock);
+out_free:
+  ftl_free(ftl);
+  errno = -err;
+  return NULL;
+}
+
+/* Write the staged sectors to the log */
+static int
+ftl_flush(struct ubi_ftl *ftl)
+{
+  int err;
+
+  if (ftl->nstaged == 0)
+    return 0;
+  err = ftl_append(ftl, ftl->stage_lba, ftl->stage_data, ftl->nstaged, NULL,
+		   0);
+  /* on failure, the sectors stay staged; writing them again is harmless */
+  if (err == 0)
+    ftl->nstaged = 0;
+  return err;
+}
+
+static int
+ftl_staged(struct ubi_ftl *ftl, uint32_t lba)
+{
+  int i;
+
+  for (i = 0; i < ftl->nstaged; i++)
+    if (ftl->stage_lba[i] == lba)
+      return i;
+  return -1;
+}
+
+/**
+ * ubi_ftl_close - close a block translation layer.
+ * @ftl: the translation layer
+ *
+ * Pending sectors are written and a checkpoint is taken, so that the next
+ * open does not have anything to replay. Returns %0 in case of success and a
+ * negative error code in case of failure; @ftl is freed in both cases.
+ */
+int
+ubi_ftl_close(struct ubi_ftl *ftl)
+{
+  int err;
+
+  pthread_mutex_lock(&ftl->lock);
+  err = ftl_flush(ftl);
+  if (!err && ftl->seq != ftl->cp_rec_seq)
+    err = ftl_checkpoint(ftl);
+  pthread_mutex_unlock(&ftl->lock);
+  pthread_mutex_destroy(&ftl->lock);
+  ftl_free(ftl);
+  return err;
+}
+
+/**
+ * ubi_ftl_read - read sectors.
+ * @ftl: the translation layer
+ * @lba: first sector to read
+ * @buf: where to store the data
+ * @count: number of sectors to read
+ *
+ * Sectors never written or discarded read as zeroes. Returns %0 in case of
+ * success and a negative error code in case of failure.
+ */
+int
+ubi_ftl_read(struct ubi_ftl *ftl, int lba, void *buf, int count)
+{
+  char *p = buf;
+  uint32_t loc;
+  int i, n, err = 0, idx;
+
+  if (lba < 0 || count < 0 || lba + count > ftl->nr_sectors)
+    return -EINVAL;
+
+  pthread_mutex_lock(&ftl->lock);
+  for (i = 0; i < count; i += n, p += (size_t) n * ftl->sector_size)
+    {
+      n = 1;
+      idx = ftl_staged(ftl, lba + i);
+      if (idx >= 0)
+	{
+	  memcpy(p, ftl->stage_data + (size_t) idx * ftl->sector_size,
+		 ftl->sector_size);
+	  continue;
+	}
+      loc = ftl->map[lba + i];
+      if (loc == FTL_NONE)
+	{
+	  memset(p, 0, ftl->sector_size);
+	  continue;
+	}
+      /* read sectors stored next to each other at once */
+      while (i + n < count && ftl->map[lba + i + n] == loc + n * ftl->su
+	     && (loc + n * ftl->su) / ftl->upl == loc / ftl->upl
+	     && ftl_staged(ftl, lba + i + n) < 0)
+	n++;
+      err = ubi_leb_read(ftl->desc, loc / ftl->upl, p,
+			 (loc % ftl->upl) * ftl->io, n * ftl->sector_size, 0);
+      if (err)
+	break;
+    }
+  pthread_mutex_unlock(&ftl->lock);
+  return err;
+}
+
+/**
+ * ubi_ftl_write - write sectors.
+ * @ftl: the translation layer
+ * @lba: first sector to write
+ * @buf: data to write
+ * @count: number of sectors to write
+ *
+ * Sectors are gathered in memory and written to the flash in batches; they
+ * are only guaranteed to survive a power cut once 'ubi_ftl_sync()' returned.
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_ftl_write(struct ubi_ftl *ftl, int lba, const void *buf, int count)
+{
+  const char *p = buf;
+  int i, idx, err = 0;
+
+  if (lba < 0 || count < 0 || lba + count > ftl->nr_sectors)
+    return -EINVAL;
+
+  pthread_mutex_lock(&ftl->lock);
+  for (i = 0; i < count; i++, p += ftl->sector_size)
+    {
+      idx = ftl_staged(ftl, lba + i);
+      if (idx < 0)
+	{
+	  if (ftl->nstaged == ftl_batch(ftl))
+	    {
+	      err = ftl_flush(ftl);
+	      if (err)
+		break;
+	    }
+	  idx = ftl->nstaged++;
+	  ftl->stage_lba[idx] = lba + i;
+	}
+      memcpy(ftl->stage_data + (size_t) idx * ftl->sector_size, p,
+	     ftl->sector_size);
+    }
+  pthread_mutex_unlock(&ftl->lock);
+  return err;
+}
+
+/**
+ * ubi_ftl_discard - discard sectors.
+ * @ftl: the translation layer
+ * @lba: first sector to discard
+ * @count: number of sectors to discard
+ *
+ * The sectors read as zeroes afterwards and the space they used is reclaimed.
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_ftl_discard(struct ubi_ftl *ftl, int lba, int count)
+{
+  uint32_t *lbas;
+  int i, n = 0, idx, err;
+
+  if (lba < 0 || count < 0 || lba + count > ftl->nr_sectors)
+    return -EINVAL;
+
+  lbas = malloc(MAX(count, 1) * sizeof(uint32_t));
+  if (lbas == NULL)
+    return -ENOMEM;
+
+  pthread_mutex_lock(&ftl->lock);
+  for (i = 0; i < count; i++)
+    {
+      idx = ftl_staged(ftl, lba + i);
+      if (idx >= 0)
+	{
+	  ftl->nstaged -= 1;
+	  ftl->stage_lba[idx] = ftl->stage_lba[ftl->nstaged];
+	  memcpy(ftl->stage_data + (size_t) idx * ftl->sector_size,
+		 ftl->stage_data + (size_t) ftl->nstaged * ftl->sector_size,
+		 ftl->sector_size);
+	}
+      if (ftl->map[lba + i] != FTL_NONE)
+	lbas[n++] = lba + i;
+    }
+  err = ftl_append(ftl, NULL, NULL, 0, lbas, n);
+  pthread_mutex_unlock(&ftl->lock);
+  free(lbas);
+  return err;
+}
+
+/**
+ * ubi_ftl_sync - write pending sectors to the flash.
+ * @ftl: the translation layer
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_ftl_sync(struct ubi_ftl *ftl)
+{
+  int err;
+
+  pthread_mutex_lock(&ftl->lock);
+  err = ftl_flush(ftl);
+  pthread_mutex_unlock(&ftl->lock);
+  return err;
+}
+
+/**
+ * ubi_ftl_get_stats - get block translation layer statistics.
+ * @ftl: the translation layer
+ * @stats: the statistics are stored here
+ *
+ * The write amplification is the number of minimal I/O units programmed,
+ * (@user_sectors + @gc_sectors) * sector size / min I/O size + @header_ios,
+ * divided by the number of units the user asked to write.
+ */
+void
+ubi_ftl_get_stats(struct ubi_ftl *ftl, struct ubi_ftl_stats *stats)
+{
+  pthread_mutex_lock(&ftl->lock);
+  memcpy(stats, &ftl->stats, sizeof(*stats));
+  stats->free_lebs = ftl->nr_free;
+  pthread_mutex_unlock(&ftl->lock);
+}
@@ -0,0 +1,348 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - device health monitor.
+ *
+ * The monitor samples the wear and bad block counters UBI exports in sysfs
+ * for a device, and keeps the last samples to compute trends. The sysfs
+ * attributes are opened once and re-read at offset 0 for every sample, which
+ * costs one system call per attribute instead of three. Samples are taken on
+ * request, or by a thread at a fixed interval.
+ *
+ * UBI does not count the data written to a device, but wear-leveling keeps
+ * the erase counters of all the physical eraseblocks close to each other, so
+ * the rise of the maximum erase counter times the number of eraseblocks is an
+ * estimate of the erasures, and thus of the data programmed.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define HEALTH_DEFAULT_WINDOW	60
+
+/*
+ * Attributes sampled, in the order of the fields of &struct ubi_health_sample
+ */
+static const char *const health_attrs[] = {
+  DEV_AVAIL_EBS,
+  DEV_TOTAL_EBS,
+  DEV_BAD_COUNT,
+  DEV_MAX_EC,
+  DEV_MAX_RSVD
+};
+
+#define HEALTH_NR_ATTRS	(sizeof(health_attrs) / sizeof(health_attrs[0]))
+
+/**
+ * struct ubi_health - device health monitor.
+ * @ubi_num: UBI device number
+ * @eb_size: eraseblock size UBI reports, which is the LEB size
+ * @fds: descriptors of the attributes of @health_attrs, %-1 if missing
+ * @interval_ms: sampling interval of @thread, %0 if there is no thread
+ * @thread: the sampling thread
+ * @lock: protects all the fields below
+ * @cond: signalled to stop @thread
+ * @stop: set to make @thread exit
+ * @err: error of the last sample taken by @thread
+ * @window: number of entries of @ring
+ * @count: number of samples in @ring
+ * @next: where the next sample goes in @ring
+ * @ring: the last samples
+ */
+struct ubi_health
+{
+  int ubi_num;
+  int eb_size;
+  int fds[HEALTH_NR_ATTRS];
+  int interval_ms;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  int err;
+  int window;
+  int count;
+  int next;
+  struct ubi_health_sample *ring;
+};
+
+/* Re-read an attribute. Returns its value or a negative error code. */
+static long long
+health_read(int fd)
+{
+  char buf[32], *end;
+  long long val;
+  ssize_t rd;
+
+  rd = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (rd < 0)
+    return -errno;
+  buf[rd] = '\0';
+  val = strtoll(buf, &end, 10);
+  if (end == buf || val < 0)
+    return -EINVAL;
+  return val;
+}
+
+static long long
+health_now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * ubi_health_poll - take a sample.
+ * @h: the health monitor
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_health_poll(struct ubi_health *h)
+{
+  struct ubi_health_sample s;
+  long long val[HEALTH_NR_ATTRS];
+  unsigned int i;
+
+  for (i = 0; i < HEALTH_NR_ATTRS; i++)
+    {
+      if (h->fds[i] < 0)
+	{
+	  val[i] = -1;
+	  continue;
+	}
+      val[i] = health_read(h->fds[i]);
+      if (val[i] < 0)
+	{
+	  errmsg("cannot read %s of UBI device %d, error %lld",
+		 health_attrs[i], h->ubi_num, val[i]);
+	  return val[i];
+	}
+    }
+  s.time_ms = health_now_ms();
+  s.avail_ebs = val[0];
+  s.total_ebs = val[1];
+  s.bad_pebs = val[2];
+  s.max_ec = val[3];
+  s.reserved_pebs = val[4];
+
+  pthread_mutex_lock(&h->lock);
+  h->ring[h->next] = s;
+  h->next = (h->next + 1) % h->window;
+  if (h->count < h->window)
+    h->count += 1;
+  pthread_mutex_unlock(&h->lock);
+  return 0;
+}
+
+static void *
+health_thread(void *arg)
+{
+  struct ubi_health *h = arg;
+  struct timespec ts;
+  int err;
+
+  pthread_mutex_lock(&h->lock);
+  while (!h->stop)
+    {
+      pthread_mutex_unlock(&h->lock);
+      err = ubi_health_poll(h);
+      pthread_mutex_lock(&h->lock);
+      h->err = err;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += h->interval_ms / 1000;
+      ts.tv_nsec += (h->interval_ms % 1000) * 1000000L;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec += 1;
+	  ts.tv_nsec -= 1000000000;
+	}
+      while (!h->stop
+	     && pthread_cond_timedwait(&h->cond, &h->lock, &ts) != ETIMEDOUT)
+	;
+    }
+  pthread_mutex_unlock(&h->lock);
+  return NULL;
+}
+
+/**
+ * ubi_health_open - start monitoring the health of a UBI device.
+ * @ubi_num: UBI device number
+ * @interval_ms: sampling interval in milliseconds, or %0 to only sample when
+ *               'ubi_health_poll()' is called
+ * @window: number of samples kept to compute trends, or %0 for the default
+ *
+ * A first sample is taken before this function returns. Attributes older
+ * kernels do not have read as %-1.
+ *
+ * Returns the monitor in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_health *
+ubi_health_open(int ubi_num, int interval_ms, int window)
+{
+  char path[PATH_MAX];
+  struct ubi_device_info di;
+  struct ubi_health *h;
+  unsigned int i;
+  int err;
+
+  if (interval_ms < 0 || window < 0)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  err = ubi_get_device_info(ubi_num, &di);
+  if (err)
+    {
+      errno = -err;
+      return NULL;
+    }
+
+  h = calloc(1, sizeof(struct ubi_health));
+  if (h == NULL)
+    return NULL;
+  h->ubi_num = ubi_num;
+  h->eb_size = di.leb_size;
+  h->window = window ? window : HEALTH_DEFAULT_WINDOW;
+  h->ring = calloc(h->window, sizeof(struct ubi_health_sample));
+  pthread_mutex_init(&h->lock, NULL);
+  pthread_cond_init(&h->cond, NULL);
+  for (i = 0; i < HEALTH_NR_ATTRS; i++)
+    h->fds[i] = -1;
+  if (h->ring == NULL)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  for (i = 0; i < HEALTH_NR_ATTRS; i++)
+    {
+      sprintf(path, "%s/" SYSFS_UBI "/" UBI_DEV_NAME_PATT "/%s",
+	      __ubi_sys_dir(), ubi_num, health_attrs[i]);
+      h->fds[i] = open(path, O_RDONLY);
+      if (h->fds[i] < 0 && (errno != ENOENT || i <= 1))
+	{
+	  err = -errno;
+	  sys_errmsg("cannot open \"%s\"", path);
+	  goto out;
+	}
+    }
+
+  err = ubi_health_poll(h);
+  if (err)
+    goto out;
+
+  if (interval_ms)
+    {
+      h->interval_ms = interval_ms;
+      err = -pthread_create(&h->thread, NULL, health_thread, h);
+      if (err)
+	{
+	  h->interval_ms = 0;
+	  goto out;
+	}
+    }
+  return h;
+
+out:
+  ubi_health_close(h);
+  errno = -err;
+  return NULL;
+}
+
+/**
+ * ubi_health_close - stop monitoring the health of a UBI device.
+ * @h: the health monitor
+ */
+void
+ubi_health_close(struct ubi_health *h)
+{
+  unsigned int i;
+
+  if (h->interval_ms)
+    {
+      pthread_mutex_lock(&h->lock);
+      h->stop = 1;
+      pthread_cond_signal(&h->cond);
+      pthread_mutex_unlock(&h->lock);
+      pthread_join(h->thread, NULL);
+    }
+  for (i = 0; i < HEALTH_NR_ATTRS; i++)
+    if (h->fds[i] >= 0)
+      close(h->fds[i]);
+  pthread_cond_destroy(&h->cond);
+  pthread_mutex_destroy(&h->lock);
+  free(h->ring);
+  free(h);
+}
+
+/**
+ * ubi_health_get_report - get the last sample and the trends.
+ * @h: the health monitor
+ * @r: the report is stored here
+ *
+ * The trends are computed between the oldest and the newest sample kept; they
+ * are %0 until there are two samples taken at different times.
+ *
+ * Returns %0 in case of success and the error of the last sample if the
+ * sampling thread failed to take it.
+ */
+int
+ubi_health_get_report(struct ubi_health *h, struct ubi_health_report *r)
+{
+  const struct ubi_health_sample *first, *last;
+  double secs;
+  int err;
+
+  memset(r, 0, sizeof(*r));
+  pthread_mutex_lock(&h->lock);
+  last = &h->ring[(h->next + h->window - 1) % h->window];
+  first = &h->ring[h->count < h->window ? 0 : h->next];
+  r->last = *last;
+  r->first = *first;
+  r->samples = h->count;
+  err = h->err;
+  pthread_mutex_unlock(&h->lock);
+
+  secs = (r->last.time_ms - r->first.time_ms) / 1000.0;
+  if (secs <= 0)
+    return err;
+  r->avail_ebs_per_hour = (r->last.avail_ebs - r->first.avail_ebs)
+    * 3600.0 / secs;
+  r->bad_pebs_per_day = (r->last.bad_pebs - r->first.bad_pebs)
+    * 86400.0 / secs;
+  if (r->last.max_ec >= 0)
+    {
+      r->max_ec_per_hour = (r->last.max_ec - r->first.max_ec) * 3600.0 / secs;
+      r->erase_rate = (r->last.max_ec - r->first.max_ec)
+	* (double) r->last.total_ebs / secs;
+      r->write_rate = r->erase_rate * h->eb_size;
+    }
+  return err;
+}
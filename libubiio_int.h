@@ -33,6 +33,7 @@ extern "C"
 #endif
 
 #define MIN(a ,b) ((a) < (b) ? (a) : (b))
+#define MAX(a ,b) ((a) > (b) ? (a) : (b))
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 /* Verbose messages */
@@ -77,12 +78,25 @@ extern "C"
 #define dbgmsg(fmt, ...)	(void) fmt
 #endif
 
+  struct ubi_readahead;
+  struct ubi_verify;
+  struct ubi_sim;
+  struct ubi_throttle;
+  struct ubi_capture;
+
 /**
  * struct ubi_volume_desc - UBI volume information.
  * @fd: UBI volume file descriptor
  * @mode: volume open mode (%UBI_READONLY, %UBI_READWRITE, %UBI_EXCLUSIVE)
  * @vi: volume info structure
  * @di: device info structure
+ * @ra: readahead state, %NULL if readahead is disabled
+ * @verify: verification state, %NULL if verification is disabled
+ * @sim: simulation state, %NULL unless the volume is file-backed
+ * @stats: exported statistics slot, looked up on first use
+ * @throttle: I/O budget, %NULL if the descriptor is not throttled
+ * @capture: operation recording, %NULL unless the descriptor is captured
+ * @profile: measured performance of the device, %NULL if there is none
  */
   struct ubi_volume_desc
   {
@@ -90,6 +104,13 @@ extern "C"
     int mode;
     struct ubi_volume_info vi;
     struct ubi_device_info di;
+    struct ubi_readahead *ra;
+    struct ubi_verify *verify;
+    struct ubi_sim *sim;
+    struct ubi_stats_slot *stats;
+    struct ubi_throttle *throttle;
+    struct ubi_capture *capture;
+    struct ubi_profile *profile;
   };
 
 /*
@@ -135,51 +156,77 @@ extern "C"
 #define VOL_CORRUPTED     "corrupted"
 #define VOL_NAME          "name"
 
-
-/**
- * get_sys_dir_path - return the sys directory path
- */
-static char *get_sys_dir_path();
-/**
- * read_positive_ll - read a positive 'long long' value from a file.
- * @file: the file to read from
- * @value: the result is stored here
- *
- * This function reads file @file and interprets its contents as a positive
- * 'long long' integer. If this is not true, it fails with %EINVAL error code.
- * Returns %0 in case of success and %-1 in case of failure.
- */
-static int read_positive_ll(const char *file, long long *value);
-/**
- * read_positive_int - read a positive 'int' value from a file.
- * @file: the file to read from
- * @value: the result is stored here
- *
- * This function is the same as 'read_positive_ll()', but it reads an 'int'
- * value, not 'long long'.
- * Returns %0 in case of success and %-1 in case of failure.
- */
-static int read_positive_int(const char *file, int *value);
-/**
- * read_data - read data from a file.
- * @file: the file to read from
- * @buf: the buffer to read to
- * @buf_len: buffer length
- *
- * This function returns number of read bytes in case of success and %-1 in
- * case of failure. Note, if the file contains more then @buf_len bytes of
- * date, this function fails with %EINVAL error code.
- * Returns %0 in case of success and %-1 in case of failure.
- */
-static int read_data(const char *file, void *buf, int buf_len);
-/**
- * read_cdev - read major and minor numbers from a file.
- * @file: name of the file to read from
- * @pdev: device decription is returned here
- *
- * Returns %0 in case of succes, and %-1 in case of failure.
- */
-static int read_cdev(const char *file, dev_t * pdev);
+/* libubiio.c */
+  struct iovec;
+
+  const char *__ubi_sys_dir(void);
+
+  int __ubi_vol_readv(struct ubi_volume_desc *desc, const struct iovec *iov,
+		      int iovcnt, long long addr);
+  int __ubi_vol_writev(struct ubi_volume_desc *desc, const struct iovec *iov,
+		       int iovcnt, long long addr);
+  int __ubi_leb_change(struct ubi_volume_desc *desc, int lnum, const void *buf,
+		       int len, int dtype);
+  int __ubi_leb_erase(struct ubi_volume_desc *desc, int lnum);
+  int __ubi_leb_unmap(struct ubi_volume_desc *desc, int lnum);
+  int __ubi_leb_map(struct ubi_volume_desc *desc, int lnum, int dtype);
+
+/* libubiio_crc32.c */
+#define UBI_CRC32_INIT 0xFFFFFFFFU
+  uint32_t __ubi_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* libubiio_simd.c */
+  int __ubi_is_erased(const void *buf, size_t len);
+  int __ubi_memeq(const void *a, const void *b, size_t len);
+
+/* libubiio_ra.c */
+  int __ubi_ra_read(struct ubi_readahead *ra, char *buf, loff_t addr,
+		    int len);
+  void __ubi_ra_invalidate(struct ubi_readahead *ra, loff_t addr, int len);
+
+/* libubiio_verify.c */
+  int __ubi_verify_write(struct ubi_verify *v, int lnum, int offset,
+			 const void *buf, int len);
+  void __ubi_verify_drop(struct ubi_verify *v, int lnum);
+
+/* libubiio_sim.c */
+  int __ubi_sim_ioctl(struct ubi_volume_desc *desc, unsigned long cmd,
+		      void *arg);
+  void __ubi_sim_read(struct ubi_volume_desc *desc, int lnum, int offset,
+		      int len);
+  void __ubi_sim_write(struct ubi_volume_desc *desc, int lnum, int offset,
+		       int len);
+  void __ubi_sim_close(struct ubi_volume_desc *desc);
+
+/* libubiio_stats.c */
+  extern int __ubi_stats_on;
+
+  struct ubi_stats_slot *__ubi_stats_vol(struct ubi_volume_desc *desc);
+  struct ubi_stats_slot *__ubi_stats_dev(int ubi_num);
+  long long __ubi_stats_start(struct ubi_volume_desc *desc);
+  void __ubi_stats_account(struct ubi_volume_desc *desc, int opcode, int len,
+			   int err, long long start);
+
+/* libubiio_scrub.c */
+  extern int __ubi_scrub_on;
+
+  void __ubi_scrub_note_io(void);
+
+/* libubiio_lz.c */
+#define UBI_LZ_MAX_BLOCK	65536
+  int __ubi_lz_compress(const void *src, int len, void *dst, int cap);
+  int __ubi_lz_decompress(const void *src, int clen, void *dst, int len);
+
+/* libubiio_throttle.c */
+  int __ubi_throttle(struct ubi_throttle *thr, int opcode, int len);
+
+/* libubiio_capture.c */
+  void __ubi_capture(struct ubi_volume_desc *desc, int opcode, long long addr,
+		     const struct iovec *iov, int iovcnt, int dtype, int result,
+		     long long start);
+
+/* libubiio_calib.c */
+  void __ubi_profile_open(struct ubi_volume_desc *desc);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,999 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - key-value store.
+ *
+ * Every update of the store, be it a single put or delete or a batch of them,
+ * is written as one frame appended to the head LEB of a dynamic volume. A
+ * frame is a header followed by the entries, padded to the minimal I/O unit
+ * size, and is protected by a single CRC, so that a batch is either entirely
+ * visible after a power cut or not at all. A small update costs one page
+ * program.
+ *
+ * The store keeps a hash index of all keys in memory, giving for each key
+ * the location of its value, so that a lookup reads only the value. The
+ * index is rebuilt at open time by scanning the mapped LEBs; frames carry
+ * a sequence number which decides which entry of a key is the newest.
+ *
+ * Space is reclaimed by compacting the LEB with the most dead data: its live
+ * entries are appended to the head again and the LEB is un-mapped. A
+ * deletion is remembered by a tombstone entry, which is only dropped once no
+ * older entry of the key can be found on the flash anymore.
+ *
+ * On-flash structures use host byte order.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define KV_MAGIC		0x55424b56	/* "UBKV" */
+#define KV_TOMBSTONE		0x1
+/* Free LEBs kept for compaction */
+#define KV_RESERVE		1
+#define KV_MIN_BUCKETS		256
+
+/**
+ * struct kv_frame_hdr - frame header.
+ * @magic: %KV_MAGIC
+ * @crc: CRC of the frame, starting at @seq and ending with the last entry
+ * @seq: frame sequence number
+ * @len: size of the entries following the header
+ * @count: number of entries
+ */
+struct kv_frame_hdr
+{
+  uint32_t magic;
+  uint32_t crc;
+  uint64_t seq;
+  uint32_t len;
+  uint32_t count;
+};
+
+/**
+ * struct kv_entry_hdr - entry header, followed by the key and the value.
+ * @klen: key length
+ * @flags: %KV_TOMBSTONE for deletions
+ * @vlen: value length
+ */
+struct kv_entry_hdr
+{
+  uint16_t klen;
+  uint16_t flags;
+  uint32_t vlen;
+};
+
+/**
+ * struct kv_node - index entry.
+ * @next: next node of the hash bucket
+ * @hash: hash of the key
+ * @klen: key length
+ * @tomb: non-zero if the key is deleted
+ * @lnum: LEB holding the newest entry of the key
+ * @off: offset of the entry in @lnum
+ * @vlen: value length
+ * @seq: sequence number of the frame holding the entry
+ * @key: the key
+ */
+struct kv_node
+{
+  struct kv_node *next;
+  uint32_t hash;
+  int klen;
+  int tomb;
+  int lnum;
+  int off;
+  int vlen;
+  uint64_t seq;
+  char key[];
+};
+
+/**
+ * struct kv_leb - in-memory state of a LEB.
+ * @used: bytes written to the LEB, %0 if it is free
+ * @live: bytes of live entries in the LEB
+ * @min_seq: sequence number of the oldest frame in the LEB
+ * @unmapped: set when the LEB has been un-mapped and not written since,
+ *            meaning its old contents may come back after an unclean reboot
+ */
+struct kv_leb
+{
+  int used;
+  int live;
+  uint64_t min_seq;
+  int unmapped;
+};
+
+/**
+ * struct ubi_kv_batch - a set of updates applied atomically.
+ * @buf: the entries, laid out as on the flash
+ * @len: size of the entries
+ * @size: size of @buf
+ * @count: number of entries
+ */
+struct ubi_kv_batch
+{
+  char *buf;
+  int len;
+  int size;
+  int count;
+};
+
+/**
+ * struct ubi_kv - key-value store.
+ * @desc: volume descriptor
+ * @lock: serializes all operations
+ * @io: minimal I/O unit size
+ * @leb_size: usable LEB size
+ * @nr_lebs: number of LEBs of the volume
+ * @lebs: per-LEB state
+ * @nr_free: number of free LEBs
+ * @head: LEB frames are appended to
+ * @seq: sequence number of the last frame
+ * @buckets: hash buckets
+ * @nr_buckets: number of hash buckets, a power of 2
+ * @nr_nodes: number of index entries
+ * @wbuf: frame buffer, one LEB large
+ * @stats: statistics
+ */
+struct ubi_kv
+{
+  struct ubi_volume_desc *desc;
+  pthread_mutex_t lock;
+  int io;
+  int leb_size;
+  int nr_lebs;
+  struct kv_leb *lebs;
+  int nr_free;
+  int head;
+  uint64_t seq;
+  struct kv_node **buckets;
+  int nr_buckets;
+  int nr_nodes;
+  char *wbuf;
+  struct ubi_kv_stats stats;
+};
+
+static int
+kv_align(struct ubi_kv *kv, int len)
+{
+  return (len + kv->io - 1) / kv->io * kv->io;
+}
+
+/* Entries are padded so that their headers stay aligned */
+static int
+kv_entry_size(int klen, int vlen)
+{
+  return (sizeof(struct kv_entry_hdr) + klen + vlen + 3) & ~3;
+}
+
+/* FNV-1a */
+static uint32_t
+kv_hash(const void *key, int klen)
+{
+  const unsigned char *p = key;
+  uint32_t h = 2166136261U;
+
+  while (klen--)
+    h = (h ^ *p++) * 16777619U;
+  return h;
+}
+
+static struct kv_node **
+kv_find(struct ubi_kv *kv, const void *key, int klen, uint32_t hash)
+{
+  struct kv_node **pp = &kv->buckets[hash & (kv->nr_buckets - 1)];
+
+  for (; *pp; pp = &(*pp)->next)
+    if ((*pp)->hash == hash && (*pp)->klen == klen
+	&& !memcmp((*pp)->key, key, klen))
+      break;
+  return pp;
+}
+
+static int
+kv_grow(struct ubi_kv *kv)
+{
+  int nr = kv->nr_buckets * 2, i;
+  struct kv_node **b, *node, *next;
+
+  b = calloc(nr, sizeof(struct kv_node *));
+  if (b == NULL)
+    return -ENOMEM;
+  for (i = 0; i < kv->nr_buckets; i++)
+    for (node = kv->buckets[i]; node; node = next)
+      {
+	next = node->next;
+	node->next = b[node->hash & (nr - 1)];
+	b[node->hash & (nr - 1)] = node;
+      }
+  free(kv->buckets);
+  kv->buckets = b;
+  kv->nr_buckets = nr;
+  return 0;
+}
+
+/*
+ * Record that the newest entry of @key is at @off in LEB @lnum, unless the
+ * index already knows a newer one. The entry at @off is laid out as a
+ * &struct kv_entry_hdr followed by the key and the value.
+ */
+static int
+kv_index(struct ubi_kv *kv, const void *key, int klen, int vlen, int tomb,
+	 int lnum, int off, uint64_t seq)
+{
+  uint32_t hash = kv_hash(key, klen);
+  struct kv_node **pp, *node;
+  int err;
+
+  pp = kv_find(kv, key, klen, hash);
+  node = *pp;
+  if (node)
+    {
+      if (node->seq > seq)
+	{
+	  /* an older entry met while scanning */
+	  return 0;
+	}
+      kv->lebs[node->lnum].live -= kv_entry_size(klen, node->vlen);
+    }
+  else
+    {
+      if (kv->nr_nodes >= kv->nr_buckets)
+	{
+	  err = kv_grow(kv);
+	  if (err)
+	    return err;
+	  pp = kv_find(kv, key, klen, hash);
+	}
+      node = malloc(sizeof(struct kv_node) + klen);
+      if (node == NULL)
+	return -ENOMEM;
+      node->next = NULL;
+      node->hash = hash;
+      node->klen = klen;
+      memcpy(node->key, key, klen);
+      *pp = node;
+      kv->nr_nodes += 1;
+    }
+  node->tomb = tomb;
+  node->lnum = lnum;
+  node->off = off;
+  node->vlen = vlen;
+  node->seq = seq;
+  kv->lebs[lnum].live += kv_entry_size(klen, vlen);
+  return 0;
+}
+
+static void
+kv_unindex(struct ubi_kv *kv, struct kv_node **pp)
+{
+  struct kv_node *node = *pp;
+
+  kv->lebs[node->lnum].live -= kv_entry_size(node->klen, node->vlen);
+  *pp = node->next;
+  free(node);
+  kv->nr_nodes -= 1;
+}
+
+/*
+ * Walk the frames of LEB @lnum, whose contents are in @buf, and call @fn for
+ * each entry. Returns the offset of the end of the last valid frame.
+ */
+static int
+kv_walk(struct ubi_kv *kv, int lnum, const char *buf,
+	int (*fn) (struct ubi_kv * kv, int lnum, int off, uint64_t seq,
+		   const struct kv_entry_hdr * ent, void *priv), void *priv,
+	int *err)
+{
+  const struct kv_frame_hdr *fh;
+  const struct kv_entry_hdr *ent;
+  int off = 0, pos, end, i;
+
+  *err = 0;
+  while (off + (int) sizeof(*fh) <= kv->leb_size)
+    {
+      fh = (const struct kv_frame_hdr *) (buf + off);
+      if (fh->magic != KV_MAGIC
+	  || fh->len > (uint32_t) (kv->leb_size - off - sizeof(*fh))
+	  || fh->crc != __ubi_crc32(UBI_CRC32_INIT, &fh->seq,
+				    fh->len + sizeof(*fh) - 8))
+	break;
+
+      pos = off + sizeof(*fh);
+      end = pos + fh->len;
+      for (i = 0; i < (int) fh->count; i++)
+	{
+	  ent = (const struct kv_entry_hdr *) (buf + pos);
+	  if (pos + (int) sizeof(*ent) > end
+	      || pos + kv_entry_size(ent->klen, ent->vlen) > end)
+	    break;
+	  *err = fn(kv, lnum, pos, fh->seq, ent, priv);
+	  if (*err)
+	    return off;
+	  pos += kv_entry_size(ent->klen, ent->vlen);
+	}
+      if (kv->lebs[lnum].min_seq == 0 || fh->seq < kv->lebs[lnum].min_seq)
+	kv->lebs[lnum].min_seq = fh->seq;
+      if (fh->seq > kv->seq)
+	kv->seq = fh->seq;
+      off = kv_align(kv, end);
+    }
+  return off;
+}
+
+static int
+kv_scan_entry(struct ubi_kv *kv, int lnum, int off, uint64_t seq,
+	      const struct kv_entry_hdr *ent, void *priv)
+{
+  (void) priv;
+  return kv_index(kv, (const char *) (ent + 1), ent->klen, ent->vlen,
+		  ent->flags & KV_TOMBSTONE, lnum, off, seq);
+}
+
+/* Pick a free LEB as new head */
+static int
+kv_new_head(struct ubi_kv *kv)
+{
+  int lnum;
+
+  for (lnum = 0; lnum < kv->nr_lebs; lnum++)
+    if (kv->lebs[lnum].used == 0 && lnum != kv->head)
+      {
+	kv->head = lnum;
+	kv->nr_free -= 1;
+	return 0;
+      }
+  return -ENOSPC;
+}
+
+/* Write the frame in @kv->wbuf, holding @len bytes of entries, to the head */
+static int
+kv_write_frame(struct ubi_kv *kv, int len, int count)
+{
+  struct kv_frame_hdr *fh = (struct kv_frame_hdr *) kv->wbuf;
+  int total = kv_align(kv, sizeof(*fh) + len), err, off;
+
+  off = kv->lebs[kv->head].used;
+  memset(kv->wbuf + sizeof(*fh) + len, 0, total - sizeof(*fh) - len);
+  fh->magic = KV_MAGIC;
+  fh->seq = kv->seq + 1;
+  fh->len = len;
+  fh->count = count;
+  fh->crc = __ubi_crc32(UBI_CRC32_INIT, &fh->seq, len + sizeof(*fh) - 8);
+
+  err = ubi_leb_write(kv->desc, kv->head, kv->wbuf, off, total, UBI_UNKNOWN);
+  if (err)
+    {
+      /* the end of the LEB may be garbage now */
+      kv->lebs[kv->head].used = kv->leb_size;
+      return err;
+    }
+  kv->seq += 1;
+  if (off == 0)
+    kv->lebs[kv->head].min_seq = kv->seq;
+  kv->lebs[kv->head].used = off + total;
+  kv->lebs[kv->head].unmapped = 0;
+  kv->stats.frames += 1;
+  kv->stats.bytes_written += total;
+  return 0;
+}
+
+/* Index the entries of the frame just written at @off of the head */
+static int
+kv_index_frame(struct ubi_kv *kv, int off, int len)
+{
+  const struct kv_entry_hdr *ent;
+  int pos = sizeof(struct kv_frame_hdr), err;
+
+  while (pos < (int) sizeof(struct kv_frame_hdr) + len)
+    {
+      ent = (const struct kv_entry_hdr *) (kv->wbuf + pos);
+      err = kv_index(kv, (const char *) (ent + 1), ent->klen, ent->vlen,
+		     ent->flags & KV_TOMBSTONE, kv->head, off + pos, kv->seq);
+      if (err)
+	return err;
+      pos += kv_entry_size(ent->klen, ent->vlen);
+    }
+  return 0;
+}
+
+/*
+ * Can the tombstone of @node be forgotten? Only if no LEB which may still
+ * hold an older entry of the key is left, un-mapped LEBs included since they
+ * may come back.
+ */
+static int
+kv_tomb_needed(struct ubi_kv *kv, const struct kv_node *node, int victim)
+{
+  int lnum;
+
+  for (lnum = 0; lnum < kv->nr_lebs; lnum++)
+    {
+      if (lnum == victim)
+	continue;
+      if (kv->lebs[lnum].unmapped)
+	return 1;
+      if (kv->lebs[lnum].used && kv->lebs[lnum].min_seq < node->seq)
+	return 1;
+    }
+  return 0;
+}
+
+struct kv_gc_ctx
+{
+  int victim;
+  int len;
+  int count;
+};
+
+static int
+kv_gc_entry(struct ubi_kv *kv, int lnum, int off, uint64_t seq,
+	    const struct kv_entry_hdr *ent, void *priv)
+{
+  struct kv_gc_ctx *ctx = priv;
+  uint32_t hash = kv_hash(ent + 1, ent->klen);
+  struct kv_node **pp = kv_find(kv, ent + 1, ent->klen, hash);
+  int size = kv_entry_size(ent->klen, ent->vlen);
+
+  (void) seq;
+  if (*pp == NULL || (*pp)->lnum != lnum || (*pp)->off != off)
+    return 0;
+  if ((*pp)->tomb && !kv_tomb_needed(kv, *pp, lnum))
+    {
+      kv_unindex(kv, pp);
+      return 0;
+    }
+  memcpy(kv->wbuf + sizeof(struct kv_frame_hdr) + ctx->len, ent, size);
+  ctx->len += size;
+  ctx->count += 1;
+  return 0;
+}
+
+/* Compact the LEB with the most dead data */
+static int
+kv_compact(struct ubi_kv *kv)
+{
+  struct kv_gc_ctx ctx;
+  char *buf;
+  int lnum, victim = -1, dead, best = 0, err, off;
+
+  for (lnum = 0; lnum < kv->nr_lebs; lnum++)
+    {
+      if (lnum == kv->head || kv->lebs[lnum].used == 0)
+	continue;
+      dead = kv->lebs[lnum].used - kv->lebs[lnum].live;
+      if (dead > best)
+	{
+	  best = dead;
+	  victim = lnum;
+	}
+    }
+  if (victim < 0)
+    return -ENOSPC;
+
+  /*
+   * An un-mapped LEB may get its old contents back after an unclean reboot,
+   * which would resurrect the keys whose tombstones are dropped here. Mapping
+   * it again makes the un-map durable.
+   */
+  for (lnum = 0; lnum < kv->nr_lebs; lnum++)
+    if (kv->lebs[lnum].unmapped && lnum != kv->head)
+      {
+	err = ubi_leb_map(kv->desc, lnum, UBI_UNKNOWN);
+	if (err)
+	  return err;
+	kv->lebs[lnum].unmapped = 0;
+      }
+
+  buf = malloc(kv->leb_size);
+  if (buf == NULL)
+    return -ENOMEM;
+  err = ubi_leb_read(kv->desc, victim, buf, 0, kv->lebs[victim].used, 0);
+  if (err)
+    goto out;
+
+  /*
+   * The live entries of a LEB always fit in one frame, which is written to
+   * a fresh LEB if it does not fit in the head.
+   */
+  ctx.victim = victim;
+  ctx.len = ctx.count = 0;
+  kv_walk(kv, victim, buf, kv_gc_entry, &ctx, &err);
+  if (err)
+    goto out;
+  if (ctx.count)
+    {
+      if (kv->lebs[kv->head].used + kv_align(kv, sizeof(struct kv_frame_hdr)
+					     + ctx.len) > kv->leb_size)
+	{
+	  err = kv_new_head(kv);
+	  if (err)
+	    goto out;
+	}
+      off = kv->lebs[kv->head].used;
+      err = kv_write_frame(kv, ctx.len, ctx.count);
+      if (err)
+	goto out;
+      err = kv_index_frame(kv, off, ctx.len);
+      if (err)
+	goto out;
+    }
+
+  err = ubi_leb_unmap(kv->desc, victim);
+  if (err)
+    goto out;
+  kv->lebs[victim].used = 0;
+  kv->lebs[victim].live = 0;
+  kv->lebs[victim].min_seq = 0;
+  kv->lebs[victim].unmapped = 1;
+  kv->nr_free += 1;
+  kv->stats.compactions += 1;
+  dbgmsg("kv: compacted LEB %d, %d entries moved", victim, ctx.count);
+out:
+  free(buf);
+  return err;
+}
+
+/* Append the @len bytes of entries in @kv->wbuf as one frame */
+static int
+kv_commit(struct ubi_kv *kv, int len, int count)
+{
+  int total = kv_align(kv, sizeof(struct kv_frame_hdr) + len), off, err, i;
+  char *tmp;
+
+  if (total > kv->leb_size)
+    return -E2BIG;
+
+  if (kv->lebs[kv->head].used + total > kv->leb_size)
+    {
+      /*
+       * Compaction writes through @kv->wbuf as well, so the frame is set
+       * aside meanwhile.
+       */
+      tmp = malloc(sizeof(struct kv_frame_hdr) + len);
+      if (tmp == NULL)
+	return -ENOMEM;
+      memcpy(tmp, kv->wbuf, sizeof(struct kv_frame_hdr) + len);
+      err = 0;
+      for (i = 0; !err && kv->nr_free <= KV_RESERVE && i < kv->nr_lebs; i++)
+	err = kv_compact(kv);
+      if (!err && kv->lebs[kv->head].used + total > kv->leb_size)
+	{
+	  /* the reserve is for compaction, updates cannot use it */
+	  if (kv->nr_free <= KV_RESERVE)
+	    err = -ENOSPC;
+	  else
+	    err = kv_new_head(kv);
+	}
+      memcpy(kv->wbuf, tmp, sizeof(struct kv_frame_hdr) + len);
+      free(tmp);
+      if (err)
+	return err;
+    }
+
+  off = kv->lebs[kv->head].used;
+  err = kv_write_frame(kv, len, count);
+  if (err)
+    return err;
+  return kv_index_frame(kv, off, len);
+}
+
+static int
+kv_put_entry(char *p, const void *key, int klen, const void *val, int vlen,
+	     int flags)
+{
+  struct kv_entry_hdr ent;
+  int len = kv_entry_size(klen, vlen);
+
+  ent.klen = klen;
+  ent.flags = flags;
+  ent.vlen = vlen;
+  memcpy(p, &ent, sizeof(ent));
+  memcpy(p + sizeof(ent), key, klen);
+  if (vlen)
+    memcpy(p + sizeof(ent) + klen, val, vlen);
+  memset(p + sizeof(ent) + klen + vlen, 0, len - sizeof(ent) - klen - vlen);
+  return len;
+}
+
+/**
+ * ubi_kv_open - open a key-value store.
+ * @desc: descriptor of the dynamic volume holding the store
+ *
+ * The index is rebuilt by reading all mapped LEBs. An empty volume is an
+ * empty store; @desc must stay open as long as the store is.
+ *
+ * Returns the store in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_kv *
+ubi_kv_open(struct ubi_volume_desc *desc)
+{
+  struct ubi_kv *kv;
+  int lnum, err, ret, torn;
+  uint64_t head_seq = 0;
+
+  if (desc->vi.vol_type != UBI_DYNAMIC_VOLUME || desc->vi.used_ebs < 2)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  kv = calloc(1, sizeof(struct ubi_kv));
+  if (kv == NULL)
+    return NULL;
+  pthread_mutex_init(&kv->lock, NULL);
+  kv->desc = desc;
+  kv->io = desc->di.min_io_size;
+  kv->leb_size = desc->vi.usable_leb_size;
+  kv->nr_lebs = desc->vi.used_ebs;
+  kv->nr_buckets = KV_MIN_BUCKETS;
+  kv->head = -1;
+  kv->lebs = calloc(kv->nr_lebs, sizeof(struct kv_leb));
+  kv->buckets = calloc(kv->nr_buckets, sizeof(struct kv_node *));
+  kv->wbuf = malloc(kv->leb_size);
+  if (!kv->lebs || !kv->buckets || !kv->wbuf)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  for (lnum = 0; lnum < kv->nr_lebs; lnum++)
+    {
+      ret = ubi_is_mapped(desc, lnum);
+      if (ret < 0)
+	{
+	  err = -errno;
+	  goto out;
+	}
+      if (ret == 0)
+	{
+	  kv->nr_free += 1;
+	  continue;
+	}
+
+      err = ubi_leb_read(desc, lnum, kv->wbuf, 0, kv->leb_size, 0);
+      if (err && err != -EBADMSG)
+	goto out;
+      if (err)
+	warnmsg("kv: LEB %d has ECC errors, reading what is readable", lnum);
+      kv->lebs[lnum].used = kv_walk(kv, lnum, kv->wbuf, kv_scan_entry, NULL,
+				    &err);
+      if (err)
+	goto out;
+
+      /* anything after the last frame means a torn write */
+      torn = !__ubi_is_erased(kv->wbuf + kv->lebs[lnum].used,
+			      kv->leb_size - kv->lebs[lnum].used);
+
+      if (kv->lebs[lnum].used == 0)
+	{
+	  /* a torn first frame, the LEB is free once un-mapped */
+	  if (torn)
+	    {
+	      err = ubi_leb_unmap(desc, lnum);
+	      if (err)
+		goto out;
+	    }
+	  kv->nr_free += 1;
+	  continue;
+	}
+      if (torn)
+	kv->lebs[lnum].used = kv->leb_size;
+      if (kv->seq > head_seq)
+	{
+	  head_seq = kv->seq;
+	  kv->head = lnum;
+	}
+    }
+
+  if (kv->head < 0)
+    {
+      err = kv_new_head(kv);
+      if (err)
+	goto out;
+    }
+  dbgmsg("kv: %d keys, head LEB %d", kv->nr_nodes, kv->head);
+  return kv;
+
+out:
+  ubi_kv_close(kv);
+  errno = -err;
+  return NULL;
+}
+
+/**
+ * ubi_kv_close - close a key-value store.
+ * @kv: the store
+ *
+ * All updates are on the flash already, so this only frees memory.
+ */
+void
+ubi_kv_close(struct ubi_kv *kv)
+{
+  struct kv_node *node, *next;
+  int i;
+
+  for (i = 0; kv->buckets && i < kv->nr_buckets; i++)
+    for (node = kv->buckets[i]; node; node = next)
+      {
+	next = node->next;
+	free(node);
+      }
+  free(kv->buckets);
+  free(kv->wbuf);
+  free(kv->lebs);
+  pthread_mutex_destroy(&kv->lock);
+  free(kv);
+}
+
+/**
+ * ubi_kv_get - look a key up.
+ * @kv: the store
+ * @key: the key
+ * @klen: key length
+ * @val: where to store the value
+ * @size: size of @val
+ *
+ * At most @size bytes of the value are stored. Returns the length of the
+ * value in case of success, %-ENOENT if the key does not exist and another
+ * negative error code in case of failure.
+ */
+int
+ubi_kv_get(struct ubi_kv *kv, const void *key, int klen, void *val, int size)
+{
+  struct kv_node *node;
+  int err, lnum, off, vlen;
+
+  if (klen <= 0 || klen > UBI_KV_KEY_MAX || size < 0)
+    return -EINVAL;
+
+  pthread_mutex_lock(&kv->lock);
+  node = *kv_find(kv, key, klen, kv_hash(key, klen));
+  if (node == NULL || node->tomb)
+    {
+      pthread_mutex_unlock(&kv->lock);
+      return -ENOENT;
+    }
+  lnum = node->lnum;
+  off = node->off + sizeof(struct kv_entry_hdr) + klen;
+  vlen = node->vlen;
+  kv->stats.lookups += 1;
+
+  err = 0;
+  if (vlen && size)
+    err = ubi_leb_read(kv->desc, lnum, val, off, MIN(vlen, size), 0);
+  pthread_mutex_unlock(&kv->lock);
+  return err ? err : vlen;
+}
+
+/**
+ * ubi_kv_put - store a value.
+ * @kv: the store
+ * @key: the key
+ * @klen: key length, up to %UBI_KV_KEY_MAX
+ * @val: the value
+ * @vlen: value length
+ *
+ * The update is on the flash when this function returns. Returns %0 in case
+ * of success and a negative error code in case of failure.
+ */
+int
+ubi_kv_put(struct ubi_kv *kv, const void *key, int klen, const void *val,
+	   int vlen)
+{
+  int len, err;
+
+  if (klen <= 0 || klen > UBI_KV_KEY_MAX || vlen < 0)
+    return -EINVAL;
+  len = kv_entry_size(klen, vlen);
+  if (kv_align(kv, sizeof(struct kv_frame_hdr) + len) > kv->leb_size)
+    return -E2BIG;
+
+  pthread_mutex_lock(&kv->lock);
+  kv_put_entry(kv->wbuf + sizeof(struct kv_frame_hdr), key, klen, val, vlen,
+	       0);
+  err = kv_commit(kv, len, 1);
+  pthread_mutex_unlock(&kv->lock);
+  return err;
+}
+
+/**
+ * ubi_kv_delete - delete a key.
+ * @kv: the store
+ * @key: the key
+ * @klen: key length
+ *
+ * Returns %0 in case of success, %-ENOENT if the key does not exist and
+ * another negative error code in case of failure.
+ */
+int
+ubi_kv_delete(struct ubi_kv *kv, const void *key, int klen)
+{
+  struct kv_node *node;
+  int err;
+
+  if (klen <= 0 || klen > UBI_KV_KEY_MAX)
+    return -EINVAL;
+
+  pthread_mutex_lock(&kv->lock);
+  node = *kv_find(kv, key, klen, kv_hash(key, klen));
+  if (node == NULL || node->tomb)
+    err = -ENOENT;
+  else
+    {
+      kv_put_entry(kv->wbuf + sizeof(struct kv_frame_hdr), key, klen, NULL,
+		   0, KV_TOMBSTONE);
+      err = kv_commit(kv, kv_entry_size(klen, 0), 1);
+    }
+  pthread_mutex_unlock(&kv->lock);
+  return err;
+}
+
+/**
+ * ubi_kv_batch_create - create an empty batch of updates.
+ *
+ * Returns the batch in case of success and %NULL in case of failure.
+ */
+struct ubi_kv_batch *
+ubi_kv_batch_create(void)
+{
+  return calloc(1, sizeof(struct ubi_kv_batch));
+}
+
+/**
+ * ubi_kv_batch_free - free a batch.
+ * @batch: the batch
+ */
+void
+ubi_kv_batch_free(struct ubi_kv_batch *batch)
+{
+  free(batch->buf);
+  free(batch);
+}
+
+static int
+kv_batch_add(struct ubi_kv_batch *batch, const void *key, int klen,
+	     const void *val, int vlen, int flags)
+{
+  int len = kv_entry_size(klen, vlen), size;
+  char *buf;
+
+  if (klen <= 0 || klen > UBI_KV_KEY_MAX || vlen < 0)
+    return -EINVAL;
+  if (batch->len + len > batch->size)
+    {
+      size = MAX(batch->size * 2, batch->len + len);
+      buf = realloc(batch->buf, size);
+      if (buf == NULL)
+	return -ENOMEM;
+      batch->buf = buf;
+      batch->size = size;
+    }
+  batch->len += kv_put_entry(batch->buf + batch->len, key, klen, val, vlen,
+			     flags);
+  batch->count += 1;
+  return 0;
+}
+
+/**
+ * ubi_kv_batch_put - add a put to a batch.
+ * @batch: the batch
+ * @key: the key
+ * @klen: key length
+ * @val: the value
+ * @vlen: value length
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_kv_batch_put(struct ubi_kv_batch *batch, const void *key, int klen,
+		 const void *val, int vlen)
+{
+  return kv_batch_add(batch, key, klen, val, vlen, 0);
+}
+
+/**
+ * ubi_kv_batch_delete - add a deletion to a batch.
+ * @batch: the batch
+ * @key: the key
+ * @klen: key length
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_kv_batch_delete(struct ubi_kv_batch *batch, const void *key, int klen)
+{
+  return kv_batch_add(batch, key, klen, NULL, 0, KV_TOMBSTONE);
+}
+
+/**
+ * ubi_kv_batch_commit - apply a batch atomically.
+ * @kv: the store
+ * @batch: the batch, which can be reused or freed afterwards
+ *
+ * Either all updates of the batch survive a power cut or none does. Later
+ * updates of a key in the batch win over earlier ones. The batch must fit in
+ * one LEB. Returns %0 in case of success and a negative error code in case
+ * of failure.
+ */
+int
+ubi_kv_batch_commit(struct ubi_kv *kv, struct ubi_kv_batch *batch)
+{
+  int err;
+
+  if (batch->count == 0)
+    return 0;
+  if (kv_align(kv, sizeof(struct kv_frame_hdr) + batch->len) > kv->leb_size)
+    return -E2BIG;
+
+  pthread_mutex_lock(&kv->lock);
+  memcpy(kv->wbuf + sizeof(struct kv_frame_hdr), batch->buf, batch->len);
+  err = kv_commit(kv, batch->len, batch->count);
+  pthread_mutex_unlock(&kv->lock);
+  if (!err)
+    batch->len = batch->count = 0;
+  return err;
+}
+
+/**
+ * ubi_kv_compact - compact the LEB with the most dead data.
+ * @kv: the store
+ *
+ * Compaction happens on its own when the store runs out of free LEBs; this
+ * function allows doing it at a convenient time. Returns %0 in case of
+ * success and a negative error code in case of failure.
+ */
+int
+ubi_kv_compact(struct ubi_kv *kv)
+{
+  int err;
+
+  pthread_mutex_lock(&kv->lock);
+  err = kv_compact(kv);
+  pthread_mutex_unlock(&kv->lock);
+  return err;
+}
+
+/**
+ * ubi_kv_get_stats - get key-value store statistics.
+ * @kv: the store
+ * @stats: the statistics are stored here
+ */
+void
+ubi_kv_get_stats(struct ubi_kv *kv, struct ubi_kv_stats *stats)
+{
+  int i;
+
+  pthread_mutex_lock(&kv->lock);
+  memcpy(stats, &kv->stats, sizeof(*stats));
+  stats->keys = 0;
+  for (i = 0; i < kv->nr_buckets; i++)
+    {
+      struct kv_node *node;
+
+      for (node = kv->buckets[i]; node; node = node->next)
+	stats->keys += !node->tomb;
+    }
+  stats->free_lebs = kv->nr_free;
+  pthread_mutex_unlock(&kv->lock);
+}
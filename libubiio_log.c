@@ -0,0 +1,917 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - append-only log.
+ *
+ * Records are numbered by log sequence numbers (LSNs) and written to the LEBs
+ * of a dynamic volume used as a ring. Appending a record only queues it in
+ * memory; committing writes every queued record as one chunk. Appenders
+ * committing while a chunk is being written wait for it and the first of them
+ * then writes everything queued in the meantime, so concurrent appenders
+ * share page programs.
+ *
+ * A chunk is a header, the records and a trailer, padded to the minimal I/O
+ * unit size. The header of the first chunk of a LEB tells which LSN the LEB
+ * starts with, which is enough to find the head LEB at open time. The head
+ * is then walked chunk by chunk from its start, each header giving the size
+ * of its chunk, up to the first erased page where a chunk would start: a
+ * page of records may well be all 0xFF, so erased-looking pages in the middle
+ * of a chunk do not tell where the written area ends.
+ *
+ * Truncation un-maps the LEBs holding only records below the truncation
+ * point, which every chunk records as well. On-flash structures use host byte
+ * order.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define LOG_HDR_MAGIC		0x55424c48	/* "UBLH" */
+#define LOG_TRL_MAGIC		0x55424c54	/* "UBLT" */
+
+/**
+ * struct log_chunk_hdr - chunk header.
+ * @magic: %LOG_HDR_MAGIC
+ * @hdr_crc: CRC of the header, starting at @first_lsn
+ * @first_lsn: LSN of the first record of the chunk
+ * @trunc_lsn: truncation point when the chunk was written
+ * @count: number of records
+ * @len: size of the records
+ * @data_crc: CRC of the records
+ * @padding: reserved, zero
+ *
+ * Each record is a 32-bit length followed by the data, padded to 4 bytes.
+ */
+struct log_chunk_hdr
+{
+  uint32_t magic;
+  uint32_t hdr_crc;
+  uint64_t first_lsn;
+  uint64_t trunc_lsn;
+  uint32_t count;
+  uint32_t len;
+  uint32_t data_crc;
+  uint32_t padding;
+};
+
+/**
+ * struct log_chunk_trl - chunk trailer, in the last bytes of the chunk.
+ * @magic: %LOG_TRL_MAGIC
+ * @start: offset of the chunk in the LEB
+ */
+struct log_chunk_trl
+{
+  uint32_t magic;
+  uint32_t start;
+};
+
+/**
+ * struct log_buf - queued records.
+ * @data: the records, laid out as on the flash
+ * @len: size of the records
+ * @count: number of records
+ * @first_lsn: LSN of the first record
+ */
+struct log_buf
+{
+  char *data;
+  int len;
+  int count;
+  uint64_t first_lsn;
+};
+
+/**
+ * struct ubi_log - append-only log.
+ * @desc: volume descriptor
+ * @io: minimal I/O unit size
+ * @leb_size: usable LEB size
+ * @nr_lebs: number of LEBs of the volume
+ * @lock: protects all the fields below but @wbuf and the read cache; @head
+ *        and @head_off are only changed by the thread which set @flushing
+ * @cond: signalled when a chunk has been written
+ * @flushing: set while a thread writes to the flash
+ * @err: sticky error, set when a write failed
+ * @first_lsn: for each LEB, LSN of its first record, %0 if unused
+ * @tail: oldest LEB of the log
+ * @head: LEB chunks are written to
+ * @head_off: where the next chunk goes in @head
+ * @trunc_lsn: records below this LSN are truncated
+ * @next_lsn: LSN of the next record appended
+ * @durable_lsn: LSN of the last committed record
+ * @bufs: queued records and the records being written
+ * @queued: index of the buffer records are queued to
+ * @wbuf: chunk buffer, one LEB large
+ * @rlock: protects the read cache
+ * @rbuf: read cache, holding a chunk
+ * @r_lnum: LEB of the cached chunk, %-1 if none
+ * @r_off: offset of the cached chunk
+ * @r_size: size of the cached chunk
+ * @stats: statistics
+ */
+struct ubi_log
+{
+  struct ubi_volume_desc *desc;
+  int io;
+  int leb_size;
+  int nr_lebs;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int flushing;
+  int err;
+  uint64_t *first_lsn;
+  int tail;
+  int head;
+  int head_off;
+  uint64_t trunc_lsn;
+  uint64_t next_lsn;
+  uint64_t durable_lsn;
+  struct log_buf bufs[2];
+  int queued;
+  char *wbuf;
+  pthread_mutex_t rlock;
+  char *rbuf;
+  int r_lnum;
+  int r_off;
+  int r_size;
+  struct ubi_log_stats stats;
+};
+
+static int
+log_rec_size(int len)
+{
+  return (sizeof(uint32_t) + len + 3) & ~3;
+}
+
+/* Size of a chunk holding @len bytes of records */
+static int
+log_chunk_size(struct ubi_log *log, int len)
+{
+  int size = sizeof(struct log_chunk_hdr) + len + sizeof(struct log_chunk_trl);
+
+  return (size + log->io - 1) / log->io * log->io;
+}
+
+static int
+log_next(struct ubi_log *log, int lnum)
+{
+  return (lnum + 1) % log->nr_lebs;
+}
+
+static int
+log_prev(struct ubi_log *log, int lnum)
+{
+  return (lnum + log->nr_lebs - 1) % log->nr_lebs;
+}
+
+static int
+log_hdr_ok(const struct log_chunk_hdr *hdr)
+{
+  return hdr->magic == LOG_HDR_MAGIC
+    && hdr->hdr_crc == __ubi_crc32(UBI_CRC32_INIT, &hdr->first_lsn,
+				   sizeof(*hdr) - 8);
+}
+
+/*
+ * Check the chunk of @size bytes at the start of @buf, which was read from
+ * offset @off of its LEB.
+ */
+static int
+log_chunk_ok(struct ubi_log *log, const char *buf, int off, int size)
+{
+  const struct log_chunk_hdr *hdr = (const struct log_chunk_hdr *) buf;
+  const struct log_chunk_trl *trl;
+
+  if (!log_hdr_ok(hdr) || hdr->len > (uint32_t) log->leb_size
+      || log_chunk_size(log, hdr->len) != size)
+    return 0;
+  trl = (const struct log_chunk_trl *) (buf + size - sizeof(*trl));
+  return trl->magic == LOG_TRL_MAGIC && trl->start == (uint32_t) off
+    && hdr->data_crc == __ubi_crc32(UBI_CRC32_INIT, hdr + 1, hdr->len);
+}
+
+/*
+ * Find the last valid chunk of LEB @lnum, walking its chunks from the start.
+ * A torn chunk is stepped over, by the size in its header if the header made
+ * it to the flash and by one page otherwise, since the chunk written after
+ * it at recovery starts there. On success, the header of the last valid chunk
+ * is stored in @hdr, the end of the written area in @end and %1 is returned.
+ * Returns %0 if the LEB holds no valid chunk and a negative error code in
+ * case of failure.
+ */
+static int
+log_recover_head(struct ubi_log *log, int lnum, struct log_chunk_hdr *hdr,
+		 int *end)
+{
+  const struct log_chunk_hdr *h = (const struct log_chunk_hdr *) log->wbuf;
+  int off = 0, size, found = 0, err;
+
+  *end = 0;
+  while (off < log->leb_size)
+    {
+      err = ubi_leb_read(log->desc, lnum, log->wbuf, off, log->io, 0);
+      if (err && err != -EBADMSG)
+	return err;
+      if (!err && __ubi_is_erased(log->wbuf, log->io))
+	break;
+      size = log->io;
+      if (!err && log_hdr_ok(h) && h->len <= (uint32_t) log->leb_size
+	  && log_chunk_size(log, h->len) <= log->leb_size - off)
+	{
+	  size = log_chunk_size(log, h->len);
+	  err = ubi_leb_read(log->desc, lnum, log->wbuf, off, size, 0);
+	  if (err && err != -EBADMSG)
+	    return err;
+	  if (!err && log_chunk_ok(log, log->wbuf, off, size))
+	    {
+	      memcpy(hdr, log->wbuf, sizeof(*hdr));
+	      found = 1;
+	    }
+	}
+      off += size;
+    }
+  *end = off;
+  return found;
+}
+
+/* Move the head to the next LEB */
+static int
+log_next_leb(struct ubi_log *log)
+{
+  int next = log_next(log, log->head), err;
+
+  pthread_mutex_lock(&log->lock);
+  err = next == log->tail;
+  pthread_mutex_unlock(&log->lock);
+  if (err)
+    return -ENOSPC;
+
+  /* leftovers of a truncated or torn LEB */
+  err = ubi_is_mapped(log->desc, next);
+  if (err < 0)
+    return -errno;
+  if (err)
+    {
+      err = ubi_leb_unmap(log->desc, next);
+      if (err)
+	return err;
+    }
+  pthread_mutex_lock(&log->lock);
+  log->head = next;
+  log->head_off = 0;
+  pthread_mutex_unlock(&log->lock);
+  return 0;
+}
+
+/*
+ * Count how many records of @buf, starting at offset @pos, fit in @room
+ * bytes. Returns their size and stores their number in @count.
+ */
+static int
+log_pack(const struct log_buf *buf, int pos, int room, int *count)
+{
+  int len = 0, sz;
+
+  *count = 0;
+  while (pos + len < buf->len)
+    {
+      sz = log_rec_size(*(const uint32_t *) (buf->data + pos + len));
+      if (len + sz > room)
+	break;
+      len += sz;
+      *count += 1;
+    }
+  return len;
+}
+
+/*
+ * Write the records of @buf. Called by the thread which set @log->flushing,
+ * without @log->lock held. Returns the number of records written, which is
+ * less than @buf->count in case of failure, in which case the error is
+ * stored in @err.
+ */
+static int
+log_flush(struct ubi_log *log, struct log_buf *buf, int *err)
+{
+  struct log_chunk_hdr *hdr = (struct log_chunk_hdr *) log->wbuf;
+  struct log_chunk_trl *trl;
+  int pos = 0, done = 0, len, count, room, size;
+  uint64_t trunc_lsn;
+
+  pthread_mutex_lock(&log->lock);
+  trunc_lsn = log->trunc_lsn;
+  pthread_mutex_unlock(&log->lock);
+
+  *err = 0;
+  while (pos < buf->len)
+    {
+      /* take as many records as fit in the head */
+      room = log->leb_size - log->head_off - sizeof(struct log_chunk_hdr)
+	- sizeof(struct log_chunk_trl);
+      len = log_pack(buf, pos, room, &count);
+      if (count == 0)
+	{
+	  *err = log_next_leb(log);
+	  if (*err)
+	    break;
+	  continue;
+	}
+
+      size = log_chunk_size(log, len);
+      hdr->magic = LOG_HDR_MAGIC;
+      hdr->first_lsn = buf->first_lsn + done;
+      hdr->trunc_lsn = trunc_lsn;
+      hdr->count = count;
+      hdr->len = len;
+      hdr->padding = 0;
+      memcpy(hdr + 1, buf->data + pos, len);
+      memset((char *) (hdr + 1) + len, 0, size - sizeof(*hdr) - len);
+      trl = (struct log_chunk_trl *) (log->wbuf + size - sizeof(*trl));
+      trl->magic = LOG_TRL_MAGIC;
+      trl->start = log->head_off;
+      hdr->data_crc = __ubi_crc32(UBI_CRC32_INIT, hdr + 1, len);
+      hdr->hdr_crc = __ubi_crc32(UBI_CRC32_INIT, &hdr->first_lsn,
+				 sizeof(*hdr) - 8);
+
+      *err = ubi_leb_write(log->desc, log->head, log->wbuf, log->head_off,
+			   size, UBI_UNKNOWN);
+      if (*err)
+	break;
+
+      pthread_mutex_lock(&log->lock);
+      if (log->head_off == 0)
+	log->first_lsn[log->head] = hdr->first_lsn;
+      log->stats.commits += 1;
+      log->stats.bytes_written += size;
+      log->head_off += size;
+      pthread_mutex_unlock(&log->lock);
+      pos += len;
+      done += count;
+    }
+  return done;
+}
+
+/*
+ * Check that the records of @buf fit in the free space of the log, packing
+ * them as 'log_flush()' does. Called with @log->lock held.
+ */
+static int
+log_fits(struct ubi_log *log, const struct log_buf *buf)
+{
+  int pos = 0, off = log->head_off, lnum = log->head, room, sz, count;
+
+  while (pos < buf->len)
+    {
+      room = log->leb_size - off - sizeof(struct log_chunk_hdr)
+	- sizeof(struct log_chunk_trl);
+      sz = log_pack(buf, pos, room, &count);
+      if (count == 0)
+	{
+	  lnum = log_next(log, lnum);
+	  if (lnum == log->tail)
+	    return 0;
+	  off = 0;
+	  continue;
+	}
+      off += log_chunk_size(log, sz);
+      pos += sz;
+    }
+  return 1;
+}
+
+/* Commit all records up to @lsn, called with @log->lock held */
+static int
+log_commit(struct ubi_log *log, uint64_t lsn)
+{
+  struct log_buf *buf;
+  int done, err;
+
+  while (log->durable_lsn < lsn)
+    {
+      if (log->err)
+	return log->err;
+      if (log->flushing)
+	{
+	  pthread_cond_wait(&log->cond, &log->lock);
+	  continue;
+	}
+
+      /*
+       * Write everything queued so far, appenders use the other buffer. If
+       * the log is full, the records stay queued until it is truncated.
+       */
+      buf = &log->bufs[log->queued];
+      if (!log_fits(log, buf))
+	return -ENOSPC;
+      log->queued ^= 1;
+      log->bufs[log->queued].len = log->bufs[log->queued].count = 0;
+      log->bufs[log->queued].first_lsn = log->next_lsn;
+      log->flushing = 1;
+      pthread_mutex_unlock(&log->lock);
+
+      done = log_flush(log, buf, &err);
+
+      pthread_mutex_lock(&log->lock);
+      log->durable_lsn += done;
+      if (err)
+	{
+	  errmsg("log: cannot write LEB %d, error %d", log->head, err);
+	  log->err = err;
+	}
+      log->flushing = 0;
+      pthread_cond_broadcast(&log->cond);
+    }
+  return 0;
+}
+
+/* Truncate before @lsn, called with @log->lock held */
+static int
+log_truncate(struct ubi_log *log, uint64_t lsn)
+{
+  int next, err = 0;
+
+  while (log->flushing)
+    pthread_cond_wait(&log->cond, &log->lock);
+  log->flushing = 1;
+
+  if (lsn > log->durable_lsn + 1)
+    lsn = log->durable_lsn + 1;
+  if (lsn > log->trunc_lsn)
+    log->trunc_lsn = lsn;
+
+  while (log->tail != log->head)
+    {
+      next = log_next(log, log->tail);
+      if (log->first_lsn[next] == 0 || log->first_lsn[next] > log->trunc_lsn)
+	break;
+      pthread_mutex_unlock(&log->lock);
+      err = ubi_leb_unmap(log->desc, log->tail);
+      pthread_mutex_lock(&log->lock);
+      if (err)
+	break;
+      log->first_lsn[log->tail] = 0;
+      log->tail = next;
+    }
+
+  log->flushing = 0;
+  pthread_cond_broadcast(&log->cond);
+  return err;
+}
+
+/*
+ * Find the head, the newest LEB holding a valid chunk, and the LEBs of the
+ * log before it.
+ */
+static int
+log_recover(struct ubi_log *log)
+{
+  struct log_chunk_hdr hdr;
+  int lnum, head, end, ret, prev;
+
+  for (;;)
+    {
+      head = -1;
+      for (lnum = 0; lnum < log->nr_lebs; lnum++)
+	if (log->first_lsn[lnum]
+	    && (head < 0 || log->first_lsn[lnum] > log->first_lsn[head]))
+	  head = lnum;
+      if (head < 0)
+	break;
+
+      ret = log_recover_head(log, head, &hdr, &end);
+      if (ret < 0)
+	return ret;
+      if (ret)
+	{
+	  log->head = head;
+	  log->head_off = end;
+	  log->next_lsn = hdr.first_lsn + hdr.count;
+	  log->trunc_lsn = hdr.trunc_lsn;
+	  break;
+	}
+      /* only a torn chunk, whose records were never committed */
+      warnmsg("log: LEB %d holds no valid chunk, ignoring it", head);
+      log->first_lsn[head] = 0;
+    }
+
+  if (head < 0)
+    {
+      /* an empty log, get rid of any leftovers */
+      for (lnum = 0; lnum < log->nr_lebs; lnum++)
+	{
+	  ret = ubi_is_mapped(log->desc, lnum);
+	  if (ret < 0)
+	    return -errno;
+	  if (ret)
+	    {
+	      ret = ubi_leb_unmap(log->desc, lnum);
+	      if (ret)
+		return ret;
+	    }
+	}
+      log->head = log->tail = 0;
+      log->next_lsn = 1;
+      return 0;
+    }
+
+  /* the log is the run of LEBs with decreasing LSNs before the head */
+  log->tail = head;
+  for (;;)
+    {
+      prev = log_prev(log, log->tail);
+      if (prev == head || log->first_lsn[prev] == 0
+	  || log->first_lsn[prev] >= log->first_lsn[log->tail])
+	break;
+      log->tail = prev;
+    }
+  for (lnum = log_next(log, head); lnum != log->tail;
+       lnum = log_next(log, lnum))
+    log->first_lsn[lnum] = 0;
+
+  /* un-mapping is not durable, truncated LEBs may be back */
+  while (log->tail != head
+	 && log->first_lsn[log_next(log, log->tail)] <= log->trunc_lsn)
+    {
+      ret = ubi_leb_unmap(log->desc, log->tail);
+      if (ret)
+	return ret;
+      log->first_lsn[log->tail] = 0;
+      log->tail = log_next(log, log->tail);
+    }
+  return 0;
+}
+
+/**
+ * ubi_log_open - open an append-only log.
+ * @desc: descriptor of the dynamic volume holding the log
+ *
+ * An empty volume is an empty log, whose first record gets LSN %1. @desc must
+ * stay open as long as the log is.
+ *
+ * Returns the log in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_log *
+ubi_log_open(struct ubi_volume_desc *desc)
+{
+  struct log_chunk_hdr *hdr;
+  struct ubi_log *log;
+  int lnum, ret, err;
+
+  if (desc->vi.vol_type != UBI_DYNAMIC_VOLUME || desc->vi.used_ebs < 2)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  log = calloc(1, sizeof(struct ubi_log));
+  if (log == NULL)
+    return NULL;
+  log->desc = desc;
+  log->io = desc->di.min_io_size;
+  log->leb_size = desc->vi.usable_leb_size;
+  log->nr_lebs = desc->vi.used_ebs;
+  log->r_lnum = -1;
+  log->first_lsn = calloc(log->nr_lebs, sizeof(uint64_t));
+  log->wbuf = malloc(log->leb_size);
+  log->rbuf = malloc(log->leb_size);
+  log->bufs[0].data = malloc(log->leb_size);
+  log->bufs[1].data = malloc(log->leb_size);
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_mutex_init(&log->rlock, NULL);
+  pthread_cond_init(&log->cond, NULL);
+  if (!log->first_lsn || !log->wbuf || !log->rbuf || !log->bufs[0].data
+      || !log->bufs[1].data)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  /* the first chunk of each LEB tells where it is in the log */
+  hdr = (struct log_chunk_hdr *) log->wbuf;
+  for (lnum = 0; lnum < log->nr_lebs; lnum++)
+    {
+      ret = ubi_is_mapped(desc, lnum);
+      if (ret < 0)
+	{
+	  err = -errno;
+	  goto out;
+	}
+      if (ret == 0)
+	continue;
+      err = ubi_leb_read(desc, lnum, log->wbuf, 0, log->io, 0);
+      if (err && err != -EBADMSG)
+	goto out;
+      if (!err && log_hdr_ok(hdr))
+	log->first_lsn[lnum] = hdr->first_lsn;
+    }
+
+  err = log_recover(log);
+  if (err)
+    goto out;
+  log->durable_lsn = log->next_lsn - 1;
+  log->bufs[0].first_lsn = log->next_lsn;
+  dbgmsg("log: LSNs %llu-%llu, head LEB %d:%d",
+	 (unsigned long long) log->first_lsn[log->tail],
+	 (unsigned long long) log->durable_lsn, log->head, log->head_off);
+  return log;
+
+out:
+  ubi_log_close(log);
+  errno = -err;
+  return NULL;
+}
+
+/**
+ * ubi_log_close - close a log.
+ * @log: the log
+ *
+ * Records appended but not committed yet are committed first. Returns %0 in
+ * case of success and a negative error code if they could not be written;
+ * the log is closed anyway.
+ */
+int
+ubi_log_close(struct ubi_log *log)
+{
+  int err = 0;
+
+  if (log->next_lsn)
+    {
+      pthread_mutex_lock(&log->lock);
+      err = log_commit(log, log->next_lsn - 1);
+      pthread_mutex_unlock(&log->lock);
+    }
+  pthread_cond_destroy(&log->cond);
+  pthread_mutex_destroy(&log->rlock);
+  pthread_mutex_destroy(&log->lock);
+  free(log->bufs[1].data);
+  free(log->bufs[0].data);
+  free(log->rbuf);
+  free(log->wbuf);
+  free(log->first_lsn);
+  free(log);
+  return err;
+}
+
+/**
+ * ubi_log_append - append a record to a log.
+ * @log: the log
+ * @rec: the record
+ * @len: record length
+ * @lsn: the LSN of the record is stored here
+ *
+ * The record is only queued; it is on the flash once 'ubi_log_commit()' has
+ * been called for its LSN, by this thread or another one. Returns %0 in case
+ * of success and a negative error code in case of failure.
+ */
+int
+ubi_log_append(struct ubi_log *log, const void *rec, int len, uint64_t *lsn)
+{
+  struct log_buf *buf;
+  int size = log_rec_size(len), err;
+  uint32_t hdr = len;
+
+  if (len < 0 || sizeof(struct log_chunk_hdr) + size
+      + sizeof(struct log_chunk_trl) > (unsigned int) log->leb_size)
+    return -EINVAL;
+
+  pthread_mutex_lock(&log->lock);
+  for (;;)
+    {
+      if (log->err)
+	{
+	  err = log->err;
+	  goto out;
+	}
+      buf = &log->bufs[log->queued];
+      if (buf->len + size <= log->leb_size)
+	break;
+      /* the queue is full, make room */
+      err = log_commit(log, log->next_lsn - 1);
+      if (err)
+	goto out;
+    }
+
+  memcpy(buf->data + buf->len, &hdr, sizeof(hdr));
+  memcpy(buf->data + buf->len + sizeof(hdr), rec, len);
+  memset(buf->data + buf->len + sizeof(hdr) + len, 0,
+	 size - sizeof(hdr) - len);
+  buf->len += size;
+  buf->count += 1;
+  *lsn = log->next_lsn++;
+  log->stats.records += 1;
+  err = 0;
+out:
+  pthread_mutex_unlock(&log->lock);
+  return err;
+}
+
+/**
+ * ubi_log_commit - make records durable.
+ * @log: the log
+ * @lsn: LSN of the last record to commit, or %0 for all appended records
+ *
+ * If another thread is already writing, this function waits for it and, if
+ * needed, then writes all the records queued meanwhile at once. Returns %0 in
+ * case of success and a negative error code in case of failure. Once a write
+ * has failed, the log stays in error.
+ */
+int
+ubi_log_commit(struct ubi_log *log, uint64_t lsn)
+{
+  int err;
+
+  pthread_mutex_lock(&log->lock);
+  if (lsn == 0)
+    lsn = log->next_lsn - 1;
+  if (lsn >= log->next_lsn)
+    err = -EINVAL;
+  else
+    err = log_commit(log, lsn);
+  pthread_mutex_unlock(&log->lock);
+  return err;
+}
+
+/*
+ * Look for record @lsn in the chunk in @log->rbuf. Returns the length of the
+ * record or %-ENOENT.
+ */
+static int
+log_rec_from_cache(struct ubi_log *log, uint64_t lsn, void *buf, int size)
+{
+  const struct log_chunk_hdr *hdr = (const struct log_chunk_hdr *) log->rbuf;
+  const char *p = (const char *) (hdr + 1);
+  uint64_t i;
+  uint32_t len;
+
+  if (log->r_lnum < 0 || lsn < hdr->first_lsn
+      || lsn >= hdr->first_lsn + hdr->count)
+    return -ENOENT;
+  for (i = hdr->first_lsn; i < lsn; i++)
+    p += log_rec_size(*(const uint32_t *) p);
+  len = *(const uint32_t *) p;
+  memcpy(buf, p + sizeof(uint32_t), MIN((int) len, size));
+  return len;
+}
+
+/**
+ * ubi_log_read - read a record.
+ * @log: the log
+ * @lsn: LSN of the record
+ * @buf: where to store the record
+ * @size: size of @buf
+ *
+ * At most @size bytes of the record are stored. Reading records in order is
+ * cheap, the chunk last read being cached. Returns the length of the record
+ * in case of success, %-ENOENT if the record has been truncated or does not
+ * exist, %-EAGAIN if it is not committed yet and another negative error code
+ * in case of failure.
+ */
+int
+ubi_log_read(struct ubi_log *log, uint64_t lsn, void *buf, int size)
+{
+  const struct log_chunk_hdr *hdr = (const struct log_chunk_hdr *) log->rbuf;
+  int lnum, l, end, off, sz, ret, err = 0;
+  uint64_t leb_lsn;
+
+  pthread_mutex_lock(&log->lock);
+  if (lsn == 0 || lsn < log->trunc_lsn || lsn < log->first_lsn[log->tail]
+      || lsn >= log->next_lsn)
+    ret = -ENOENT;
+  else if (lsn > log->durable_lsn)
+    ret = -EAGAIN;
+  else
+    ret = 0;
+  /* the LEB holding the record is the last one starting before it */
+  lnum = log->tail;
+  for (l = log->tail; l != log->head; l = log_next(log, l))
+    {
+      /* a new head has no records until its first chunk is written */
+      if (log->first_lsn[log_next(log, l)] == 0
+	  || log->first_lsn[log_next(log, l)] > lsn)
+	break;
+      lnum = log_next(log, l);
+    }
+  end = lnum == log->head ? log->head_off : log->leb_size;
+  leb_lsn = log->first_lsn[lnum];
+  pthread_mutex_unlock(&log->lock);
+  if (ret)
+    return ret;
+
+  pthread_mutex_lock(&log->rlock);
+  ret = log_rec_from_cache(log, lsn, buf, size);
+  if (ret >= 0)
+    goto out;
+
+  /*
+   * Go on from the cached chunk if the record follows it, unless the LEB has
+   * been reused since.
+   */
+  off = 0;
+  if (log->r_lnum == lnum && hdr->first_lsn >= leb_lsn
+      && lsn >= hdr->first_lsn + hdr->count)
+    off = log->r_off + log->r_size;
+
+  ret = -ENOENT;
+  while (off < end && ret == -ENOENT)
+    {
+      log->r_lnum = -1;
+      sz = MIN(log->io, end - off);
+      err = ubi_leb_read(log->desc, lnum, log->rbuf, off, sz, 0);
+      if (err && err != -EBADMSG)
+	goto out;
+      if (err || !log_hdr_ok(hdr) || hdr->len > (uint32_t) log->leb_size
+	  || off + log_chunk_size(log, hdr->len) > end)
+	{
+	  off += log->io;
+	  continue;
+	}
+
+      sz = log_chunk_size(log, hdr->len);
+      err = ubi_leb_read(log->desc, lnum, log->rbuf, off, sz, 0);
+      if (err && err != -EBADMSG)
+	goto out;
+      if (err || !log_chunk_ok(log, log->rbuf, off, sz))
+	{
+	  /* a torn chunk, a valid one follows it somewhere */
+	  off += log->io;
+	  continue;
+	}
+
+      log->r_lnum = lnum;
+      log->r_off = off;
+      log->r_size = sz;
+      ret = log_rec_from_cache(log, lsn, buf, size);
+      off += sz;
+    }
+
+  if (ret == -ENOENT)
+    {
+      /* the LEB may have been truncated meanwhile */
+      pthread_mutex_lock(&log->lock);
+      if (log->first_lsn[lnum] == leb_lsn)
+	{
+	  errmsg("log: record %llu not found in LEB %d",
+		 (unsigned long long) lsn, lnum);
+	  ret = -EIO;
+	}
+      pthread_mutex_unlock(&log->lock);
+    }
+out:
+  pthread_mutex_unlock(&log->rlock);
+  return err ? err : ret;
+}
+
+/**
+ * ubi_log_truncate - drop the records below a given LSN.
+ * @log: the log
+ * @lsn: LSN of the first record to keep
+ *
+ * The LEBs holding only truncated records are un-mapped. After an unclean
+ * reboot, truncated records may come back until a commit has followed the
+ * truncation. Returns %0 in case of success and a negative error code in
+ * case of failure.
+ */
+int
+ubi_log_truncate(struct ubi_log *log, uint64_t lsn)
+{
+  int err;
+
+  pthread_mutex_lock(&log->lock);
+  err = log_truncate(log, lsn);
+  pthread_mutex_unlock(&log->lock);
+  return err;
+}
+
+/**
+ * ubi_log_get_stats - get log statistics.
+ * @log: the log
+ * @stats: the statistics are stored here
+ */
+void
+ubi_log_get_stats(struct ubi_log *log, struct ubi_log_stats *stats)
+{
+  pthread_mutex_lock(&log->lock);
+  memcpy(stats, &log->stats, sizeof(*stats));
+  stats->first_lsn = MAX(log->trunc_lsn, log->first_lsn[log->tail]);
+  if (stats->first_lsn == 0)
+    stats->first_lsn = 1;
+  stats->durable_lsn = log->durable_lsn;
+  pthread_mutex_unlock(&log->lock);
+}
@@ -0,0 +1,233 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - LZ compression.
+ *
+ * A small LZ77 codec in the spirit of LZ4, for blocks of up to 64 KiB. The
+ * compressed data is a list of sequences, each made of a token byte, whose
+ * high nibble is the number of literals and low nibble the match length
+ * minus 4, the literal length continued by 255 bytes if the nibble is 15,
+ * the literals, a little-endian 16-bit match offset and the match length
+ * continued the same way. The last sequence has literals only.
+ *
+ * The compressor looks matches up in a hash table of 4-byte sequences and
+ * skips faster through data which does not compress. The decompressor checks
+ * every length and offset against its buffers, so corrupted data fails to
+ * decompress instead of overrunning them; away from the end of the buffers,
+ * it copies 16 bytes at a time, which compilers turn into vector moves.
+ */
+
+#include <stdint.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define LZ_HASH_BITS	12
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+#define LZ_COPY		16
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline unsigned int
+lz_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write a length continued by 255 bytes, @len being what the nibble left */
+static uint8_t *
+lz_put_len(uint8_t *op, int len)
+{
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/*
+ * Emit a sequence of @nlit literals and a match of @mlen bytes at @off, or
+ * no match if @mlen is %0. Returns where the output goes on, or %NULL if it
+ * does not fit before @oend.
+ */
+static uint8_t *
+lz_emit(uint8_t *op, uint8_t *oend, const uint8_t *lit, int nlit, int off,
+	int mlen)
+{
+  int need = 1 + nlit + nlit / 255 + 1;
+
+  if (mlen)
+    need += 2 + mlen / 255 + 1;
+  if (need > oend - op)
+    return NULL;
+
+  *op++ = (MIN(nlit, 15) << 4) | (mlen ? MIN(mlen - LZ_MIN_MATCH, 15) : 0);
+  if (nlit >= 15)
+    op = lz_put_len(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen)
+    {
+      *op++ = off & 0xFF;
+      *op++ = off >> 8;
+      if (mlen - LZ_MIN_MATCH >= 15)
+	op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+    }
+  return op;
+}
+
+/**
+ * __ubi_lz_compress - compress a block.
+ * @src: the data
+ * @len: its length, at most %UBI_LZ_MAX_BLOCK
+ * @dst: where to store the compressed data
+ * @cap: size of @dst
+ *
+ * Returns the compressed length, or %0 if it would not fit in @cap bytes.
+ */
+int
+__ubi_lz_compress(const void *src, int len, void *dst, int cap)
+{
+  uint16_t table[1 << LZ_HASH_BITS];
+  const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+  const uint8_t *limit = len > LZ_MIN_MATCH ? end - LZ_MIN_MATCH : in;
+  const uint8_t *ref;
+  uint8_t *op = dst, *oend = op + cap;
+  unsigned int h;
+  int mlen;
+
+  memset(table, 0, sizeof(table));
+  while (ip < limit)
+    {
+      h = lz_hash(lz_read32(ip));
+      ref = in + table[h];
+      table[h] = ip - in;
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET
+	  || lz_read32(ref) != lz_read32(ip))
+	{
+	  /* the longer nothing matches, the faster we go */
+	  ip += 1 + ((ip - anchor) >> 6);
+	  continue;
+	}
+
+      mlen = LZ_MIN_MATCH;
+      while (ip + mlen < end && ref[mlen] == ip[mlen])
+	mlen++;
+      while (ip > anchor && ref > in && ip[-1] == ref[-1])
+	{
+	  ip--;
+	  ref--;
+	  mlen++;
+	}
+      op = lz_emit(op, oend, anchor, ip - anchor, ip - ref, mlen);
+      if (op == NULL)
+	return 0;
+      ip += mlen;
+      anchor = ip;
+    }
+
+  op = lz_emit(op, oend, anchor, end - anchor, 0, 0);
+  if (op == NULL)
+    return 0;
+  return op - (uint8_t *) dst;
+}
+
+/* Read a length continued by 255 bytes. Returns %-1 if @ip runs out. */
+static int
+lz_get_len(const uint8_t **ip, const uint8_t *iend, int len)
+{
+  int b;
+
+  do
+    {
+      if (*ip >= iend)
+	return -1;
+      b = *(*ip)++;
+      len += b;
+    }
+  while (b == 255);
+  return len;
+}
+
+/**
+ * __ubi_lz_decompress - decompress a block.
+ * @src: the compressed data
+ * @clen: its length
+ * @dst: where to store the data
+ * @len: length of the data
+ *
+ * Returns %0 in case of success and %-EBADMSG if @src is corrupted or does
+ * not decompress to exactly @len bytes.
+ */
+int
+__ubi_lz_decompress(const void *src, int clen, void *dst, int len)
+{
+  const uint8_t *ip = src, *iend = ip + clen, *ref;
+  uint8_t *op = dst, *ostart = op, *oend = op + len;
+  int token, nlit, mlen, off, i;
+
+  for (;;)
+    {
+      /* the last sequence, with literals only, must be there */
+      if (ip == iend)
+	return -EBADMSG;
+      token = *ip++;
+      nlit = token >> 4;
+      if (nlit == 15 && (nlit = lz_get_len(&ip, iend, nlit)) < 0)
+	return -EBADMSG;
+      if (nlit > iend - ip || nlit > oend - op)
+	return -EBADMSG;
+      if (nlit + LZ_COPY <= iend - ip && nlit + LZ_COPY <= oend - op)
+	for (i = 0; i < nlit; i += LZ_COPY)
+	  memcpy(op + i, ip + i, LZ_COPY);
+      else
+	memcpy(op, ip, nlit);
+      op += nlit;
+      ip += nlit;
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	return -EBADMSG;
+      off = ip[0] | ip[1] << 8;
+      ip += 2;
+      mlen = token & 15;
+      if (mlen == 15 && (mlen = lz_get_len(&ip, iend, mlen)) < 0)
+	return -EBADMSG;
+      mlen += LZ_MIN_MATCH;
+      if (off == 0 || off > op - ostart || mlen > oend - op)
+	return -EBADMSG;
+
+      /* chunks do not overlap what they copy from if @off is large enough */
+      ref = op - off;
+      if (off >= LZ_COPY && mlen + LZ_COPY <= oend - op)
+	for (i = 0; i < mlen; i += LZ_COPY)
+	  memcpy(op + i, ref + i, LZ_COPY);
+      else
+	for (i = 0; i < mlen; i++)
+	  op[i] = ref[i];
+      op += mlen;
+    }
+  return op == oend ? 0 : -EBADMSG;
+}
@@ -0,0 +1,434 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - pre-validated I/O plans.
+ *
+ * Code which repeats the same LEB operations with different data, like a
+ * checkpoint written every cycle, pays for the checks of 'ubi_leb_write()' and
+ * friends on every call. A plan records such a sequence once: every step is
+ * checked when it is added, as the corresponding 'ubi_leb_*()' function would
+ * check it, and the plan is then executed any number of times with new data
+ * and no checks at all.
+ *
+ * Adding steps also groups them into runs: writes which follow each other in
+ * a LEB are executed as one 'pwritev()', the other steps one by one.
+ */
+
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/* Most writes gathered by one system call */
+#define PLAN_MAX_IOV	64
+
+/**
+ * struct plan_step - an operation of a plan.
+ * @opcode: %UBI_OP_WRITE, %UBI_OP_CHANGE, %UBI_OP_ERASE, %UBI_OP_UNMAP or
+ *          %UBI_OP_MAP
+ * @lnum: logical eraseblock number
+ * @offset: offset in the LEB
+ * @len: data length
+ * @dtype: expected data type
+ */
+struct plan_step
+{
+  int opcode;
+  int lnum;
+  int offset;
+  int len;
+  int dtype;
+};
+
+/**
+ * struct plan_run - steps executed by one system call.
+ * @first: index of the first step
+ * @count: number of steps, more than one for gathered writes only
+ */
+struct plan_run
+{
+  int first;
+  int count;
+};
+
+/**
+ * struct ubi_plan - a pre-validated sequence of LEB operations.
+ * @desc: the volume the plan is for
+ * @nr_steps: number of steps
+ * @nr_runs: number of runs
+ * @size: number of entries allocated in @steps and @runs
+ * @steps: the steps, in execution order
+ * @runs: the steps grouped by system call
+ */
+struct ubi_plan
+{
+  struct ubi_volume_desc *desc;
+  int nr_steps;
+  int nr_runs;
+  int size;
+  struct plan_step *steps;
+  struct plan_run *runs;
+};
+
+/**
+ * ubi_plan_create - create an empty plan.
+ * @desc: volume descriptor
+ *
+ * The volume has to be a dynamic volume opened for writing and must not be
+ * marked as updating; the plan checks its steps against the geometry of
+ * @desc, so it has to be freed before @desc is closed.
+ *
+ * Returns the plan in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_plan *
+ubi_plan_create(struct ubi_volume_desc *desc)
+{
+  struct ubi_plan *plan;
+
+  if (desc->mode == UBI_READONLY || desc->vi.vol_type == UBI_STATIC_VOLUME)
+    {
+      errmsg("UBI volume is readonly or static");
+      errno = EROFS;
+      return NULL;
+    }
+  if (desc->vi.upd_marker)
+    {
+      errmsg("The volume is marked as updating");
+      errno = EBADF;
+      return NULL;
+    }
+
+  plan = calloc(1, sizeof(struct ubi_plan));
+  if (plan == NULL)
+    return NULL;
+  plan->desc = desc;
+  return plan;
+}
+
+/**
+ * ubi_plan_free - free a plan.
+ * @plan: the plan to free
+ */
+void
+ubi_plan_free(struct ubi_plan *plan)
+{
+  if (plan == NULL)
+    return;
+  free(plan->runs);
+  free(plan->steps);
+  free(plan);
+}
+
+/*
+ * Offset at which the plan leaves LEB @lnum once its steps so far have run,
+ * or %0 if the plan does not write to it or starts it over.
+ */
+static int
+plan_leb_end(const struct ubi_plan *plan, int lnum)
+{
+  const struct plan_step *st;
+  int i;
+
+  for (i = plan->nr_steps - 1; i >= 0; i--)
+    {
+      st = &plan->steps[i];
+      if (st->lnum != lnum)
+	continue;
+      if (st->opcode == UBI_OP_WRITE)
+	return st->offset + st->len;
+      if (st->opcode == UBI_OP_CHANGE)
+	return st->len;
+      return 0;
+    }
+  return 0;
+}
+
+/*
+ * Append a step and return its index. A write following a write which ends
+ * where it starts joins the run of that write.
+ */
+static int
+plan_add(struct ubi_plan *plan, int opcode, int lnum, int offset, int len,
+	 int dtype)
+{
+  struct plan_step *st, *prev;
+  struct plan_run *run;
+  int size;
+
+  if (plan->nr_steps == plan->size)
+    {
+      size = plan->size ? 2 * plan->size : 16;
+      st = realloc(plan->steps, size * sizeof(struct plan_step));
+      if (st == NULL)
+	return -ENOMEM;
+      plan->steps = st;
+      run = realloc(plan->runs, size * sizeof(struct plan_run));
+      if (run == NULL)
+	return -ENOMEM;
+      plan->runs = run;
+      plan->size = size;
+    }
+
+  st = &plan->steps[plan->nr_steps];
+  st->opcode = opcode;
+  st->lnum = lnum;
+  st->offset = offset;
+  st->len = len;
+  st->dtype = dtype;
+
+  run = plan->nr_runs ? &plan->runs[plan->nr_runs - 1] : NULL;
+  prev = plan->nr_steps ? st - 1 : NULL;
+  if (opcode == UBI_OP_WRITE && prev && prev->opcode == UBI_OP_WRITE
+      && prev->lnum == lnum && prev->offset + prev->len == offset
+      && run->count < PLAN_MAX_IOV)
+    run->count += 1;
+  else
+    {
+      run = &plan->runs[plan->nr_runs++];
+      run->first = plan->nr_steps;
+      run->count = 1;
+    }
+  return plan->nr_steps++;
+}
+
+static int
+plan_check(struct ubi_plan *plan, int lnum, int dtype)
+{
+  if (lnum < 0 || lnum >= plan->desc->vi.used_ebs)
+    {
+      errmsg("Invalid arguments");
+      return -EINVAL;
+    }
+  if (dtype != UBI_LONGTERM && dtype != UBI_SHORTTERM && dtype != UBI_UNKNOWN)
+    {
+      errmsg("Invalid data type");
+      return -EINVAL;
+    }
+  return 0;
+}
+
+/**
+ * ubi_plan_write - add a write to a plan.
+ * @plan: the plan
+ * @lnum: logical eraseblock to write to
+ * @offset: offset within the logical eraseblock
+ * @len: how many bytes to write, not %0
+ * @dtype: expected data type
+ *
+ * The arguments are checked as 'ubi_leb_write()' checks them. Pages are
+ * programmed in order, so the write must also not start before the end of
+ * a previous write of the plan to the same LEB, unless the LEB has been
+ * changed, erased, un-mapped or mapped in between.
+ *
+ * Returns the index of the step, which is the index of its data in the
+ * buffers passed to 'ubi_plan_exec()', or a negative error code in case of
+ * failure, in which case the plan is left unchanged.
+ */
+int
+ubi_plan_write(struct ubi_plan *plan, int lnum, int offset, int len,
+	       int dtype)
+{
+  int min_io = plan->desc->di.min_io_size;
+  int err;
+
+  err = plan_check(plan, lnum, dtype);
+  if (err)
+    return err;
+  if (offset < 0 || len <= 0
+      || offset + len > plan->desc->vi.usable_leb_size
+      || offset & (min_io - 1) || len & (min_io - 1))
+    {
+      errmsg("Invalid arguments");
+      return -EINVAL;
+    }
+  if (offset < plan_leb_end(plan, lnum))
+    {
+      errmsg("write to LEB %d:%d goes back before offset %d", lnum, offset,
+	     plan_leb_end(plan, lnum));
+      return -EINVAL;
+    }
+  return plan_add(plan, UBI_OP_WRITE, lnum, offset, len, dtype);
+}
+
+/**
+ * ubi_plan_change - add an atomic LEB change to a plan.
+ * @plan: the plan
+ * @lnum: logical eraseblock to change
+ * @len: how many bytes to write, not %0
+ * @dtype: expected data type
+ *
+ * Returns the index of the step, or a negative error code in case of
+ * failure.
+ */
+int
+ubi_plan_change(struct ubi_plan *plan, int lnum, int len, int dtype)
+{
+  int err;
+
+  err = plan_check(plan, lnum, dtype);
+  if (err)
+    return err;
+  if (len <= 0 || len > plan->desc->vi.usable_leb_size
+      || len & (plan->desc->di.min_io_size - 1))
+    {
+      errmsg("Invalid arguments");
+      return -EINVAL;
+    }
+  return plan_add(plan, UBI_OP_CHANGE, lnum, 0, len, dtype);
+}
+
+/**
+ * ubi_plan_erase - add a synchronous LEB erasure to a plan.
+ * @plan: the plan
+ * @lnum: logical eraseblock to erase
+ *
+ * Returns the index of the step, or a negative error code in case of
+ * failure.
+ */
+int
+ubi_plan_erase(struct ubi_plan *plan, int lnum)
+{
+  int err;
+
+  err = plan_check(plan, lnum, UBI_UNKNOWN);
+  if (err)
+    return err;
+  return plan_add(plan, UBI_OP_ERASE, lnum, 0, 0, UBI_UNKNOWN);
+}
+
+/**
+ * ubi_plan_unmap - add a LEB un-map to a plan.
+ * @plan: the plan
+ * @lnum: logical eraseblock to un-map
+ *
+ * Returns the index of the step, or a negative error code in case of
+ * failure.
+ */
+int
+ubi_plan_unmap(struct ubi_plan *plan, int lnum)
+{
+  int err;
+
+  err = plan_check(plan, lnum, UBI_UNKNOWN);
+  if (err)
+    return err;
+  return plan_add(plan, UBI_OP_UNMAP, lnum, 0, 0, UBI_UNKNOWN);
+}
+
+/**
+ * ubi_plan_map - add a LEB map to a plan.
+ * @plan: the plan
+ * @lnum: logical eraseblock to map
+ * @dtype: expected data type
+ *
+ * Returns the index of the step, or a negative error code in case of
+ * failure.
+ */
+int
+ubi_plan_map(struct ubi_plan *plan, int lnum, int dtype)
+{
+  int err;
+
+  err = plan_check(plan, lnum, dtype);
+  if (err)
+    return err;
+  return plan_add(plan, UBI_OP_MAP, lnum, 0, 0, dtype);
+}
+
+/**
+ * ubi_plan_steps - get the number of steps of a plan.
+ * @plan: the plan
+ */
+int
+ubi_plan_steps(const struct ubi_plan *plan)
+{
+  return plan->nr_steps;
+}
+
+static int
+plan_exec_run(struct ubi_plan *plan, const struct plan_run *run,
+	      const void *const *bufs)
+{
+  struct ubi_volume_desc *desc = plan->desc;
+  const struct plan_step *st = &plan->steps[run->first];
+  struct iovec iov[PLAN_MAX_IOV];
+  int i;
+
+  switch (st->opcode)
+    {
+    case UBI_OP_WRITE:
+      if (run->count == 1)
+	return ubi_vol_write(desc, bufs[run->first], st->len,
+			     desc->vi.usable_leb_size * (long long) st->lnum
+			     + st->offset);
+      for (i = 0; i < run->count; i++)
+	{
+	  iov[i].iov_base = (void *) bufs[run->first + i];
+	  iov[i].iov_len = st[i].len;
+	}
+      return __ubi_vol_writev(desc, iov, run->count,
+			      desc->vi.usable_leb_size * (long long) st->lnum
+			      + st->offset);
+    case UBI_OP_CHANGE:
+      return __ubi_leb_change(desc, st->lnum, bufs[run->first], st->len,
+			      st->dtype);
+    case UBI_OP_ERASE:
+      return __ubi_leb_erase(desc, st->lnum);
+    case UBI_OP_UNMAP:
+      return __ubi_leb_unmap(desc, st->lnum);
+    case UBI_OP_MAP:
+      return __ubi_leb_map(desc, st->lnum, st->dtype);
+    }
+  return -EINVAL;
+}
+
+/**
+ * ubi_plan_exec - execute a plan.
+ * @plan: the plan
+ * @bufs: data of the steps, indexed by step; entries of the steps which do
+ *        not write are not used, and @bufs may be %NULL if no step writes
+ * @failed: where to store the index of the step which failed, may be %NULL
+ *
+ * The steps are executed in order without any checks. Several threads may
+ * execute the same plan, as long as the order they modify the volume in
+ * does not matter.
+ *
+ * Returns %0 if all the steps have been executed and a negative error code
+ * if one failed, in which case the following steps have not been executed.
+ * The steps of a gathered write are reported as failing together, at the
+ * index of the first one, and any of them may have been written.
+ */
+int
+ubi_plan_exec(struct ubi_plan *plan, const void *const *bufs, int *failed)
+{
+  int i, err;
+
+  for (i = 0; i < plan->nr_runs; i++)
+    {
+      err = plan_exec_run(plan, &plan->runs[i], bufs);
+      if (err)
+	{
+	  dbgmsg("plan step %d failed: %d", plan->runs[i].first, err);
+	  if (failed)
+	    *failed = plan->runs[i].first;
+	  return err;
+	}
+    }
+  return 0;
+}
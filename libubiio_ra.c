@@ -0,0 +1,363 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - sequential readahead.
+ *
+ * The volume is seen as one linear address space, LEB @lnum starting at
+ * @lnum * usable_leb_size, which is also how the volume character device
+ * addresses it. Once a descriptor has issued a few reads each starting where
+ * the previous one ended, a background thread reads the following window of
+ * the volume into a private buffer, which then serves the next reads. This
+ * covers the rest of the current LEB and, as the window grows, the next ones.
+ * The window doubles every time the buffer is refilled and collapses back as
+ * soon as a read breaks the stream.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/* Sequential reads needed before readahead starts */
+#define RA_STREAM_THRESHOLD	2
+/* Initial window, in minimal I/O units */
+#define RA_MIN_WINDOW_IOS	16
+
+/**
+ * struct ubi_readahead - readahead state of a volume descriptor.
+ * @fd: volume file descriptor
+ * @vol_end: size of the volume's address space
+ * @lock: protects all the fields below
+ * @cond: signalled when the prefetch thread has work or finished it
+ * @thread: the prefetch thread
+ * @stop: set to make the prefetch thread exit
+ * @next_addr: where the next read of the current stream is expected
+ * @seq_count: number of consecutive sequential reads
+ * @window: current prefetch window size
+ * @min_window: window size when a stream starts
+ * @max_window: largest window allowed
+ * @buf: prefetch buffer, twice @max_window bytes
+ * @buf_addr: volume address of the first byte of @buf
+ * @buf_len: amount of valid data in @buf
+ * @req_len: bytes the prefetch thread has to read after @buf_len, %0 if idle
+ * @req_gen: value of @gen when the prefetch was requested
+ * @busy: non-zero while the prefetch thread is reading
+ * @gen: bumped on invalidation so that in-flight data is dropped
+ * @stats: hit and miss counters
+ */
+struct ubi_readahead
+{
+  int fd;
+  loff_t vol_end;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int stop;
+  loff_t next_addr;
+  int seq_count;
+  int window;
+  int min_window;
+  int max_window;
+  char *buf;
+  loff_t buf_addr;
+  int buf_len;
+  int req_len;
+  unsigned int req_gen;
+  int busy;
+  unsigned int gen;
+  struct ubi_readahead_stats stats;
+};
+
+static void *
+ra_thread(void *arg)
+{
+  struct ubi_readahead *ra = arg;
+  unsigned int gen;
+  loff_t addr;
+  char *dst;
+  int len, rd;
+
+  pthread_mutex_lock(&ra->lock);
+  for (;;)
+    {
+      while (ra->req_len == 0 && !ra->stop)
+	pthread_cond_wait(&ra->cond, &ra->lock);
+      if (ra->stop)
+	break;
+
+      addr = ra->buf_addr + ra->buf_len;
+      dst = ra->buf + ra->buf_len;
+      len = ra->req_len;
+      gen = ra->req_gen;
+      ra->busy = 1;
+      pthread_mutex_unlock(&ra->lock);
+
+      rd = pread(ra->fd, dst, len, addr);
+
+      pthread_mutex_lock(&ra->lock);
+      ra->busy = 0;
+      ra->req_len = 0;
+      /* on error, the reader will hit the problem itself and report it */
+      if (rd > 0 && gen == ra->gen)
+	{
+	  ra->buf_len += rd;
+	  ra->stats.prefetched_bytes += rd;
+	}
+      pthread_cond_broadcast(&ra->cond);
+    }
+  pthread_mutex_unlock(&ra->lock);
+  return NULL;
+}
+
+/*
+ * Queue a prefetch of the window following the buffered data, dropping the
+ * data before @consumed to make room. Called with @ra->lock held and the
+ * prefetch thread idle.
+ */
+static void
+ra_schedule(struct ubi_readahead *ra, loff_t consumed)
+{
+  int room, len, keep;
+  loff_t end;
+
+  if (consumed < ra->buf_addr || consumed > ra->buf_addr + ra->buf_len)
+    {
+      ra->buf_addr = consumed;
+      ra->buf_len = 0;
+    }
+  else if (consumed > ra->buf_addr)
+    {
+      keep = ra->buf_addr + ra->buf_len - consumed;
+      memmove(ra->buf, ra->buf + (consumed - ra->buf_addr), keep);
+      ra->buf_addr = consumed;
+      ra->buf_len = keep;
+    }
+
+  /* only refill once half of the window has been consumed */
+  if (ra->buf_len > ra->window / 2)
+    return;
+
+  end = ra->buf_addr + ra->buf_len;
+  room = 2 * ra->max_window - ra->buf_len;
+  len = MIN(ra->window, room);
+  if (end + len > ra->vol_end)
+    len = ra->vol_end - end;
+  if (len <= 0)
+    return;
+
+  ra->req_len = len;
+  ra->req_gen = ra->gen;
+  pthread_cond_broadcast(&ra->cond);
+
+  /* the stream goes on, read more next time */
+  ra->window = MIN(ra->window * 2, ra->max_window);
+}
+
+/**
+ * __ubi_ra_read - read through the readahead buffer.
+ * @ra: readahead state
+ * @buf: where to store the data
+ * @addr: volume address to read from
+ * @len: how many bytes to read
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+__ubi_ra_read(struct ubi_readahead *ra, char *buf, loff_t addr, int len)
+{
+  int hit = 0, rd;
+
+  pthread_mutex_lock(&ra->lock);
+
+  if (addr == ra->next_addr)
+    {
+      if (ra->seq_count < RA_STREAM_THRESHOLD)
+	ra->seq_count += 1;
+    }
+  else
+    {
+      /* random access, give up */
+      ra->seq_count = 0;
+      ra->window = ra->min_window;
+      ra->gen += 1;
+      ra->buf_len = 0;
+    }
+  ra->next_addr = addr + len;
+
+  /* wait for a prefetch which will cover this read */
+  while (ra->req_len && ra->req_gen == ra->gen && addr >= ra->buf_addr
+	 && addr + len <= ra->buf_addr + ra->buf_len + ra->req_len)
+    pthread_cond_wait(&ra->cond, &ra->lock);
+
+  if (addr >= ra->buf_addr && addr + len <= ra->buf_addr + ra->buf_len)
+    {
+      memcpy(buf, ra->buf + (addr - ra->buf_addr), len);
+      ra->stats.hits += 1;
+      hit = 1;
+    }
+  else
+    ra->stats.misses += 1;
+
+  if (ra->seq_count >= RA_STREAM_THRESHOLD && !ra->busy && !ra->req_len)
+    ra_schedule(ra, addr + len);
+
+  pthread_mutex_unlock(&ra->lock);
+
+  if (hit)
+    return 0;
+  rd = pread(ra->fd, buf, len, addr);
+  if (rd < 0)
+    return -errno;
+  return 0;
+}
+
+/**
+ * __ubi_ra_invalidate - drop prefetched data overlapping a region.
+ * @ra: readahead state
+ * @addr: volume address of the region
+ * @len: region length
+ *
+ * Must be called for every modification made through the descriptor, so
+ * that later reads do not return stale data.
+ */
+void
+__ubi_ra_invalidate(struct ubi_readahead *ra, loff_t addr, int len)
+{
+  pthread_mutex_lock(&ra->lock);
+  if (addr < ra->buf_addr + ra->buf_len + ra->req_len
+      && addr + len > ra->buf_addr)
+    {
+      ra->gen += 1;
+      ra->buf_len = 0;
+      ra->buf_addr = ra->next_addr;
+    }
+  pthread_mutex_unlock(&ra->lock);
+}
+
+/**
+ * ubi_readahead_enable - enable sequential readahead on a descriptor.
+ * @desc: volume descriptor
+ * @max_window: largest amount of data to prefetch at once, in bytes, or %0
+ *              for the readahead window of the device profile, or one
+ *              logical eraseblock if there is no profile
+ *
+ * Reads done through @desc are watched and, when they form a sequential
+ * stream, the data following them is read in background. The memory used is
+ * bounded by twice @max_window. Prefetched data is dropped when @desc
+ * modifies the volume; modifications made through other descriptors are not
+ * seen, so readahead should not be used on volumes written concurrently by
+ * somebody else.
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_readahead_enable(struct ubi_volume_desc *desc, int max_window)
+{
+  struct ubi_readahead *ra;
+  int err;
+
+  if (desc->ra)
+    return -EBUSY;
+  if (max_window < 0)
+    return -EINVAL;
+  if (max_window == 0)
+    max_window = desc->profile ? desc->profile->readahead
+      : desc->vi.usable_leb_size;
+
+  ra = calloc(1, sizeof(struct ubi_readahead));
+  if (ra == NULL)
+    return -ENOMEM;
+  ra->buf = malloc(2 * (size_t) max_window);
+  if (ra->buf == NULL)
+    {
+      free(ra);
+      return -ENOMEM;
+    }
+  ra->fd = desc->fd;
+  ra->vol_end = desc->vi.usable_leb_size * (loff_t) desc->vi.used_ebs;
+  ra->max_window = max_window;
+  /* streams start with reads as large as the device needs to be efficient */
+  ra->min_window = MIN(desc->profile ? desc->profile->read_size
+		       : RA_MIN_WINDOW_IOS * desc->di.min_io_size, max_window);
+  ra->window = ra->min_window;
+  ra->next_addr = -1;
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+
+  err = pthread_create(&ra->thread, NULL, ra_thread, ra);
+  if (err)
+    {
+      pthread_cond_destroy(&ra->cond);
+      pthread_mutex_destroy(&ra->lock);
+      free(ra->buf);
+      free(ra);
+      return -err;
+    }
+  desc->ra = ra;
+  return 0;
+}
+
+/**
+ * ubi_readahead_disable - disable readahead on a descriptor.
+ * @desc: volume descriptor
+ */
+void
+ubi_readahead_disable(struct ubi_volume_desc *desc)
+{
+  struct ubi_readahead *ra = desc->ra;
+
+  if (ra == NULL)
+    return;
+  desc->ra = NULL;
+
+  pthread_mutex_lock(&ra->lock);
+  ra->stop = 1;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->lock);
+  pthread_join(ra->thread, NULL);
+
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->lock);
+  free(ra->buf);
+  free(ra);
+}
+
+/**
+ * ubi_readahead_get_stats - get readahead statistics of a descriptor.
+ * @desc: volume descriptor
+ * @stats: the statistics are stored here
+ *
+ * Returns %0 in case of success and %-EINVAL if readahead is not enabled.
+ */
+int
+ubi_readahead_get_stats(struct ubi_volume_desc *desc,
+			struct ubi_readahead_stats *stats)
+{
+  struct ubi_readahead *ra = desc->ra;
+
+  if (ra == NULL)
+    return -EINVAL;
+  pthread_mutex_lock(&ra->lock);
+  memcpy(stats, &ra->stats, sizeof(*stats));
+  stats->window = ra->window;
+  pthread_mutex_unlock(&ra->lock);
+  return 0;
+}
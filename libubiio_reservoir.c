@@ -0,0 +1,444 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - reservoir of pre-mapped LEBs.
+ *
+ * The first write to an un-mapped LEB makes UBI pick a physical eraseblock,
+ * possibly waiting for one to be erased, and write the volume header to it
+ * before the data. A reservoir manages a range of LEBs of a volume on
+ * behalf of its writers and keeps a number of them mapped ahead of time, by
+ * a background thread, so that a writer claiming a LEB gets one whose first
+ * write is an ordinary program. LEBs given back are un-mapped by the thread
+ * as well, and become free again.
+ *
+ * At creation, the un-mapped LEBs of the range are free and the mapped ones
+ * are in use: an empty mapped LEB may well be one a writer claimed and has
+ * not written to yet, so only its owner can give it back. For the same
+ * reason, a reservoir un-maps its pre-mapped LEBs when it is destroyed
+ * rather than leave them for the next one.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define RESERVOIR_DEFAULT_TARGET	4
+/* Time the thread waits after a failure before trying again */
+#define RESERVOIR_RETRY_MS		100
+
+/* States of the LEBs of a reservoir */
+enum
+{
+  LEB_FREE,
+  LEB_READY,
+  LEB_CLAIMED,
+  LEB_DIRTY
+};
+
+/**
+ * struct leb_queue - ring of LEB numbers.
+ * @lebs: the LEB numbers
+ * @head: index of the oldest one
+ * @count: number of LEBs in the ring
+ *
+ * A ring is as large as the reservoir, so it never overflows.
+ */
+struct leb_queue
+{
+  int *lebs;
+  int head;
+  int count;
+};
+
+/**
+ * struct ubi_reservoir - reservoir of pre-mapped LEBs.
+ * @desc: volume descriptor
+ * @first: first LEB of the range managed
+ * @nr: number of LEBs managed
+ * @target: number of pre-mapped LEBs to keep
+ * @dtype: data type given to 'ubi_leb_map()'
+ * @lock: protects the fields below
+ * @work: signalled when there is something for the thread to do
+ * @mapped: broadcast when the thread is done mapping a LEB
+ * @state: state of each LEB, %LEB_FREE, %LEB_READY, ...
+ * @ready: pre-mapped LEBs, taken in the order they were mapped, which gives
+ *         the volume header program of each the most time to finish
+ * @mapping: number of LEBs the thread is mapping
+ * @free: un-mapped LEBs
+ * @dirty: LEBs given back, to un-map
+ * @stop: set when the thread has to exit
+ * @thread: the thread mapping and un-mapping LEBs
+ * @stats: statistics
+ */
+struct ubi_reservoir
+{
+  struct ubi_volume_desc *desc;
+  int first;
+  int nr;
+  int target;
+  int dtype;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t mapped;
+  unsigned char *state;
+  struct leb_queue ready;
+  int mapping;
+  struct leb_queue free;
+  struct leb_queue dirty;
+  int stop;
+  pthread_t thread;
+  struct ubi_reservoir_stats stats;
+};
+
+static void
+queue_push(struct ubi_reservoir *res, struct leb_queue *q, int lnum)
+{
+  q->lebs[(q->head + q->count) % res->nr] = lnum;
+  q->count += 1;
+}
+
+static int
+queue_pop(struct ubi_reservoir *res, struct leb_queue *q)
+{
+  int lnum = q->lebs[q->head];
+
+  q->head = (q->head + 1) % res->nr;
+  q->count -= 1;
+  return lnum;
+}
+
+/* Whether the thread has work, called with @res->lock held */
+static int
+reservoir_has_work(struct ubi_reservoir *res)
+{
+  return res->dirty.count
+    || (res->free.count && res->ready.count + res->mapping < res->target);
+}
+
+static void
+reservoir_retry_wait(struct ubi_reservoir *res)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += RESERVOIR_RETRY_MS * 1000000L;
+  ts.tv_sec += ts.tv_nsec / 1000000000L;
+  ts.tv_nsec %= 1000000000L;
+  while (!res->stop
+	 && pthread_cond_timedwait(&res->work, &res->lock, &ts) != ETIMEDOUT)
+    ;
+}
+
+static void *
+reservoir_thread(void *arg)
+{
+  struct ubi_reservoir *res = arg;
+  int lnum, unmap, err;
+
+  pthread_mutex_lock(&res->lock);
+  for (;;)
+    {
+      while (!res->stop && !reservoir_has_work(res))
+	pthread_cond_wait(&res->work, &res->lock);
+      if (res->stop)
+	break;
+
+      /* LEBs given back first, they may be what there is left to map */
+      unmap = res->dirty.count != 0;
+      if (unmap)
+	lnum = queue_pop(res, &res->dirty);
+      else
+	{
+	  lnum = queue_pop(res, &res->free);
+	  res->mapping += 1;
+	}
+      pthread_mutex_unlock(&res->lock);
+
+      err = unmap ? ubi_leb_unmap(res->desc, lnum)
+	: ubi_leb_map(res->desc, lnum, res->dtype);
+
+      pthread_mutex_lock(&res->lock);
+      if (err)
+	{
+	  warnmsg("cannot %s LEB %d:%d, error %d", unmap ? "un-map" : "map",
+		  res->desc->vi.vol_id, lnum, err);
+	  res->stats.errors += 1;
+	  if (unmap)
+	    queue_push(res, &res->dirty, lnum);
+	  else
+	    {
+	      res->mapping -= 1;
+	      queue_push(res, &res->free, lnum);
+	      pthread_cond_broadcast(&res->mapped);
+	    }
+	  reservoir_retry_wait(res);
+	}
+      else if (unmap)
+	{
+	  res->state[lnum - res->first] = LEB_FREE;
+	  queue_push(res, &res->free, lnum);
+	  res->stats.unmaps += 1;
+	}
+      else
+	{
+	  res->mapping -= 1;
+	  res->state[lnum - res->first] = LEB_READY;
+	  queue_push(res, &res->ready, lnum);
+	  res->stats.maps += 1;
+	  pthread_cond_broadcast(&res->mapped);
+	}
+    }
+  pthread_mutex_unlock(&res->lock);
+  return NULL;
+}
+
+/* Sort the LEBs out at creation time */
+static int
+reservoir_scan(struct ubi_reservoir *res)
+{
+  int lnum, i, ret;
+
+  for (i = 0; i < res->nr; i++)
+    {
+      lnum = res->first + i;
+      ret = ubi_is_mapped(res->desc, lnum);
+      if (ret < 0)
+	return -errno;
+      if (ret)
+	res->state[i] = LEB_CLAIMED;
+      else
+	{
+	  res->state[i] = LEB_FREE;
+	  queue_push(res, &res->free, lnum);
+	}
+    }
+  return 0;
+}
+
+/**
+ * ubi_reservoir_create - keep LEBs of a volume mapped ahead of time.
+ * @desc: volume descriptor
+ * @cfg: range of LEBs, number of LEBs to keep mapped and data type
+ *
+ * The reservoir manages LEBs @cfg->first_leb to @cfg->first_leb +
+ * @cfg->nr_lebs - 1, or to the end of the volume if @cfg->nr_lebs is %0,
+ * which nothing else must map or un-map. It keeps @cfg->target of the free
+ * ones mapped, %4 if it is %0.
+ *
+ * Returns the reservoir in case of success and %NULL in case of failure,
+ * with errno set.
+ */
+struct ubi_reservoir *
+ubi_reservoir_create(struct ubi_volume_desc *desc,
+		     const struct ubi_reservoir_config *cfg)
+{
+  struct ubi_reservoir *res;
+  int nr = cfg->nr_lebs ? cfg->nr_lebs : desc->vi.used_ebs - cfg->first_leb;
+  int err;
+
+  if (desc->mode == UBI_READONLY || desc->vi.vol_type == UBI_STATIC_VOLUME)
+    {
+      errno = EROFS;
+      return NULL;
+    }
+  if (cfg->first_leb < 0 || nr <= 0 || cfg->nr_lebs < 0
+      || cfg->first_leb + nr > desc->vi.used_ebs || cfg->target < 0
+      || (cfg->dtype != UBI_LONGTERM && cfg->dtype != UBI_SHORTTERM
+	  && cfg->dtype != UBI_UNKNOWN))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  res = calloc(1, sizeof(struct ubi_reservoir));
+  if (res == NULL)
+    return NULL;
+  res->desc = desc;
+  res->first = cfg->first_leb;
+  res->nr = nr;
+  res->target = MIN(cfg->target ? cfg->target : RESERVOIR_DEFAULT_TARGET, nr);
+  res->dtype = cfg->dtype;
+  res->state = malloc(nr);
+  res->ready.lebs = malloc(nr * sizeof(int));
+  res->free.lebs = malloc(nr * sizeof(int));
+  res->dirty.lebs = malloc(nr * sizeof(int));
+  if (res->state == NULL || res->ready.lebs == NULL || res->free.lebs == NULL
+      || res->dirty.lebs == NULL)
+    {
+      err = -ENOMEM;
+      goto out_free;
+    }
+
+  err = reservoir_scan(res);
+  if (err)
+    goto out_free;
+  pthread_mutex_init(&res->lock, NULL);
+  pthread_cond_init(&res->work, NULL);
+  pthread_cond_init(&res->mapped, NULL);
+  err = -pthread_create(&res->thread, NULL, reservoir_thread, res);
+  if (err)
+    {
+      pthread_cond_destroy(&res->mapped);
+      pthread_cond_destroy(&res->work);
+      pthread_mutex_destroy(&res->lock);
+      goto out_free;
+    }
+  return res;
+
+out_free:
+  free(res->dirty.lebs);
+  free(res->free.lebs);
+  free(res->ready.lebs);
+  free(res->state);
+  free(res);
+  errno = -err;
+  return NULL;
+}
+
+/**
+ * ubi_reservoir_destroy - stop keeping LEBs mapped ahead of time.
+ * @res: the reservoir
+ *
+ * The pre-mapped LEBs and the LEBs given back but not un-mapped yet are
+ * un-mapped before the reservoir goes, as the next one would take them for
+ * LEBs in use. LEBs claimed stay as they are.
+ */
+void
+ubi_reservoir_destroy(struct ubi_reservoir *res)
+{
+  int lnum, err;
+
+  pthread_mutex_lock(&res->lock);
+  res->stop = 1;
+  pthread_cond_signal(&res->work);
+  pthread_mutex_unlock(&res->lock);
+  pthread_join(res->thread, NULL);
+
+  while (res->ready.count || res->dirty.count)
+    {
+      if (res->ready.count)
+	lnum = queue_pop(res, &res->ready);
+      else
+	lnum = queue_pop(res, &res->dirty);
+      err = ubi_leb_unmap(res->desc, lnum);
+      if (err)
+	warnmsg("cannot un-map LEB %d:%d, error %d", res->desc->vi.vol_id,
+		lnum, err);
+    }
+  pthread_cond_destroy(&res->mapped);
+  pthread_cond_destroy(&res->work);
+  pthread_mutex_destroy(&res->lock);
+  free(res->dirty.lebs);
+  free(res->free.lebs);
+  free(res->ready.lebs);
+  free(res->state);
+  free(res);
+}
+
+/**
+ * ubi_reservoir_get - claim a LEB to write to.
+ * @res: the reservoir
+ * @flags: %UBI_RESERVOIR_NOWAIT to only take a pre-mapped LEB
+ *
+ * The LEB is empty and, unless the reservoir ran out of pre-mapped LEBs, is
+ * mapped already; otherwise it is an un-mapped one, which the first write
+ * maps. If the only free LEBs are being mapped, this waits for one to be
+ * done. The LEB belongs to the caller until it is given back with
+ * 'ubi_reservoir_put()'.
+ *
+ * Returns the LEB number in case of success, %-EAGAIN if there is no
+ * pre-mapped LEB and %UBI_RESERVOIR_NOWAIT is set, and %-ENOSPC if there is
+ * no free LEB at all; LEBs given back and not un-mapped yet are not free.
+ */
+int
+ubi_reservoir_get(struct ubi_reservoir *res, int flags)
+{
+  int lnum, err;
+
+  pthread_mutex_lock(&res->lock);
+  while (!(flags & UBI_RESERVOIR_NOWAIT) && !res->ready.count
+	 && !res->free.count && res->mapping)
+    pthread_cond_wait(&res->mapped, &res->lock);
+  if (res->ready.count)
+    {
+      lnum = queue_pop(res, &res->ready);
+      res->stats.hits += 1;
+    }
+  else if (res->free.count && !(flags & UBI_RESERVOIR_NOWAIT))
+    {
+      lnum = queue_pop(res, &res->free);
+      res->stats.misses += 1;
+    }
+  else
+    {
+      err = flags & UBI_RESERVOIR_NOWAIT && (res->free.count || res->mapping)
+	? -EAGAIN : -ENOSPC;
+      pthread_mutex_unlock(&res->lock);
+      return err;
+    }
+  res->state[lnum - res->first] = LEB_CLAIMED;
+  if (reservoir_has_work(res))
+    pthread_cond_signal(&res->work);
+  pthread_mutex_unlock(&res->lock);
+  return lnum;
+}
+
+/**
+ * ubi_reservoir_put - give a LEB back.
+ * @res: the reservoir
+ * @lnum: the LEB, claimed with 'ubi_reservoir_get()' or in use when the
+ *        reservoir was created
+ *
+ * The LEB is un-mapped in the background, and then is free again. Returns
+ * %0 in case of success and %-EINVAL if @lnum is not a LEB in use.
+ */
+int
+ubi_reservoir_put(struct ubi_reservoir *res, int lnum)
+{
+  pthread_mutex_lock(&res->lock);
+  if (lnum < res->first || lnum >= res->first + res->nr
+      || res->state[lnum - res->first] != LEB_CLAIMED)
+    {
+      pthread_mutex_unlock(&res->lock);
+      return -EINVAL;
+    }
+  res->state[lnum - res->first] = LEB_DIRTY;
+  queue_push(res, &res->dirty, lnum);
+  pthread_cond_signal(&res->work);
+  pthread_mutex_unlock(&res->lock);
+  return 0;
+}
+
+/**
+ * ubi_reservoir_get_stats - get reservoir statistics.
+ * @res: the reservoir
+ * @stats: the statistics are stored here
+ */
+void
+ubi_reservoir_get_stats(struct ubi_reservoir *res,
+			struct ubi_reservoir_stats *stats)
+{
+  pthread_mutex_lock(&res->lock);
+  memcpy(stats, &res->stats, sizeof(*stats));
+  stats->ready = res->ready.count;
+  stats->free = res->free.count + res->mapping;
+  stats->dirty = res->dirty.count;
+  pthread_mutex_unlock(&res->lock);
+}
@@ -0,0 +1,419 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - background scrubber.
+ *
+ * The scrubber reads every mapped LEB of a set of volumes, so that UBI gets
+ * to see the bit-flips and ECC errors before an application does: UBI moves
+ * the data of an eraseblock with correctable bit-flips by itself, and an
+ * uncorrectable one fails the read with %EBADMSG. A read failing once but not
+ * when retried is the sign of a marginal eraseblock.
+ *
+ * Several threads take the LEBs in turn and read them in chunks. The chunks
+ * go through a throttle in %UBI_THROTTLE_DELAY mode, to stay under a
+ * bandwidth and a read rate budget, and no chunk is read until the process
+ * has done no I/O through libubiio for a while: every operation bumps a
+ * counter the scrubbers watch while any runs.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define SCRUB_DEFAULT_THREADS	2
+#define SCRUB_CHUNK		(64 * 1024)
+
+/* Number of scrubbers running, and operations done by other threads */
+int __ubi_scrub_on;
+static unsigned long scrub_fg_ops;
+
+/* Set in the scrubber threads, whose I/O is not foreground I/O */
+static __thread int scrub_self;
+
+/**
+ * struct ubi_scrubber - background scrubber.
+ * @descs: the volumes
+ * @nr_descs: number of entries of @descs
+ * @cfg: configuration
+ * @throttle: bandwidth and read rate budget, %NULL for none
+ * @nr_threads: number of entries of @threads
+ * @threads: the scrubbing threads
+ * @lock: protects all the fields below
+ * @cond: signalled when stopping and when a thread exits
+ * @stop: set to make the threads exit
+ * @running: number of threads still scrubbing
+ * @vol: volume of the next LEB to scrub
+ * @lnum: next LEB to scrub
+ * @fg_seen: last value of @scrub_fg_ops seen
+ * @quiet_ns: time foreground I/O is assumed over at
+ * @stats: statistics
+ */
+struct ubi_scrubber
+{
+  struct ubi_volume_desc **descs;
+  int nr_descs;
+  struct ubi_scrub_config cfg;
+  struct ubi_throttle *throttle;
+  int nr_threads;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  int running;
+  int vol;
+  int lnum;
+  unsigned long fg_seen;
+  long long quiet_ns;
+  struct ubi_scrub_stats stats;
+};
+
+/**
+ * __ubi_scrub_note_io - tell the scrubbers an operation is starting.
+ *
+ * Only called while a scrubber runs.
+ */
+void
+__ubi_scrub_note_io(void)
+{
+  if (!scrub_self)
+    __atomic_fetch_add(&scrub_fg_ops, 1, __ATOMIC_RELAXED);
+}
+
+static long long
+scrub_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Wait up to @ns nanoseconds or until stopped, called with @sc->lock held */
+static void
+scrub_sleep(struct ubi_scrubber *sc, long long ns)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ns += ts.tv_nsec;
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  pthread_cond_timedwait(&sc->cond, &sc->lock, &ts);
+}
+
+/*
+ * Wait until there has been no foreground I/O for @sc->cfg.idle_ms, called
+ * with @sc->lock held. Returns %0, or %-ECANCELED if the scrubber is
+ * stopping.
+ */
+static int
+scrub_backoff(struct ubi_scrubber *sc)
+{
+  unsigned long fg;
+  long long now;
+
+  while (!sc->stop)
+    {
+      now = scrub_now();
+      fg = __atomic_load_n(&scrub_fg_ops, __ATOMIC_RELAXED);
+      if (fg != sc->fg_seen)
+	{
+	  sc->fg_seen = fg;
+	  sc->quiet_ns = now + sc->cfg.idle_ms * 1000000LL;
+	}
+      if (now < sc->quiet_ns)
+	{
+	  sc->stats.backoffs += 1;
+	  scrub_sleep(sc, sc->quiet_ns - now);
+	  continue;
+	}
+      return 0;
+    }
+  return -ECANCELED;
+}
+
+/* Take the next LEB to scrub. Returns %0, or %-ENOENT when all are done. */
+static int
+scrub_next(struct ubi_scrubber *sc, int *vol, int *lnum)
+{
+  while (sc->vol < sc->nr_descs)
+    {
+      if (sc->lnum < sc->descs[sc->vol]->vi.used_ebs)
+	{
+	  *vol = sc->vol;
+	  *lnum = sc->lnum++;
+	  return 0;
+	}
+      sc->vol += 1;
+      sc->lnum = 0;
+    }
+  return -ENOENT;
+}
+
+/*
+ * Read a chunk from the device itself: through the readahead of the volume,
+ * it would be served from the cache, and would evict the data of the
+ * application.
+ */
+static int
+scrub_read(struct ubi_volume_desc *desc, char *buf, int len, long long addr)
+{
+  int leb_size = desc->vi.usable_leb_size;
+
+  if (pread(desc->fd, buf, len, addr) < 0)
+    return -errno;
+  if (desc->sim)
+    __ubi_sim_read(desc, addr / leb_size, addr % leb_size, len);
+  return 0;
+}
+
+/*
+ * Scrub a LEB. Returns %0 if it read fine, %UBI_SCRUB_MARGINAL or
+ * %UBI_SCRUB_BAD, with the read error in @err, or %-ECANCELED.
+ */
+static int
+scrub_leb(struct ubi_scrubber *sc, struct ubi_volume_desc *desc, int lnum,
+	  char *buf, int *err)
+{
+  int leb_size = desc->vi.usable_leb_size;
+  long long addr = (long long) lnum * leb_size;
+  int offset, len, ret, state = 0;
+
+  for (offset = 0; offset < leb_size; offset += len)
+    {
+      len = MIN(SCRUB_CHUNK, leb_size - offset);
+      pthread_mutex_lock(&sc->lock);
+      ret = scrub_backoff(sc);
+      pthread_mutex_unlock(&sc->lock);
+      if (ret)
+	return ret;
+      if (sc->throttle)
+	__ubi_throttle(sc->throttle, UBI_OP_READ, len);
+
+      ret = scrub_read(desc, buf, len, addr + offset);
+      if (ret == 0)
+	continue;
+      *err = ret;
+      ret = scrub_read(desc, buf, len, addr + offset);
+      if (ret)
+	return UBI_SCRUB_BAD;
+      state = UBI_SCRUB_MARGINAL;
+    }
+  return state;
+}
+
+static void *
+scrub_thread(void *arg)
+{
+  struct ubi_scrubber *sc = arg;
+  struct ubi_volume_desc *desc;
+  int vol, lnum, state, err = 0;
+  char *buf;
+
+  scrub_self = 1;
+  buf = malloc(SCRUB_CHUNK);
+
+  pthread_mutex_lock(&sc->lock);
+  while (buf != NULL && !sc->stop && !scrub_next(sc, &vol, &lnum))
+    {
+      pthread_mutex_unlock(&sc->lock);
+      desc = sc->descs[vol];
+      /* reading an unmapped LEB gives 0xFF bytes without reading flash */
+      state = ubi_is_mapped(desc, lnum);
+      if (state)
+	state = scrub_leb(sc, desc, lnum, buf, &err);
+      else
+	state = -ENOENT;
+      if (state > 0 && sc->cfg.report)
+	sc->cfg.report(desc, lnum, state, err, sc->cfg.priv);
+
+      pthread_mutex_lock(&sc->lock);
+      if (state == -ENOENT)
+	sc->stats.unmapped += 1;
+      else if (state != -ECANCELED)
+	{
+	  sc->stats.scrubbed += 1;
+	  sc->stats.bytes += desc->vi.usable_leb_size;
+	  if (state == UBI_SCRUB_BAD)
+	    sc->stats.bad += 1;
+	  else if (state == UBI_SCRUB_MARGINAL)
+	    sc->stats.marginal += 1;
+	}
+    }
+  if (buf == NULL)
+    warnmsg("scrub: out of memory");
+  sc->running -= 1;
+  pthread_cond_broadcast(&sc->cond);
+  pthread_mutex_unlock(&sc->lock);
+  free(buf);
+  return NULL;
+}
+
+/**
+ * ubi_scrub_start - start scrubbing volumes.
+ * @descs: descriptors of the volumes to scrub
+ * @nr_descs: number of entries of @descs
+ * @cfg: configuration, or %NULL for the defaults
+ *
+ * The descriptors must stay open until the scrubber is stopped. Only I/O
+ * done through libubiio by this process makes the scrubber back off.
+ *
+ * Returns the scrubber in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_scrubber *
+ubi_scrub_start(struct ubi_volume_desc *const *descs, int nr_descs,
+		const struct ubi_scrub_config *cfg)
+{
+  struct ubi_scrubber *sc;
+  int i, err = 0;
+
+  if (nr_descs <= 0 || (cfg && (cfg->threads < 0 || cfg->max_bps < 0
+				|| cfg->max_iops < 0 || cfg->idle_ms < 0)))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  sc = calloc(1, sizeof(struct ubi_scrubber));
+  if (sc == NULL)
+    return NULL;
+  if (cfg)
+    sc->cfg = *cfg;
+  sc->nr_threads = sc->cfg.threads ? sc->cfg.threads : SCRUB_DEFAULT_THREADS;
+  sc->nr_descs = nr_descs;
+  sc->descs = malloc(nr_descs * sizeof(*descs));
+  sc->threads = calloc(sc->nr_threads, sizeof(pthread_t));
+  if (sc->cfg.max_bps || sc->cfg.max_iops)
+    {
+      struct ubi_throttle_config tc = {
+	.max_bps = sc->cfg.max_bps,
+	.max_ops = sc->cfg.max_iops,
+	.mode = UBI_THROTTLE_DELAY
+      };
+
+      sc->throttle = ubi_throttle_create(&tc);
+    }
+  if (sc->descs == NULL || sc->threads == NULL
+      || ((sc->cfg.max_bps || sc->cfg.max_iops) && sc->throttle == NULL))
+    {
+      if (sc->throttle)
+	ubi_throttle_destroy(sc->throttle);
+      free(sc->descs);
+      free(sc->threads);
+      free(sc);
+      errno = ENOMEM;
+      return NULL;
+    }
+  memcpy(sc->descs, descs, nr_descs * sizeof(*descs));
+  for (i = 0; i < nr_descs; i++)
+    sc->stats.total += descs[i]->vi.used_ebs;
+  pthread_mutex_init(&sc->lock, NULL);
+  pthread_cond_init(&sc->cond, NULL);
+  sc->fg_seen = __atomic_load_n(&scrub_fg_ops, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&__ubi_scrub_on, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&sc->lock);
+  for (i = 0; i < sc->nr_threads && !err; i++)
+    {
+      err = pthread_create(&sc->threads[i], NULL, scrub_thread, sc);
+      if (!err)
+	sc->running += 1;
+    }
+  pthread_mutex_unlock(&sc->lock);
+  sc->nr_threads = sc->running;
+  if (err)
+    {
+      ubi_scrub_stop(sc);
+      errno = err;
+      return NULL;
+    }
+  return sc;
+}
+
+/**
+ * ubi_scrub_wait - wait for a scrubber to go through all the LEBs.
+ * @sc: the scrubber
+ * @timeout_ms: how long to wait at most, %-1 to wait as long as needed
+ *
+ * Returns %0 when the scrubber is done and %-ETIMEDOUT otherwise.
+ */
+int
+ubi_scrub_wait(struct ubi_scrubber *sc, int timeout_ms)
+{
+  long long end = scrub_now() + timeout_ms * 1000000LL, now;
+  int err = 0;
+
+  pthread_mutex_lock(&sc->lock);
+  while (sc->running && !err)
+    {
+      now = scrub_now();
+      if (timeout_ms < 0)
+	pthread_cond_wait(&sc->cond, &sc->lock);
+      else if (now < end)
+	scrub_sleep(sc, end - now);
+      else
+	err = -ETIMEDOUT;
+    }
+  pthread_mutex_unlock(&sc->lock);
+  return err;
+}
+
+/**
+ * ubi_scrub_stop - stop and free a scrubber.
+ * @sc: the scrubber
+ *
+ * LEBs being scrubbed are left halfway and are not reported.
+ */
+void
+ubi_scrub_stop(struct ubi_scrubber *sc)
+{
+  int i;
+
+  pthread_mutex_lock(&sc->lock);
+  sc->stop = 1;
+  pthread_cond_broadcast(&sc->cond);
+  pthread_mutex_unlock(&sc->lock);
+  for (i = 0; i < sc->nr_threads; i++)
+    pthread_join(sc->threads[i], NULL);
+  __atomic_fetch_sub(&__ubi_scrub_on, 1, __ATOMIC_RELAXED);
+
+  if (sc->throttle)
+    ubi_throttle_destroy(sc->throttle);
+  pthread_cond_destroy(&sc->cond);
+  pthread_mutex_destroy(&sc->lock);
+  free(sc->threads);
+  free(sc->descs);
+  free(sc);
+}
+
+/**
+ * ubi_scrub_get_stats - get scrubber statistics.
+ * @sc: the scrubber
+ * @stats: the statistics are stored here
+ */
+void
+ubi_scrub_get_stats(struct ubi_scrubber *sc, struct ubi_scrub_stats *stats)
+{
+  pthread_mutex_lock(&sc->lock);
+  memcpy(stats, &sc->stats, sizeof(*stats));
+  pthread_mutex_unlock(&sc->lock);
+}
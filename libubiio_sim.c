@@ -0,0 +1,797 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - file-backed volumes.
+ *
+ * A simulated volume is a regular file holding the LEBs one after the other,
+ * so that the library, and what is built on it, can be run and measured
+ * without UBI. Reads and writes go to the file like they go to the volume
+ * character device; the operations UBI does with ioctls are emulated here.
+ * Erasing or un-mapping a LEB fills it with %0xFF bytes at once.
+ *
+ * The file does not record which LEBs are mapped: a LEB is taken as mapped
+ * the first time it is looked at if it holds anything but %0xFF bytes. So
+ * an empty LEB mapped with 'ubi_leb_map()' comes back un-mapped when the
+ * file is opened again, which UBI allows after an unclean reboot too.
+ *
+ * A timing model can be set on a simulated volume to make it behave like a
+ * given NAND chip. LEBs are spread over the dies of the chip, each die does
+ * one array operation at a time (a page read, a page program or a block
+ * erase) and all dies share one bus, on which data moves at a given rate.
+ * Reads and writes of the 'ubi_leb_*()' functions wait until the dies and
+ * the bus they need are free, then for their operations. An erase done by
+ * 'ubi_leb_erase()' is waited for, one done in background after an un-map
+ * only keeps the die busy; changing or mapping a LEB writes its volume
+ * header page first, like UBI does. Readahead and verification reads are
+ * not modelled.
+ *
+ * With a real clock, operations sleep for the time the model gives them.
+ * With a virtual clock they do not wait at all; instead, each thread has a
+ * simulated time which the operations it does move forward, and which
+ * 'ubi_sim_clock()' returns, so a run of any length takes the time of the
+ * file I/O only.
+ */
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <mtd/ubi-user.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/* LEB mapping states */
+#define SIM_UNKNOWN	-1
+#define SIM_UNMAPPED	0
+#define SIM_MAPPED	1
+
+/* Operations of the timing model */
+#define SIM_READ	0
+#define SIM_PROG	1
+#define SIM_ERASE	2
+#define SIM_BG_ERASE	3
+
+/* Busy periods remembered per die and for the bus */
+#define SIM_HORIZON	256
+
+/*
+ * With a virtual clock, threads more than SIM_MAX_SKEW ns ahead of another
+ * one wait for it, unless it has not used the model for SIM_IDLE ns of real
+ * time; when it does again, its time catches up with the others. Up to
+ * SIM_MAX_CLIENTS threads are kept in step.
+ */
+#define SIM_MAX_SKEW	1000000LL
+#define SIM_IDLE	50000000LL
+#define SIM_MAX_CLIENTS	64
+
+/**
+ * struct sim_resource - a die or the bus in the timing model.
+ * @floor: the resource is taken as busy until then, in ns
+ * @count: number of periods in @busy
+ * @busy: periods during which the resource is busy, by start time
+ *
+ * With a virtual clock, threads may use a resource at times earlier than
+ * another thread already did, so the gaps between busy periods are kept and
+ * used. The oldest periods are forgotten, and the gaps before them lost.
+ */
+struct sim_resource
+{
+  long long floor;
+  int count;
+  struct
+  {
+    long long start;
+    long long end;
+  } busy[SIM_HORIZON];
+};
+
+/**
+ * struct sim_client - a thread using a virtual clock.
+ * @owner: identifies the thread, %NULL if the slot is free
+ * @now: simulated time of the thread
+ * @seen: real time at which the thread last used the model
+ */
+struct sim_client
+{
+  const void *owner;
+  long long now;
+  long long seen;
+};
+
+/**
+ * struct ubi_sim - state of a simulated volume.
+ * @geo: volume geometry
+ * @lock: protects all the fields below
+ * @mapped: mapping state of each LEB
+ * @ff: a LEB worth of %0xFF bytes
+ * @timed: non-zero if @timing is in use
+ * @timing: timing model
+ * @dies: the dies
+ * @bus: the bus
+ * @vclock: latest time reached by a thread, with a virtual clock
+ * @epoch: identifies the current timing model among all the volumes
+ * @base: real time of the simulated time origin
+ * @clients: threads kept in step with a virtual clock
+ * @tick: signalled when a client moves its time forward
+ */
+struct ubi_sim
+{
+  struct ubi_sim_geometry geo;
+  pthread_mutex_t lock;
+  signed char *mapped;
+  char *ff;
+  int timed;
+  struct ubi_sim_timing timing;
+  struct sim_resource *dies;
+  struct sim_resource bus;
+  long long vclock;
+  unsigned long epoch;
+  struct timespec base;
+  struct sim_client clients[SIM_MAX_CLIENTS];
+  pthread_cond_t tick;
+};
+
+/* Source of timing model identifiers */
+static unsigned long sim_epochs;
+
+/*
+ * Simulated time of the calling thread with the virtual clock of the timing
+ * model @epoch. A thread which has not used a model yet starts at the latest
+ * time reached with it.
+ */
+static __thread struct
+{
+  unsigned long epoch;
+  long long now;
+} sim_thread;
+
+static long long
+sim_real_now(struct ubi_sim *sim)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - sim->base.tv_sec) * 1000000000LL
+    + ts.tv_nsec - sim->base.tv_nsec;
+}
+
+/* Must be called with @sim->lock held */
+static long long
+sim_now(struct ubi_sim *sim)
+{
+  if (!(sim->timing.flags & UBI_SIM_VIRTUAL_CLOCK))
+    return sim_real_now(sim);
+  if (sim_thread.epoch != sim->epoch)
+    {
+      sim_thread.epoch = sim->epoch;
+      sim_thread.now = sim->vclock;
+    }
+  return sim_thread.now;
+}
+
+/*
+ * Returns the client slot of the calling thread, taking a free or idle one
+ * if it has none, or %NULL if all are in use. @*idle is set if the thread
+ * was idle. Must be called with @sim->lock held.
+ */
+static struct sim_client *
+sim_client(struct ubi_sim *sim, long long real, int *idle)
+{
+  struct sim_client *c, *slot = NULL;
+
+  for (c = sim->clients; c < sim->clients + SIM_MAX_CLIENTS; c++)
+    {
+      if (c->owner == &sim_thread)
+	{
+	  *idle = real - c->seen > SIM_IDLE;
+	  return c;
+	}
+      if (slot == NULL && (c->owner == NULL || real - c->seen > SIM_IDLE))
+	slot = c;
+    }
+  if (slot)
+    slot->owner = &sim_thread;
+  *idle = 1;
+  return slot;
+}
+
+/*
+ * Wait until no active thread is too far behind the calling one, whose
+ * simulated time is @now; the time of a thread which was idle is moved
+ * forward to the others' instead. Must be called with @sim->lock held.
+ */
+static struct sim_client *
+sim_sync(struct ubi_sim *sim, long long *now)
+{
+  struct sim_client *me, *c;
+  long long real, min;
+  struct timespec ts;
+  int idle;
+
+  for (;;)
+    {
+      real = sim_real_now(sim);
+      me = sim_client(sim, real, &idle);
+      if (me == NULL)
+	return NULL;
+
+      min = LLONG_MAX;
+      for (c = sim->clients; c < sim->clients + SIM_MAX_CLIENTS; c++)
+	if (c != me && c->owner && real - c->seen <= SIM_IDLE)
+	  min = MIN(min, c->now);
+      if (idle && min != LLONG_MAX && *now < min)
+	*now = sim_thread.now = min;
+      me->now = *now;
+      me->seen = real;
+      if (min == LLONG_MAX || *now <= min + SIM_MAX_SKEW)
+	return me;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 1000000;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec += 1;
+	  ts.tv_nsec -= 1000000000;
+	}
+      pthread_cond_timedwait(&sim->tick, &sim->lock, &ts);
+    }
+}
+
+/*
+ * Make @r busy for @len ns in the first period it is free from time @t on.
+ * Returns the start of that period.
+ */
+static long long
+sim_reserve(struct sim_resource *r, long long t, long long len)
+{
+  int i;
+
+  t = MAX(t, r->floor);
+  for (i = 0; i < r->count; i++)
+    {
+      if (r->busy[i].end <= t)
+	continue;
+      if (r->busy[i].start >= t + len)
+	break;
+      t = r->busy[i].end;
+    }
+  if (len == 0)
+    return t;
+
+  if (r->count == SIM_HORIZON)
+    {
+      /* forget the oldest period, the new one may be it */
+      if (i == 0)
+	{
+	  r->floor = t + len;
+	  return t;
+	}
+      r->floor = r->busy[0].end;
+      i -= 1;
+      r->count -= 1;
+      memmove(&r->busy[0], &r->busy[1], i * sizeof(r->busy[0]));
+    }
+  memmove(&r->busy[i + 1], &r->busy[i], (r->count - i) * sizeof(r->busy[0]));
+  r->busy[i].start = t;
+  r->busy[i].end = t + len;
+  r->count += 1;
+  return t;
+}
+
+/*
+ * Run operation @op on @len bytes at offset @offset of LEB @lnum through
+ * the timing model, and wait until it is done.
+ */
+static void
+sim_delay(struct ubi_sim *sim, int op, int lnum, int offset, int len)
+{
+  const struct ubi_sim_timing *t = &sim->timing;
+  long long now, done, xfer, array;
+  struct sim_resource *die;
+  struct sim_client *me = NULL;
+  int io = sim->geo.min_io_size, pages;
+  struct timespec ts;
+
+  pthread_mutex_lock(&sim->lock);
+  if (!sim->timed)
+    {
+      pthread_mutex_unlock(&sim->lock);
+      return;
+    }
+
+  now = sim_now(sim);
+  if (t->flags & UBI_SIM_VIRTUAL_CLOCK)
+    me = sim_sync(sim, &now);
+  die = &sim->dies[lnum % t->dies];
+  pages = (offset + len + io - 1) / io - offset / io;
+  /* bytes at N MB/s take N^-1 us per byte */
+  xfer = t->bus_mbps ? len * 1000LL / t->bus_mbps : 0;
+
+  switch (op)
+    {
+    case SIM_READ:
+      /* pages go from the array to the page register, then on the bus */
+      array = pages * 1000LL * t->read_us;
+      done = sim_reserve(die, now, array) + array;
+      done = sim_reserve(&sim->bus, done, xfer) + xfer;
+      break;
+    case SIM_PROG:
+      array = pages * 1000LL * t->prog_us;
+      done = sim_reserve(&sim->bus, now, xfer) + xfer;
+      done = sim_reserve(die, done, array) + array;
+      break;
+    case SIM_ERASE:
+    case SIM_BG_ERASE:
+      array = 1000LL * t->erase_us;
+      done = sim_reserve(die, now, array) + array;
+      if (op == SIM_BG_ERASE)
+	done = now;
+      break;
+    default:
+      done = now;
+    }
+
+  if (t->flags & UBI_SIM_VIRTUAL_CLOCK)
+    {
+      sim_thread.now = done;
+      sim->vclock = MAX(sim->vclock, done);
+      if (me)
+	{
+	  me->now = done;
+	  pthread_cond_broadcast(&sim->tick);
+	}
+      pthread_mutex_unlock(&sim->lock);
+      return;
+    }
+  done += sim->base.tv_sec * 1000000000LL + sim->base.tv_nsec;
+  pthread_mutex_unlock(&sim->lock);
+
+  for (;;)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      now = done - ts.tv_sec * 1000000000LL - ts.tv_nsec;
+      if (now <= 0)
+	break;
+      ts.tv_sec = now / 1000000000LL;
+      ts.tv_nsec = now % 1000000000LL;
+      nanosleep(&ts, NULL);
+    }
+}
+
+/* Write %0xFF bytes all over LEB @lnum */
+static int
+sim_erase(struct ubi_volume_desc *desc, int lnum)
+{
+  struct ubi_sim *sim = desc->sim;
+  int leb_size = sim->geo.leb_size;
+
+  if (pwrite(desc->fd, sim->ff, leb_size, leb_size * (off_t) lnum)
+      != leb_size)
+    return -1;
+  return 0;
+}
+
+/* Returns the mapping state of LEB @lnum, looking at it the first time */
+static int
+sim_is_mapped(struct ubi_volume_desc *desc, int lnum)
+{
+  struct ubi_sim *sim = desc->sim;
+  int leb_size = sim->geo.leb_size, state;
+  char *buf;
+
+  pthread_mutex_lock(&sim->lock);
+  state = sim->mapped[lnum];
+  pthread_mutex_unlock(&sim->lock);
+  if (state != SIM_UNKNOWN)
+    return state;
+
+  buf = malloc(leb_size);
+  if (buf == NULL)
+    return -1;
+  if (pread(desc->fd, buf, leb_size, leb_size * (off_t) lnum) != leb_size)
+    {
+      free(buf);
+      if (errno == 0)
+	errno = EIO;
+      return -1;
+    }
+  state = __ubi_is_erased(buf, leb_size) ? SIM_UNMAPPED : SIM_MAPPED;
+  free(buf);
+
+  pthread_mutex_lock(&sim->lock);
+  if (sim->mapped[lnum] == SIM_UNKNOWN)
+    sim->mapped[lnum] = state;
+  state = sim->mapped[lnum];
+  pthread_mutex_unlock(&sim->lock);
+  return state;
+}
+
+static void
+sim_set_mapped(struct ubi_sim *sim, int lnum, int state)
+{
+  pthread_mutex_lock(&sim->lock);
+  sim->mapped[lnum] = state;
+  pthread_mutex_unlock(&sim->lock);
+}
+
+/**
+ * __ubi_sim_ioctl - emulate an ioctl of the UBI volume character device.
+ * @desc: simulated volume descriptor
+ * @cmd: ioctl command
+ * @arg: ioctl argument
+ *
+ * Returns what 'ioctl()' would: %-1 with errno set in case of failure, and
+ * otherwise %0, or the mapping state for %UBI_IOCEBISMAP.
+ */
+int
+__ubi_sim_ioctl(struct ubi_volume_desc *desc, unsigned long cmd, void *arg)
+{
+  struct ubi_sim *sim = desc->sim;
+  int lnum, err;
+
+  switch (cmd)
+    {
+    case UBI_IOCEBCH:
+      lnum = ((struct ubi_leb_change_req *) arg)->lnum;
+      if (sim_erase(desc, lnum))
+	return -1;
+      sim_set_mapped(sim, lnum, SIM_MAPPED);
+      /*
+       * The volume header and the data go to a new PEB, the old one is
+       * erased in background.
+       */
+      sim_delay(sim, SIM_PROG, lnum, 0, sim->geo.min_io_size
+		+ ((struct ubi_leb_change_req *) arg)->bytes);
+      sim_delay(sim, SIM_BG_ERASE, lnum, 0, 0);
+      return 0;
+
+    case UBI_IOCEBER:
+    case UBI_IOCEBUNMAP:
+      lnum = *(int *) arg;
+      if (sim_erase(desc, lnum))
+	return -1;
+      sim_set_mapped(sim, lnum, SIM_UNMAPPED);
+      sim_delay(sim, cmd == UBI_IOCEBER ? SIM_ERASE : SIM_BG_ERASE, lnum,
+		0, 0);
+      return 0;
+
+    case UBI_IOCEBMAP:
+      lnum = ((struct ubi_map_req *) arg)->lnum;
+      err = sim_is_mapped(desc, lnum);
+      if (err < 0)
+	return -1;
+      if (err == SIM_MAPPED)
+	{
+	  errno = EBADMSG;
+	  return -1;
+	}
+      sim_set_mapped(sim, lnum, SIM_MAPPED);
+      sim_delay(sim, SIM_PROG, lnum, 0, sim->geo.min_io_size);
+      return 0;
+
+    case UBI_IOCEBISMAP:
+      lnum = *(int *) arg;
+      if (lnum < 0 || lnum >= sim->geo.nr_lebs)
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+      return sim_is_mapped(desc, lnum);
+
+    default:
+      errno = ENOTTY;
+      return -1;
+    }
+}
+
+/**
+ * __ubi_sim_read - account for a read from a simulated volume.
+ * @desc: simulated volume descriptor
+ * @lnum: LEB read from
+ * @offset: offset in the LEB
+ * @len: length of the read
+ */
+void
+__ubi_sim_read(struct ubi_volume_desc *desc, int lnum, int offset, int len)
+{
+  sim_delay(desc->sim, SIM_READ, lnum, offset, len);
+}
+
+/**
+ * __ubi_sim_write - account for a write to a simulated volume.
+ * @desc: simulated volume descriptor
+ * @lnum: LEB written to
+ * @offset: offset in the LEB
+ * @len: length of the write
+ */
+void
+__ubi_sim_write(struct ubi_volume_desc *desc, int lnum, int offset, int len)
+{
+  struct ubi_sim *sim = desc->sim;
+  int state;
+
+  pthread_mutex_lock(&sim->lock);
+  state = sim->mapped[lnum];
+  sim->mapped[lnum] = SIM_MAPPED;
+  pthread_mutex_unlock(&sim->lock);
+  /* writing to an un-mapped LEB maps it first, like %UBI_IOCEBMAP */
+  if (state == SIM_UNMAPPED)
+    sim_delay(sim, SIM_PROG, lnum, 0, sim->geo.min_io_size);
+  sim_delay(sim, SIM_PROG, lnum, offset, len);
+}
+
+/**
+ * __ubi_sim_close - free the simulation state of a volume descriptor.
+ * @desc: simulated volume descriptor
+ */
+void
+__ubi_sim_close(struct ubi_volume_desc *desc)
+{
+  struct ubi_sim *sim = desc->sim;
+
+  desc->sim = NULL;
+  pthread_cond_destroy(&sim->tick);
+  pthread_mutex_destroy(&sim->lock);
+  free(sim->dies);
+  free(sim->mapped);
+  free(sim->ff);
+  free(sim);
+}
+
+/**
+ * ubi_sim_set_timing - set the timing model of a simulated volume.
+ * @desc: simulated volume descriptor
+ * @timing: the timing model, %NULL to run at the speed of the file
+ *
+ * The model starts with idle dies and bus, and a simulated time of %0.
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure; %-EINVAL is returned if @desc is not a simulated volume.
+ */
+int
+ubi_sim_set_timing(struct ubi_volume_desc *desc,
+		   const struct ubi_sim_timing *timing)
+{
+  struct ubi_sim *sim = desc->sim;
+  struct sim_resource *dies = NULL;
+
+  if (sim == NULL)
+    return -EINVAL;
+  if (timing)
+    {
+      if (timing->read_us < 0 || timing->prog_us < 0
+	  || timing->erase_us < 0 || timing->dies <= 0
+	  || timing->bus_mbps < 0 || timing->flags & ~UBI_SIM_VIRTUAL_CLOCK)
+	return -EINVAL;
+      dies = calloc(timing->dies, sizeof(struct sim_resource));
+      if (dies == NULL)
+	return -ENOMEM;
+    }
+
+  pthread_mutex_lock(&sim->lock);
+  free(sim->dies);
+  sim->dies = dies;
+  sim->timed = timing != NULL;
+  if (timing)
+    sim->timing = *timing;
+  memset(&sim->bus, 0, sizeof(sim->bus));
+  memset(sim->clients, 0, sizeof(sim->clients));
+  sim->vclock = 0;
+  sim->epoch = __sync_add_and_fetch(&sim_epochs, 1);
+  clock_gettime(CLOCK_MONOTONIC, &sim->base);
+  pthread_mutex_unlock(&sim->lock);
+  return 0;
+}
+
+/**
+ * ubi_sim_set_clock - set the simulated time of the calling thread.
+ * @desc: simulated volume descriptor
+ * @now: the new time, in nanoseconds
+ *
+ * A thread starts with the latest time reached by the other threads; this
+ * lets threads which stand for concurrent clients start at the same time.
+ * The other threads are kept in step with the calling one from then on, so
+ * the clock of all of them should be set before any does I/O.
+ *
+ * Returns %0 in case of success and %-EINVAL if @desc is not a simulated
+ * volume with a virtual clock.
+ */
+int
+ubi_sim_set_clock(struct ubi_volume_desc *desc, long long now)
+{
+  struct ubi_sim *sim = desc->sim;
+  struct sim_client *me;
+  long long real;
+  int err = -EINVAL, idle;
+
+  if (sim == NULL || now < 0)
+    return -EINVAL;
+  pthread_mutex_lock(&sim->lock);
+  if (sim->timed && sim->timing.flags & UBI_SIM_VIRTUAL_CLOCK)
+    {
+      sim_thread.epoch = sim->epoch;
+      sim_thread.now = now;
+      sim->vclock = MAX(sim->vclock, now);
+      /* other threads wait for this one from now on */
+      real = sim_real_now(sim);
+      me = sim_client(sim, real, &idle);
+      if (me)
+	{
+	  me->now = now;
+	  me->seen = real;
+	}
+      err = 0;
+    }
+  pthread_mutex_unlock(&sim->lock);
+  return err;
+}
+
+/**
+ * ubi_sim_clock - get the simulated time.
+ * @desc: simulated volume descriptor
+ *
+ * Returns the simulated time in nanoseconds since the timing model was set:
+ * the time of the calling thread with a virtual clock, the elapsed real
+ * time otherwise. %-EINVAL is returned if @desc is not a simulated volume
+ * with a timing model.
+ */
+long long
+ubi_sim_clock(struct ubi_volume_desc *desc)
+{
+  struct ubi_sim *sim = desc->sim;
+  long long now;
+
+  if (sim == NULL)
+    return -EINVAL;
+  pthread_mutex_lock(&sim->lock);
+  now = sim->timed ? sim_now(sim) : -EINVAL;
+  pthread_mutex_unlock(&sim->lock);
+  return now;
+}
+
+/**
+ * ubi_open_volume_sim - open a file-backed stand-in for a UBI volume.
+ * @path: file holding the volume
+ * @geo: volume geometry
+ * @mode: open mode (%UBI_READONLY, %UBI_READWRITE, %UBI_EXCLUSIVE)
+ *
+ * The file is created if needed when opening for writing, and is extended
+ * with %0xFF bytes, i.e. with un-mapped LEBs, if it is shorter than the
+ * volume. If @geo->nr_lebs is %0, the volume takes the whole file. The
+ * returned descriptor is used like one returned by 'ubi_open_volume()' and
+ * is closed by 'ubi_close_volume()'; its UBI device number is %-1.
+ *
+ * Returns the volume descriptor in case of success and %NULL in case of
+ * failure, with errno set.
+ */
+struct ubi_volume_desc *
+ubi_open_volume_sim(const char *path, const struct ubi_sim_geometry *geo,
+		    int mode)
+{
+  struct ubi_volume_desc *desc;
+  struct ubi_sim *sim;
+  struct stat st;
+  const char *name;
+  int flags, err, nr_lebs = geo->nr_lebs, lnum;
+
+  if (geo->leb_size <= 0 || geo->min_io_size <= 0 || nr_lebs < 0
+      || geo->leb_size % geo->min_io_size
+      || (geo->min_io_size & (geo->min_io_size - 1)))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  switch (mode)
+    {
+    case UBI_READONLY:
+      flags = O_RDONLY;
+      break;
+    case UBI_READWRITE:
+    case UBI_EXCLUSIVE:
+      flags = O_RDWR | O_CREAT;
+      break;
+    default:
+      errno = EINVAL;
+      return NULL;
+    }
+
+  desc = calloc(1, sizeof(struct ubi_volume_desc));
+  sim = calloc(1, sizeof(struct ubi_sim));
+  if (desc == NULL || sim == NULL)
+    goto failed;
+  desc->sim = sim;
+  desc->mode = mode;
+  desc->fd = open(path, flags, 0644);
+  if (desc->fd < 0)
+    goto failed;
+  if (mode == UBI_EXCLUSIVE && flock(desc->fd, LOCK_EX | LOCK_NB))
+    goto failed_close;
+  if (fstat(desc->fd, &st))
+    goto failed_close;
+  if (nr_lebs == 0)
+    nr_lebs = st.st_size / geo->leb_size;
+  if (nr_lebs == 0)
+    {
+      errno = EINVAL;
+      goto failed_close;
+    }
+
+  sim->geo = *geo;
+  sim->geo.nr_lebs = nr_lebs;
+  sim->mapped = malloc(nr_lebs);
+  sim->ff = malloc(geo->leb_size);
+  if (sim->mapped == NULL || sim->ff == NULL)
+    goto failed_close;
+  memset(sim->mapped, SIM_UNKNOWN, nr_lebs);
+  memset(sim->ff, 0xFF, geo->leb_size);
+  pthread_mutex_init(&sim->lock, NULL);
+  pthread_cond_init(&sim->tick, NULL);
+
+  /* new LEBs are un-mapped */
+  for (lnum = st.st_size / geo->leb_size; lnum < nr_lebs; lnum++)
+    {
+      if (mode == UBI_READONLY)
+	{
+	  errno = EROFS;
+	  goto failed_lock;
+	}
+      if (sim_erase(desc, lnum))
+	goto failed_lock;
+      sim->mapped[lnum] = SIM_UNMAPPED;
+    }
+
+  name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  desc->vi.name = strdup(name);
+  if (desc->vi.name == NULL)
+    goto failed_lock;
+  desc->vi.name_len = strlen(name);
+  desc->vi.ubi_num = -1;
+  desc->vi.vol_type = UBI_DYNAMIC_VOLUME;
+  desc->vi.alignment = 1;
+  desc->vi.size = desc->vi.used_ebs = nr_lebs;
+  desc->vi.usable_leb_size = geo->leb_size;
+  desc->vi.used_bytes = geo->leb_size * (long long) nr_lebs;
+  desc->di.ubi_num = -1;
+  desc->di.leb_size = geo->leb_size;
+  desc->di.min_io_size = geo->min_io_size;
+  __ubi_profile_open(desc);
+  return desc;
+
+failed_lock:
+  pthread_cond_destroy(&sim->tick);
+  pthread_mutex_destroy(&sim->lock);
+failed_close:
+  err = errno;
+  close(desc->fd);
+  errno = err;
+failed:
+  if (sim)
+    {
+      free(sim->mapped);
+      free(sim->ff);
+    }
+  free(sim);
+  free(desc);
+  return NULL;
+}
@@ -0,0 +1,200 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - vectorized buffer primitives.
+ *
+ * Scanning pages for erased state is done on every mount and every resumed
+ * LEB, and verified writes compare everything they write, so these use the
+ * vector unit the library is compiled for: AVX2 or SSE2 on x86 and NEON on
+ * AArch64, with a word-at-a-time fallback elsewhere. The vector loops combine
+ * a few vectors before testing them, which keeps the branch out of the inner
+ * loop; the price is that a difference is only noticed at the end of its
+ * block.
+ */
+
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/* Generic version, also used for the bytes the vector loops leave */
+static int
+is_erased_words(const unsigned char *p, size_t len)
+{
+  uint64_t acc = ~(uint64_t) 0, w;
+
+  for (; len >= 32; p += 32, len -= 32)
+    {
+      memcpy(&w, p, 8);
+      acc &= w;
+      memcpy(&w, p + 8, 8);
+      acc &= w;
+      memcpy(&w, p + 16, 8);
+      acc &= w;
+      memcpy(&w, p + 24, 8);
+      acc &= w;
+      if (acc != ~(uint64_t) 0)
+	return 0;
+    }
+  for (; len; p++, len--)
+    if (*p != 0xFF)
+      return 0;
+  return 1;
+}
+
+/**
+ * __ubi_is_erased - check whether a buffer only holds %0xFF bytes.
+ * @buf: the buffer
+ * @len: buffer length
+ *
+ * Returns %1 if all bytes of @buf are %0xFF and %0 otherwise.
+ */
+int
+__ubi_is_erased(const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi8(-1);
+  __m256i acc;
+
+  for (; len >= 128; p += 128, len -= 128)
+    {
+      acc = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) p),
+			     _mm256_loadu_si256((const __m256i *) (p + 32)));
+      acc = _mm256_and_si256(acc,
+			     _mm256_loadu_si256((const __m256i *) (p + 64)));
+      acc = _mm256_and_si256(acc,
+			     _mm256_loadu_si256((const __m256i *) (p + 96)));
+      if (!_mm256_testc_si256(acc, ones))
+	return 0;
+    }
+#elif defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi8(-1);
+  __m128i acc;
+
+  for (; len >= 64; p += 64, len -= 64)
+    {
+      acc = _mm_and_si128(_mm_loadu_si128((const __m128i *) p),
+			  _mm_loadu_si128((const __m128i *) (p + 16)));
+      acc = _mm_and_si128(acc, _mm_loadu_si128((const __m128i *) (p + 32)));
+      acc = _mm_and_si128(acc, _mm_loadu_si128((const __m128i *) (p + 48)));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, ones)) != 0xFFFF)
+	return 0;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint8x16_t acc;
+
+  for (; len >= 64; p += 64, len -= 64)
+    {
+      acc = vandq_u8(vld1q_u8(p), vld1q_u8(p + 16));
+      acc = vandq_u8(acc, vld1q_u8(p + 32));
+      acc = vandq_u8(acc, vld1q_u8(p + 48));
+      if (vminvq_u8(acc) != 0xFF)
+	return 0;
+    }
+#endif
+  return is_erased_words(p, len);
+}
+
+static int
+memeq_words(const unsigned char *a, const unsigned char *b, size_t len)
+{
+  uint64_t acc = 0, x, y;
+  int i;
+
+  for (; len >= 32; a += 32, b += 32, len -= 32)
+    {
+      for (i = 0; i < 32; i += 8)
+	{
+	  memcpy(&x, a + i, 8);
+	  memcpy(&y, b + i, 8);
+	  acc |= x ^ y;
+	}
+      if (acc)
+	return 0;
+    }
+  for (; len; a++, b++, len--)
+    if (*a != *b)
+      return 0;
+  return 1;
+}
+
+/**
+ * __ubi_memeq - check whether two buffers are equal.
+ * @a: first buffer
+ * @b: second buffer
+ * @len: buffers length
+ *
+ * Returns %1 if the buffers are equal and %0 otherwise.
+ */
+int
+__ubi_memeq(const void *a, const void *b, size_t len)
+{
+  const unsigned char *p = a, *q = b;
+
+#if defined(__AVX2__)
+  __m256i acc;
+  int i;
+
+  for (; len >= 128; p += 128, q += 128, len -= 128)
+    {
+      acc = _mm256_setzero_si256();
+      for (i = 0; i < 128; i += 32)
+	acc = _mm256_or_si256(acc, _mm256_xor_si256(
+	  _mm256_loadu_si256((const __m256i *) (p + i)),
+	  _mm256_loadu_si256((const __m256i *) (q + i))));
+      if (!_mm256_testz_si256(acc, acc))
+	return 0;
+    }
+#elif defined(__SSE2__)
+  __m128i acc;
+  int i;
+
+  for (; len >= 64; p += 64, q += 64, len -= 64)
+    {
+      acc = _mm_set1_epi8(-1);
+      for (i = 0; i < 64; i += 16)
+	acc = _mm_and_si128(acc, _mm_cmpeq_epi8(
+	  _mm_loadu_si128((const __m128i *) (p + i)),
+	  _mm_loadu_si128((const __m128i *) (q + i))));
+      if (_mm_movemask_epi8(acc) != 0xFFFF)
+	return 0;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint8x16_t acc;
+  int i;
+
+  for (; len >= 64; p += 64, q += 64, len -= 64)
+    {
+      acc = vdupq_n_u8(0);
+      for (i = 0; i < 64; i += 16)
+	acc = vorrq_u8(acc, veorq_u8(vld1q_u8(p + i), vld1q_u8(q + i)));
+      if (vmaxvq_u8(acc) != 0)
+	return 0;
+    }
+#endif
+  return memeq_words(p, q, len);
+}
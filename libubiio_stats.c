@@ -0,0 +1,257 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - shared memory statistics.
+ *
+ * Once exported, the counters of every volume the process does I/O on, and
+ * the queue depths of the executor devices, live in a file mapped by the
+ * process, normally in a tmpfs, which other processes map read-only to
+ * scrape them. The layout is described by &struct ubi_stats_shm in
+ * libubiio.h. Writers update the counters with relaxed atomic additions and
+ * never wait for readers, so scraping costs the I/O threads nothing but the
+ * cache line transfers.
+ *
+ * A slot is claimed for a volume or a device the first time it is used and
+ * is never given back. Volume descriptors cache their slot and look it up
+ * again when the statistics are exported anew. Old mappings are never
+ * removed, so that a thread still holding a slot of an old mapping is safe.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/* Non-zero while the counters are exported */
+int __ubi_stats_on;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ubi_stats_shm *stats_shm;
+static char stats_path[PATH_MAX];
+
+static long long
+stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Find or claim the slot of volume @vol_id of device @ubi_num */
+static struct ubi_stats_slot *
+stats_slot(int ubi_num, int vol_id)
+{
+  struct ubi_stats_slot *slot;
+  int i;
+
+  pthread_mutex_lock(&stats_lock);
+  slot = NULL;
+  for (i = 0; stats_shm != NULL && i < UBI_STATS_NR_SLOTS; i++)
+    {
+      slot = &stats_shm->slots[i];
+      if (slot->in_use == 0)
+	{
+	  slot->ubi_num = ubi_num;
+	  slot->vol_id = vol_id;
+	  /* readers see the slot only once its owner is set */
+	  __atomic_store_n(&slot->in_use, 1, __ATOMIC_RELEASE);
+	  break;
+	}
+      if (slot->ubi_num == ubi_num && slot->vol_id == vol_id)
+	break;
+      slot = NULL;
+    }
+  pthread_mutex_unlock(&stats_lock);
+  if (slot == NULL && stats_shm != NULL)
+    dbgmsg("stats: no slot left for %d:%d", ubi_num, vol_id);
+  return slot;
+}
+
+/**
+ * __ubi_stats_vol - get the statistics slot of a volume.
+ * @desc: volume descriptor
+ *
+ * Returns the slot, or %NULL if the statistics are not exported or there is
+ * no free slot left.
+ */
+struct ubi_stats_slot *
+__ubi_stats_vol(struct ubi_volume_desc *desc)
+{
+  struct ubi_stats_shm *shm = __atomic_load_n(&stats_shm, __ATOMIC_RELAXED);
+  struct ubi_stats_slot *slot;
+
+  if (shm == NULL)
+    return NULL;
+  /* threads racing here find the same slot */
+  slot = __atomic_load_n(&desc->stats, __ATOMIC_RELAXED);
+  if (slot < shm->slots || slot >= shm->slots + UBI_STATS_NR_SLOTS)
+    {
+      slot = stats_slot(desc->vi.ubi_num, desc->vi.vol_id);
+      __atomic_store_n(&desc->stats, slot, __ATOMIC_RELAXED);
+    }
+  return slot;
+}
+
+/**
+ * __ubi_stats_dev - get the statistics slot of a UBI device.
+ * @ubi_num: UBI device number
+ */
+struct ubi_stats_slot *
+__ubi_stats_dev(int ubi_num)
+{
+  return stats_slot(ubi_num, -1);
+}
+
+/**
+ * __ubi_stats_start - start timing an operation.
+ * @desc: volume descriptor the operation is done through
+ *
+ * Every operation starts here, so this is also where the scrubbers learn
+ * about foreground I/O. Returns the current time in nanoseconds, or %0 if
+ * the statistics are not exported and @desc is not captured.
+ */
+long long
+__ubi_stats_start(struct ubi_volume_desc *desc)
+{
+  if (__atomic_load_n(&__ubi_scrub_on, __ATOMIC_RELAXED))
+    __ubi_scrub_note_io();
+  if (!__atomic_load_n(&__ubi_stats_on, __ATOMIC_RELAXED)
+      && desc->capture == NULL)
+    return 0;
+  return stats_now();
+}
+
+/**
+ * __ubi_stats_account - account for a completed operation.
+ * @desc: volume descriptor
+ * @opcode: %UBI_OP_READ, %UBI_OP_WRITE, ...
+ * @len: bytes transferred
+ * @err: result of the operation
+ * @start: what '__ubi_stats_start()' returned before the operation
+ */
+void
+__ubi_stats_account(struct ubi_volume_desc *desc, int opcode, int len,
+		    int err, long long start)
+{
+  struct ubi_stats_slot *slot = __ubi_stats_vol(desc);
+  int op = opcode - 1, b = 0;
+  long long us;
+
+  /* statistics were off when the operation started, its latency is unknown */
+  if (start == 0 || slot == NULL || op < 0 || op >= UBI_STATS_NR_OPS)
+    return;
+  us = (stats_now() - start) / 1000;
+  while (us > 1 && b < UBI_STATS_NR_BUCKETS - 1)
+    {
+      us >>= 1;
+      b += 1;
+    }
+  __atomic_fetch_add(&slot->ops[op], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&slot->lat[op][b], 1, __ATOMIC_RELAXED);
+  if (err)
+    __atomic_fetch_add(&slot->errors[op], 1, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&slot->bytes[op], len, __ATOMIC_RELAXED);
+}
+
+/**
+ * ubi_stats_export - publish the library counters in shared memory.
+ * @path: file to map the counters from, or %NULL for
+ *        "/dev/shm/libubiio.<pid>"
+ *
+ * The file is created, or truncated if it exists. Statistics can only be
+ * exported to one file at a time. Returns %0 in case of success and a
+ * negative error code in case of failure.
+ */
+int
+ubi_stats_export(const char *path)
+{
+  struct ubi_stats_shm *shm;
+  int fd, err = 0;
+
+  pthread_mutex_lock(&stats_lock);
+  if (__ubi_stats_on)
+    {
+      err = -EBUSY;
+      goto out;
+    }
+  if (path == NULL)
+    snprintf(stats_path, sizeof(stats_path), "/dev/shm/libubiio.%d",
+	     (int) getpid());
+  else
+    snprintf(stats_path, sizeof(stats_path), "%s", path);
+
+  fd = open(stats_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      err = -errno;
+      sys_errmsg("cannot create \"%s\"", stats_path);
+      goto out;
+    }
+  if (ftruncate(fd, sizeof(struct ubi_stats_shm)))
+    {
+      err = -errno;
+      close(fd);
+      goto out;
+    }
+  shm = mmap(NULL, sizeof(struct ubi_stats_shm), PROT_READ | PROT_WRITE,
+	     MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED)
+    {
+      err = -errno;
+      goto out;
+    }
+
+  /* a previous export keeps its mapping, see the top of the file */
+  shm->version = UBI_STATS_VERSION;
+  shm->size = sizeof(struct ubi_stats_shm);
+  shm->nr_slots = UBI_STATS_NR_SLOTS;
+  shm->pid = getpid();
+  __atomic_store_n(&shm->magic, UBI_STATS_MAGIC, __ATOMIC_RELEASE);
+  __atomic_store_n(&stats_shm, shm, __ATOMIC_RELAXED);
+  __atomic_store_n(&__ubi_stats_on, 1, __ATOMIC_RELAXED);
+
+out:
+  pthread_mutex_unlock(&stats_lock);
+  return err;
+}
+
+/**
+ * ubi_stats_unexport - stop publishing the library counters.
+ *
+ * The file is removed and the counters are not updated anymore.
+ */
+void
+ubi_stats_unexport(void)
+{
+  pthread_mutex_lock(&stats_lock);
+  if (__ubi_stats_on)
+    {
+      __atomic_store_n(&__ubi_stats_on, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&stats_shm, NULL, __ATOMIC_RELAXED);
+      unlink(stats_path);
+    }
+  pthread_mutex_unlock(&stats_lock);
+}
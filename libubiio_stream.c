@@ -0,0 +1,352 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - byte streams.
+ *
+ * A stream reads and writes a volume as one sequence of bytes, volume
+ * address after volume address, over LEB boundaries. The volume character
+ * device crosses LEBs by itself, so a transfer is one system call whatever
+ * its length, up to %STREAM_MAX_IO.
+ *
+ * The stream has one buffer. Reading, it holds the data following what the
+ * caller asked for, and the part of a request larger than the buffer goes
+ * to the caller's memory in the same 'preadv()' as the next buffer. Writing,
+ * it holds the data which does not make a whole number of minimal I/O units
+ * yet; once there is a buffer worth of data, the buffered head and as much
+ * of the caller's data as makes whole units go out in one 'pwritev()'. The
+ * UBI volume character device writes each segment of a 'pwritev()' on its
+ * own, and only takes whole units, so the head is first completed to a unit
+ * boundary with the caller's data.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define STREAM_DEFAULT_BUF	(64 * 1024)
+#define STREAM_MAX_IO		(1 << 30)
+
+/**
+ * struct ubi_stream - byte stream over a volume.
+ * @desc: volume descriptor
+ * @size: volume size in bytes
+ * @min_io: minimal I/O unit size
+ * @buf_size: size of @buf, a multiple of @min_io
+ * @pos: current position
+ * @buf: the buffer
+ * @buf_addr: volume address of the first byte of @buf
+ * @buf_len: how many bytes of @buf are valid
+ * @dirty: @buf holds data to write, and @pos is @buf_addr + @buf_len
+ */
+struct ubi_stream
+{
+  struct ubi_volume_desc *desc;
+  long long size;
+  int min_io;
+  int buf_size;
+  long long pos;
+  char *buf;
+  long long buf_addr;
+  int buf_len;
+  int dirty;
+};
+
+/**
+ * ubi_stream_open - open a byte stream over a volume.
+ * @desc: volume descriptor
+ * @buf_size: buffer size, or %0 for the larger of the read and write sizes of
+ *            the device profile, or 64KiB if there is no profile; it is
+ *            rounded up to a multiple of the minimal I/O unit size
+ *
+ * The stream starts at address %0. Its buffer only sees the I/O done through
+ * the stream: the volume must not be written by other means meanwhile.
+ *
+ * Returns the stream in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_stream *
+ubi_stream_open(struct ubi_volume_desc *desc, int buf_size)
+{
+  struct ubi_stream *s;
+  int err;
+
+  if (buf_size < 0 || buf_size > STREAM_MAX_IO)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  s = calloc(1, sizeof(struct ubi_stream));
+  if (s == NULL)
+    return NULL;
+  s->desc = desc;
+  s->size = desc->vi.used_bytes;
+  s->min_io = desc->di.min_io_size;
+  if (buf_size == 0 && desc->profile)
+    buf_size = MAX(desc->profile->read_size, desc->profile->write_size);
+  else if (buf_size == 0)
+    buf_size = STREAM_DEFAULT_BUF;
+  s->buf_size = (buf_size + s->min_io - 1) / s->min_io * s->min_io;
+  err = posix_memalign((void **) &s->buf, MAX(getpagesize(), s->min_io),
+		       s->buf_size);
+  if (err)
+    {
+      free(s);
+      errno = err;
+      return NULL;
+    }
+  return s;
+}
+
+/**
+ * ubi_stream_flush - write the buffered data.
+ * @s: the stream
+ *
+ * If the data does not end on a minimal I/O unit boundary, the last unit is
+ * padded with 0xFF bytes and the position moves to the end of the padding:
+ * flash cannot be written twice, so the unit is done with.
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_stream_flush(struct ubi_stream *s)
+{
+  int len, err;
+
+  if (!s->dirty)
+    return 0;
+  if (s->buf_len)
+    {
+      len = (s->buf_len + s->min_io - 1) / s->min_io * s->min_io;
+      memset(s->buf + s->buf_len, 0xFF, len - s->buf_len);
+      err = ubi_vol_write(s->desc, s->buf, len, s->buf_addr);
+      if (err)
+	return err;
+      s->pos = s->buf_addr + len;
+    }
+  s->dirty = 0;
+  s->buf_len = 0;
+  return 0;
+}
+
+/**
+ * ubi_stream_close - flush and free a byte stream.
+ * @s: the stream
+ *
+ * The stream is freed even if flushing fails. Returns %0 in case of success
+ * and the error of 'ubi_stream_flush()' in case of failure.
+ */
+int
+ubi_stream_close(struct ubi_stream *s)
+{
+  int err = ubi_stream_flush(s);
+
+  free(s->buf);
+  free(s);
+  return err;
+}
+
+/**
+ * ubi_stream_seek - move the position of a byte stream.
+ * @s: the stream
+ * @offset: where to, relative to @whence
+ * @whence: %SEEK_SET, %SEEK_CUR or %SEEK_END, as for 'lseek()'
+ *
+ * Moving away from buffered data to write flushes it first. Returns the new
+ * position in case of success and a negative error code in case of failure.
+ */
+long long
+ubi_stream_seek(struct ubi_stream *s, long long offset, int whence)
+{
+  long long pos;
+  int err;
+
+  if (whence == SEEK_SET)
+    pos = offset;
+  else if (whence == SEEK_CUR)
+    pos = s->pos + offset;
+  else if (whence == SEEK_END)
+    pos = s->size + offset;
+  else
+    return -EINVAL;
+  if (pos < 0 || pos > s->size)
+    return -EINVAL;
+
+  if (s->dirty && pos != s->pos)
+    {
+      err = ubi_stream_flush(s);
+      if (err)
+	return err;
+    }
+  s->pos = pos;
+  return pos;
+}
+
+/**
+ * ubi_stream_read - read from a byte stream.
+ * @s: the stream
+ * @buf: where to store the data
+ * @len: how many bytes to read
+ *
+ * Buffered data to write is flushed first. Returns the number of bytes read,
+ * less than @len only at the end of the volume or if an error stopped the
+ * transfer midway, and a negative error code if nothing could be read.
+ */
+ssize_t
+ubi_stream_read(struct ubi_stream *s, void *buf, size_t len)
+{
+  struct iovec iov[2];
+  char *p = buf;
+  size_t done = 0, n;
+  int direct, fill, cnt, err;
+
+  err = ubi_stream_flush(s);
+  if (err)
+    return err;
+  len = MIN(len, (size_t) (s->size - s->pos));
+
+  while (done < len)
+    {
+      if (s->pos >= s->buf_addr && s->pos < s->buf_addr + s->buf_len)
+	{
+	  n = MIN(len - done, (size_t) (s->buf_addr + s->buf_len - s->pos));
+	  memcpy(p + done, s->buf + (s->pos - s->buf_addr), n);
+	  done += n;
+	  s->pos += n;
+	  continue;
+	}
+
+      /* what does not fit in the buffer goes straight to the caller */
+      n = len - done;
+      direct = n >= (size_t) s->buf_size ? MIN(n, STREAM_MAX_IO) : 0;
+      fill = MIN(s->buf_size, s->size - s->pos - direct);
+      cnt = 0;
+      if (direct)
+	{
+	  iov[cnt].iov_base = p + done;
+	  iov[cnt++].iov_len = direct;
+	}
+      if (fill)
+	{
+	  iov[cnt].iov_base = s->buf;
+	  iov[cnt++].iov_len = fill;
+	}
+      s->buf_len = 0;
+      err = __ubi_vol_readv(s->desc, iov, cnt, s->pos);
+      if (err)
+	return done ? (ssize_t) done : err;
+      s->buf_addr = s->pos + direct;
+      s->buf_len = fill;
+      done += direct;
+      s->pos += direct;
+    }
+  return done;
+}
+
+/**
+ * ubi_stream_write - write to a byte stream.
+ * @s: the stream
+ * @buf: the data
+ * @len: how many bytes to write
+ *
+ * Writing has to start at a minimal I/O unit boundary, and goes on from
+ * there as long as the position is not moved. The data is buffered until
+ * there is a buffer worth of it; see 'ubi_stream_flush()'.
+ *
+ * Returns the number of bytes written, less than @len only if an error
+ * stopped the transfer midway, and a negative error code if nothing could be
+ * written: %-EINVAL if the position is not aligned, %-ENOSPC if the data
+ * does not fit in the volume.
+ */
+ssize_t
+ubi_stream_write(struct ubi_stream *s, const void *buf, size_t len)
+{
+  struct ubi_volume_desc *desc = s->desc;
+  struct iovec iov[2];
+  const char *p = buf;
+  size_t done = 0, pad, k;
+  int cnt, err;
+
+  if (desc->mode == UBI_READONLY || desc->vi.vol_type == UBI_STATIC_VOLUME)
+    return -EROFS;
+  if (desc->vi.upd_marker)
+    return -EBADF;
+  if (len > (size_t) (s->size - s->pos))
+    return -ENOSPC;
+  if (!s->dirty)
+    {
+      if (s->pos & (s->min_io - 1))
+	return -EINVAL;
+      s->buf_addr = s->pos;
+      s->buf_len = 0;
+      s->dirty = 1;
+    }
+
+  while (len)
+    {
+      if (s->buf_len + len < (size_t) s->buf_size)
+	{
+	  memcpy(s->buf + s->buf_len, p, len);
+	  s->buf_len += len;
+	  s->pos += len;
+	  done += len;
+	  break;
+	}
+
+      /*
+       * Complete the buffered head to whole units, there is room for it as
+       * the buffer size is a multiple of the unit; then the rest of the data
+       * starts on a boundary.
+       */
+      pad = MIN(-(size_t) s->buf_len & (s->min_io - 1), len);
+      memcpy(s->buf + s->buf_len, p, pad);
+      s->buf_len += pad;
+      s->pos += pad;
+      p += pad;
+      len -= pad;
+      done += pad;
+
+      /* the buffered head and the whole units of the caller's data */
+      k = MIN(len, (size_t) (STREAM_MAX_IO - s->buf_len))
+	& ~(size_t) (s->min_io - 1);
+      cnt = 0;
+      if (s->buf_len)
+	{
+	  iov[cnt].iov_base = s->buf;
+	  iov[cnt++].iov_len = s->buf_len;
+	}
+      if (k)
+	{
+	  iov[cnt].iov_base = (void *) p;
+	  iov[cnt++].iov_len = k;
+	}
+      err = __ubi_vol_writev(desc, iov, cnt, s->buf_addr);
+      if (err)
+	return done ? (ssize_t) done : err;
+      s->buf_addr += s->buf_len + k;
+      s->buf_len = 0;
+      s->pos += k;
+      p += k;
+      len -= k;
+      done += k;
+    }
+  return done;
+}
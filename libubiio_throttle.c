@@ -0,0 +1,325 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - I/O throttling.
+ *
+ * A throttle is a group of token buckets, for bytes, operations and
+ * erasures, shared by the volume descriptors attached to it. Buckets fill at
+ * their rate up to a burst of %burst_ms worth of tokens, and every operation
+ * of an attached descriptor takes its cost from them before it runs. Changes
+ * and un-maps count as erasures, since UBI erases the old eraseblock. An
+ * operation larger than a bucket goes once the bucket is full, and leaves it
+ * in debt.
+ *
+ * What an operation does when the tokens are not there depends on the mode:
+ * %UBI_THROTTLE_BLOCK waits for them, %UBI_THROTTLE_NOWAIT fails with
+ * %-EAGAIN and %UBI_THROTTLE_DELAY takes them anyway and sleeps until the
+ * debt is paid back. Delayed operations thus go in the order they came, which
+ * blocked ones racing for the tokens do not.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define THROTTLE_DEFAULT_BURST_MS	100
+
+enum
+{
+  THROTTLE_BYTES,
+  THROTTLE_OPS,
+  THROTTLE_ERASES,
+  THROTTLE_NR_BUCKETS
+};
+
+static const double no_cost[THROTTLE_NR_BUCKETS];
+
+/**
+ * struct throttle_bucket - a token bucket.
+ * @rate: tokens added per second, %0 for no limit
+ * @cap: most tokens the bucket holds
+ * @tokens: tokens in the bucket, negative when in debt
+ */
+struct throttle_bucket
+{
+  double rate;
+  double cap;
+  double tokens;
+};
+
+/**
+ * struct ubi_throttle - a group of token buckets.
+ * @mode: %UBI_THROTTLE_BLOCK, %UBI_THROTTLE_NOWAIT or %UBI_THROTTLE_DELAY
+ * @lock: protects all the fields below
+ * @users: number of descriptors attached
+ * @last_ns: when the buckets were last filled
+ * @buckets: the buckets
+ * @stats: statistics
+ */
+struct ubi_throttle
+{
+  int mode;
+  pthread_mutex_t lock;
+  int users;
+  long long last_ns;
+  struct throttle_bucket buckets[THROTTLE_NR_BUCKETS];
+  struct ubi_throttle_stats stats;
+};
+
+static long long
+throttle_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+throttle_sleep(long long ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  nanosleep(&ts, NULL);
+}
+
+/* Fill the buckets up to now, called with @thr->lock held */
+static void
+throttle_fill(struct ubi_throttle *thr)
+{
+  struct throttle_bucket *b;
+  long long now = throttle_now();
+  double secs = (now - thr->last_ns) / 1e9;
+  int i;
+
+  thr->last_ns = now;
+  for (i = 0; i < THROTTLE_NR_BUCKETS; i++)
+    {
+      b = &thr->buckets[i];
+      b->tokens = MIN(b->tokens + b->rate * secs, b->cap);
+    }
+}
+
+/*
+ * How long to wait, in nanoseconds, until the buckets hold @cost or are
+ * full, called with @thr->lock held.
+ */
+static long long
+throttle_wait_ns(struct ubi_throttle *thr, const double *cost)
+{
+  struct throttle_bucket *b;
+  double need, wait = 0;
+  int i;
+
+  for (i = 0; i < THROTTLE_NR_BUCKETS; i++)
+    {
+      b = &thr->buckets[i];
+      need = MIN(cost[i], b->cap);
+      if (b->rate && b->tokens < need)
+	wait = MAX(wait, (need - b->tokens) / b->rate);
+    }
+  return wait * 1e9 + (wait > 0);
+}
+
+/* Take @cost from the buckets, called with @thr->lock held */
+static void
+throttle_take(struct ubi_throttle *thr, const double *cost)
+{
+  int i;
+
+  for (i = 0; i < THROTTLE_NR_BUCKETS; i++)
+    if (thr->buckets[i].rate)
+      thr->buckets[i].tokens -= cost[i];
+}
+
+/**
+ * __ubi_throttle - take the tokens of an operation.
+ * @thr: the throttle
+ * @opcode: %UBI_OP_READ, %UBI_OP_WRITE, ...
+ * @len: bytes transferred
+ *
+ * Returns %0 when the operation may go, after waiting if need be, and
+ * %-EAGAIN if it has to be retried later.
+ */
+int
+__ubi_throttle(struct ubi_throttle *thr, int opcode, int len)
+{
+  double cost[THROTTLE_NR_BUCKETS];
+  long long wait, waited = 0;
+
+  cost[THROTTLE_BYTES] = len;
+  cost[THROTTLE_OPS] = 1;
+  cost[THROTTLE_ERASES] = opcode == UBI_OP_ERASE || opcode == UBI_OP_UNMAP
+    || opcode == UBI_OP_CHANGE;
+
+  pthread_mutex_lock(&thr->lock);
+  throttle_fill(thr);
+  wait = throttle_wait_ns(thr, cost);
+  if (wait && thr->mode == UBI_THROTTLE_NOWAIT)
+    {
+      thr->stats.rejected += 1;
+      pthread_mutex_unlock(&thr->lock);
+      return -EAGAIN;
+    }
+
+  if (thr->mode == UBI_THROTTLE_DELAY)
+    {
+      throttle_take(thr, cost);
+      wait = throttle_wait_ns(thr, no_cost);
+      if (wait)
+	{
+	  pthread_mutex_unlock(&thr->lock);
+	  throttle_sleep(wait);
+	  waited = wait;
+	  pthread_mutex_lock(&thr->lock);
+	}
+    }
+  else
+    {
+      while (wait)
+	{
+	  pthread_mutex_unlock(&thr->lock);
+	  throttle_sleep(wait);
+	  waited += wait;
+	  pthread_mutex_lock(&thr->lock);
+	  throttle_fill(thr);
+	  wait = throttle_wait_ns(thr, cost);
+	}
+      throttle_take(thr, cost);
+    }
+
+  thr->stats.ops += 1;
+  thr->stats.bytes += len;
+  thr->stats.erases += cost[THROTTLE_ERASES];
+  if (waited)
+    {
+      thr->stats.throttled += 1;
+      thr->stats.wait_us += waited / 1000;
+    }
+  pthread_mutex_unlock(&thr->lock);
+  return 0;
+}
+
+/**
+ * ubi_throttle_create - create a throttle.
+ * @cfg: limits and mode
+ *
+ * Returns the throttle in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_throttle *
+ubi_throttle_create(const struct ubi_throttle_config *cfg)
+{
+  struct ubi_throttle *thr;
+  double burst;
+  int i;
+
+  if (cfg->max_bps < 0 || cfg->max_ops < 0 || cfg->max_erases < 0
+      || cfg->burst_ms < 0 || (cfg->mode != UBI_THROTTLE_BLOCK
+			       && cfg->mode != UBI_THROTTLE_NOWAIT
+			       && cfg->mode != UBI_THROTTLE_DELAY))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  thr = calloc(1, sizeof(struct ubi_throttle));
+  if (thr == NULL)
+    return NULL;
+  thr->mode = cfg->mode;
+  thr->buckets[THROTTLE_BYTES].rate = cfg->max_bps;
+  thr->buckets[THROTTLE_OPS].rate = cfg->max_ops;
+  thr->buckets[THROTTLE_ERASES].rate = cfg->max_erases;
+  burst = (cfg->burst_ms ? cfg->burst_ms : THROTTLE_DEFAULT_BURST_MS) / 1000.0;
+  for (i = 0; i < THROTTLE_NR_BUCKETS; i++)
+    {
+      /* at least one operation's worth, so that the rates are reachable */
+      thr->buckets[i].cap = MAX(thr->buckets[i].rate * burst, 1);
+      thr->buckets[i].tokens = thr->buckets[i].cap;
+    }
+  thr->last_ns = throttle_now();
+  pthread_mutex_init(&thr->lock, NULL);
+  return thr;
+}
+
+/**
+ * ubi_throttle_destroy - destroy a throttle.
+ * @thr: the throttle
+ *
+ * Returns %0 in case of success and %-EBUSY if descriptors are still
+ * attached to the throttle.
+ */
+int
+ubi_throttle_destroy(struct ubi_throttle *thr)
+{
+  pthread_mutex_lock(&thr->lock);
+  if (thr->users)
+    {
+      pthread_mutex_unlock(&thr->lock);
+      return -EBUSY;
+    }
+  pthread_mutex_unlock(&thr->lock);
+  pthread_mutex_destroy(&thr->lock);
+  free(thr);
+  return 0;
+}
+
+/**
+ * ubi_throttle_attach - meter the I/O of a volume descriptor.
+ * @desc: volume descriptor
+ * @thr: the throttle, or %NULL to detach @desc from its throttle
+ *
+ * Several descriptors attached to the same throttle share its budget. This
+ * must not be called while I/O is going on through @desc. Closing @desc
+ * detaches it.
+ */
+void
+ubi_throttle_attach(struct ubi_volume_desc *desc, struct ubi_throttle *thr)
+{
+  if (desc->throttle)
+    {
+      pthread_mutex_lock(&desc->throttle->lock);
+      desc->throttle->users -= 1;
+      pthread_mutex_unlock(&desc->throttle->lock);
+    }
+  desc->throttle = thr;
+  if (thr)
+    {
+      pthread_mutex_lock(&thr->lock);
+      thr->users += 1;
+      pthread_mutex_unlock(&thr->lock);
+    }
+}
+
+/**
+ * ubi_throttle_get_stats - get throttling statistics.
+ * @thr: the throttle
+ * @stats: the statistics are stored here
+ */
+void
+ubi_throttle_get_stats(struct ubi_throttle *thr,
+		       struct ubi_throttle_stats *stats)
+{
+  pthread_mutex_lock(&thr->lock);
+  memcpy(stats, &thr->stats, sizeof(*stats));
+  pthread_mutex_unlock(&thr->lock);
+}
@@ -0,0 +1,782 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - multi-LEB transactions.
+ *
+ * A transactional volume exposes fewer LEBs than the dynamic volume holding
+ * it: LEB 0 of the volume holds the commit record, which maps every exposed
+ * LEB to a LEB of the volume or to nothing, and the other LEBs of the volume
+ * hold the data of the exposed LEBs or are free. A transaction writes the new
+ * contents of the LEBs it changes to free LEBs, the shadow LEBs, and commits
+ * by writing a new commit record with 'ubi_leb_change()', which UBI does
+ * atomically: after an unclean reboot, either all the changes of the
+ * transaction are visible or none is. The LEBs the new record no longer
+ * refers to are then un-mapped.
+ *
+ * Transactions committing while a record is being written wait for it, and
+ * the first of them then writes one record for all of them, so concurrent
+ * transactions share the record write. Two transactions may not change the
+ * same LEB at the same time.
+ *
+ * Neither shadow LEBs of transactions which did not commit nor LEBs un-mapped
+ * after a commit survive an unclean reboot reliably, so opening the volume
+ * un-maps every LEB the commit record does not refer to. The commit record
+ * uses host byte order.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define TX_REC_MAGIC	0x55425458	/* "UBTX" */
+
+/* LEB of the volume holding the commit record */
+#define TX_REC_LEB	0
+
+/* States of the LEBs of the volume */
+enum
+{
+  TX_FREE = 0,
+  TX_USED,
+  TX_SHADOW
+};
+
+/**
+ * struct tx_record - commit record header.
+ * @magic: %TX_REC_MAGIC
+ * @crc: CRC of the record, starting at @seqnum and ending with the map
+ * @seqnum: number of commit records written to the volume
+ * @nr_lebs: number of exposed LEBs
+ * @padding: reserved, zero
+ *
+ * The header is followed by @nr_lebs 32-bit LEB numbers of the volume, %-1
+ * for exposed LEBs which are not mapped.
+ */
+struct tx_record
+{
+  uint32_t magic;
+  uint32_t crc;
+  uint64_t seqnum;
+  uint32_t nr_lebs;
+  uint32_t padding;
+};
+
+/**
+ * struct tx_ent - a LEB changed by a transaction.
+ * @lnum: the exposed LEB
+ * @shadow: LEB of the volume holding its new contents, %-1 to un-map it
+ */
+struct tx_ent
+{
+  int lnum;
+  int shadow;
+};
+
+/**
+ * struct ubi_tx - a transaction.
+ * @txv: the volume
+ * @nr: number of entries in @ents
+ * @size: number of entries allocated in @ents
+ * @ents: the changed LEBs
+ * @err: sticky error, set when writing a shadow LEB failed
+ * @done: set once the transaction has been committed or failed to
+ * @next: next transaction waiting for the same commit record
+ */
+struct ubi_tx
+{
+  struct ubi_txv *txv;
+  int nr;
+  int size;
+  struct tx_ent *ents;
+  int err;
+  int done;
+  struct ubi_tx *next;
+};
+
+/**
+ * struct ubi_txv - transactional volume.
+ * @desc: volume descriptor
+ * @leb_size: usable LEB size
+ * @nr_lebs: number of exposed LEBs
+ * @nr_pebs: number of LEBs of the volume
+ * @rec_size: size of the commit record, aligned to the minimal I/O unit
+ * @rec: commit record buffer, used by the thread which set @committing
+ * @maplock: held for reading while a LEB of @map is read, and for writing
+ *           to change @map
+ * @lock: protects all the fields below
+ * @cond: signalled when a commit record has been written
+ * @map: for each exposed LEB, the LEB of the volume holding it, or %-1
+ * @state: for each LEB of the volume, %TX_FREE, %TX_USED or %TX_SHADOW
+ * @owner: for each exposed LEB, the transaction changing it, if any
+ * @cursor: where to start looking for a free LEB, to spread the writes
+ * @committing: set while a thread writes a commit record
+ * @queue: transactions waiting for the next commit record
+ * @tail: where the next committing transaction is queued
+ * @seqnum: sequence number of the last commit record
+ * @stats: statistics
+ */
+struct ubi_txv
+{
+  struct ubi_volume_desc *desc;
+  int leb_size;
+  int nr_lebs;
+  int nr_pebs;
+  int rec_size;
+  char *rec;
+  pthread_rwlock_t maplock;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int *map;
+  char *state;
+  struct ubi_tx **owner;
+  int cursor;
+  int committing;
+  struct ubi_tx *queue;
+  struct ubi_tx **tail;
+  uint64_t seqnum;
+  struct ubi_txv_stats stats;
+};
+
+/* Un-map a LEB of the volume the commit record does not refer to */
+static void
+tx_discard(struct ubi_txv *txv, int pnum)
+{
+  int err;
+
+  err = ubi_leb_unmap(txv->desc, pnum);
+  if (err)
+    warnmsg("tx: cannot un-map LEB %d, error %d", pnum, err);
+}
+
+/* Take a free LEB of the volume, called with @txv->lock held */
+static int
+tx_alloc(struct ubi_txv *txv)
+{
+  int i, pnum;
+
+  for (i = 0; i < txv->nr_pebs; i++)
+    {
+      pnum = txv->cursor;
+      txv->cursor = txv->cursor + 1 < txv->nr_pebs ? txv->cursor + 1 : 1;
+      if (pnum != TX_REC_LEB && txv->state[pnum] == TX_FREE)
+	{
+	  txv->state[pnum] = TX_SHADOW;
+	  return pnum;
+	}
+    }
+  return -ENOSPC;
+}
+
+/*
+ * Give up the changes of @tx, called with @txv->lock held. The shadow LEBs are
+ * returned to @shadows, to be un-mapped without the lock held, and their
+ * number is returned.
+ */
+static int
+tx_release(struct ubi_tx *tx, int *shadows)
+{
+  struct ubi_txv *txv = tx->txv;
+  int i, n = 0;
+
+  for (i = 0; i < tx->nr; i++)
+    {
+      txv->owner[tx->ents[i].lnum] = NULL;
+      if (tx->ents[i].shadow >= 0)
+	shadows[n++] = tx->ents[i].shadow;
+    }
+  return n;
+}
+
+/* Fill the commit record buffer with @map */
+static void
+tx_fill_record(struct ubi_txv *txv, const int *map, uint64_t seqnum)
+{
+  struct tx_record *rec = (struct tx_record *) txv->rec;
+  int32_t *ent = (int32_t *) (rec + 1);
+  int i;
+
+  memset(txv->rec, 0, txv->rec_size);
+  rec->magic = TX_REC_MAGIC;
+  rec->seqnum = seqnum;
+  rec->nr_lebs = txv->nr_lebs;
+  for (i = 0; i < txv->nr_lebs; i++)
+    ent[i] = map[i];
+  rec->crc = __ubi_crc32(UBI_CRC32_INIT, &rec->seqnum,
+			 sizeof(*rec) - 8 + txv->nr_lebs * sizeof(int32_t));
+}
+
+/*
+ * Write one commit record for the transactions of @batch, called by the thread
+ * which set @txv->committing, without @txv->lock held. Returns %0 or a
+ * negative error code.
+ */
+static int
+tx_commit_batch(struct ubi_txv *txv, struct ubi_tx *batch)
+{
+  struct ubi_tx *tx;
+  int *map, *old, nr_old = 0, nr_tx = 0, i, lnum, err;
+
+  map = malloc(txv->nr_lebs * sizeof(int));
+  old = malloc(txv->nr_pebs * sizeof(int));
+  if (map == NULL || old == NULL)
+    {
+      free(old);
+      free(map);
+      return -ENOMEM;
+    }
+
+  /* nobody else changes the map while @committing is set */
+  memcpy(map, txv->map, txv->nr_lebs * sizeof(int));
+  for (tx = batch; tx != NULL; tx = tx->next, nr_tx++)
+    for (i = 0; i < tx->nr; i++)
+      map[tx->ents[i].lnum] = tx->ents[i].shadow;
+
+  tx_fill_record(txv, map, txv->seqnum + 1);
+  err = ubi_leb_change(txv->desc, TX_REC_LEB, txv->rec, txv->rec_size,
+		       UBI_LONGTERM);
+  if (err)
+    {
+      errmsg("tx: cannot write the commit record, error %d", err);
+      free(old);
+      free(map);
+      return err;
+    }
+
+  /* readers of the LEBs about to be un-mapped are done after this */
+  pthread_rwlock_wrlock(&txv->maplock);
+  pthread_mutex_lock(&txv->lock);
+  for (tx = batch; tx != NULL; tx = tx->next)
+    for (i = 0; i < tx->nr; i++)
+      {
+	lnum = tx->ents[i].lnum;
+	if (txv->map[lnum] >= 0)
+	  old[nr_old++] = txv->map[lnum];
+	if (tx->ents[i].shadow >= 0)
+	  txv->state[tx->ents[i].shadow] = TX_USED;
+	txv->owner[lnum] = NULL;
+      }
+  memcpy(txv->map, map, txv->nr_lebs * sizeof(int));
+  txv->seqnum += 1;
+  txv->stats.commits += 1;
+  txv->stats.transactions += nr_tx;
+  pthread_mutex_unlock(&txv->lock);
+  pthread_rwlock_unlock(&txv->maplock);
+
+  for (i = 0; i < nr_old; i++)
+    tx_discard(txv, old[i]);
+  pthread_mutex_lock(&txv->lock);
+  for (i = 0; i < nr_old; i++)
+    txv->state[old[i]] = TX_FREE;
+  pthread_mutex_unlock(&txv->lock);
+
+  free(old);
+  free(map);
+  return 0;
+}
+
+/* Size of the commit record of @txv->nr_lebs LEBs, in minimal I/O units */
+static long long
+tx_rec_size(struct ubi_txv *txv)
+{
+  int io = txv->desc->di.min_io_size;
+  long long len = sizeof(struct tx_record)
+    + (long long) txv->nr_lebs * sizeof(int32_t);
+
+  return (len + io - 1) / io * io;
+}
+
+/* Read the commit record and un-map what it does not refer to */
+static int
+tx_recover(struct ubi_txv *txv, int nr_lebs)
+{
+  struct tx_record *rec = (struct tx_record *) txv->rec;
+  int32_t *ent;
+  int i, ret, err;
+
+  ret = ubi_is_mapped(txv->desc, TX_REC_LEB);
+  if (ret < 0)
+    return -errno;
+  if (ret == 0)
+    {
+      /* a new transactional volume, nothing is mapped */
+      txv->nr_lebs = nr_lebs ? nr_lebs : (txv->nr_pebs - 1) / 2;
+      if (txv->nr_lebs <= 0 || txv->nr_lebs > txv->nr_pebs - 2
+	  || tx_rec_size(txv) > txv->leb_size)
+	return -EINVAL;
+      for (i = 0; i < txv->nr_lebs; i++)
+	txv->map[i] = -1;
+    }
+  else
+    {
+      err = ubi_leb_read(txv->desc, TX_REC_LEB, txv->rec, 0,
+			 sizeof(struct tx_record), 0);
+      if (err)
+	return err;
+      if (rec->magic != TX_REC_MAGIC || rec->nr_lebs == 0
+	  || rec->nr_lebs > (uint32_t) txv->nr_pebs - 2
+	  || (nr_lebs && rec->nr_lebs != (uint32_t) nr_lebs))
+	{
+	  errmsg("tx: no valid commit record in LEB %d", TX_REC_LEB);
+	  return -EINVAL;
+	}
+      txv->nr_lebs = rec->nr_lebs;
+      /* the record is read to a buffer of one LEB */
+      if (tx_rec_size(txv) > txv->leb_size)
+	{
+	  errmsg("tx: commit record of %d LEBs does not fit in a LEB",
+		 txv->nr_lebs);
+	  return -EINVAL;
+	}
+      err = ubi_leb_read(txv->desc, TX_REC_LEB, txv->rec, 0,
+			 sizeof(struct tx_record)
+			 + txv->nr_lebs * sizeof(int32_t), 0);
+      if (err)
+	return err;
+      if (rec->crc != __ubi_crc32(UBI_CRC32_INIT, &rec->seqnum,
+				  sizeof(*rec) - 8
+				  + txv->nr_lebs * sizeof(int32_t)))
+	{
+	  errmsg("tx: corrupted commit record");
+	  return -EUCLEAN;
+	}
+      txv->seqnum = rec->seqnum;
+      ent = (int32_t *) (rec + 1);
+      for (i = 0; i < txv->nr_lebs; i++)
+	{
+	  if (ent[i] >= txv->nr_pebs || ent[i] == TX_REC_LEB
+	      || (ent[i] >= 0 && txv->state[ent[i]] == TX_USED))
+	    {
+	      errmsg("tx: bad mapping %d -> %d", i, ent[i]);
+	      return -EUCLEAN;
+	    }
+	  txv->map[i] = ent[i] < 0 ? -1 : ent[i];
+	  if (txv->map[i] >= 0)
+	    txv->state[txv->map[i]] = TX_USED;
+	}
+    }
+
+  txv->rec_size = tx_rec_size(txv);
+
+  for (i = 1; i < txv->nr_pebs; i++)
+    {
+      if (txv->state[i] == TX_USED)
+	continue;
+      ret = ubi_is_mapped(txv->desc, i);
+      if (ret < 0)
+	return -errno;
+      if (ret)
+	{
+	  err = ubi_leb_unmap(txv->desc, i);
+	  if (err)
+	    return err;
+	  txv->stats.recovered += 1;
+	}
+    }
+  return 0;
+}
+
+/**
+ * ubi_txv_open - open a transactional volume.
+ * @desc: descriptor of the dynamic volume holding it
+ * @nr_lebs: number of LEBs to expose, or %0
+ *
+ * An empty volume is a transactional volume whose LEBs are all un-mapped. It
+ * exposes @nr_lebs LEBs, or half of the LEBs following the commit record if
+ * @nr_lebs is %0; the others are used as shadow LEBs, so a transaction can
+ * change at most as many LEBs as the volume has LEBs which are neither the
+ * commit record nor hold an exposed LEB. Otherwise, @nr_lebs must be %0 or
+ * the number of LEBs the volume exposes. @desc must stay open as long as the
+ * transactional volume is.
+ *
+ * Returns the transactional volume in case of success and %NULL in case of
+ * failure, with errno set.
+ */
+struct ubi_txv *
+ubi_txv_open(struct ubi_volume_desc *desc, int nr_lebs)
+{
+  struct ubi_txv *txv;
+  int err;
+
+  if (desc->vi.vol_type != UBI_DYNAMIC_VOLUME || desc->vi.used_ebs < 3
+      || nr_lebs < 0)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  txv = calloc(1, sizeof(struct ubi_txv));
+  if (txv == NULL)
+    return NULL;
+  txv->desc = desc;
+  txv->leb_size = desc->vi.usable_leb_size;
+  txv->nr_pebs = desc->vi.used_ebs;
+  txv->cursor = 1;
+  txv->tail = &txv->queue;
+  txv->rec = malloc(txv->leb_size);
+  txv->map = malloc(txv->nr_pebs * sizeof(int));
+  txv->state = calloc(txv->nr_pebs, 1);
+  txv->owner = calloc(txv->nr_pebs, sizeof(struct ubi_tx *));
+  pthread_rwlock_init(&txv->maplock, NULL);
+  pthread_mutex_init(&txv->lock, NULL);
+  pthread_cond_init(&txv->cond, NULL);
+  if (!txv->rec || !txv->map || !txv->state || !txv->owner)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  err = tx_recover(txv, nr_lebs);
+  if (err)
+    goto out;
+  dbgmsg("tx: %d LEBs, commit %llu, %lld LEBs recovered", txv->nr_lebs,
+	 (unsigned long long) txv->seqnum, txv->stats.recovered);
+  return txv;
+
+out:
+  ubi_txv_close(txv);
+  errno = -err;
+  return NULL;
+}
+
+/**
+ * ubi_txv_close - close a transactional volume.
+ * @txv: the transactional volume
+ *
+ * All the transactions must have been committed or aborted.
+ */
+void
+ubi_txv_close(struct ubi_txv *txv)
+{
+  pthread_cond_destroy(&txv->cond);
+  pthread_mutex_destroy(&txv->lock);
+  pthread_rwlock_destroy(&txv->maplock);
+  free(txv->owner);
+  free(txv->state);
+  free(txv->map);
+  free(txv->rec);
+  free(txv);
+}
+
+/**
+ * ubi_txv_read - read committed data.
+ * @txv: the transactional volume
+ * @lnum: exposed LEB to read from
+ * @buf: buffer where to store the data
+ * @offset: offset within the LEB
+ * @len: how many bytes to read
+ *
+ * An un-mapped LEB reads as %0xFF bytes. Changes of transactions which have
+ * not committed yet are not visible. Returns %0 in case of success and a
+ * negative error code in case of failure.
+ */
+int
+ubi_txv_read(struct ubi_txv *txv, int lnum, void *buf, int offset, int len)
+{
+  int pnum, err;
+
+  if (lnum < 0 || lnum >= txv->nr_lebs || offset < 0 || len < 0
+      || offset + len > txv->leb_size)
+    return -EINVAL;
+
+  pthread_rwlock_rdlock(&txv->maplock);
+  pnum = txv->map[lnum];
+  if (pnum < 0)
+    {
+      memset(buf, 0xFF, len);
+      err = 0;
+    }
+  else
+    err = ubi_leb_read(txv->desc, pnum, buf, offset, len, 0);
+  pthread_rwlock_unlock(&txv->maplock);
+  return err;
+}
+
+/**
+ * ubi_txv_get_stats - get transactional volume statistics.
+ * @txv: the transactional volume
+ * @stats: the statistics are stored here
+ */
+void
+ubi_txv_get_stats(struct ubi_txv *txv, struct ubi_txv_stats *stats)
+{
+  int i;
+
+  pthread_mutex_lock(&txv->lock);
+  memcpy(stats, &txv->stats, sizeof(*stats));
+  stats->nr_lebs = txv->nr_lebs;
+  stats->free_lebs = 0;
+  for (i = 1; i < txv->nr_pebs; i++)
+    stats->free_lebs += txv->state[i] == TX_FREE;
+  pthread_mutex_unlock(&txv->lock);
+}
+
+/**
+ * ubi_tx_begin - start a transaction.
+ * @txv: the transactional volume
+ *
+ * Returns the transaction in case of success and %NULL in case of failure,
+ * with errno set.
+ */
+struct ubi_tx *
+ubi_tx_begin(struct ubi_txv *txv)
+{
+  struct ubi_tx *tx;
+
+  tx = calloc(1, sizeof(struct ubi_tx));
+  if (tx == NULL)
+    return NULL;
+  tx->txv = txv;
+  return tx;
+}
+
+/*
+ * Find or add the entry of @tx for @lnum, called with @txv->lock held.
+ * Returns %NULL with errno set if another transaction changes @lnum.
+ */
+static struct tx_ent *
+tx_get_ent(struct ubi_tx *tx, int lnum)
+{
+  struct ubi_txv *txv = tx->txv;
+  struct tx_ent *ent;
+  int i, size;
+
+  if (txv->owner[lnum] != NULL && txv->owner[lnum] != tx)
+    {
+      errno = EBUSY;
+      return NULL;
+    }
+  for (i = 0; i < tx->nr; i++)
+    if (tx->ents[i].lnum == lnum)
+      return &tx->ents[i];
+
+  if (tx->nr == tx->size)
+    {
+      size = tx->size ? 2 * tx->size : 8;
+      ent = realloc(tx->ents, size * sizeof(struct tx_ent));
+      if (ent == NULL)
+	return NULL;
+      tx->ents = ent;
+      tx->size = size;
+    }
+  ent = &tx->ents[tx->nr++];
+  ent->lnum = lnum;
+  ent->shadow = -1;
+  txv->owner[lnum] = tx;
+  return ent;
+}
+
+/**
+ * ubi_tx_change - stage new contents of a LEB.
+ * @tx: the transaction
+ * @lnum: exposed LEB to change
+ * @buf: the new contents
+ * @len: length of @buf, a multiple of the minimal I/O unit size, not %0
+ *
+ * The data is written to a shadow LEB right away and becomes the contents of
+ * @lnum when the transaction commits. Changing a LEB several times in a
+ * transaction keeps the last contents.
+ *
+ * Returns %0 in case of success and a negative error code in case of failure:
+ * %-EBUSY if another transaction changes @lnum, %-ENOSPC if there is no free
+ * LEB left to use as shadow. If writing the shadow LEB fails, the transaction
+ * can only be aborted.
+ */
+int
+ubi_tx_change(struct ubi_tx *tx, int lnum, const void *buf, int len)
+{
+  struct ubi_txv *txv = tx->txv;
+  struct tx_ent *ent;
+  int shadow, err;
+
+  if (lnum < 0 || lnum >= txv->nr_lebs || len <= 0 || len > txv->leb_size
+      || len & (txv->desc->di.min_io_size - 1))
+    return -EINVAL;
+  if (tx->err)
+    return tx->err;
+
+  pthread_mutex_lock(&txv->lock);
+  ent = tx_get_ent(tx, lnum);
+  if (ent == NULL)
+    {
+      pthread_mutex_unlock(&txv->lock);
+      return -errno;
+    }
+  if (ent->shadow < 0)
+    {
+      shadow = tx_alloc(txv);
+      if (shadow < 0)
+	{
+	  pthread_mutex_unlock(&txv->lock);
+	  return shadow;
+	}
+      ent->shadow = shadow;
+    }
+  shadow = ent->shadow;
+  pthread_mutex_unlock(&txv->lock);
+
+  /* the shadow may hold leftovers of its previous use */
+  err = ubi_leb_change(txv->desc, shadow, buf, len, UBI_UNKNOWN);
+  if (err)
+    {
+      errmsg("tx: cannot write shadow LEB %d, error %d", shadow, err);
+      tx->err = err;
+      return err;
+    }
+  pthread_mutex_lock(&txv->lock);
+  txv->stats.lebs_written += 1;
+  pthread_mutex_unlock(&txv->lock);
+  return 0;
+}
+
+/**
+ * ubi_tx_unmap - stage the un-mapping of a LEB.
+ * @tx: the transaction
+ * @lnum: exposed LEB to un-map
+ *
+ * Returns %0 in case of success and a negative error code in case of failure,
+ * %-EBUSY if another transaction changes @lnum.
+ */
+int
+ubi_tx_unmap(struct ubi_tx *tx, int lnum)
+{
+  struct ubi_txv *txv = tx->txv;
+  struct tx_ent *ent;
+  int shadow;
+
+  if (lnum < 0 || lnum >= txv->nr_lebs)
+    return -EINVAL;
+
+  pthread_mutex_lock(&txv->lock);
+  ent = tx_get_ent(tx, lnum);
+  if (ent == NULL)
+    {
+      pthread_mutex_unlock(&txv->lock);
+      return -errno;
+    }
+  shadow = ent->shadow;
+  ent->shadow = -1;
+  pthread_mutex_unlock(&txv->lock);
+
+  if (shadow >= 0)
+    {
+      tx_discard(txv, shadow);
+      pthread_mutex_lock(&txv->lock);
+      txv->state[shadow] = TX_FREE;
+      pthread_mutex_unlock(&txv->lock);
+    }
+  return 0;
+}
+
+/**
+ * ubi_tx_abort - abort a transaction.
+ * @tx: the transaction, which is freed
+ */
+void
+ubi_tx_abort(struct ubi_tx *tx)
+{
+  struct ubi_txv *txv = tx->txv;
+  int *shadows, n, i;
+
+  shadows = malloc((tx->nr + 1) * sizeof(int));
+  pthread_mutex_lock(&txv->lock);
+  n = shadows ? tx_release(tx, shadows) : 0;
+  pthread_mutex_unlock(&txv->lock);
+
+  /* without memory the shadows stay used until the next open */
+  for (i = 0; i < n; i++)
+    tx_discard(txv, shadows[i]);
+  pthread_mutex_lock(&txv->lock);
+  for (i = 0; i < n; i++)
+    txv->state[shadows[i]] = TX_FREE;
+  pthread_mutex_unlock(&txv->lock);
+
+  free(shadows);
+  free(tx->ents);
+  free(tx);
+}
+
+/**
+ * ubi_tx_commit - commit a transaction.
+ * @tx: the transaction, which is freed
+ *
+ * If a commit record is being written, this function waits for it and, if
+ * the transaction was not part of it, a single record is then written for
+ * all the transactions which committed in the meantime. Once this function
+ * has returned %0, all the changes of the transaction are durable.
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure, in which case the transaction has been aborted.
+ */
+int
+ubi_tx_commit(struct ubi_tx *tx)
+{
+  struct ubi_txv *txv = tx->txv;
+  struct ubi_tx *batch, *t;
+  int err;
+
+  if (tx->err)
+    {
+      err = tx->err;
+      ubi_tx_abort(tx);
+      return err;
+    }
+
+  pthread_mutex_lock(&txv->lock);
+  tx->next = NULL;
+  *txv->tail = tx;
+  txv->tail = &tx->next;
+  while (!tx->done)
+    {
+      if (txv->committing)
+	{
+	  pthread_cond_wait(&txv->cond, &txv->lock);
+	  continue;
+	}
+
+      /* write a record for everything queued so far */
+      batch = txv->queue;
+      txv->queue = NULL;
+      txv->tail = &txv->queue;
+      txv->committing = 1;
+      pthread_mutex_unlock(&txv->lock);
+
+      err = tx_commit_batch(txv, batch);
+
+      pthread_mutex_lock(&txv->lock);
+      for (t = batch; t != NULL; t = t->next)
+	{
+	  t->err = err;
+	  t->done = 1;
+	}
+      txv->committing = 0;
+      pthread_cond_broadcast(&txv->cond);
+    }
+  pthread_mutex_unlock(&txv->lock);
+
+  err = tx->err;
+  if (err)
+    {
+      tx->err = 0;
+      ubi_tx_abort(tx);
+      return err;
+    }
+  free(tx->ents);
+  free(tx);
+  return 0;
+}
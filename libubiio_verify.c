@@ -0,0 +1,476 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - read-after-write verification.
+ *
+ * When verification is enabled on a descriptor, the data written through it
+ * by 'ubi_leb_write()' and 'ubi_leb_change()' is read back from the volume
+ * and compared with what was written. Either every write or one in N is
+ * verified. Verification is done either by the writer before it returns, or
+ * later by a background thread which reads back queued writes in batches,
+ * merging the writes which follow each other in a LEB into one read.
+ *
+ * A deferred verification must not read a LEB which has been changed, erased
+ * or un-mapped since it was written, so these operations drop the queued
+ * verifications of the LEB they modify.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+/*
+ * Queued data above which writers wait for the verifier: this many LEBs, or
+ * what the device reads back in this many milliseconds if it is more
+ */
+#define VERIFY_MAX_PENDING_LEBS	4
+#define VERIFY_MAX_PENDING_MS	50
+
+/**
+ * struct verify_entry - a write waiting for deferred verification.
+ * @next: next queued write
+ * @lnum: LEB written to
+ * @offset: offset in the LEB
+ * @len: length of the write
+ * @data: the data which was written
+ */
+struct verify_entry
+{
+  struct verify_entry *next;
+  int lnum;
+  int offset;
+  int len;
+  char data[];
+};
+
+/**
+ * struct ubi_verify - verification state of a volume descriptor.
+ * @fd: volume file descriptor
+ * @leb_size: usable LEB size
+ * @sample: one write in @sample is verified
+ * @deferred: non-zero if writes are verified by @thread
+ * @lock: protects all the fields below
+ * @cond: signalled when writes are queued or @stop is set
+ * @done: signalled when a batch has been verified
+ * @thread: the verifier thread
+ * @stop: set to make the verifier thread exit
+ * @count: number of writes seen, for sampling
+ * @queue: writes waiting for verification
+ * @tail: where the next write is queued
+ * @pending: bytes in @queue
+ * @max_pending: @pending above which writers wait
+ * @busy: non-zero while the verifier thread works on a batch
+ * @err: first error found by the verifier thread since the last flush
+ * @stats: statistics
+ */
+struct ubi_verify
+{
+  int fd;
+  int leb_size;
+  int sample;
+  int deferred;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t done;
+  pthread_t thread;
+  int stop;
+  unsigned long count;
+  struct verify_entry *queue;
+  struct verify_entry **tail;
+  long pending;
+  long max_pending;
+  int busy;
+  int err;
+  struct ubi_verify_stats stats;
+};
+
+/*
+ * Read back @len bytes at offset @offset of LEB @lnum, bypassing readahead,
+ * and compare them with @data. @rbuf is a scratch buffer of @len bytes.
+ * Returns %0 if they match, %-UBI_EVERIFY if they do not and another
+ * negative error code if the read failed.
+ */
+static int
+verify_range(struct ubi_verify *v, int lnum, int offset, const void *data,
+	     int len, char *rbuf)
+{
+  loff_t addr = v->leb_size * (loff_t) lnum + offset;
+  ssize_t rd;
+
+  rd = pread(v->fd, rbuf, len, addr);
+  if (rd < 0)
+    return -errno;
+  if (rd != len)
+    return -EIO;
+  if (!__ubi_memeq(rbuf, data, len))
+    return -UBI_EVERIFY;
+  return 0;
+}
+
+static void
+verify_account(struct ubi_verify *v, int lnum, int offset, int len, int err)
+{
+  if (err == 0)
+    {
+      v->stats.verified += 1;
+      v->stats.bytes += len;
+    }
+  else if (err == -UBI_EVERIFY)
+    {
+      errmsg("verify: LEB %d:%d (%d bytes) does not read back as written",
+	     lnum, offset, len);
+      v->stats.mismatches += 1;
+    }
+  else
+    v->stats.read_errors += 1;
+}
+
+/* Verify a batch of queued writes, merging contiguous ones */
+static void
+verify_batch(struct ubi_verify *v, struct verify_entry *batch, char *rbuf,
+	     char *cbuf)
+{
+  struct verify_entry *e, *last;
+  int len, err;
+
+  while (batch)
+    {
+      /* gather the writes which follow @batch in the same LEB */
+      len = batch->len;
+      memcpy(cbuf, batch->data, batch->len);
+      for (last = batch; last->next; last = last->next)
+	{
+	  e = last->next;
+	  if (e->lnum != batch->lnum || e->offset != batch->offset + len)
+	    break;
+	  memcpy(cbuf + len, e->data, e->len);
+	  len += e->len;
+	}
+
+      err = verify_range(v, batch->lnum, batch->offset, cbuf, len, rbuf);
+
+      pthread_mutex_lock(&v->lock);
+      verify_account(v, batch->lnum, batch->offset, len, err);
+      if (err && !v->err)
+	v->err = err;
+      pthread_mutex_unlock(&v->lock);
+
+      e = batch;
+      batch = last->next;
+      last->next = NULL;
+      while (e)
+	{
+	  last = e->next;
+	  free(e);
+	  e = last;
+	}
+    }
+}
+
+static void *
+verify_thread(void *arg)
+{
+  struct ubi_verify *v = arg;
+  struct verify_entry *batch;
+  char *rbuf, *cbuf;
+  long bytes;
+
+  /* merged writes never span LEBs */
+  rbuf = malloc(v->leb_size);
+  cbuf = malloc(v->leb_size);
+
+  pthread_mutex_lock(&v->lock);
+  for (;;)
+    {
+      while (v->queue == NULL && !v->stop)
+	pthread_cond_wait(&v->cond, &v->lock);
+      if (v->queue == NULL)
+	break;
+
+      batch = v->queue;
+      bytes = v->pending;
+      v->queue = NULL;
+      v->tail = &v->queue;
+      v->busy = 1;
+      pthread_mutex_unlock(&v->lock);
+
+      if (rbuf && cbuf)
+	verify_batch(v, batch, rbuf, cbuf);
+
+      pthread_mutex_lock(&v->lock);
+      if (!rbuf || !cbuf)
+	{
+	  /* nothing can be verified, say so at the next flush */
+	  v->err = -ENOMEM;
+	  while (batch)
+	    {
+	      struct verify_entry *next = batch->next;
+
+	      free(batch);
+	      batch = next;
+	    }
+	}
+      v->pending -= bytes;
+      v->busy = 0;
+      pthread_cond_broadcast(&v->done);
+    }
+  pthread_mutex_unlock(&v->lock);
+  free(cbuf);
+  free(rbuf);
+  return NULL;
+}
+
+/**
+ * __ubi_verify_write - verify data just written.
+ * @v: verification state
+ * @lnum: LEB written to
+ * @offset: offset in the LEB
+ * @buf: the data which was written
+ * @len: length of the data
+ *
+ * Returns %0 if the write is not sampled, is queued or matches, and
+ * %-UBI_EVERIFY or another negative error code if the data could not be
+ * read back as written.
+ */
+int
+__ubi_verify_write(struct ubi_verify *v, int lnum, int offset,
+		   const void *buf, int len)
+{
+  struct verify_entry *e;
+  char *rbuf;
+  int err;
+
+  pthread_mutex_lock(&v->lock);
+  v->stats.writes += 1;
+  if (len == 0 || v->count++ % v->sample)
+    {
+      pthread_mutex_unlock(&v->lock);
+      return 0;
+    }
+
+  if (v->deferred)
+    {
+      while (v->pending && v->pending + len > v->max_pending)
+	pthread_cond_wait(&v->done, &v->lock);
+      pthread_mutex_unlock(&v->lock);
+
+      e = malloc(sizeof(struct verify_entry) + len);
+      if (e == NULL)
+	return -ENOMEM;
+      e->next = NULL;
+      e->lnum = lnum;
+      e->offset = offset;
+      e->len = len;
+      memcpy(e->data, buf, len);
+
+      pthread_mutex_lock(&v->lock);
+      *v->tail = e;
+      v->tail = &e->next;
+      v->pending += len;
+      pthread_cond_signal(&v->cond);
+      pthread_mutex_unlock(&v->lock);
+      return 0;
+    }
+  pthread_mutex_unlock(&v->lock);
+
+  rbuf = malloc(len);
+  if (rbuf == NULL)
+    return -ENOMEM;
+  err = verify_range(v, lnum, offset, buf, len, rbuf);
+  free(rbuf);
+
+  pthread_mutex_lock(&v->lock);
+  verify_account(v, lnum, offset, len, err);
+  pthread_mutex_unlock(&v->lock);
+  return err;
+}
+
+/**
+ * __ubi_verify_drop - drop the queued verifications of a LEB.
+ * @v: verification state
+ * @lnum: LEB about to be changed, erased or un-mapped
+ *
+ * Must be called before modifying LEB @lnum other than by writing to it, so
+ * that the verifier does not read the new contents.
+ */
+void
+__ubi_verify_drop(struct ubi_verify *v, int lnum)
+{
+  struct verify_entry **pp, *e;
+
+  pthread_mutex_lock(&v->lock);
+  /* the batch in flight may read the LEB too */
+  while (v->busy)
+    pthread_cond_wait(&v->done, &v->lock);
+
+  v->tail = &v->queue;
+  for (pp = &v->queue; *pp;)
+    {
+      e = *pp;
+      if (e->lnum == lnum)
+	{
+	  *pp = e->next;
+	  v->pending -= e->len;
+	  v->stats.dropped += 1;
+	  free(e);
+	  continue;
+	}
+      pp = &e->next;
+      v->tail = pp;
+    }
+  pthread_mutex_unlock(&v->lock);
+}
+
+/**
+ * ubi_verify_enable - enable read-after-write verification on a descriptor.
+ * @desc: volume descriptor
+ * @sample: verify one write in @sample, or every write if %0 or %1
+ * @flags: %UBI_VERIFY_DEFERRED to verify in background
+ *
+ * Without %UBI_VERIFY_DEFERRED, 'ubi_leb_write()' and 'ubi_leb_change()'
+ * return %-UBI_EVERIFY when the data they wrote does not read back the same.
+ * With it, the written data is copied and verified by a background thread;
+ * the first error it finds is returned by 'ubi_verify_flush()'. Writers wait
+ * when too much data is waiting for verification: four LEBs, or more if the
+ * profile of the device says it reads data back quickly.
+ *
+ * Returns %0 in case of success and a negative error code in case of
+ * failure.
+ */
+int
+ubi_verify_enable(struct ubi_volume_desc *desc, int sample, int flags)
+{
+  struct ubi_verify *v;
+  int err;
+
+  if (desc->verify)
+    return -EBUSY;
+  if (sample < 0 || flags & ~UBI_VERIFY_DEFERRED)
+    return -EINVAL;
+
+  v = calloc(1, sizeof(struct ubi_verify));
+  if (v == NULL)
+    return -ENOMEM;
+  v->fd = desc->fd;
+  v->leb_size = desc->vi.usable_leb_size;
+  v->sample = sample ? sample : 1;
+  v->deferred = !!(flags & UBI_VERIFY_DEFERRED);
+  v->tail = &v->queue;
+  v->max_pending = VERIFY_MAX_PENDING_LEBS * (long) v->leb_size;
+  if (desc->profile)
+    /* kB/s are bytes per millisecond */
+    v->max_pending = MAX(v->max_pending, (long) desc->profile->read_kbps
+			 * VERIFY_MAX_PENDING_MS);
+  pthread_mutex_init(&v->lock, NULL);
+  pthread_cond_init(&v->cond, NULL);
+  pthread_cond_init(&v->done, NULL);
+
+  if (v->deferred)
+    {
+      err = pthread_create(&v->thread, NULL, verify_thread, v);
+      if (err)
+	{
+	  pthread_cond_destroy(&v->done);
+	  pthread_cond_destroy(&v->cond);
+	  pthread_mutex_destroy(&v->lock);
+	  free(v);
+	  return -err;
+	}
+    }
+  desc->verify = v;
+  return 0;
+}
+
+/**
+ * ubi_verify_flush - wait for deferred verifications.
+ * @desc: volume descriptor
+ *
+ * Returns %0 if all the writes verified since the previous call matched,
+ * %-UBI_EVERIFY if one of them did not, another negative error code if one
+ * could not be read back, and %-EINVAL if verification is not enabled.
+ */
+int
+ubi_verify_flush(struct ubi_volume_desc *desc)
+{
+  struct ubi_verify *v = desc->verify;
+  int err;
+
+  if (v == NULL)
+    return -EINVAL;
+  pthread_mutex_lock(&v->lock);
+  while (v->queue || v->busy)
+    pthread_cond_wait(&v->done, &v->lock);
+  err = v->err;
+  v->err = 0;
+  pthread_mutex_unlock(&v->lock);
+  return err;
+}
+
+/**
+ * ubi_verify_disable - disable verification on a descriptor.
+ * @desc: volume descriptor
+ *
+ * Queued verifications are done first; use 'ubi_verify_flush()' before to
+ * get their result.
+ */
+void
+ubi_verify_disable(struct ubi_volume_desc *desc)
+{
+  struct ubi_verify *v = desc->verify;
+
+  if (v == NULL)
+    return;
+  desc->verify = NULL;
+
+  if (v->deferred)
+    {
+      pthread_mutex_lock(&v->lock);
+      v->stop = 1;
+      pthread_cond_broadcast(&v->cond);
+      pthread_mutex_unlock(&v->lock);
+      pthread_join(v->thread, NULL);
+    }
+  pthread_cond_destroy(&v->done);
+  pthread_cond_destroy(&v->cond);
+  pthread_mutex_destroy(&v->lock);
+  free(v);
+}
+
+/**
+ * ubi_verify_get_stats - get verification statistics of a descriptor.
+ * @desc: volume descriptor
+ * @stats: the statistics are stored here
+ *
+ * Returns %0 in case of success and %-EINVAL if verification is not enabled.
+ */
+int
+ubi_verify_get_stats(struct ubi_volume_desc *desc,
+		     struct ubi_verify_stats *stats)
+{
+  struct ubi_verify *v = desc->verify;
+
+  if (v == NULL)
+    return -EINVAL;
+  pthread_mutex_lock(&v->lock);
+  memcpy(stats, &v->stats, sizeof(*stats));
+  stats->pending = v->pending;
+  pthread_mutex_unlock(&v->lock);
+  return 0;
+}
@@ -0,0 +1,571 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * UBI (Unsorted Block Images) io library - compressed LEBs.
+ *
+ * A compressed volume stores in each LEB the contents given to
+ * 'ubi_zvol_change()', cut in extents of a fixed size which are compressed
+ * one by one with the codec of libubiio_lz.c, or stored as they are if they
+ * do not compress. The LEB starts with a header giving the size of the
+ * contents and the compressed length of each extent, so that a read only
+ * reads and decompresses the extents it needs; the data of the extents
+ * follows. Contents may be larger than a LEB as long as they compress into
+ * it. The headers are cached.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libubiio.h"
+#include "libubiio_int.h"
+
+#define PROGRAM_NAME "libubiio"
+
+#define ZVOL_MAGIC		0x55425A4C	/* "UBZL" */
+#define ZVOL_DEFAULT_EXTENT	(16 * 1024)
+#define ZVOL_MAX_EXTENTS	65535
+/* Flag of an extent stored uncompressed */
+#define ZVOL_RAW		0x80000000U
+
+/* Bytes read to get a header, which is most often all of it */
+#define ZVOL_HDR_READ		4096
+
+/**
+ * struct zvol_hdr - header of a compressed LEB.
+ * @magic: %ZVOL_MAGIC
+ * @crc: CRC of the header, starting at @size and ending with the extents
+ * @size: size of the contents
+ * @extent_shift: log2 of the extent size
+ * @nr_extents: number of extents
+ *
+ * The header is followed by @nr_extents 32-bit compressed extent lengths,
+ * with %ZVOL_RAW set for extents stored as they are, then by their data.
+ */
+struct zvol_hdr
+{
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t size;
+  uint16_t extent_shift;
+  uint16_t nr_extents;
+};
+
+/**
+ * struct zvol_map - cached header of a compressed LEB.
+ * @refs: references held
+ * @size: size of the contents
+ * @shift: log2 of the extent size
+ * @nr: number of extents
+ * @ext: compressed length of each extent, with %ZVOL_RAW
+ * @off: offset of the data of each extent in the LEB
+ */
+struct zvol_map
+{
+  int refs;
+  int size;
+  int shift;
+  int nr;
+  uint32_t *ext;
+  uint32_t *off;
+};
+
+/**
+ * struct ubi_zvol - compressed volume.
+ * @desc: volume descriptor
+ * @shift: log2 of the extent size of the LEBs written
+ * @lock: protects the fields below
+ * @maps: cached headers, by LEB, %NULL if not read yet
+ * @stats: statistics
+ */
+struct ubi_zvol
+{
+  struct ubi_volume_desc *desc;
+  int shift;
+  pthread_mutex_t lock;
+  struct zvol_map **maps;
+  struct ubi_zvol_stats stats;
+};
+
+static struct zvol_map *
+zvol_map_new(int size, int shift, int nr, const uint32_t *ext, int data_off)
+{
+  struct zvol_map *map;
+  int i;
+
+  map = malloc(sizeof(struct zvol_map) + 2 * nr * sizeof(uint32_t));
+  if (map == NULL)
+    return NULL;
+  map->refs = 1;
+  map->size = size;
+  map->shift = shift;
+  map->nr = nr;
+  map->ext = (uint32_t *) (map + 1);
+  map->off = map->ext + nr;
+  for (i = 0; i < nr; i++)
+    {
+      map->ext[i] = ext[i];
+      map->off[i] = data_off;
+      data_off += ext[i] & ~ZVOL_RAW;
+    }
+  return map;
+}
+
+static void
+zvol_map_put(struct ubi_zvol *zv, struct zvol_map *map)
+{
+  int last;
+
+  if (map == NULL)
+    return;
+  pthread_mutex_lock(&zv->lock);
+  last = --map->refs == 0;
+  pthread_mutex_unlock(&zv->lock);
+  if (last)
+    free(map);
+}
+
+/* Replace the cached header of @lnum by @map, which may be %NULL */
+static void
+zvol_map_set(struct ubi_zvol *zv, int lnum, struct zvol_map *map)
+{
+  struct zvol_map *old;
+
+  pthread_mutex_lock(&zv->lock);
+  old = zv->maps[lnum];
+  zv->maps[lnum] = map;
+  pthread_mutex_unlock(&zv->lock);
+  zvol_map_put(zv, old);
+}
+
+/* Read the header of @lnum */
+static int
+zvol_map_read(struct ubi_zvol *zv, int lnum, struct zvol_map **pmap)
+{
+  struct ubi_volume_desc *desc = zv->desc;
+  int leb_size = desc->vi.usable_leb_size;
+  int len = MIN(ZVOL_HDR_READ, leb_size), hlen, i, err;
+  struct zvol_hdr *hdr;
+  uint32_t *ext;
+  char *buf;
+
+  buf = malloc(len);
+  if (buf == NULL)
+    return -ENOMEM;
+  err = ubi_leb_read(desc, lnum, buf, 0, len, 0);
+  if (err)
+    goto out;
+  hdr = (struct zvol_hdr *) buf;
+
+  /* never written, or un-mapped */
+  if (__ubi_is_erased(buf, sizeof(struct zvol_hdr)))
+    {
+      *pmap = zvol_map_new(0, 0, 0, NULL, 0);
+      err = *pmap ? 0 : -ENOMEM;
+      goto out;
+    }
+
+  hlen = sizeof(struct zvol_hdr) + hdr->nr_extents * sizeof(uint32_t);
+  if (hdr->magic != ZVOL_MAGIC || hlen > leb_size
+      || hdr->extent_shift < 9 || hdr->extent_shift > 16
+      || hdr->nr_extents
+      != ((long long) hdr->size + (1 << hdr->extent_shift) - 1)
+      >> hdr->extent_shift)
+    {
+      errmsg("LEB %d:%d is not a compressed LEB", desc->vi.vol_id, lnum);
+      err = -EBADMSG;
+      goto out;
+    }
+  if (hlen > len)
+    {
+      free(buf);
+      buf = malloc(hlen);
+      if (buf == NULL)
+	return -ENOMEM;
+      err = ubi_leb_read(desc, lnum, buf, 0, hlen, 0);
+      if (err)
+	goto out;
+      hdr = (struct zvol_hdr *) buf;
+    }
+
+  ext = (uint32_t *) (hdr + 1);
+  if (hdr->crc != __ubi_crc32(UBI_CRC32_INIT, &hdr->size,
+			      hlen - offsetof(struct zvol_hdr, size)))
+    {
+      errmsg("bad header CRC in compressed LEB %d:%d", desc->vi.vol_id,
+	     lnum);
+      err = -EBADMSG;
+      goto out;
+    }
+  for (i = 0, len = hlen; i < hdr->nr_extents; i++)
+    len += ext[i] & ~ZVOL_RAW;
+  if (len > leb_size)
+    {
+      errmsg("corrupted header in compressed LEB %d:%d", desc->vi.vol_id,
+	     lnum);
+      err = -EBADMSG;
+      goto out;
+    }
+
+  *pmap = zvol_map_new(hdr->size, hdr->extent_shift, hdr->nr_extents, ext,
+		       hlen);
+  err = *pmap ? 0 : -ENOMEM;
+
+out:
+  free(buf);
+  return err;
+}
+
+/* Get a reference to the header of @lnum, reading it if need be */
+static int
+zvol_map_get(struct ubi_zvol *zv, int lnum, struct zvol_map **pmap)
+{
+  struct zvol_map *map;
+  int err;
+
+  pthread_mutex_lock(&zv->lock);
+  map = zv->maps[lnum];
+  if (map)
+    map->refs += 1;
+  pthread_mutex_unlock(&zv->lock);
+  if (map)
+    {
+      *pmap = map;
+      return 0;
+    }
+
+  err = zvol_map_read(zv, lnum, &map);
+  if (err)
+    return err;
+  pthread_mutex_lock(&zv->lock);
+  if (zv->maps[lnum] == NULL)
+    {
+      zv->maps[lnum] = map;
+      map->refs += 1;
+    }
+  pthread_mutex_unlock(&zv->lock);
+  *pmap = map;
+  return 0;
+}
+
+/**
+ * ubi_zvol_open - compress the LEBs of a dynamic volume.
+ * @desc: volume descriptor
+ * @extent_size: size of the pieces LEB contents are compressed in, a power
+ *               of 2 from 512 bytes to 64 KiB, or %0 for the default
+ *
+ * Smaller extents make small reads cheaper, larger ones compress better.
+ * LEBs written with another extent size can be read. The LEBs must not be
+ * changed other than through the returned handle while it is open.
+ *
+ * Returns the handle in case of success and %NULL in case of failure, with
+ * errno set.
+ */
+struct ubi_zvol *
+ubi_zvol_open(struct ubi_volume_desc *desc, int extent_size)
+{
+  struct ubi_zvol *zv;
+  int shift = 9;
+
+  if (extent_size == 0)
+    extent_size = ZVOL_DEFAULT_EXTENT;
+  while ((1 << shift) < extent_size)
+    shift++;
+  if (extent_size != 1 << shift || shift > 16)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  zv = calloc(1, sizeof(struct ubi_zvol));
+  if (zv == NULL)
+    return NULL;
+  zv->maps = calloc(desc->vi.used_ebs, sizeof(struct zvol_map *));
+  if (zv->maps == NULL)
+    {
+      free(zv);
+      errno = ENOMEM;
+      return NULL;
+    }
+  zv->desc = desc;
+  zv->shift = shift;
+  pthread_mutex_init(&zv->lock, NULL);
+  return zv;
+}
+
+/**
+ * ubi_zvol_close - close a compressed volume.
+ * @zv: the compressed volume
+ *
+ * The volume descriptor is left open.
+ */
+void
+ubi_zvol_close(struct ubi_zvol *zv)
+{
+  int i;
+
+  for (i = 0; i < zv->desc->vi.used_ebs; i++)
+    free(zv->maps[i]);
+  pthread_mutex_destroy(&zv->lock);
+  free(zv->maps);
+  free(zv);
+}
+
+/**
+ * ubi_zvol_change - change the contents of a compressed LEB.
+ * @zv: the compressed volume
+ * @lnum: the LEB
+ * @buf: the new contents
+ * @len: their size
+ * @dtype: expected data type
+ *
+ * The LEB is changed atomically, see 'ubi_leb_change()'. Returns %0 in case
+ * of success, %-ENOSPC if the contents do not compress into the LEB and
+ * another negative error code in case of failure.
+ */
+int
+ubi_zvol_change(struct ubi_zvol *zv, int lnum, const void *buf, int len,
+		int dtype)
+{
+  struct ubi_volume_desc *desc = zv->desc;
+  int leb_size = desc->vi.usable_leb_size;
+  int min_io = desc->di.min_io_size;
+  int extent = 1 << zv->shift, nr, hlen, pos, ulen, clen, i, err;
+  const char *p = buf;
+  struct zvol_hdr *hdr;
+  struct zvol_map *map;
+  uint32_t *ext;
+  char *out;
+
+  if (lnum < 0 || lnum >= desc->vi.used_ebs || len < 0)
+    return -EINVAL;
+  nr = (len + extent - 1) >> zv->shift;
+  hlen = sizeof(struct zvol_hdr) + nr * sizeof(uint32_t);
+  if (nr > ZVOL_MAX_EXTENTS || hlen > leb_size)
+    return -ENOSPC;
+
+  out = malloc(leb_size);
+  if (out == NULL)
+    return -ENOMEM;
+  hdr = (struct zvol_hdr *) out;
+  ext = (uint32_t *) (hdr + 1);
+  for (i = 0, pos = hlen; i < nr; i++)
+    {
+      ulen = MIN(extent, len - (i << zv->shift));
+      clen = __ubi_lz_compress(p + (i << zv->shift), ulen, out + pos,
+			       MIN(ulen - 1, leb_size - pos));
+      if (clen == 0)
+	{
+	  if (ulen > leb_size - pos)
+	    {
+	      free(out);
+	      return -ENOSPC;
+	    }
+	  memcpy(out + pos, p + (i << zv->shift), ulen);
+	  ext[i] = ulen | ZVOL_RAW;
+	  clen = ulen;
+	}
+      else
+	ext[i] = clen;
+      pos += clen;
+    }
+
+  hdr->magic = ZVOL_MAGIC;
+  hdr->size = len;
+  hdr->extent_shift = zv->shift;
+  hdr->nr_extents = nr;
+  hdr->crc = __ubi_crc32(UBI_CRC32_INIT, &hdr->size,
+			 hlen - offsetof(struct zvol_hdr, size));
+  clen = (pos + min_io - 1) / min_io * min_io;
+  memset(out + pos, 0xFF, clen - pos);
+
+  map = zvol_map_new(len, zv->shift, nr, ext, hlen);
+  if (map == NULL)
+    err = -ENOMEM;
+  else
+    err = ubi_leb_change(desc, lnum, out, clen, dtype);
+  free(out);
+  if (err)
+    {
+      free(map);
+      zvol_map_set(zv, lnum, NULL);
+      return err;
+    }
+  zvol_map_set(zv, lnum, map);
+
+  pthread_mutex_lock(&zv->lock);
+  zv->stats.changes += 1;
+  zv->stats.bytes_in += len;
+  zv->stats.bytes_written += clen;
+  pthread_mutex_unlock(&zv->lock);
+  return 0;
+}
+
+/**
+ * ubi_zvol_read - read from a compressed LEB.
+ * @zv: the compressed volume
+ * @lnum: the LEB
+ * @buf: where to store the data
+ * @offset: offset in the contents of the LEB
+ * @len: how many bytes to read
+ *
+ * Returns the number of bytes read, less than @len if the contents end
+ * before, in case of success and a negative error code in case of failure;
+ * %-EBADMSG if the LEB does not hold valid compressed data.
+ */
+int
+ubi_zvol_read(struct ubi_zvol *zv, int lnum, void *buf, int offset, int len)
+{
+  struct ubi_volume_desc *desc = zv->desc;
+  struct zvol_map *map;
+  int first, last, start, clen, ulen, eoff, n, i, err;
+  char *cbuf = NULL, *tmp = NULL, *p = buf, *src;
+
+  if (lnum < 0 || lnum >= desc->vi.used_ebs || offset < 0 || len < 0)
+    return -EINVAL;
+  err = zvol_map_get(zv, lnum, &map);
+  if (err)
+    return err;
+  if (offset >= map->size || len == 0)
+    {
+      err = 0;
+      goto out;
+    }
+  len = MIN(len, map->size - offset);
+
+  /* the data of the extents needed, in one read */
+  first = offset >> map->shift;
+  last = (offset + len - 1) >> map->shift;
+  start = map->off[first];
+  clen = map->off[last] + (map->ext[last] & ~ZVOL_RAW) - start;
+  cbuf = malloc(clen);
+  if (cbuf == NULL)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+  err = ubi_leb_read(desc, lnum, cbuf, start, clen, 0);
+  if (err)
+    goto out;
+
+  for (i = first; i <= last; i++)
+    {
+      src = cbuf + map->off[i] - start;
+      clen = map->ext[i] & ~ZVOL_RAW;
+      ulen = MIN(1 << map->shift, map->size - (i << map->shift));
+      eoff = i == first ? offset - (first << map->shift) : 0;
+      n = MIN(ulen - eoff, len - (p - (char *) buf));
+
+      if (map->ext[i] & ZVOL_RAW)
+	{
+	  if (clen != ulen)
+	    err = -EBADMSG;
+	  else
+	    memcpy(p, src + eoff, n);
+	}
+      else if (eoff == 0 && n == ulen)
+	err = __ubi_lz_decompress(src, clen, p, ulen);
+      else
+	{
+	  /* part of an extent, decompress it aside */
+	  if (tmp == NULL)
+	    tmp = malloc(1 << map->shift);
+	  if (tmp == NULL)
+	    err = -ENOMEM;
+	  else
+	    err = __ubi_lz_decompress(src, clen, tmp, ulen);
+	  if (!err)
+	    memcpy(p, tmp + eoff, n);
+	}
+      if (err)
+	{
+	  if (err == -EBADMSG)
+	    errmsg("corrupted extent %d in compressed LEB %d:%d", i,
+		   desc->vi.vol_id, lnum);
+	  goto out;
+	}
+      p += n;
+    }
+  err = len;
+
+  pthread_mutex_lock(&zv->lock);
+  zv->stats.reads += 1;
+  zv->stats.extents_read += last - first + 1;
+  pthread_mutex_unlock(&zv->lock);
+
+out:
+  free(tmp);
+  free(cbuf);
+  zvol_map_put(zv, map);
+  return err;
+}
+
+/**
+ * ubi_zvol_size - get the size of the contents of a compressed LEB.
+ * @zv: the compressed volume
+ * @lnum: the LEB
+ *
+ * Returns the size, %0 for LEBs never written or un-mapped, in case of
+ * success and a negative error code in case of failure.
+ */
+int
+ubi_zvol_size(struct ubi_zvol *zv, int lnum)
+{
+  struct zvol_map *map;
+  int err;
+
+  if (lnum < 0 || lnum >= zv->desc->vi.used_ebs)
+    return -EINVAL;
+  err = zvol_map_get(zv, lnum, &map);
+  if (err)
+    return err;
+  err = map->size;
+  zvol_map_put(zv, map);
+  return err;
+}
+
+/**
+ * ubi_zvol_unmap - un-map a compressed LEB.
+ * @zv: the compressed volume
+ * @lnum: the LEB
+ *
+ * See 'ubi_leb_unmap()'. Returns %0 in case of success and a negative error
+ * code in case of failure.
+ */
+int
+ubi_zvol_unmap(struct ubi_zvol *zv, int lnum)
+{
+  int err;
+
+  if (lnum < 0 || lnum >= zv->desc->vi.used_ebs)
+    return -EINVAL;
+  err = ubi_leb_unmap(zv->desc, lnum);
+  zvol_map_set(zv, lnum, NULL);
+  return err;
+}
+
+/**
+ * ubi_zvol_get_stats - get compressed volume statistics.
+ * @zv: the compressed volume
+ * @stats: the statistics are stored here
+ */
+void
+ubi_zvol_get_stats(struct ubi_zvol *zv, struct ubi_zvol_stats *stats)
+{
+  pthread_mutex_lock(&zv->lock);
+  memcpy(stats, &zv->stats, sizeof(*stats));
+  pthread_mutex_unlock(&zv->lock);
+}
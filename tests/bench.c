@@ -0,0 +1,571 @@
+/*
+ * libubiio benchmark.
+ *
+ * Runs timed workloads against a UBI volume, or against a file-backed
+ * stand-in, and prints the latency percentiles and the throughput of each
+ * workload as JSON on stdout. The volume contents are destroyed.
+ */
+
+#include <libubiio.h>
+#include <libubiio_int.h>
+#include <mtd/ubi-user.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+
+enum
+{
+	W_SEQWRITE,
+	W_SEQREAD,
+	W_RANDWRITE,
+	W_RANDREAD,
+	W_CHANGE,
+	W_MAP,
+	W_UNMAP,
+	W_ERASE,
+	W_OPEN,
+	W_LOOKUP,
+	W_COUNT
+};
+
+/* Workloads doing data transfers, run once per I/O size */
+#define W_SIZED(w) ((w) <= W_CHANGE)
+
+static const char *wl_names[W_COUNT] = {
+	"seqwrite", "seqread", "randwrite", "randread", "change",
+	"map", "unmap", "erase", "open", "lookup"
+};
+
+#define MAX_LIST 16
+#define MAX_THREADS 256
+
+struct bench
+{
+	/* volume */
+	const char *path;
+	int sim;
+	int ubi_num;
+	int vol_id;
+	struct ubi_sim_geometry geo;
+	struct ubi_volume_desc *desc;
+	int leb_size;
+	int min_io;
+	int nr_lebs;
+	/* parameters */
+	int workloads[W_COUNT];
+	int sizes[MAX_LIST];
+	int nr_sizes;
+	int threads[MAX_LIST];
+	int nr_threads;
+	int ops;
+	unsigned int seed;
+	/* simulated NAND timing */
+	int timed;
+	struct ubi_sim_timing timing;
+	uint64_t vnow;
+	/* start gate of the workers */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int waiting;
+};
+
+struct worker
+{
+	struct bench *b;
+	pthread_t thread;
+	int workload;
+	int size;
+	int first_leb;
+	int nr_lebs;
+	int ops;
+	uint64_t rnd;
+	char *buf;
+	uint64_t *lat;
+	uint64_t vstart;
+	uint64_t start;
+	uint64_t end;
+	int err;
+};
+
+static int usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [options] volume\n"
+		"volume is /dev/ubiX_Y, or a file used as a simulated volume.\n"
+		"The contents of the volume are destroyed.\n"
+		"  -w list  workloads among seqwrite, seqread, randwrite,\n"
+		"           randread, change, map, unmap, erase, open, lookup\n"
+		"           (default: all)\n"
+		"  -s list  I/O sizes in bytes, or \"leb\" (default: min I/O,\n"
+		"           4096, 65536 and leb)\n"
+		"  -t list  thread counts (default: 1)\n"
+		"  -n ops   operations per run (default: 1000)\n"
+		"  -S seed  random seed (default: 1)\n"
+		"Simulated volume geometry:\n"
+		"  -l lebs  number of LEBs (default: 64, 0 to use the file\n"
+		"           size)\n"
+		"  -e size  LEB size (default: 126976)\n"
+		"  -m size  minimal I/O unit size (default: 2048)\n"
+		"  -T tR,tPROG,tBERS,dies,MB/s\n"
+		"           NAND timing model, times in microseconds\n"
+		"  -V       run the timing model on a virtual clock\n"
+		"Sample: %s -w randread,randwrite -t 1,2,4 /dev/ubi0_0\n",
+		argv[0], argv[0]);
+	return 1;
+}
+
+/* Time in ns, simulated time when there is a timing model */
+static uint64_t now_ns(struct bench *b)
+{
+	struct timespec ts;
+
+	if (b->timed)
+		return ubi_sim_clock(b->desc);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t rnd_next(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static int parse_list(char *arg, int *list, int max, int leb_size)
+{
+	char *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save))
+	{
+		if (n == max)
+			return -1;
+		if (!strcmp(tok, "leb"))
+			list[n] = leb_size ? leb_size : -1;
+		else
+			list[n] = atoi(tok);
+		n++;
+	}
+	return n;
+}
+
+static struct ubi_volume_desc *bench_open(struct bench *b)
+{
+	if (b->sim)
+		return ubi_open_volume_sim(b->path, &b->geo, UBI_READWRITE);
+	return ubi_open_volume(b->ubi_num, b->vol_id, UBI_READWRITE);
+}
+
+/*
+ * Empty the LEBs of a worker, outside of the measured time: erasures wait for
+ * the eraseblocks to be erased, where un-maps would leave the erasures to the
+ * background, in the way of the first writes
+ */
+static int reset_lebs(struct worker *w)
+{
+	int lnum, err;
+
+	for (lnum = w->first_leb; lnum < w->first_leb + w->nr_lebs; lnum++)
+	{
+		err = ubi_leb_erase(w->b->desc, lnum);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct bench *b = w->b;
+	struct ubi_volume_desc *desc = b->desc, *d;
+	int per_leb = b->leb_size / w->size, *fill = NULL;
+	int i, lnum, off, pos = 0, err = 0;
+	uint64_t t0 = 0;
+
+	if (w->workload == W_RANDWRITE)
+	{
+		fill = calloc(w->nr_lebs, sizeof(int));
+		if (fill == NULL)
+		{
+			w->err = -ENOMEM;
+			return NULL;
+		}
+	}
+
+	/* the workers of a run start together */
+	if (b->timing.flags & UBI_SIM_VIRTUAL_CLOCK)
+		ubi_sim_set_clock(desc, w->vstart);
+	pthread_mutex_lock(&b->lock);
+	if (--b->waiting == 0)
+		pthread_cond_broadcast(&b->cond);
+	while (b->waiting)
+		pthread_cond_wait(&b->cond, &b->lock);
+	pthread_mutex_unlock(&b->lock);
+	w->start = now_ns(b);
+	for (i = 0; i < w->ops && !err; i++)
+	{
+		lnum = w->first_leb + rnd_next(&w->rnd) % w->nr_lebs;
+		switch (w->workload)
+		{
+		case W_SEQWRITE:
+			lnum = w->first_leb + pos / per_leb % w->nr_lebs;
+			off = pos % per_leb * w->size;
+			if (off == 0 && pos >= per_leb * w->nr_lebs)
+				err = ubi_leb_unmap(desc, lnum);
+			pos++;
+			t0 = now_ns(b);
+			if (!err)
+				err = ubi_leb_write(desc, lnum, w->buf, off,
+						    w->size, UBI_UNKNOWN);
+			break;
+		case W_SEQREAD:
+			lnum = w->first_leb + pos / per_leb % w->nr_lebs;
+			off = pos % per_leb * w->size;
+			pos++;
+			t0 = now_ns(b);
+			err = ubi_leb_read(desc, lnum, w->buf, off, w->size, 0);
+			break;
+		case W_RANDWRITE:
+			/* pages of a LEB are written in order */
+			if (fill[lnum - w->first_leb] == per_leb)
+			{
+				err = ubi_leb_unmap(desc, lnum);
+				fill[lnum - w->first_leb] = 0;
+			}
+			off = fill[lnum - w->first_leb]++ * w->size;
+			t0 = now_ns(b);
+			if (!err)
+				err = ubi_leb_write(desc, lnum, w->buf, off,
+						    w->size, UBI_UNKNOWN);
+			break;
+		case W_RANDREAD:
+			off = rnd_next(&w->rnd) % per_leb * w->size;
+			t0 = now_ns(b);
+			err = ubi_leb_read(desc, lnum, w->buf, off, w->size, 0);
+			break;
+		case W_CHANGE:
+			t0 = now_ns(b);
+			err = ubi_leb_change(desc, lnum, w->buf, w->size,
+					     UBI_UNKNOWN);
+			break;
+		case W_MAP:
+			err = ubi_leb_unmap(desc, lnum);
+			t0 = now_ns(b);
+			if (!err)
+				err = ubi_leb_map(desc, lnum, UBI_UNKNOWN);
+			break;
+		case W_UNMAP:
+		case W_ERASE:
+			/* make sure there is something to get rid of */
+			err = ubi_leb_unmap(desc, lnum);
+			if (!err)
+				err = ubi_leb_write(desc, lnum, w->buf, 0,
+						    b->min_io, UBI_UNKNOWN);
+			t0 = now_ns(b);
+			if (!err)
+				err = w->workload == W_UNMAP
+					? ubi_leb_unmap(desc, lnum)
+					: ubi_leb_erase(desc, lnum);
+			break;
+		case W_OPEN:
+			t0 = now_ns(b);
+			d = bench_open(b);
+			if (d == NULL)
+				err = -errno;
+			else
+				ubi_close_volume(d);
+			break;
+		case W_LOOKUP:
+			t0 = now_ns(b);
+			err = ubi_get_vol_id_by_name(b->ubi_num,
+						     desc->vi.name);
+			err = err == b->vol_id ? 0 : -ENOENT;
+			break;
+		}
+		w->lat[i] = now_ns(b) - t0;
+	}
+	w->end = now_ns(b);
+	free(fill);
+	w->err = err;
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct_us(uint64_t *lat, int n, double p)
+{
+	int i = (int) (p / 100.0 * (n - 1) + 0.5);
+
+	return lat[i] / 1000.0;
+}
+
+/* Run one workload with the given I/O size and thread count */
+static int run(struct bench *b, int workload, int size, int nr_threads,
+	       int *first)
+{
+	struct worker w[MAX_THREADS];
+	uint64_t *lat, start, end;
+	int i, n, err = 0, per = b->nr_lebs / nr_threads;
+	double secs;
+
+	if (nr_threads > (int) ARRAY_SIZE(w) || per == 0)
+	{
+		fprintf(stderr, "too many threads for %d LEBs\n", b->nr_lebs);
+		return -EINVAL;
+	}
+	lat = malloc(sizeof(uint64_t) * b->ops * nr_threads);
+	if (lat == NULL)
+		return -ENOMEM;
+
+	memset(w, 0, sizeof(w));
+	if (b->timing.flags & UBI_SIM_VIRTUAL_CLOCK)
+		ubi_sim_set_clock(b->desc, MAX(now_ns(b), b->vnow));
+	for (i = 0; i < nr_threads; i++)
+	{
+		w[i].b = b;
+		w[i].workload = workload;
+		w[i].size = size ? size : b->min_io;
+		w[i].first_leb = i * per;
+		w[i].nr_lebs = per;
+		w[i].ops = b->ops;
+		w[i].rnd = (b->seed + 1) * 0x9E3779B97F4A7C15ULL + i;
+		w[i].lat = lat + i * b->ops;
+		w[i].buf = malloc(w[i].size);
+		if (w[i].buf == NULL)
+		{
+			err = -ENOMEM;
+			goto out;
+		}
+		memset(w[i].buf, 0xA5 ^ i, w[i].size);
+		/* writers start on empty LEBs */
+		if (workload == W_SEQWRITE || workload == W_RANDWRITE)
+		{
+			err = reset_lebs(&w[i]);
+			if (err)
+				goto out;
+		}
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		w[i].vstart = b->timed ? now_ns(b) : 0;
+	b->waiting = nr_threads;
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&w[i].thread, NULL, worker_run, &w[i]);
+	for (i = 0; i < nr_threads; i++)
+	{
+		pthread_join(w[i].thread, NULL);
+		if (w[i].err && !err)
+			err = w[i].err;
+	}
+	start = w[0].start;
+	end = w[0].end;
+	for (i = 1; i < nr_threads; i++)
+	{
+		start = MIN(start, w[i].start);
+		end = MAX(end, w[i].end);
+	}
+	b->vnow = end;
+	if (err)
+	{
+		fprintf(stderr, "%s: %s\n", wl_names[workload],
+			strerror(-err));
+		goto out;
+	}
+
+	n = b->ops * nr_threads;
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+	secs = (end - start) / 1e9;
+	printf("%s    {\"workload\": \"%s\", \"size\": %d, \"threads\": %d, "
+	       "\"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+	       "\"mb_per_sec\": %.3f,\n"
+	       "     \"lat_us\": {\"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+	       "\"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}}",
+	       *first ? "" : ",\n", wl_names[workload], size, nr_threads, n,
+	       secs, n / secs, W_SIZED(workload) ? n * (double) size / secs
+	       / 1e6 : 0.0, lat[0] / 1000.0, pct_us(lat, n, 50),
+	       pct_us(lat, n, 90), pct_us(lat, n, 99), pct_us(lat, n, 99.9),
+	       lat[n - 1] / 1000.0);
+	*first = 0;
+out:
+	for (i = 0; i < nr_threads; i++)
+		free(w[i].buf);
+	free(lat);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	char *wl_arg = NULL, *size_arg = NULL, *tok, *save;
+	int c, i, s, t, first = 1, err = 0;
+
+	memset(&b, 0, sizeof(b));
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
+	b.ops = 1000;
+	b.seed = 1;
+	b.geo.nr_lebs = 64;
+	b.geo.leb_size = 126976;
+	b.geo.min_io_size = 2048;
+	b.threads[0] = 1;
+	b.nr_threads = 1;
+
+	while ((c = getopt(argc, argv, "w:s:t:n:S:l:e:m:T:Vh")) != -1)
+	{
+		switch (c)
+		{
+		case 'w':
+			wl_arg = optarg;
+			break;
+		case 's':
+			size_arg = optarg;
+			break;
+		case 't':
+			b.nr_threads = parse_list(optarg, b.threads, MAX_LIST,
+						  0);
+			break;
+		case 'n':
+			b.ops = atoi(optarg);
+			break;
+		case 'S':
+			b.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			b.geo.nr_lebs = atoi(optarg);
+			break;
+		case 'e':
+			b.geo.leb_size = atoi(optarg);
+			break;
+		case 'm':
+			b.geo.min_io_size = atoi(optarg);
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d,%d,%d,%d,%d",
+				   &b.timing.read_us, &b.timing.prog_us,
+				   &b.timing.erase_us, &b.timing.dies,
+				   &b.timing.bus_mbps) != 5)
+				return usage(argv);
+			b.timed = 1;
+			break;
+		case 'V':
+			b.timing.flags |= UBI_SIM_VIRTUAL_CLOCK;
+			break;
+		default:
+			return usage(argv);
+		}
+	}
+	if (optind != argc - 1 || b.ops <= 0 || b.nr_threads <= 0)
+		return usage(argv);
+	for (i = 0; i < b.nr_threads; i++)
+		if (b.threads[i] <= 0)
+			return usage(argv);
+
+	b.path = argv[optind];
+	b.sim = sscanf(b.path, "/dev/ubi%d_%d", &b.ubi_num, &b.vol_id) != 2;
+	b.desc = bench_open(&b);
+	if (b.desc == NULL)
+	{
+		perror(b.path);
+		return 1;
+	}
+	if (b.timed)
+	{
+		err = b.sim ? ubi_sim_set_timing(b.desc, &b.timing) : -EINVAL;
+		if (err)
+		{
+			fprintf(stderr, "cannot set the timing model: %s\n",
+				strerror(-err));
+			return 1;
+		}
+	}
+	b.leb_size = b.desc->vi.usable_leb_size;
+	b.min_io = b.desc->di.min_io_size;
+	b.nr_lebs = b.desc->vi.used_ebs;
+
+	if (wl_arg)
+	{
+		for (tok = strtok_r(wl_arg, ",", &save); tok;
+		     tok = strtok_r(NULL, ",", &save))
+		{
+			for (i = 0; i < W_COUNT; i++)
+				if (!strcmp(tok, wl_names[i]))
+					break;
+			if (i == W_COUNT)
+			{
+				fprintf(stderr, "unknown workload \"%s\"\n",
+					tok);
+				return usage(argv);
+			}
+			b.workloads[i] = 1;
+		}
+	}
+	else
+		for (i = 0; i < W_COUNT; i++)
+			b.workloads[i] = 1;
+	/* there is nothing to look up on a simulated volume */
+	if (b.sim)
+		b.workloads[W_LOOKUP] = 0;
+
+	if (size_arg)
+		b.nr_sizes = parse_list(size_arg, b.sizes, MAX_LIST,
+					b.leb_size);
+	else
+	{
+		b.sizes[b.nr_sizes++] = b.min_io;
+		if (b.min_io < 4096)
+			b.sizes[b.nr_sizes++] = 4096;
+		if (b.min_io < 65536 && 65536 < b.leb_size)
+			b.sizes[b.nr_sizes++] = 65536;
+		b.sizes[b.nr_sizes++] = b.leb_size;
+	}
+	for (i = 0; i < b.nr_sizes; i++)
+		if (b.sizes[i] <= 0 || b.sizes[i] > b.leb_size
+		    || b.sizes[i] % b.min_io)
+		{
+			fprintf(stderr, "invalid I/O size, it must be a "
+				"multiple of %d up to %d\n", b.min_io,
+				b.leb_size);
+			return usage(argv);
+		}
+
+	printf("{\"volume\": \"%s\", \"backend\": \"%s\", \"leb_size\": %d, "
+	       "\"min_io_size\": %d, \"lebs\": %d, \"seed\": %u,\n",
+	       b.path, b.sim ? "file" : "ubi", b.leb_size, b.min_io,
+	       b.nr_lebs, b.seed);
+	if (b.timed)
+		printf("  \"timing\": {\"read_us\": %d, \"prog_us\": %d, "
+		       "\"erase_us\": %d, \"dies\": %d, \"bus_mbps\": %d, "
+		       "\"clock\": \"%s\"},\n", b.timing.read_us,
+		       b.timing.prog_us, b.timing.erase_us, b.timing.dies,
+		       b.timing.bus_mbps, b.timing.flags & UBI_SIM_VIRTUAL_CLOCK
+		       ? "virtual" : "real");
+	printf("  \"results\": [\n");
+	for (i = 0; i < W_COUNT && !err; i++)
+	{
+		if (!b.workloads[i])
+			continue;
+		for (s = 0; s < (W_SIZED(i) ? b.nr_sizes : 1) && !err; s++)
+			for (t = 0; t < b.nr_threads && !err; t++)
+				err = run(&b, i, W_SIZED(i) ? b.sizes[s] : 0,
+					  b.threads[t], &first);
+	}
+	printf("\n  ]}\n");
+
+	ubi_close_volume(b.desc);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * libubiio calibration.
+ *
+ * Measures the performance of the device of a UBI volume, or of a
+ * file-backed stand-in, on a scratch LEB, prints the profile as JSON on
+ * stdout and saves it, so that the volumes of the device opened afterwards
+ * use it.
+ */
+
+#include <libubiio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+static int usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [options] volume\n"
+		"volume is /dev/ubiX_Y, or a file used as a simulated volume.\n"
+		"  -s lnum  un-mapped LEB to run the benchmark on (default:\n"
+		"           the last one)\n"
+		"  -b ms    time budget in milliseconds (default: 2000)\n"
+		"  -d dir   directory of the profiles (default:\n"
+		"           /var/lib/libubiio)\n"
+		"  -n       do not save the profile\n"
+		"Simulated volume geometry:\n"
+		"  -l lebs  number of LEBs (default: 64, 0 to use the file\n"
+		"           size)\n"
+		"  -e size  LEB size (default: 126976)\n"
+		"  -m size  minimal I/O unit size (default: 2048)\n"
+		"  -T tR,tPROG,tBERS,dies,MB/s\n"
+		"           NAND timing model, times in microseconds\n"
+		"Sample: %s -s 100 /dev/ubi0_0\n",
+		argv[0], argv[0]);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct ubi_sim_geometry geo = { 64, 126976, 2048 };
+	struct ubi_sim_timing timing;
+	struct ubi_volume_desc *desc;
+	struct ubi_profile prof;
+	int c, lnum = -1, budget = 0, save = 1, timed = 0, ubi_num, vol_id;
+	int sim, err;
+	const char *path;
+
+	memset(&timing, 0, sizeof(timing));
+	while ((c = getopt(argc, argv, "s:b:d:nl:e:m:T:h")) != -1)
+	{
+		switch (c)
+		{
+		case 's':
+			lnum = atoi(optarg);
+			break;
+		case 'b':
+			budget = atoi(optarg);
+			break;
+		case 'd':
+			if (ubi_profile_dir(optarg))
+				return usage(argv);
+			break;
+		case 'n':
+			save = 0;
+			break;
+		case 'l':
+			geo.nr_lebs = atoi(optarg);
+			break;
+		case 'e':
+			geo.leb_size = atoi(optarg);
+			break;
+		case 'm':
+			geo.min_io_size = atoi(optarg);
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d,%d,%d,%d,%d",
+				   &timing.read_us, &timing.prog_us,
+				   &timing.erase_us, &timing.dies,
+				   &timing.bus_mbps) != 5)
+				return usage(argv);
+			timed = 1;
+			break;
+		default:
+			return usage(argv);
+		}
+	}
+	if (optind != argc - 1 || budget < 0)
+		return usage(argv);
+
+	path = argv[optind];
+	sim = sscanf(path, "/dev/ubi%d_%d", &ubi_num, &vol_id) != 2;
+	if (sim)
+		desc = ubi_open_volume_sim(path, &geo, UBI_READWRITE);
+	else
+		desc = ubi_open_volume(ubi_num, vol_id, UBI_READWRITE);
+	if (desc == NULL)
+	{
+		perror(path);
+		return 1;
+	}
+	if (timed)
+	{
+		err = sim ? ubi_sim_set_timing(desc, &timing) : -EINVAL;
+		if (err)
+		{
+			fprintf(stderr, "cannot set the timing model: %s\n",
+				strerror(-err));
+			return 1;
+		}
+	}
+	if (lnum < 0)
+	{
+		struct ubi_volume_info vi;
+
+		ubi_get_volume_info(desc, &vi);
+		lnum = vi.used_ebs - 1;
+	}
+
+	err = ubi_calibrate(desc, lnum, budget, &prof);
+	if (err)
+	{
+		fprintf(stderr, "calibration failed: %s\n", strerror(-err));
+		return 1;
+	}
+	if (save && (err = ubi_profile_save(desc, &prof)))
+	{
+		fprintf(stderr, "cannot save the profile: %s\n",
+			strerror(-err));
+		return 1;
+	}
+
+	printf("{\"write_size\": %d, \"read_size\": %d, \"queue_depth\": %d, "
+	       "\"readahead\": %d,\n \"write_kbps\": %d, \"read_kbps\": %d, "
+	       "\"read_us\": %d, \"prog_us\": %d, \"erase_us\": %d, "
+	       "\"saved\": %s}\n",
+	       prof.write_size, prof.read_size, prof.queue_depth,
+	       prof.readahead, prof.write_kbps, prof.read_kbps, prof.read_us,
+	       prof.prog_us, prof.erase_us, save ? "true" : "false");
+	ubi_close_volume(desc);
+	return 0;
+}
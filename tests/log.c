@@ -0,0 +1,160 @@
+/*
+ * libubiio append-only log test.
+ *
+ * Runs on a file used as a simulated volume, which it overwrites. Commits
+ * records whose pages are all 0xFF in the middle of a LEB, reopens the log
+ * and checks that recovery finds every committed record and appends after
+ * them.
+ */
+
+#include <libubiio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define NR_LEBS		16
+#define LEB_SIZE	126976
+#define MIN_IO		2048
+
+static const int rec_len[] = { 56000, 24000, 3000, 3000, 5000 };
+#define NR_RECS (int) (sizeof(rec_len) / sizeof(rec_len[0]))
+
+static int usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s file\n"
+		"file is overwritten with a simulated volume.\n",
+		argv[0]);
+	return 1;
+}
+
+/* Record @i, all 0xFF for the second one */
+static void fill(char *buf, int i)
+{
+	memset(buf, i == 1 ? 0xFF : 'a' + i, rec_len[i]);
+}
+
+static struct ubi_volume_desc *open_sim(const char *path)
+{
+	static const struct ubi_sim_geometry geo = {
+		NR_LEBS, LEB_SIZE, MIN_IO
+	};
+
+	return ubi_open_volume_sim(path, &geo, UBI_READWRITE);
+}
+
+static int append(struct ubi_log *log, char *buf, int i, uint64_t expect)
+{
+	uint64_t lsn;
+	int err;
+
+	fill(buf, i);
+	err = ubi_log_append(log, buf, rec_len[i], &lsn);
+	if (!err)
+		err = ubi_log_commit(log, lsn);
+	if (err)
+	{
+		fprintf(stderr, "record %d: append failed: %s\n", i,
+			strerror(-err));
+		return 1;
+	}
+	if (lsn != expect)
+	{
+		fprintf(stderr, "record %d: LSN %llu, expected %llu\n", i,
+			(unsigned long long) lsn, (unsigned long long) expect);
+		return 1;
+	}
+	return 0;
+}
+
+static int check(struct ubi_log *log, char *buf, char *ref, int nr)
+{
+	int i, ret, fails = 0;
+
+	for (i = 0; i < nr; i++)
+	{
+		fill(ref, i);
+		ret = ubi_log_read(log, i + 1, buf, LEB_SIZE);
+		if (ret != rec_len[i] || memcmp(buf, ref, rec_len[i]))
+		{
+			fprintf(stderr, "LSN %d: read returned %d\n", i + 1,
+				ret);
+			fails++;
+		}
+	}
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	struct ubi_volume_desc *desc;
+	struct ubi_log *log;
+	char *buf, *ref;
+	int i, fd, fails = 0;
+
+	if (argc != 2)
+		return usage(argv);
+
+	/* an erased volume */
+	buf = malloc(LEB_SIZE);
+	ref = malloc(LEB_SIZE);
+	if (buf == NULL || ref == NULL)
+		return 1;
+	memset(buf, 0xFF, LEB_SIZE);
+	fd = open(argv[1], O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	for (i = 0; i < NR_LEBS; i++)
+		if (write(fd, buf, LEB_SIZE) != LEB_SIZE)
+		{
+			perror(argv[1]);
+			return 1;
+		}
+	close(fd);
+
+	desc = open_sim(argv[1]);
+	if (desc == NULL || (log = ubi_log_open(desc)) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	for (i = 0; i < NR_RECS - 1; i++)
+		if (append(log, buf, i, i + 1))
+			return 1;
+	ubi_log_close(log);
+	ubi_close_volume(desc);
+
+	/* recovery must not stop at the pages of 0xFF */
+	desc = open_sim(argv[1]);
+	if (desc == NULL || (log = ubi_log_open(desc)) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fails += check(log, buf, ref, NR_RECS - 1);
+	if (append(log, buf, NR_RECS - 1, NR_RECS))
+		return 1;
+	ubi_log_close(log);
+	ubi_close_volume(desc);
+
+	/* and what was appended after recovery is found again */
+	desc = open_sim(argv[1]);
+	if (desc == NULL || (log = ubi_log_open(desc)) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fails += check(log, buf, ref, NR_RECS);
+	ubi_log_close(log);
+	ubi_close_volume(desc);
+
+	printf("{\"test\": \"log\", \"failures\": %d}\n", fails);
+	free(ref);
+	free(buf);
+	return fails != 0;
+}
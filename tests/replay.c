@@ -0,0 +1,381 @@
+/*
+ * libubiio workload replay.
+ *
+ * Re-issues the operations recorded by 'ubi_capture_start()' against a UBI
+ * volume, or against a file-backed stand-in with the geometry of the
+ * captured volume, as fast as possible or at the time they were captured,
+ * and prints the latencies of the capture and of the replay as JSON on
+ * stdout. The volume contents are overwritten by the writes and changes of
+ * the capture, with data of our own.
+ *
+ * With one thread, the operations are issued in the order they started in,
+ * one at a time. With more, each thread takes the next operation, so that
+ * operations which overlapped in the capture overlap again.
+ */
+
+#include <libubiio.h>
+#include <libubiio_int.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define NR_OPS UBI_OP_IS_MAPPED
+#define MAX_THREADS 256
+
+static const char *op_names[NR_OPS] = {
+	"read", "write", "change", "erase", "unmap", "map", "is_mapped"
+};
+
+struct replay
+{
+	const struct ubi_capture_hdr *hdr;
+	struct ubi_capture_rec *recs;
+	int nr;
+	struct ubi_volume_desc *desc;
+	long long vol_size;
+	int max_len;
+	/* timing, speed 0 for as fast as possible */
+	double speed;
+	uint64_t start;
+	/* next record to issue */
+	int next;
+	/* replayed latencies and results, by record */
+	uint64_t *lat;
+	int *result;
+};
+
+static int usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [options] capture volume\n"
+		"capture is a file written by ubi_capture_start(), volume is\n"
+		"/dev/ubiX_Y, or a file used as a simulated volume with the\n"
+		"geometry of the captured volume. The contents of the volume\n"
+		"are destroyed.\n"
+		"  -t       issue the operations at their original time\n"
+		"  -x speed same at speed times the original pace (default:\n"
+		"           1)\n"
+		"  -j n     threads issuing the operations (default: 1)\n"
+		"Sample: %s -t /tmp/app.cap /dev/ubi0_0\n",
+		argv[0], argv[0]);
+	return 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+	       == EINTR)
+		;
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct ubi_capture_rec *x = a, *y = b;
+
+	if (x->time_ns != y->time_ns)
+		return x->time_ns < y->time_ns ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Copy the records which are complete out of the ring, in the order the
+ * operations started. Returns how many there are.
+ */
+static int load_records(struct replay *r, const struct ubi_capture_rec *ring)
+{
+	const struct ubi_capture_hdr *hdr = r->hdr;
+	uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	uint64_t s = head > hdr->nr_recs ? head - hdr->nr_recs : 0;
+	const struct ubi_capture_rec *rec;
+	int n = 0;
+
+	r->recs = malloc(sizeof(struct ubi_capture_rec) * (head - s + 1));
+	if (r->recs == NULL)
+		return -ENOMEM;
+	for (; s < head; s++)
+	{
+		rec = &ring[s % hdr->nr_recs];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE)
+		    != (uint32_t) (s + 1))
+			continue;
+		r->recs[n] = *rec;
+		if (r->recs[n].opcode >= UBI_OP_READ
+		    && r->recs[n].opcode <= NR_OPS)
+			n++;
+	}
+	qsort(r->recs, n, sizeof(struct ubi_capture_rec), cmp_rec);
+	return n;
+}
+
+/* Issue one operation, returning what it returned */
+static int issue(struct replay *r, const struct ubi_capture_rec *rec,
+		 char *buf)
+{
+	struct ubi_volume_desc *desc = r->desc;
+	long long addr = desc->vi.usable_leb_size * (long long) rec->lnum
+		+ rec->offset;
+	struct iovec iov = { buf, rec->len };
+	int ret;
+
+	if (rec->lnum < 0 || rec->lnum >= desc->vi.used_ebs || rec->len < 0
+	    || rec->len > r->max_len || addr + rec->len > r->vol_size)
+		return -ERANGE;
+	switch (rec->opcode)
+	{
+	case UBI_OP_READ:
+		return __ubi_vol_readv(desc, &iov, 1, addr);
+	case UBI_OP_WRITE:
+		return __ubi_vol_writev(desc, &iov, 1, addr);
+	case UBI_OP_CHANGE:
+		return __ubi_leb_change(desc, rec->lnum, buf, rec->len,
+					rec->dtype);
+	case UBI_OP_ERASE:
+		return __ubi_leb_erase(desc, rec->lnum);
+	case UBI_OP_UNMAP:
+		return __ubi_leb_unmap(desc, rec->lnum);
+	case UBI_OP_MAP:
+		return __ubi_leb_map(desc, rec->lnum, rec->dtype);
+	default:
+		ret = ubi_is_mapped(desc, rec->lnum);
+		return ret < 0 ? -errno : ret;
+	}
+}
+
+static void *worker_run(void *arg)
+{
+	struct replay *r = arg;
+	const struct ubi_capture_rec *rec;
+	uint64_t t0;
+	char *buf;
+	int i;
+
+	buf = malloc(r->max_len ? r->max_len : 1);
+	if (buf == NULL)
+		return NULL;
+	memset(buf, 0xA5, r->max_len);
+	for (;;)
+	{
+		i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+		if (i >= r->nr)
+			break;
+		rec = &r->recs[i];
+		if (r->speed)
+			sleep_until(r->start + rec->time_ns / r->speed);
+		t0 = now_ns();
+		r->result[i] = issue(r, rec, buf);
+		r->lat[i] = now_ns() - t0;
+	}
+	free(buf);
+	return NULL;
+}
+
+static double pct_us(uint64_t *lat, int n, double p)
+{
+	int i = (int) (p / 100.0 * (n - 1) + 0.5);
+
+	return lat[i] / 1000.0;
+}
+
+/* Print the latencies of the operations of one kind */
+static void report(struct replay *r, int opcode, int *first)
+{
+	uint64_t *cap, *rep;
+	int i, n = 0, errors = 0, mismatches = 0, skipped = 0;
+
+	cap = malloc(sizeof(uint64_t) * r->nr);
+	rep = malloc(sizeof(uint64_t) * r->nr);
+	if (cap == NULL || rep == NULL)
+		goto out;
+	for (i = 0; i < r->nr; i++)
+	{
+		if (r->recs[i].opcode != opcode)
+			continue;
+		if (r->result[i] == -ERANGE)
+		{
+			skipped++;
+			continue;
+		}
+		cap[n] = r->recs[i].lat_ns;
+		rep[n] = r->lat[i];
+		errors += r->result[i] < 0;
+		mismatches += r->result[i] != r->recs[i].result;
+		n++;
+	}
+	if (n == 0 && skipped == 0)
+		goto out;
+	printf("%s    {\"op\": \"%s\", \"count\": %d, \"skipped\": %d, "
+	       "\"errors\": %d, \"result_mismatches\": %d", *first ? "" : ",\n",
+	       op_names[opcode - 1], n, skipped, errors, mismatches);
+	if (n)
+	{
+		qsort(cap, n, sizeof(uint64_t), cmp_u64);
+		qsort(rep, n, sizeof(uint64_t), cmp_u64);
+		printf(",\n     \"captured_lat_us\": {\"p50\": %.2f, "
+		       "\"p99\": %.2f, \"max\": %.2f},\n"
+		       "     \"replayed_lat_us\": {\"p50\": %.2f, "
+		       "\"p99\": %.2f, \"max\": %.2f}", pct_us(cap, n, 50),
+		       pct_us(cap, n, 99), cap[n - 1] / 1000.0,
+		       pct_us(rep, n, 50), pct_us(rep, n, 99),
+		       rep[n - 1] / 1000.0);
+	}
+	printf("}");
+	*first = 0;
+out:
+	free(cap);
+	free(rep);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay r;
+	struct ubi_sim_geometry geo;
+	pthread_t threads[MAX_THREADS];
+	struct stat st;
+	const char *cap_path, *path;
+	int c, i, fd, ubi_num, vol_id, nr_threads = 1, first = 1, timed = 0;
+	uint64_t begin, end;
+	void *map;
+
+	memset(&r, 0, sizeof(r));
+	r.speed = 1;
+	while ((c = getopt(argc, argv, "tx:j:h")) != -1)
+	{
+		switch (c)
+		{
+		case 't':
+			timed = 1;
+			break;
+		case 'x':
+			r.speed = atof(optarg);
+			timed = 1;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			return usage(argv);
+		}
+	}
+	if (optind != argc - 2 || r.speed <= 0 || nr_threads <= 0
+	    || nr_threads > MAX_THREADS)
+		return usage(argv);
+	if (!timed)
+		r.speed = 0;
+	cap_path = argv[optind];
+	path = argv[optind + 1];
+
+	fd = open(cap_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+	{
+		perror(cap_path);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		perror(cap_path);
+		return 1;
+	}
+	r.hdr = map;
+	if (st.st_size < (off_t) sizeof(struct ubi_capture_hdr)
+	    || r.hdr->magic != UBI_CAPTURE_MAGIC
+	    || r.hdr->version != UBI_CAPTURE_VERSION
+	    || r.hdr->rec_size != sizeof(struct ubi_capture_rec)
+	    || st.st_size < (off_t) (sizeof(struct ubi_capture_hdr)
+				     + (uint64_t) r.hdr->nr_recs
+				     * sizeof(struct ubi_capture_rec)))
+	{
+		fprintf(stderr, "%s: not a capture file\n", cap_path);
+		return 1;
+	}
+	r.nr = load_records(&r, (const struct ubi_capture_rec *) (r.hdr + 1));
+	if (r.nr < 0)
+	{
+		fprintf(stderr, "%s\n", strerror(-r.nr));
+		return 1;
+	}
+
+	if (sscanf(path, "/dev/ubi%d_%d", &ubi_num, &vol_id) == 2)
+		r.desc = ubi_open_volume(ubi_num, vol_id, UBI_READWRITE);
+	else
+	{
+		geo.nr_lebs = r.hdr->nr_lebs;
+		geo.leb_size = r.hdr->leb_size;
+		geo.min_io_size = r.hdr->min_io_size;
+		r.desc = ubi_open_volume_sim(path, &geo, UBI_READWRITE);
+	}
+	if (r.desc == NULL)
+	{
+		perror(path);
+		return 1;
+	}
+	r.vol_size = r.desc->vi.usable_leb_size
+		* (long long) r.desc->vi.used_ebs;
+	if (r.desc->vi.usable_leb_size != r.hdr->leb_size)
+		fprintf(stderr, "warning: LEB size %d, captured on %d\n",
+			r.desc->vi.usable_leb_size, r.hdr->leb_size);
+	for (i = 0; i < r.nr; i++)
+		r.max_len = MAX(r.max_len, r.recs[i].len);
+	r.max_len = MIN(r.max_len, r.vol_size);
+	r.lat = calloc(r.nr + 1, sizeof(uint64_t));
+	r.result = calloc(r.nr + 1, sizeof(int));
+	if (r.lat == NULL || r.result == NULL)
+	{
+		fprintf(stderr, "%s\n", strerror(ENOMEM));
+		return 1;
+	}
+
+	/* the first operation goes right away */
+	begin = now_ns();
+	r.start = begin - (r.nr && r.speed ? r.recs[0].time_ns / r.speed : 0);
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, worker_run, &r);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	end = now_ns();
+
+	printf("{\"capture\": \"%s\", \"volume\": \"%s\", \"backend\": \"%s\", "
+	       "\"records\": %d, \"lost\": %llu, \"threads\": %d,\n"
+	       "  \"timing\": \"%s\", \"speed\": %.2f, \"seconds\": %.6f,\n"
+	       "  \"ops\": [\n", cap_path, path,
+	       r.desc->sim ? "file" : "ubi", r.nr,
+	       (unsigned long long) (r.hdr->head - r.nr), nr_threads,
+	       r.speed ? "original" : "none", r.speed,
+	       (end - begin) / 1e9);
+	for (i = UBI_OP_READ; i <= NR_OPS; i++)
+		report(&r, i, &first);
+	printf("\n  ]}\n");
+
+	ubi_close_volume(r.desc);
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * libubiio statistics reader.
+ *
+ * Maps the statistics a process exported with 'ubi_stats_export()' and
+ * prints them, once or at an interval. The mapping is read-only, so the
+ * process being watched is not disturbed.
+ */
+
+#include <libubiio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+static const char *op_names[UBI_STATS_NR_OPS] = {
+	"read", "write", "change", "erase", "unmap", "map"
+};
+
+static int usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [options] file\n"
+		"file is what the process passed to ubi_stats_export(), by\n"
+		"default /dev/shm/libubiio.<pid>.\n"
+		"  -i ms    print every ms milliseconds, with rates\n"
+		"  -c count stop after count prints (default: 1, or forever\n"
+		"           with -i)\n",
+		argv[0]);
+	return 1;
+}
+
+static uint64_t load(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* Upper bound in microseconds of the bucket holding the p-th fraction */
+static uint64_t pct_us(const struct ubi_stats_slot *s, int op, double p)
+{
+	uint64_t n = 0, seen = 0;
+	int b;
+
+	for (b = 0; b < UBI_STATS_NR_BUCKETS; b++)
+		n += load(&s->lat[op][b]);
+	if (n == 0)
+		return 0;
+	for (b = 0; b < UBI_STATS_NR_BUCKETS; b++)
+	{
+		seen += load(&s->lat[op][b]);
+		if (seen >= p * n)
+			break;
+	}
+	return 2ULL << b;
+}
+
+static void print_slot(const struct ubi_stats_slot *s,
+		       const struct ubi_stats_slot *prev, double secs)
+{
+	uint64_t ops, bytes;
+	int op;
+
+	if (s->vol_id < 0)
+	{
+		printf("ubi%d: queued %lld in flight %lld\n", s->ubi_num,
+		       (long long) __atomic_load_n(&s->queued,
+						   __ATOMIC_RELAXED),
+		       (long long) __atomic_load_n(&s->inflight,
+						   __ATOMIC_RELAXED));
+		return;
+	}
+
+	printf("ubi%d_%d:\n", s->ubi_num, s->vol_id);
+	for (op = 0; op < UBI_STATS_NR_OPS; op++)
+	{
+		ops = load(&s->ops[op]);
+		bytes = load(&s->bytes[op]);
+		if (ops == 0)
+			continue;
+		printf("  %-6s %12llu ops %14llu bytes %8llu errors"
+		       "  p50 <%lluus p99 <%lluus",
+		       op_names[op], (unsigned long long) ops,
+		       (unsigned long long) bytes,
+		       (unsigned long long) load(&s->errors[op]),
+		       (unsigned long long) pct_us(s, op, 0.5),
+		       (unsigned long long) pct_us(s, op, 0.99));
+		if (prev && secs > 0)
+			printf("  %.0f ops/s %.2f MB/s",
+			       (ops - prev->ops[op]) / secs,
+			       (bytes - prev->bytes[op]) / secs / 1e6);
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct ubi_stats_shm *shm, *prev = NULL;
+	struct timespec ts;
+	double t, t_prev = 0;
+	int fd, c, i, interval = 0, count = -1;
+
+	while ((c = getopt(argc, argv, "i:c:h")) != -1)
+	{
+		switch (c)
+		{
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'c':
+			count = atoi(optarg);
+			break;
+		default:
+			return usage(argv);
+		}
+	}
+	if (optind != argc - 1 || interval < 0)
+		return usage(argv);
+	if (count < 0)
+		count = interval ? 0 : 1;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != UBI_STATS_MAGIC
+	    || shm->version != UBI_STATS_VERSION
+	    || shm->size != sizeof(*shm))
+	{
+		fprintf(stderr, "%s: not libubiio statistics version %d\n",
+			argv[optind], UBI_STATS_VERSION);
+		return 1;
+	}
+	if (count != 1)
+	{
+		prev = calloc(1, sizeof(*prev));
+		if (prev == NULL)
+			return 1;
+	}
+
+	for (c = 0; count == 0 || c < count; c++)
+	{
+		if (c)
+			usleep(interval * 1000);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		t = ts.tv_sec + ts.tv_nsec / 1e9;
+		printf("pid %d\n", shm->pid);
+		for (i = 0; i < UBI_STATS_NR_SLOTS; i++)
+		{
+			if (!__atomic_load_n(&shm->slots[i].in_use,
+					     __ATOMIC_ACQUIRE))
+				break;
+			print_slot(&shm->slots[i],
+				   c && prev ? &prev->slots[i] : NULL,
+				   t - t_prev);
+		}
+		fflush(stdout);
+		if (prev)
+			memcpy(prev, shm, sizeof(*prev));
+		t_prev = t;
+	}
+	return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * libubiio transaction test.
+ *
+ * Runs on a file used as a simulated volume, which it overwrites. Checks
+ * commits, group commits of concurrent transactions, and recovery at open
+ * time: interrupted transactions, LEBs a commit did not get to un-map, and
+ * commit records with a bad CRC, a bad mapping or a bad size.
+ */
+
+#include <libubiio.h>
+#include <libubiio_int.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define NR_LEBS		32
+#define LEB_SIZE	16384
+#define MIN_IO		512
+#define NR_THREADS	8
+
+/* Layout of the commit record, see libubiio_tx.c */
+#define TX_REC_MAGIC	0x55425458
+struct tx_record
+{
+	uint32_t magic;
+	uint32_t crc;
+	uint64_t seqnum;
+	uint32_t nr_lebs;
+	uint32_t padding;
+};
+
+static const char *path;
+static int fails;
+
+#define CHECK(cond)							\
+	do								\
+	{								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "%s:%d: %s\n", __FILE__,	\
+				__LINE__, #cond);			\
+			fails++;					\
+		}							\
+	} while (0)
+
+static int usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s file\n"
+		"file is overwritten with a simulated volume.\n",
+		argv[0]);
+	return 1;
+}
+
+static struct ubi_volume_desc *open_sim(void)
+{
+	static const struct ubi_sim_geometry geo = {
+		NR_LEBS, LEB_SIZE, MIN_IO
+	};
+	struct ubi_volume_desc *desc;
+
+	desc = ubi_open_volume_sim(path, &geo, UBI_READWRITE);
+	if (desc == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+	return desc;
+}
+
+/* Start over with an erased volume */
+static void erase_all(void)
+{
+	char buf[LEB_SIZE];
+	int fd, i;
+
+	memset(buf, 0xFF, sizeof(buf));
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+	{
+		perror(path);
+		exit(1);
+	}
+	for (i = 0; i < NR_LEBS; i++)
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+		{
+			perror(path);
+			exit(1);
+		}
+	close(fd);
+}
+
+/* Whether exposed LEB @lnum holds @len bytes of @c */
+static int holds(struct ubi_txv *txv, int lnum, int c, int len)
+{
+	char buf[LEB_SIZE];
+	int i;
+
+	if (ubi_txv_read(txv, lnum, buf, 0, len))
+		return 0;
+	for (i = 0; i < len; i++)
+		if (buf[i] != (char) c)
+			return 0;
+	return 1;
+}
+
+static int change(struct ubi_tx *tx, int lnum, int c)
+{
+	char buf[MIN_IO];
+
+	memset(buf, c, sizeof(buf));
+	return ubi_tx_change(tx, lnum, buf, sizeof(buf));
+}
+
+static void test_commit(void)
+{
+	struct ubi_volume_desc *desc;
+	struct ubi_txv_stats st;
+	struct ubi_txv *txv;
+	struct ubi_tx *tx;
+
+	erase_all();
+	desc = open_sim();
+	txv = ubi_txv_open(desc, 0);
+	CHECK(txv != NULL);
+	if (txv == NULL)
+		return;
+
+	tx = ubi_tx_begin(txv);
+	CHECK(change(tx, 0, 'a') == 0);
+	CHECK(change(tx, 1, 'b') == 0);
+	/* not visible before the commit */
+	CHECK(holds(txv, 0, 0xFF, MIN_IO));
+	CHECK(ubi_tx_commit(tx) == 0);
+	CHECK(holds(txv, 0, 'a', MIN_IO) && holds(txv, 1, 'b', MIN_IO));
+
+	tx = ubi_tx_begin(txv);
+	CHECK(change(tx, 0, 'c') == 0);
+	CHECK(ubi_tx_unmap(tx, 1) == 0);
+	CHECK(ubi_tx_commit(tx) == 0);
+	ubi_txv_get_stats(txv, &st);
+	CHECK(st.commits == 2 && st.transactions == 2);
+	ubi_txv_close(txv);
+
+	/* the last commit is what a reopen finds, with nothing to clean */
+	txv = ubi_txv_open(desc, 0);
+	CHECK(txv != NULL);
+	if (txv)
+	{
+		CHECK(holds(txv, 0, 'c', MIN_IO));
+		CHECK(holds(txv, 1, 0xFF, MIN_IO));
+		ubi_txv_get_stats(txv, &st);
+		CHECK(st.recovered == 0);
+		ubi_txv_close(txv);
+	}
+	ubi_close_volume(desc);
+}
+
+struct worker
+{
+	struct ubi_txv *txv;
+	pthread_barrier_t *barrier;
+	int lnum;
+	int err;
+};
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct ubi_tx *tx = ubi_tx_begin(w->txv);
+
+	w->err = change(tx, w->lnum, 'A' + w->lnum);
+	pthread_barrier_wait(w->barrier);
+	if (w->err)
+		ubi_tx_abort(tx);
+	else
+		w->err = ubi_tx_commit(tx);
+	return NULL;
+}
+
+static void test_group_commit(void)
+{
+	struct ubi_sim_timing timing = { 50, 300, 2000, 1, 0, 0 };
+	struct worker w[NR_THREADS];
+	pthread_barrier_t barrier;
+	struct ubi_volume_desc *desc;
+	struct ubi_txv_stats st;
+	struct ubi_txv *txv;
+	int i;
+
+	erase_all();
+	desc = open_sim();
+	/* slow record writes, so that commits pile up behind them */
+	CHECK(ubi_sim_set_timing(desc, &timing) == 0);
+	txv = ubi_txv_open(desc, NR_THREADS);
+	CHECK(txv != NULL);
+	if (txv == NULL)
+		return;
+
+	pthread_barrier_init(&barrier, NULL, NR_THREADS);
+	for (i = 0; i < NR_THREADS; i++)
+	{
+		w[i].txv = txv;
+		w[i].barrier = &barrier;
+		w[i].lnum = i;
+		w[i].err = 0;
+	}
+	{
+		pthread_t threads[NR_THREADS];
+
+		for (i = 0; i < NR_THREADS; i++)
+			pthread_create(&threads[i], NULL, worker_run, &w[i]);
+		for (i = 0; i < NR_THREADS; i++)
+			pthread_join(threads[i], NULL);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	for (i = 0; i < NR_THREADS; i++)
+	{
+		CHECK(w[i].err == 0);
+		CHECK(holds(txv, i, 'A' + i, MIN_IO));
+	}
+	ubi_txv_get_stats(txv, &st);
+	CHECK(st.transactions == NR_THREADS);
+	CHECK(st.commits < st.transactions);
+	ubi_txv_close(txv);
+	ubi_close_volume(desc);
+}
+
+static void test_interrupted(void)
+{
+	struct ubi_volume_desc *desc;
+	struct ubi_txv_stats st;
+	struct ubi_txv *txv;
+	struct ubi_tx *tx;
+	char buf[MIN_IO];
+	int leftover = NR_LEBS - 1;
+
+	erase_all();
+	desc = open_sim();
+	txv = ubi_txv_open(desc, 4);
+	CHECK(txv != NULL);
+	if (txv == NULL)
+		return;
+	tx = ubi_tx_begin(txv);
+	CHECK(change(tx, 2, 'x') == 0);
+	CHECK(ubi_tx_commit(tx) == 0);
+
+	/* a crash after the shadow LEB was written, before the commit */
+	tx = ubi_tx_begin(txv);
+	CHECK(change(tx, 2, 'y') == 0);
+	CHECK(change(tx, 3, 'z') == 0);
+	/* the transaction is leaked, as a crash would */
+	ubi_txv_close(txv);
+
+	/* and an old LEB a commit did not get to un-map */
+	memset(buf, 'o', sizeof(buf));
+	CHECK(ubi_leb_write(desc, leftover, buf, 0, sizeof(buf),
+			    UBI_UNKNOWN) == 0);
+
+	txv = ubi_txv_open(desc, 0);
+	CHECK(txv != NULL);
+	if (txv == NULL)
+		return;
+	CHECK(holds(txv, 2, 'x', MIN_IO));
+	CHECK(holds(txv, 3, 0xFF, MIN_IO));
+	ubi_txv_get_stats(txv, &st);
+	CHECK(st.nr_lebs == 4);
+	CHECK(st.recovered == 3);
+	CHECK(ubi_is_mapped(desc, leftover) == 0);
+	ubi_txv_close(txv);
+	ubi_close_volume(desc);
+}
+
+/*
+ * Write a commit record of @nr_lebs LEBs mapping LEB @i to @map[i], whose CRC
+ * is off by @crc_off, then check what opening the volume does
+ */
+static void bad_record(const int32_t *map, uint32_t nr_lebs, int crc_off,
+		       int expect)
+{
+	char buf[LEB_SIZE];
+	struct tx_record *rec = (struct tx_record *) buf;
+	struct ubi_volume_desc *desc;
+	struct ubi_txv *txv;
+	uint32_t i, n = nr_lebs < 8 ? nr_lebs : 8;
+
+	erase_all();
+	desc = open_sim();
+	memset(buf, 0, sizeof(buf));
+	rec->magic = TX_REC_MAGIC;
+	rec->seqnum = 1;
+	rec->nr_lebs = nr_lebs;
+	for (i = 0; i < n; i++)
+		((int32_t *) (rec + 1))[i] = map[i];
+	rec->crc = __ubi_crc32(UBI_CRC32_INIT, &rec->seqnum,
+			       sizeof(*rec) - 8 + n * sizeof(int32_t))
+		+ crc_off;
+	CHECK(ubi_leb_change(desc, 0, buf, MIN_IO, UBI_LONGTERM) == 0);
+
+	txv = ubi_txv_open(desc, 0);
+	if (txv)
+		ubi_txv_close(txv);
+	if (expect)
+		CHECK(txv == NULL && errno == expect);
+	else
+		CHECK(txv != NULL);
+	ubi_close_volume(desc);
+}
+
+static void test_bad_records(void)
+{
+	static const int32_t good[] = { 1, -1, 2, 3 };
+	static const int32_t to_rec[] = { 1, 0, -1, -1 };
+	static const int32_t twice[] = { 1, 2, 1, -1 };
+	static const int32_t beyond[] = { 1, NR_LEBS, -1, -1 };
+
+	bad_record(good, 4, 0, 0);
+	bad_record(good, 4, 1, EUCLEAN);
+	bad_record(to_rec, 4, 0, EUCLEAN);
+	bad_record(twice, 4, 0, EUCLEAN);
+	bad_record(beyond, 4, 0, EUCLEAN);
+	/* more LEBs than the volume has */
+	bad_record(good, NR_LEBS, 0, EINVAL);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+		return usage(argv);
+	path = argv[1];
+
+	test_commit();
+	test_group_commit();
+	test_interrupted();
+	test_bad_records();
+
+	printf("{\"test\": \"tx\", \"failures\": %d}\n", fails);
+	return fails != 0;
+}
@@ -0,0 +1,365 @@
+/*
+ * libubiio compression test.
+ *
+ * Round-trips blocks through the LZ codec, and checks that corrupted
+ * compressed data fails to decompress instead of overrunning the buffers.
+ * Then runs on a file used as a simulated volume, which it overwrites:
+ * writes compressed LEBs mixing extents which compress and extents which do
+ * not, reads them back whole and in pieces, and checks that a corrupted
+ * extent reads as -EBADMSG.
+ */
+
+#include <libubiio.h>
+#include <libubiio_int.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define NR_LEBS		8
+#define LEB_SIZE	126976
+#define MIN_IO		2048
+#define EXTENT		4096
+
+/* Header of a compressed LEB with @n extents, see libubiio_zvol.c */
+#define HDR_LEN(n)	(16 + (n) * 4)
+
+static const char *path;
+static int fails;
+
+#define CHECK(cond)							\
+	do								\
+	{								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "%s:%d: %s\n", __FILE__,	\
+				__LINE__, #cond);			\
+			fails++;					\
+		}							\
+	} while (0)
+
+static int usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s file\n"
+		"file is overwritten with a simulated volume.\n",
+		argv[0]);
+	return 1;
+}
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/* Random bytes, which do not compress */
+static void fill_random(char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rnd();
+}
+
+/* Text-like bytes, which compress */
+static void fill_text(char *buf, int len)
+{
+	static const char *words[] = {
+		"erase ", "block ", "page ", "LEB ", "volume ", "wear ",
+		"level ", "\n"
+	};
+	int i, n;
+
+	for (i = 0; i < len; i += n)
+	{
+		const char *w = words[rnd() % 8];
+
+		n = strlen(w);
+		memcpy(buf + i, w, i + n > len ? len - i : n);
+	}
+}
+
+/*
+ * Blocks of every kind: @kind 0 is zeros, 1 text, 2 random, 3 text and
+ * random in turns, 4 a short period, so that matches overlap what they copy
+ */
+static void fill(char *buf, int len, int kind)
+{
+	int i;
+
+	switch (kind)
+	{
+	case 0:
+		memset(buf, 0, len);
+		break;
+	case 1:
+		fill_text(buf, len);
+		break;
+	case 2:
+		fill_random(buf, len);
+		break;
+	case 3:
+		for (i = 0; i < len; i += 1000)
+		{
+			int n = len - i < 1000 ? len - i : 1000;
+
+			if (i / 1000 % 2)
+				fill_random(buf + i, n);
+			else
+				fill_text(buf + i, n);
+		}
+		break;
+	default:
+		for (i = 0; i < len; i++)
+			buf[i] = "abc"[i % 3];
+		break;
+	}
+}
+
+static void test_codec(void)
+{
+	static const int lens[] = {
+		0, 1, 3, 4, 5, 15, 16, 17, 100, 4095, 4096, 20000,
+		UBI_LZ_MAX_BLOCK
+	};
+	int cap = UBI_LZ_MAX_BLOCK + UBI_LZ_MAX_BLOCK / 255 + 16;
+	char *src = malloc(UBI_LZ_MAX_BLOCK);
+	char *dst = malloc(UBI_LZ_MAX_BLOCK);
+	char *cmp = malloc(cap);
+	char *bad = malloc(cap);
+	int i, kind, len, clen, j, pos, err;
+
+	if (!src || !dst || !cmp || !bad)
+	{
+		fails++;
+		return;
+	}
+	for (kind = 0; kind < 5; kind++)
+		for (i = 0; i < (int) (sizeof(lens) / sizeof(lens[0])); i++)
+		{
+			len = lens[i];
+			fill(src, len, kind);
+			clen = __ubi_lz_compress(src, len, cmp, cap);
+			CHECK(clen > 0);
+			if (clen <= 0)
+				continue;
+			if (len > 1000 && kind != 2)
+				CHECK(clen < len);
+
+			memset(dst, 0x5A, UBI_LZ_MAX_BLOCK);
+			CHECK(__ubi_lz_decompress(cmp, clen, dst, len) == 0);
+			CHECK(memcmp(dst, src, len) == 0);
+
+			/* not the expected length, or truncated */
+			CHECK(__ubi_lz_decompress(cmp, clen, dst, len + 1)
+			      == -EBADMSG);
+			if (len)
+				CHECK(__ubi_lz_decompress(cmp, clen - 1, dst,
+							  len) == -EBADMSG);
+
+			/*
+			 * random damage: not always detected, but never a
+			 * write out of the buffer, which ASan would catch
+			 */
+			for (j = 0; j < 50; j++)
+			{
+				memcpy(bad, cmp, clen);
+				pos = rnd() % clen;
+				bad[pos] ^= 1 << (rnd() % 8);
+				err = __ubi_lz_decompress(bad, clen, dst, len);
+				CHECK(err == 0 || err == -EBADMSG);
+			}
+		}
+
+	/* too small a buffer makes the compressor give up */
+	fill_random(src, 4096);
+	CHECK(__ubi_lz_compress(src, 4096, cmp, 4095) == 0);
+	free(bad);
+	free(cmp);
+	free(dst);
+	free(src);
+}
+
+static struct ubi_volume_desc *open_sim(void)
+{
+	static const struct ubi_sim_geometry geo = {
+		NR_LEBS, LEB_SIZE, MIN_IO
+	};
+	struct ubi_volume_desc *desc;
+	char *buf;
+	int fd, i;
+
+	/* an erased volume */
+	buf = malloc(LEB_SIZE);
+	if (buf == NULL)
+		exit(1);
+	memset(buf, 0xFF, LEB_SIZE);
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+	{
+		perror(path);
+		exit(1);
+	}
+	for (i = 0; i < NR_LEBS; i++)
+		if (write(fd, buf, LEB_SIZE) != LEB_SIZE)
+		{
+			perror(path);
+			exit(1);
+		}
+	close(fd);
+	free(buf);
+
+	desc = ubi_open_volume_sim(path, &geo, UBI_READWRITE);
+	if (desc == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+	return desc;
+}
+
+/* Read @lnum back whole and in pieces which start and end mid-extent */
+static void check_leb(struct ubi_zvol *zv, int lnum, const char *ref,
+		      int size)
+{
+	char *buf = malloc(size + EXTENT);
+	int off, len;
+
+	if (buf == NULL)
+	{
+		fails++;
+		return;
+	}
+	CHECK(ubi_zvol_size(zv, lnum) == size);
+	CHECK(ubi_zvol_read(zv, lnum, buf, 0, size) == size);
+	CHECK(memcmp(buf, ref, size) == 0);
+
+	for (off = 0; off < size; off += 1531)
+		for (len = 1; len < 3 * EXTENT; len = len * 3 + 7)
+		{
+			int n = off + len > size ? size - off : len;
+
+			memset(buf, 0, len);
+			CHECK(ubi_zvol_read(zv, lnum, buf, off, len) == n);
+			CHECK(memcmp(buf, ref + off, n) == 0);
+		}
+
+	/* past the end */
+	CHECK(ubi_zvol_read(zv, lnum, buf, size - 10, 100) == 10);
+	CHECK(ubi_zvol_read(zv, lnum, buf, size, 100) == 0);
+	free(buf);
+}
+
+static void test_zvol(void)
+{
+	/* ends in a partial extent */
+	int size = 20 * EXTENT + 1000, nr = (size + EXTENT - 1) / EXTENT;
+	struct ubi_volume_desc *desc;
+	struct ubi_zvol_stats st;
+	struct ubi_zvol *zv;
+	char *ref, *raw;
+	int i;
+
+	ref = malloc(4 * LEB_SIZE);
+	raw = malloc(LEB_SIZE);
+	if (ref == NULL || raw == NULL)
+	{
+		fails++;
+		return;
+	}
+	desc = open_sim();
+	zv = ubi_zvol_open(desc, EXTENT);
+	CHECK(zv != NULL);
+	if (zv == NULL)
+		return;
+
+	/* extents which compress and which do not, in turns */
+	for (i = 0; i < nr; i++)
+		fill(ref + i * EXTENT,
+		     i == nr - 1 ? size - i * EXTENT : EXTENT, i % 2 ? 2 : 1);
+	CHECK(ubi_zvol_change(zv, 0, ref, size, UBI_UNKNOWN) == 0);
+	check_leb(zv, 0, ref, size);
+	ubi_zvol_get_stats(zv, &st);
+	CHECK(st.bytes_written < st.bytes_in);
+
+	/* and again from flash, with nothing cached and another extent size */
+	ubi_zvol_close(zv);
+	zv = ubi_zvol_open(desc, 0);
+	CHECK(zv != NULL);
+	if (zv == NULL)
+		return;
+	check_leb(zv, 0, ref, size);
+
+	/* nothing compresses: fits with its header, or does not */
+	fill(ref, LEB_SIZE, 2);
+	CHECK(ubi_zvol_change(zv, 1, ref, LEB_SIZE - EXTENT, UBI_UNKNOWN) == 0);
+	check_leb(zv, 1, ref, LEB_SIZE - EXTENT);
+	CHECK(ubi_zvol_change(zv, 2, ref, LEB_SIZE, UBI_UNKNOWN) == -ENOSPC);
+
+	/* contents larger than the LEB, which compress into it */
+	fill(ref, 4 * LEB_SIZE, 4);
+	CHECK(ubi_zvol_change(zv, 2, ref, 4 * LEB_SIZE, UBI_UNKNOWN) == 0);
+	check_leb(zv, 2, ref, 4 * LEB_SIZE);
+
+	CHECK(ubi_zvol_unmap(zv, 2) == 0);
+	CHECK(ubi_zvol_size(zv, 2) == 0);
+	CHECK(ubi_zvol_read(zv, 2, ref, 0, 100) == 0);
+
+	/* a corrupted extent, while the others still read */
+	ubi_zvol_close(zv);
+	zv = ubi_zvol_open(desc, EXTENT);
+	CHECK(zv != NULL);
+	if (zv == NULL)
+		return;
+	fill(ref, size, 1);
+	CHECK(ubi_zvol_change(zv, 3, ref, size, UBI_UNKNOWN) == 0);
+	CHECK(ubi_leb_read(desc, 3, raw, 0, LEB_SIZE, 0) == 0);
+	memset(raw + HDR_LEN(nr), 0xFF, 16);
+	CHECK(ubi_leb_change(desc, 3, raw, LEB_SIZE, UBI_UNKNOWN) == 0);
+	ubi_zvol_close(zv);
+	zv = ubi_zvol_open(desc, EXTENT);
+	CHECK(zv != NULL);
+	if (zv == NULL)
+		return;
+	CHECK(ubi_zvol_read(zv, 3, raw, 0, size) == -EBADMSG);
+	CHECK(ubi_zvol_read(zv, 3, raw, 100, 10) == -EBADMSG);
+	CHECK(ubi_zvol_read(zv, 3, raw, EXTENT, EXTENT) == EXTENT);
+	CHECK(memcmp(raw, ref + EXTENT, EXTENT) == 0);
+
+	/* and a corrupted header */
+	CHECK(ubi_leb_read(desc, 3, raw, 0, LEB_SIZE, 0) == 0);
+	raw[HDR_LEN(0)] ^= 1;
+	CHECK(ubi_leb_change(desc, 3, raw, LEB_SIZE, UBI_UNKNOWN) == 0);
+	ubi_zvol_close(zv);
+	zv = ubi_zvol_open(desc, EXTENT);
+	CHECK(zv != NULL);
+	if (zv == NULL)
+		return;
+	CHECK(ubi_zvol_read(zv, 3, raw, EXTENT, EXTENT) == -EBADMSG);
+
+	ubi_zvol_close(zv);
+	ubi_close_volume(desc);
+	free(raw);
+	free(ref);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+		return usage(argv);
+	path = argv[1];
+
+	test_codec();
+	test_zvol();
+
+	printf("{\"test\": \"zvol\", \"failures\": %d}\n", fails);
+	return fails != 0;
+}